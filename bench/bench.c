@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/csv_tokenizer.c"
+#include "../src/parsers.c"
+#include "../src/batch.c"
+#include "../src/schema.c"
+#include "../src/dedup.c"
+#include "../src/read_ahead.c"
+#include "../src/stream_decoder.c"
+#include "../src/input_reader.c"
+#include "../src/input_files.c"
+#include "../src/reject_log.c"
+#include "../src/copy_encoder.c"
+#include "../src/checkpoint.c"
+#include "../src/delta.c"
+#include "../src/db_query.c"
+#include "../src/batch_queue.c"
+#include "../src/batch_pool.c"
+#include "../src/batch_tuner.c"
+#include "../src/batch_router.c"
+#include "../src/spatial_sort.c"
+#include "../src/worker_threads.c"
+#include "../src/pipeline_writer.c"
+#include "../src/sink.c"
+#include "../src/chunk_parser.c"
+#include "../src/file_loader.c"
+#include "../src/benchmark.c"
+
+#include "bench_reader.c"
+#include "bench_parallel.c"
+#include "bench_split.c"
+#include "bench_encode.c"
+#include "bench_queue.c"
+#include "bench_fields.c"
+#include "bench_dedup.c"
+#include "bench_route.c"
+#include "bench_generate.c"
+#include "bench_e2e.c"
+#include "bench_schema.c"
+#include "bench_spatial.c"
+
+typedef struct {
+  const char *name;
+  int (*run)(int argc, char *argv[]);
+  const char *usage;
+} BenchCommand;
+
+static const BenchCommand commands[] = {
+    {"reader", bench_reader, "reader <file.csv> [iterations] [warm|cold]"},
+    {"parallel", bench_parallel, "parallel <file.csv> [max_parsers]"},
+    {"pool", bench_pool, "pool <file.csv> [parsers]"},
+    {"split", bench_split, "split <file.csv> [iterations]"},
+    {"encode", bench_encode, "encode <file.csv> [iterations]"},
+    {"queue", bench_queue, "queue [max_threads] [tokens] [capacity]"},
+    {"fields", bench_fields, "fields <file.csv> [iterations]"},
+    {"dedup", bench_dedup, "dedup <file.csv> [memory_mb] [iterations]"},
+    {"route", bench_route, "route <file.csv> [max_writers]"},
+    {"generate", bench_generate,
+     "generate <out.csv|-> <rows> [duplicate_rate] [quoted_rate] "
+     "[bad_coordinate_rate] [seed]"},
+    {"e2e", bench_e2e,
+     "e2e <file.csv> [writers] [null|file:PATH|socket] [binary|csv] "
+     "[schema]"},
+    {"schema", bench_schema, "schema <file.csv> [iterations]"},
+    {"spatial", bench_spatial, "spatial <file.csv> [memory_mb]"},
+};
+
+int main(int argc, char *argv[]) {
+  size_t num_commands = sizeof(commands) / sizeof(commands[0]);
+
+  if (argc >= 2) {
+    for (size_t i = 0; i < num_commands; i++) {
+      if (strcmp(argv[1], commands[i].name) == 0)
+        return commands[i].run(argc - 2, argv + 2);
+    }
+  }
+
+  fprintf(stderr, "Usage: %s <benchmark> [args]\n", argv[0]);
+  for (size_t i = 0; i < num_commands; i++)
+    fprintf(stderr, "  %s\n", commands[i].usage);
+  return 1;
+}
@@ -0,0 +1,78 @@
+// Duplicate key set benchmark: every sendable row of the file is checked
+// against a fresh set one probe at a time, and batch by batch with the slots
+// prefetched ahead as the producers do with --dedup
+
+static int bench_dedup(int argc, char *argv[]) {
+  if (argc < 1) {
+    fprintf(stderr, "Usage: bench dedup <file.csv> [memory_mb] [iterations]\n");
+    return 1;
+  }
+  int memory_mb = argc > 1 ? atoi(argv[1]) : DEFAULT_DEDUP_MEMORY_MB;
+  int iterations = argc > 2 ? atoi(argv[2]) : 5;
+  size_t memory = (size_t)memory_mb << 20;
+
+  InputReader reader;
+  if (!reader_open(&reader, argv[0], READER_MMAP)) {
+    fprintf(stderr, "Could not open %s\n", argv[0]);
+    return 1;
+  }
+
+  printf("%-10s %12s %12s %10s %10s %12s\n", "mode", "rows", "duplicates",
+         "best (s)", "ns/row", "saved (MB)");
+  for (int batched = 0; batched < 2; batched++) {
+    double best = 0;
+    size_t rows = 0, duplicates = 0, keys = 0;
+    uint64_t saved = 0;
+    bool full = false;
+
+    for (int it = 0; it < iterations; it++) {
+      // dedup_batch compacts the batches, every run parses them again
+      reader_seek(&reader, 0);
+      size_t num_batches;
+      Batch **batches = bench_load_batches(&reader, &num_batches);
+      DedupSet set;
+      if (!dedup_init(&set, memory))
+        return 1;
+
+      rows = 0;
+      duplicates = 0;
+      saved = 0;
+      double start = get_time();
+      for (size_t b = 0; b < num_batches; b++) {
+        Batch *batch = batches[b];
+        rows += batch->count;
+        if (batched) {
+          duplicates += dedup_batch(&set, batch, 0, &saved);
+          continue;
+        }
+        for (int i = 0; i < batch->count; i++) {
+          if (batch_row_is_valid(batch, i) &&
+              !dedup_insert(&set, dedup_row_hash(batch, i))) {
+            saved += copy_binary_row_size(batch, i);
+            duplicates++;
+          }
+        }
+      }
+      double seconds = get_time() - start;
+      if (it == 0 || seconds < best)
+        best = seconds;
+      keys = atomic_load(&set.count);
+      full = dedup_full(&set);
+
+      dedup_free(&set);
+      for (size_t b = 0; b < num_batches; b++)
+        batch_free(batches[b]);
+      free(batches);
+    }
+
+    printf("%-10s %12zu %12zu %10.4f %10.1f %12.1f\n",
+           batched ? "batched" : "per row", rows, duplicates, best,
+           rows ? best / rows * 1e9 : 0, saved / 1e6);
+    if (batched)
+      printf("%zu keys in %d MB%s\n", keys, memory_mb,
+             full ? ", set full, later keys were not checked" : "");
+  }
+
+  reader_close(&reader);
+  return 0;
+}
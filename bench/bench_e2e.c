@@ -0,0 +1,360 @@
+// End to end load without a database: loaders, queue and writers as in a
+// real run, the writers sending to a null, file or socket sink. The socket
+// sink talks to a minimal COPY server on a thread of this process, which
+// counts the rows of every COPY stream and acknowledges them like Postgres.
+// A stream holding the text REJECT is refused like a constraint violation,
+// the writers then retry it in halves down to the marked rows
+
+typedef struct {
+  int fd;
+  uint64_t rows;
+  uint64_t bytes;
+  pthread_t thread;
+} CopyConnection;
+
+typedef struct {
+  char path[108];
+  int listen_fd;
+  int connections;
+  CopyConnection *clients;
+  pthread_t thread;
+} CopyServer;
+
+static bool copy_server_send(int fd, char type, const char *body,
+                             uint32_t len) {
+  char header[5] = {type};
+  uint32_t n = htonl(len + 4);
+  memcpy(header + 1, &n, sizeof(n));
+  return write_all(fd, header, sizeof(header)) &&
+         (len == 0 || write_all(fd, body, len));
+}
+
+static bool copy_server_ready(int fd) {
+  return copy_server_send(fd, 'Z', "I", 1);
+}
+
+// Tuples of a whole binary COPY stream, -1 when it is malformed
+static long copy_server_binary_rows(const char *data, size_t len) {
+  if (len < 19 || memcmp(data, "PGCOPY\n\377\r\n\0", 11) != 0)
+    return -1;
+  uint32_t extension;
+  memcpy(&extension, data + 15, sizeof(extension));
+  size_t p = 19 + ntohl(extension);
+  long rows = 0;
+  while (p + 2 <= len) {
+    uint16_t fields;
+    memcpy(&fields, data + p, sizeof(fields));
+    p += 2;
+    if ((int16_t)ntohs(fields) == -1)
+      return p == len ? rows : -1;
+    for (int f = 0; f < ntohs(fields); f++) {
+      uint32_t field_len;
+      if (p + 4 > len)
+        return -1;
+      memcpy(&field_len, data + p, sizeof(field_len));
+      p += 4;
+      if ((int32_t)ntohl(field_len) > 0)
+        p += ntohl(field_len);
+    }
+    rows++;
+  }
+  return -1;
+}
+
+// Records of a CSV COPY stream, newlines inside quotes are data
+static long copy_server_csv_rows(const char *data, size_t len) {
+  long rows = 0;
+  bool quoted = false;
+  for (size_t i = 0; i < len; i++) {
+    quoted ^= data[i] == '"';
+    rows += data[i] == '\n' && !quoted;
+  }
+  return rows;
+}
+
+// The text REJECT anywhere in the stream
+static bool copy_server_marked(const char *data, size_t len) {
+  for (const char *p = data; len >= 6 && (p = memchr(p, 'R', data + len - p));
+       p++) {
+    if ((size_t)(data + len - p) >= 6 && memcmp(p, "REJECT", 6) == 0)
+      return true;
+  }
+  return false;
+}
+
+static void *copy_server_connection(void *arg) {
+  CopyConnection *client = arg;
+  int fd = client->fd;
+  char *stream = NULL;
+  size_t stream_len = 0, stream_capacity = 0;
+  char *body = NULL;
+  size_t body_capacity = 0;
+
+  // Startup packet, then trust authentication
+  uint32_t startup_len;
+  if (!read_all(fd, (char *)&startup_len, sizeof(startup_len)))
+    goto done;
+  startup_len = ntohl(startup_len);
+  if (startup_len < 8 || startup_len > 10000)
+    goto done;
+  body = malloc(startup_len);
+  body_capacity = startup_len;
+  uint32_t auth_ok = 0;
+  if (!read_all(fd, body, startup_len - 4) ||
+      !copy_server_send(fd, 'R', (const char *)&auth_ok, 4) ||
+      !copy_server_ready(fd))
+    goto done;
+
+  bool binary = false;
+  while (true) {
+    char header[5];
+    if (!read_all(fd, header, sizeof(header)))
+      break;
+    uint32_t len;
+    memcpy(&len, header + 1, sizeof(len));
+    len = ntohl(len) - 4;
+    if (len + 1 > body_capacity) {
+      body_capacity = len + 1;
+      body = realloc(body, body_capacity);
+    }
+    if (!read_all(fd, body, len))
+      break;
+    body[len] = '\0';
+
+    if (header[0] == 'Q') {
+      // CopyInResponse: overall format and no per column formats
+      binary = strstr(body, "binary") != NULL;
+      char response[3] = {binary ? 1 : 0, 0, 0};
+      stream_len = 0;
+      if (!copy_server_send(fd, 'G', response, sizeof(response)))
+        break;
+    } else if (header[0] == 'd') {
+      if (stream_len + len > stream_capacity) {
+        stream_capacity = (stream_len + len) * 2;
+        stream = realloc(stream, stream_capacity);
+      }
+      memcpy(stream + stream_len, body, len);
+      stream_len += len;
+      client->bytes += len;
+    } else if (header[0] == 'c') {
+      long rows = binary ? copy_server_binary_rows(stream, stream_len)
+                         : copy_server_csv_rows(stream, stream_len);
+      char tag[32];
+      bool ok;
+      if (rows < 0) {
+        static const char error[] = "SERROR\0Mmalformed COPY stream\0";
+        ok = copy_server_send(fd, 'E', error, sizeof(error));
+      } else if (copy_server_marked(stream, stream_len)) {
+        static const char error[] = "SERROR\0Mrow marked REJECT\0";
+        ok = copy_server_send(fd, 'E', error, sizeof(error));
+      } else {
+        client->rows += rows;
+        int tag_len = snprintf(tag, sizeof(tag), "COPY %ld", rows) + 1;
+        ok = copy_server_send(fd, 'C', tag, tag_len);
+      }
+      if (!ok || !copy_server_ready(fd))
+        break;
+    } else if (header[0] == 'X') {
+      break;
+    }
+  }
+
+done:
+  free(stream);
+  free(body);
+  close(fd);
+  return NULL;
+}
+
+static void *copy_server_accept(void *arg) {
+  CopyServer *server = arg;
+  for (int i = 0; i < server->connections; i++) {
+    CopyConnection *client = &server->clients[i];
+    client->fd = accept(server->listen_fd, NULL, NULL);
+    if (client->fd < 0)
+      break;
+    pthread_create(&client->thread, NULL, copy_server_connection, client);
+  }
+  return NULL;
+}
+
+static bool copy_server_start(CopyServer *server, int connections) {
+  memset(server, 0, sizeof(CopyServer));
+  snprintf(server->path, sizeof(server->path), "/tmp/postig-bench-%d.sock",
+           (int)getpid());
+  unlink(server->path);
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  strcpy(address.sun_path, server->path);
+  server->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (server->listen_fd < 0 ||
+      bind(server->listen_fd, (struct sockaddr *)&address, sizeof(address)) !=
+          0 ||
+      listen(server->listen_fd, connections) != 0) {
+    perror(server->path);
+    return false;
+  }
+  server->connections = connections;
+  server->clients = calloc(connections, sizeof(CopyConnection));
+  for (int i = 0; i < connections; i++)
+    server->clients[i].fd = -1;
+  pthread_create(&server->thread, NULL, copy_server_accept, server);
+  return true;
+}
+
+// Every writer has disconnected by now
+static void copy_server_stop(CopyServer *server, uint64_t *rows,
+                             uint64_t *bytes) {
+  pthread_join(server->thread, NULL);
+  *rows = 0;
+  *bytes = 0;
+  for (int i = 0; i < server->connections; i++) {
+    if (server->clients[i].fd < 0)
+      continue;
+    pthread_join(server->clients[i].thread, NULL);
+    *rows += server->clients[i].rows;
+    *bytes += server->clients[i].bytes;
+  }
+  close(server->listen_fd);
+  unlink(server->path);
+  free(server->clients);
+}
+
+static int bench_e2e(int argc, char *argv[]) {
+  if (argc < 1) {
+    fprintf(stderr, "Usage: bench e2e <file.csv> [writers] "
+                    "[null|file:PATH|socket] [binary|csv] [schema]\n");
+    return 1;
+  }
+  int writers = argc > 1 ? atoi(argv[1]) : 3;
+  if (writers < 1)
+    writers = 1;
+  const char *sink_spec = argc > 2 ? argv[2] : "null";
+  CopyFormat format = COPY_FORMAT_BINARY;
+  if (argc > 3 && !copy_parse_format(argv[3], &format)) {
+    fprintf(stderr, "Unknown COPY format '%s'\n", argv[3]);
+    return 1;
+  }
+
+  CopyServer server;
+  SinkConfig sink;
+  if (strcmp(sink_spec, "socket") == 0) {
+    if (!copy_server_start(&server, writers))
+      return 1;
+    sink = (SinkConfig){.kind = SINK_SOCKET, .path = server.path};
+  } else if (!sink_parse(sink_spec, &sink) || sink.kind == SINK_POSTGRES) {
+    fprintf(stderr, "Unknown sink '%s', expected null, file:PATH or "
+                    "socket\n",
+            sink_spec);
+    return 1;
+  }
+
+  Schema schema;
+  if (argc > 4 ? !schema_load(&schema, argv[4]) : !schema_builtin(&schema))
+    return 1;
+
+  InputFileList files;
+  if (!input_files_expand(&files, &argv[0], 1))
+    return 1;
+
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  LoaderOptions options = {
+      .reader_mode = READER_MMAP,
+      .num_parsers = cores < 1 ? 1 : cores > MAX_PARSERS ? MAX_PARSERS : cores};
+  Benchmark bench;
+  benchmark_init(&bench);
+  BatchQueue queue;
+  queue_init(&queue, QUEUE_SIZE);
+  BatchPool pool;
+  size_t pool_limit =
+      batch_pool_limit(options.num_parsers, QUEUE_SIZE, writers, 0);
+  batch_pool_init(&pool, BENCH_BATCH_SIZE, pool_limit);
+
+  RejectLog rejects;
+  reject_log_init(&rejects, DEFAULT_MAX_REJECTS);
+  pthread_t *threads = malloc(writers * sizeof(pthread_t));
+  WorkerContext *contexts = calloc(writers, sizeof(WorkerContext));
+  for (int i = 0; i < writers; i++) {
+    contexts[i] = (WorkerContext){.id = i,
+                                  .queue = &queue,
+                                  .pool = &pool,
+                                  .schema = &schema,
+                                  .copy_format = format,
+                                  .files = &files,
+                                  .sink = &sink,
+                                  .rejects = &rejects,
+                                  .metrics =
+                                      benchmark_thread(&bench, "writer", i)};
+    pthread_create(&threads[i], NULL, worker_thread, &contexts[i]);
+  }
+  FileLoader loader = {.files = &files,
+                       .options = &options,
+                       .schema = &schema,
+                       .num_parsers = options.num_parsers,
+                       .pool = &pool,
+                       .queue = &queue,
+                       .metrics = malloc(options.num_parsers *
+                                         sizeof(ThreadMetrics *))};
+  for (int i = 0; i < options.num_parsers; i++)
+    loader.metrics[i] = benchmark_thread(&bench, "parser", i);
+
+  double start = get_time();
+  loader_thread(&loader);
+  double parse_wall = get_time() - start;
+  queue_finish(&queue);
+  for (int i = 0; i < writers; i++)
+    pthread_join(threads[i], NULL);
+  double wall = get_time() - start;
+
+  ThreadMetrics totals;
+  benchmark_totals(&bench, &totals);
+  uint64_t parsed = totals.counters[ROWS_PARSED];
+  uint64_t sent = totals.counters[ROWS_INSERTED];
+  printf("sink %s, %s COPY, %d parsers, %d writers\n", sink_name(sink.kind),
+         format == COPY_FORMAT_BINARY ? "binary" : "csv", options.num_parsers,
+         writers);
+  printf("%-14s %12s %12s %14s\n", "stage", "rows", "seconds", "rows/s");
+  // Producer stages count parsed rows, writer stages the rows sent. Seconds
+  // are summed over the threads of the stage
+  for (int s = 0; s < STAGE_COUNT; s++) {
+    uint64_t rows = s <= STAGE_ENQUEUE_WAIT ? parsed : sent;
+    double seconds = stage_seconds(&totals, s);
+    // Stages a sink does not have, setup and commit of a file
+    if (seconds >= 0.0001)
+      printf("%-14s %12llu %12.4f %14.0f\n", stage_name(s),
+             (unsigned long long)rows, seconds, rows / seconds);
+  }
+  printf("%-14s %12llu %12.4f %14.0f\n", "parse wall",
+         (unsigned long long)parsed, parse_wall, parsed / parse_wall);
+  printf("%-14s %12llu %12.4f %14.0f\n", "end to end",
+         (unsigned long long)sent, wall, sent / wall);
+  printf("rows: %llu parsed, %llu sent, %llu skipped, %llu rejected, %llu "
+         "failed, %llu bad values\n",
+         (unsigned long long)parsed, (unsigned long long)sent,
+         (unsigned long long)totals.counters[ROWS_SKIPPED],
+         (unsigned long long)totals.counters[ROWS_REJECTED],
+         (unsigned long long)totals.counters[ROWS_FAILED],
+         (unsigned long long)totals.counters[ROWS_BAD_VALUE]);
+  if (rejects.count > 0)
+    reject_log_print(&rejects, &files);
+
+  int status = totals.counters[ROWS_FAILED] > 0 ? 1 : 0;
+  if (sink.kind == SINK_SOCKET) {
+    uint64_t server_rows, server_bytes;
+    copy_server_stop(&server, &server_rows, &server_bytes);
+    printf("server: %llu rows in %.1f MB of COPY data\n",
+           (unsigned long long)server_rows, server_bytes / 1e6);
+    if (server_rows != sent)
+      status = 1;
+  }
+
+  free(loader.metrics);
+  reject_log_free(&rejects);
+  free(threads);
+  free(contexts);
+  batch_pool_destroy(&pool);
+  queue_destroy(&queue);
+  benchmark_destroy(&bench);
+  input_files_free(&files);
+  schema_free(&schema);
+  return status;
+}
@@ -0,0 +1,105 @@
+// COPY serialization benchmark: snprintf CSV rows with EWKT points against
+// binary tuples with EWKB points, encoded into the same send buffer
+
+#define BENCH_ENCODE_BATCH 24000
+
+// Parse the whole file up front into full sized batches so only encoding is
+// measured
+static Batch **bench_load_batches(InputReader *reader, size_t *num_batches) {
+  size_t capacity = 16;
+  Batch **batches = malloc(capacity * sizeof(Batch *));
+  Batch *batch = batch_create(BENCH_ENCODE_BATCH);
+  const char *line;
+  size_t line_len;
+
+  *num_batches = 0;
+  reader_next_line(reader, &line, &line_len); // header
+  while (reader_next_line(reader, &line, &line_len)) {
+    LocationData raw_data;
+    ProcessedLocation processed;
+    parse_line(line, line_len, &raw_data);
+    process_location_data(&raw_data, &processed);
+    batch_append(batch, &processed);
+    if (batch->count == batch->capacity) {
+      if (*num_batches == capacity) {
+        capacity *= 2;
+        batches = realloc(batches, capacity * sizeof(Batch *));
+      }
+      batches[(*num_batches)++] = batch;
+      batch = batch_create(BENCH_ENCODE_BATCH);
+    }
+  }
+  if (*num_batches == capacity)
+    batches = realloc(batches, (capacity + 1) * sizeof(Batch *));
+  batches[(*num_batches)++] = batch;
+  return batches;
+}
+
+static int bench_encode(int argc, char *argv[]) {
+  if (argc < 1) {
+    fprintf(stderr, "Usage: bench encode <file.csv> [iterations]\n");
+    return 1;
+  }
+  int iterations = argc > 1 ? atoi(argv[1]) : 5;
+
+  InputReader reader;
+  if (!reader_open(&reader, argv[0], READER_MMAP)) {
+    fprintf(stderr, "Could not open %s\n", argv[0]);
+    return 1;
+  }
+  size_t num_batches;
+  Batch **batches = bench_load_batches(&reader, &num_batches);
+
+  CopyBuffer buffer;
+  copy_buffer_init(&buffer);
+
+  printf("%-8s %12s %14s %10s %12s %10s\n", "format", "rows", "bytes",
+         "best (s)", "rows/s", "bytes/row");
+  const CopyFormat formats[] = {COPY_FORMAT_CSV, COPY_FORMAT_BINARY};
+  const char *names[] = {"csv", "binary"};
+  for (int f = 0; f < 2; f++) {
+    double best = 0;
+    size_t rows = 0;
+    size_t bytes = 0;
+    for (int i = 0; i < iterations; i++) {
+      double start = get_time();
+      rows = 0;
+      bytes = 0;
+      buffer.len = 0;
+      if (formats[f] == COPY_FORMAT_BINARY)
+        copy_encode_binary_header(&buffer);
+      for (size_t b = 0; b < num_batches; b++) {
+        const Batch *batch = batches[b];
+        for (int r = 0; r < batch->count; r++) {
+          if (!batch_row_is_valid(batch, r))
+            continue;
+          if (formats[f] == COPY_FORMAT_BINARY)
+            copy_encode_binary_row(&buffer, batch, r);
+          else
+            copy_encode_csv_row(&buffer, batch, r);
+          rows++;
+          // Stands in for the PQputCopyData flush
+          if (buffer.len >= COPY_FLUSH_THRESHOLD) {
+            bytes += buffer.len;
+            buffer.len = 0;
+          }
+        }
+      }
+      if (formats[f] == COPY_FORMAT_BINARY)
+        copy_encode_binary_trailer(&buffer);
+      bytes += buffer.len;
+      double seconds = get_time() - start;
+      if (i == 0 || seconds < best)
+        best = seconds;
+    }
+    printf("%-8s %12zu %14zu %10.4f %12.0f %10.1f\n", names[f], rows, bytes,
+           best, rows / best, (double)bytes / rows);
+  }
+
+  copy_buffer_free(&buffer);
+  for (size_t b = 0; b < num_batches; b++)
+    batch_free(batches[b]);
+  free(batches);
+  reader_close(&reader);
+  return 0;
+}
@@ -0,0 +1,185 @@
+// Field decoder benchmark: the old sscanf coordinates and switch loop
+// function code against the fixed position decoders in parsers.c
+
+// Baseline: what parse_coordinates did before, staged for sscanf
+static bool bench_coordinates_sscanf(FieldView coord, double *lat,
+                                     double *lon) {
+  char coord_str[16];
+  *lat = 0;
+  *lon = 0;
+  if (coord.len == 0 || coord.len >= sizeof(coord_str))
+    return false;
+  memcpy(coord_str, coord.ptr, coord.len);
+  coord_str[coord.len] = '\0';
+
+  int lat_deg, lat_min, lon_deg, lon_min;
+  char lat_dir, lon_dir;
+  if (sscanf(coord_str, "%2d%2d%c %3d%2d%c", &lat_deg, &lat_min, &lat_dir,
+             &lon_deg, &lon_min, &lon_dir) != 6)
+    return false;
+
+  *lat = lat_deg + lat_min / 60.0;
+  *lon = lon_deg + lon_min / 60.0;
+  if (lat_dir == 'S')
+    *lat = -*lat;
+  if (lon_dir == 'W')
+    *lon = -*lon;
+  return true;
+}
+
+// Baseline: what parse_function_code did before
+static void bench_function_code_switch(FieldView function_code, bool *is_port,
+                                       bool *is_airport, bool *is_train) {
+  *is_port = false;
+  *is_airport = false;
+  *is_train = false;
+  if (function_code.len < 8)
+    return;
+  for (int i = 0; i < 8; i++) {
+    switch (function_code.ptr[i]) {
+    case '1':
+      *is_port = true;
+      break;
+    case '2':
+      *is_train = true;
+      break;
+    case '4':
+      *is_airport = true;
+      break;
+    }
+  }
+}
+
+typedef struct {
+  FieldView *coordinates;
+  FieldView *function_codes;
+  size_t count;
+} FieldSample;
+
+// Collect the two fields of every record, views into the mapping
+static void bench_load_fields(InputReader *reader, FieldSample *sample) {
+  size_t capacity = 1 << 16;
+  const char *line;
+  size_t line_len;
+
+  sample->coordinates = malloc(capacity * sizeof(FieldView));
+  sample->function_codes = malloc(capacity * sizeof(FieldView));
+  sample->count = 0;
+  reader_next_line(reader, &line, &line_len); // header
+  while (reader_next_line(reader, &line, &line_len)) {
+    if (sample->count == capacity) {
+      capacity *= 2;
+      sample->coordinates =
+          realloc(sample->coordinates, capacity * sizeof(FieldView));
+      sample->function_codes =
+          realloc(sample->function_codes, capacity * sizeof(FieldView));
+    }
+    LocationData raw_data;
+    parse_line(line, line_len, &raw_data);
+    sample->coordinates[sample->count] = raw_data.coordinates;
+    sample->function_codes[sample->count] = raw_data.function_code;
+    sample->count++;
+  }
+}
+
+static void bench_fields_report(const char *name, double best, size_t count,
+                                size_t decoded, double checksum) {
+  printf("%-18s %10zu %10.4f %10.1f %14.0f\n", name, decoded, best,
+         best * 1e9 / count, checksum);
+}
+
+static int bench_fields(int argc, char *argv[]) {
+  if (argc < 1) {
+    fprintf(stderr, "Usage: bench fields <file.csv> [iterations]\n");
+    return 1;
+  }
+  int iterations = argc > 1 ? atoi(argv[1]) : 5;
+
+  InputReader reader;
+  if (!reader_open(&reader, argv[0], READER_MMAP)) {
+    fprintf(stderr, "Could not open %s\n", argv[0]);
+    return 1;
+  }
+  FieldSample sample;
+  bench_load_fields(&reader, &sample);
+
+  printf("%-18s %10s %10s %10s %14s\n", "decoder", "decoded", "best (s)",
+         "ns/field", "checksum");
+
+  // Coordinates: the checksum sums the decoded degrees, both decoders must
+  // agree on every well formed field
+  for (int variant = 0; variant < 2; variant++) {
+    double best = 0;
+    size_t decoded = 0;
+    double checksum = 0;
+    for (int i = 0; i < iterations; i++) {
+      double start = get_time();
+      decoded = 0;
+      checksum = 0;
+      for (size_t r = 0; r < sample.count; r++) {
+        double lat, lon;
+        bool ok = variant == 0
+                      ? bench_coordinates_sscanf(sample.coordinates[r], &lat,
+                                                 &lon)
+                      : parse_coordinates(sample.coordinates[r], &lat,
+                                          &lon) == COORD_OK;
+        decoded += ok;
+        checksum += lat + lon;
+      }
+      double seconds = get_time() - start;
+      if (i == 0 || seconds < best)
+        best = seconds;
+    }
+    bench_fields_report(variant == 0 ? "coordinates sscanf" : "coordinates fixed",
+                        best, sample.count, decoded, checksum);
+  }
+
+  // Fields sscanf accepts but the fixed decoder rejects, or the reverse
+  size_t mismatches = 0;
+  size_t malformed = 0;
+  for (size_t r = 0; r < sample.count; r++) {
+    double lat_a, lon_a, lat_b, lon_b;
+    bool a = bench_coordinates_sscanf(sample.coordinates[r], &lat_a, &lon_a);
+    CoordStatus b = parse_coordinates(sample.coordinates[r], &lat_b, &lon_b);
+    malformed += b == COORD_MALFORMED;
+    if (a != (b == COORD_OK) || lat_a != lat_b || lon_a != lon_b)
+      mismatches++;
+  }
+
+  // Function codes: the checksum counts the type flags set
+  for (int variant = 0; variant < 2; variant++) {
+    double best = 0;
+    size_t decoded = 0;
+    double checksum = 0;
+    for (int i = 0; i < iterations; i++) {
+      double start = get_time();
+      decoded = 0;
+      checksum = 0;
+      for (size_t r = 0; r < sample.count; r++) {
+        bool port, airport, train;
+        if (variant == 0) {
+          bench_function_code_switch(sample.function_codes[r], &port, &airport,
+                                     &train);
+          decoded++;
+        } else {
+          decoded += parse_function_code(sample.function_codes[r], &port,
+                                         &airport, &train);
+        }
+        checksum += port + airport * 2 + train * 4;
+      }
+      double seconds = get_time() - start;
+      if (i == 0 || seconds < best)
+        best = seconds;
+    }
+    bench_fields_report(variant == 0 ? "function switch" : "function table",
+                        best, sample.count, decoded, checksum);
+  }
+
+  printf("\n%zu records, %zu malformed coordinates, %zu decoder mismatches\n",
+         sample.count, malformed, mismatches);
+
+  free(sample.coordinates);
+  free(sample.function_codes);
+  reader_close(&reader);
+  return 0;
+}
@@ -0,0 +1,195 @@
+// Synthetic UN/LOCODE code list of any size. Every row is derived from the
+// seed and its own index, so a duplicate re-emits an earlier row exactly and
+// the same arguments always produce the same file
+
+static const char *const generate_countries[] = {
+    "AD", "AE", "AR", "AU", "BE", "BR", "CA", "CH", "CL", "CN", "DE", "DK",
+    "EG", "ES", "FI", "FR", "GB", "GR", "ID", "IN", "IT", "JP", "KR", "MA",
+    "MX", "NL", "NO", "NZ", "PE", "PH", "PL", "PT", "RU", "SE", "SG", "TR",
+    "US", "VN", "ZA", "NG"};
+static const char *const generate_syllables[] = {
+    "an", "bel", "ca", "dor", "el", "fra", "gan", "hal", "is", "jo",
+    "ka", "lin", "mar", "nor", "os", "por", "qui", "ros", "san", "ter",
+    "ul", "val", "wes", "xi", "yor", "zan"};
+static const char *const generate_functions[] = {
+    "1-------", "-2------", "--3-----", "12345---", "--34-6--", "1-3-----",
+    "---4----", "12------"};
+// Malformed in the ways real files are: short, swapped, missing the space
+static const char *const generate_bad_coordinates[] = {
+    "44S 06846E", "0044X 06846E", "004406846E", "00AAN 068BBE", "9999N 99999E"};
+
+#define GENERATE_COUNT(array) (sizeof(array) / sizeof(array[0]))
+
+typedef struct {
+  double duplicate_rate;
+  double quoted_rate;
+  double bad_coordinate_rate;
+  uint64_t seed;
+} GenerateRates;
+
+static uint64_t generate_next(uint64_t *state) {
+  // xorshift64*
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ull;
+}
+
+static double generate_unit(uint64_t *state) {
+  return (generate_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint64_t generate_row_state(uint64_t seed, uint64_t row) {
+  uint64_t state = seed ^ (row + 1) * 0x9e3779b97f4a7c15ull;
+  return state ? state : 1;
+}
+
+// Row content of one index, the flags only say what was generated
+static void generate_row(FILE *out, const GenerateRates *rates, uint64_t row,
+                         bool *quoted, bool *bad_coordinates) {
+  uint64_t state = generate_row_state(rates->seed, row);
+  const char *country = generate_countries[generate_next(&state) %
+                                            GENERATE_COUNT(generate_countries)];
+  char location[4];
+  for (int i = 0; i < 3; i++) {
+    uint64_t c = generate_next(&state) % 34;
+    location[i] = c < 26 ? 'A' + c : '2' + (c - 26);
+  }
+  location[3] = '\0';
+
+  char name[64];
+  int len = 0;
+  int syllables = 2 + generate_next(&state) % 3;
+  for (int i = 0; i < syllables; i++) {
+    const char *s = generate_syllables[generate_next(&state) %
+                                       GENERATE_COUNT(generate_syllables)];
+    len += snprintf(name + len, sizeof(name) - len, "%s", s);
+  }
+  name[0] = name[0] - 'a' + 'A';
+  // Keeps keys unique across rows that drew the same syllables
+  len += snprintf(name + len, sizeof(name) - len, " %llu",
+                  (unsigned long long)(row % 100000));
+
+  // Quoted names hold a comma and sometimes an escaped quote
+  *quoted = generate_unit(&state) < rates->quoted_rate;
+  char field[160];
+  if (*quoted)
+    snprintf(field, sizeof(field),
+             generate_next(&state) % 4 == 0 ? "\"%s \"\"Old\"\", Port\""
+                                            : "\"%s, Port\"",
+             name);
+  else
+    snprintf(field, sizeof(field), "%s", name);
+
+  char coordinates[32] = "";
+  *bad_coordinates = generate_unit(&state) < rates->bad_coordinate_rate;
+  if (*bad_coordinates) {
+    size_t bad =
+        generate_next(&state) % GENERATE_COUNT(generate_bad_coordinates);
+    snprintf(coordinates, sizeof(coordinates), "%s",
+             generate_bad_coordinates[bad]);
+  } else if (generate_next(&state) % 20 != 0) {
+    snprintf(coordinates, sizeof(coordinates), "%02d%02d%c %03d%02d%c",
+             (int)(generate_next(&state) % 90),
+             (int)(generate_next(&state) % 60),
+             generate_next(&state) % 2 ? 'N' : 'S',
+             (int)(generate_next(&state) % 180),
+             (int)(generate_next(&state) % 60),
+             generate_next(&state) % 2 ? 'E' : 'W');
+  }
+
+  static const char changes[] = {' ', ' ', ' ', ' ', ' ', ' ', ' ', '+', '|',
+                                 '#'};
+  char change = changes[generate_next(&state) % sizeof(changes)];
+  const char *function =
+      generate_functions[generate_next(&state) %
+                         GENERATE_COUNT(generate_functions)];
+  int year = (int)(generate_next(&state) % 30);
+  int month = 1 + (int)(generate_next(&state) % 12);
+  fprintf(out, "%.*s,%s,%s,%s,%s,,AI,%s,%02d%02d,,%s,\n", change != ' ',
+          &change, country, location, field, field, function, year, month,
+          coordinates);
+}
+
+static bool generate_rate(const char *arg, const char *name, double *rate) {
+  char *end;
+  *rate = strtod(arg, &end);
+  if (*end != '\0' || *rate < 0 || *rate > 1) {
+    fprintf(stderr, "Invalid %s '%s', expected 0..1\n", name, arg);
+    return false;
+  }
+  return true;
+}
+
+static int bench_generate(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: bench generate <out.csv|-> <rows> "
+                    "[duplicate_rate] [quoted_rate] [bad_coordinate_rate] "
+                    "[seed]\n");
+    return 1;
+  }
+  uint64_t rows = strtoull(argv[1], NULL, 10);
+  GenerateRates rates = {.duplicate_rate = 0.01,
+                         .quoted_rate = 0.02,
+                         .bad_coordinate_rate = 0.001,
+                         .seed = 1};
+  if ((argc > 2 &&
+       !generate_rate(argv[2], "duplicate rate", &rates.duplicate_rate)) ||
+      (argc > 3 &&
+       !generate_rate(argv[3], "quoted rate", &rates.quoted_rate)) ||
+      (argc > 4 && !generate_rate(argv[4], "bad coordinate rate",
+                                  &rates.bad_coordinate_rate)))
+    return 1;
+  if (argc > 5)
+    rates.seed = strtoull(argv[5], NULL, 10);
+
+  bool to_stdout = strcmp(argv[0], "-") == 0;
+  FILE *out = to_stdout ? stdout : fopen(argv[0], "w");
+  if (out == NULL) {
+    perror(argv[0]);
+    return 1;
+  }
+  static char buffer[1 << 20];
+  setvbuf(out, buffer, _IOFBF, sizeof(buffer));
+
+  double start = get_time();
+  fprintf(out, "Change,Country,Location,Name,NameWoDiacritics,Subdivision,"
+               "Status,Function,Date,IATA,Coordinates,Remarks\n");
+  uint64_t state = generate_row_state(rates.seed, UINT64_MAX);
+  uint64_t duplicates = 0, quoted = 0, bad_coordinates = 0;
+  // Indices of the rows written as themselves, a duplicate picks one of
+  // them. Picking any earlier index could land on a slot that was itself a
+  // duplicate, and re-emit a row that was never written
+  uint64_t *originals = malloc((rows ? rows : 1) * sizeof(uint64_t));
+  uint64_t num_originals = 0;
+  for (uint64_t row = 0; row < rows; row++) {
+    uint64_t source = row;
+    if (num_originals > 0 && generate_unit(&state) < rates.duplicate_rate) {
+      source = originals[generate_next(&state) % num_originals];
+      duplicates++;
+    } else {
+      originals[num_originals++] = row;
+    }
+    bool row_quoted, row_bad;
+    generate_row(out, &rates, source, &row_quoted, &row_bad);
+    quoted += row_quoted;
+    bad_coordinates += row_bad;
+  }
+  free(originals);
+  long bytes = to_stdout ? 0 : ftell(out);
+  if (fflush(out) != 0 || (!to_stdout && fclose(out) != 0)) {
+    perror(argv[0]);
+    return 1;
+  }
+  double seconds = get_time() - start;
+
+  fprintf(stderr,
+          "%llu rows, %llu duplicates, %llu quoted names, %llu bad "
+          "coordinates",
+          (unsigned long long)rows, (unsigned long long)duplicates,
+          (unsigned long long)quoted, (unsigned long long)bad_coordinates);
+  if (bytes > 0)
+    fprintf(stderr, ", %.1f MB in %.2f s", bytes / 1e6, seconds);
+  fprintf(stderr, "\n");
+  return 0;
+}
@@ -0,0 +1,162 @@
+// Parallel parse benchmark: chunked parser threads feeding a queue that is
+// drained without touching the database
+
+typedef struct {
+  BatchQueue *queue;
+  BatchPool *pool;
+} DrainContext;
+
+static void *bench_drain_thread(void *arg) {
+  DrainContext *ctx = (DrainContext *)arg;
+  Batch *batch;
+  while ((batch = queue_pop(ctx->queue)) != NULL)
+    batch_release(ctx->pool, batch);
+  return NULL;
+}
+
+// pool_limit 0 mallocs every batch, like the loader did before the pool
+static double bench_parallel_run(InputReader *reader, size_t start,
+                                 int num_parsers, size_t pool_limit,
+                                 BatchPool *pool, size_t *rows) {
+  BatchQueue queue;
+  queue_init(&queue, QUEUE_SIZE);
+  batch_pool_init(pool, BENCH_BATCH_SIZE, pool_limit);
+  DrainContext drain_ctx = {.queue = &queue, .pool = pool};
+  pthread_t drain;
+  pthread_create(&drain, NULL, bench_drain_thread, &drain_ctx);
+
+  ByteRange ranges[MAX_PARSERS];
+  pthread_t parsers[MAX_PARSERS];
+  ParserContext contexts[MAX_PARSERS];
+  Benchmark bench;
+  benchmark_init(&bench);
+
+  double begin = get_time();
+  int count =
+      plan_chunks(reader->data, reader->size, start, num_parsers, ranges);
+  atomic_int next_range = 0;
+  for (int i = 0; i < count; i++) {
+    contexts[i].id = i;
+    contexts[i].data = reader->data;
+    contexts[i].ranges = ranges;
+    contexts[i].num_ranges = count;
+    contexts[i].next_range = &next_range;
+    contexts[i].decoder = NULL;
+    contexts[i].file = -1;
+    contexts[i].pool = pool;
+    contexts[i].queue = &queue;
+    contexts[i].dedup = NULL;
+    contexts[i].delta = NULL;
+    contexts[i].plan = NULL;
+    contexts[i].metrics = benchmark_thread(&bench, "parser", i);
+    pthread_create(&parsers[i], NULL, parser_thread, &contexts[i]);
+  }
+
+  *rows = 0;
+  for (int i = 0; i < count; i++) {
+    pthread_join(parsers[i], NULL);
+    *rows += contexts[i].metrics->counters[ROWS_PARSED];
+  }
+  queue_finish(&queue);
+  pthread_join(drain, NULL);
+  double seconds = get_time() - begin;
+
+  benchmark_destroy(&bench);
+  batch_pool_destroy(pool);
+  queue_destroy(&queue);
+  return seconds;
+}
+
+static int bench_parallel(int argc, char *argv[]) {
+  if (argc < 1) {
+    fprintf(stderr, "Usage: bench parallel <file.csv> [max_parsers]\n");
+    return 1;
+  }
+  int max_parsers = argc > 1 ? atoi(argv[1]) : 8;
+  if (max_parsers < 1 || max_parsers > MAX_PARSERS)
+    max_parsers = MAX_PARSERS;
+
+  InputReader reader;
+  if (!reader_open(&reader, argv[0], READER_MMAP)) {
+    fprintf(stderr, "Could not open %s\n", argv[0]);
+    return 1;
+  }
+  if (reader.decoder) {
+    fprintf(stderr, "%s is compressed, these runs need the mapped file\n",
+            argv[0]);
+    reader_close(&reader);
+    return 1;
+  }
+  const char *line;
+  size_t line_len;
+  reader_next_line(&reader, &line, &line_len); // header
+  size_t start = reader.offset;
+
+  printf("%8s %12s %12s %12s %10s\n", "parsers", "rows", "seconds", "rows/s",
+         "speedup");
+  double base = 0;
+  for (int n = 1; n <= max_parsers; n *= 2) {
+    size_t rows;
+    BatchPool pool;
+    double seconds = bench_parallel_run(
+        &reader, start, n, batch_pool_limit(n, QUEUE_SIZE, 1, 0), &pool, &rows);
+    if (n == 1)
+      base = seconds;
+    printf("%8d %12zu %12.4f %12.0f %9.2fx\n", n, rows, seconds,
+           rows / seconds, base / seconds);
+  }
+
+  reader_close(&reader);
+  return 0;
+}
+
+// Batch pool against malloc per batch: allocations and page faults of a
+// full parse
+static int bench_pool(int argc, char *argv[]) {
+  if (argc < 1) {
+    fprintf(stderr, "Usage: bench pool <file.csv> [parsers]\n");
+    return 1;
+  }
+  int num_parsers = argc > 1 ? atoi(argv[1]) : 2;
+  if (num_parsers < 1 || num_parsers > MAX_PARSERS)
+    num_parsers = 2;
+
+  InputReader reader;
+  if (!reader_open(&reader, argv[0], READER_MMAP)) {
+    fprintf(stderr, "Could not open %s\n", argv[0]);
+    return 1;
+  }
+  if (reader.decoder) {
+    fprintf(stderr, "%s is compressed, these runs need the mapped file\n",
+            argv[0]);
+    reader_close(&reader);
+    return 1;
+  }
+  const char *line;
+  size_t line_len;
+  reader_next_line(&reader, &line, &line_len); // header
+  size_t start = reader.offset;
+
+  printf("%-8s %10s %10s %10s %12s %10s\n", "batches", "allocated", "reused",
+         "seconds", "minor flt", "peak MB");
+  for (int pooled = 0; pooled < 2; pooled++) {
+    MemoryCounters before, after;
+    BatchPool pool;
+    size_t rows;
+    size_t limit =
+        pooled ? batch_pool_limit(num_parsers, QUEUE_SIZE, 1, 0) : 0;
+
+    read_memory_counters(&before);
+    double seconds =
+        bench_parallel_run(&reader, start, num_parsers, limit, &pool, &rows);
+    read_memory_counters(&after);
+
+    printf("%-8s %10zu %10zu %10.4f %12ld %10.1f\n",
+           pooled ? "pool" : "malloc", atomic_load(&pool.created),
+           atomic_load(&pool.reused), seconds,
+           after.minor_faults - before.minor_faults, after.max_rss_kb / 1024.0);
+  }
+
+  reader_close(&reader);
+  return 0;
+}
@@ -0,0 +1,148 @@
+// Queue contention benchmark: the lock-free BatchQueue against the previous
+// single mutex/two condvar ring, N producers and N consumers passing tokens
+
+// The queue BatchQueue replaced, kept as the baseline
+typedef struct {
+  Batch **batches;
+  size_t capacity;
+  size_t front;
+  size_t rear;
+  size_t count;
+  pthread_mutex_t mutex;
+  pthread_cond_t not_full;
+  pthread_cond_t not_empty;
+  bool done;
+} MutexQueue;
+
+static void mutex_queue_push(MutexQueue *queue, Batch *batch) {
+  pthread_mutex_lock(&queue->mutex);
+  while (queue->count == queue->capacity)
+    pthread_cond_wait(&queue->not_full, &queue->mutex);
+  queue->batches[queue->rear] = batch;
+  queue->rear = (queue->rear + 1) % queue->capacity;
+  queue->count++;
+  pthread_cond_signal(&queue->not_empty);
+  pthread_mutex_unlock(&queue->mutex);
+}
+
+static Batch *mutex_queue_pop(MutexQueue *queue) {
+  pthread_mutex_lock(&queue->mutex);
+  while (queue->count == 0 && !queue->done)
+    pthread_cond_wait(&queue->not_empty, &queue->mutex);
+  Batch *batch = NULL;
+  if (queue->count > 0) {
+    batch = queue->batches[queue->front];
+    queue->front = (queue->front + 1) % queue->capacity;
+    queue->count--;
+    pthread_cond_signal(&queue->not_full);
+  }
+  pthread_mutex_unlock(&queue->mutex);
+  return batch;
+}
+
+typedef struct {
+  bool lock_free;
+  BatchQueue *queue;
+  MutexQueue *mutex_queue;
+  size_t items;    // tokens pushed, producers only
+  size_t received; // tokens popped, consumers only
+} QueueBenchThread;
+
+static void *bench_queue_producer(void *arg) {
+  QueueBenchThread *t = (QueueBenchThread *)arg;
+  for (size_t i = 1; i <= t->items; i++) {
+    Batch *token = (Batch *)(uintptr_t)i;
+    if (t->lock_free)
+      queue_push(t->queue, token);
+    else
+      mutex_queue_push(t->mutex_queue, token);
+  }
+  return NULL;
+}
+
+static void *bench_queue_consumer(void *arg) {
+  QueueBenchThread *t = (QueueBenchThread *)arg;
+  t->received = 0;
+  while ((t->lock_free ? queue_pop(t->queue) : mutex_queue_pop(t->mutex_queue)))
+    t->received++;
+  return NULL;
+}
+
+static double bench_queue_run(bool lock_free, int threads, size_t items,
+                              size_t capacity, size_t *received) {
+  BatchQueue queue;
+  MutexQueue mutex_queue = {.capacity = capacity};
+  queue_init(&queue, capacity);
+  mutex_queue.batches = malloc(capacity * sizeof(Batch *));
+  pthread_mutex_init(&mutex_queue.mutex, NULL);
+  pthread_cond_init(&mutex_queue.not_full, NULL);
+  pthread_cond_init(&mutex_queue.not_empty, NULL);
+
+  pthread_t producers[64], consumers[64];
+  QueueBenchThread ctx[128];
+  double start = get_time();
+  for (int i = 0; i < 2 * threads; i++) {
+    ctx[i] = (QueueBenchThread){.lock_free = lock_free,
+                                .queue = &queue,
+                                .mutex_queue = &mutex_queue,
+                                .items = items / threads};
+  }
+  for (int i = 0; i < threads; i++) {
+    pthread_create(&consumers[i], NULL, bench_queue_consumer, &ctx[i]);
+    pthread_create(&producers[i], NULL, bench_queue_producer,
+                   &ctx[threads + i]);
+  }
+  for (int i = 0; i < threads; i++)
+    pthread_join(producers[i], NULL);
+
+  if (lock_free) {
+    queue_finish(&queue);
+  } else {
+    pthread_mutex_lock(&mutex_queue.mutex);
+    mutex_queue.done = true;
+    pthread_cond_broadcast(&mutex_queue.not_empty);
+    pthread_mutex_unlock(&mutex_queue.mutex);
+  }
+
+  *received = 0;
+  for (int i = 0; i < threads; i++) {
+    pthread_join(consumers[i], NULL);
+    *received += ctx[i].received;
+  }
+  double seconds = get_time() - start;
+
+  queue_destroy(&queue);
+  free(mutex_queue.batches);
+  pthread_mutex_destroy(&mutex_queue.mutex);
+  pthread_cond_destroy(&mutex_queue.not_full);
+  pthread_cond_destroy(&mutex_queue.not_empty);
+  return seconds;
+}
+
+static int bench_queue(int argc, char *argv[]) {
+  int max_threads = argc > 0 ? atoi(argv[0]) : 32;
+  size_t items = argc > 1 ? strtoull(argv[1], NULL, 10) : 2000000;
+  size_t capacity = argc > 2 ? strtoull(argv[2], NULL, 10) : 64;
+  if (max_threads < 1 || max_threads > 64)
+    max_threads = 32;
+
+  printf("capacity %zu, %zu tokens per run\n", capacity, items);
+  printf("%10s %10s %14s %14s %8s\n", "producers", "consumers",
+         "mutex ops/s", "lockfree ops/s", "ratio");
+  for (int n = 1; n <= max_threads; n *= 2) {
+    size_t received_mutex, received_lock_free;
+    double mutex_s =
+        bench_queue_run(false, n, items, capacity, &received_mutex);
+    double lock_free_s =
+        bench_queue_run(true, n, items, capacity, &received_lock_free);
+    if (received_mutex != received_lock_free) {
+      fprintf(stderr, "token count mismatch: %zu vs %zu\n", received_mutex,
+              received_lock_free);
+      return 1;
+    }
+    printf("%10d %10d %14.0f %14.0f %7.2fx\n", n, n,
+           received_mutex / mutex_s, received_lock_free / lock_free_s,
+           mutex_s / lock_free_s);
+  }
+  return 0;
+}
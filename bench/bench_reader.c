@@ -0,0 +1,288 @@
+// Reader benchmark: the original fgets and strsep path, the getline stdio
+// reader, the mmap view path and the read ahead ring, optionally with the
+// file evicted from the page cache before every run
+
+#define BENCH_BATCH_SIZE 24000
+
+typedef struct {
+  double seconds;
+  size_t rows;
+  size_t bytes;
+  const char *backend; // bench_reader_backend
+} ReaderRun;
+
+// Drops the cached pages of the file, the next run reads from the device.
+// Dirty pages stay, a freshly written file needs a sync first
+static bool bench_reader_evict(const char *path) {
+#ifdef POSIX_FADV_DONTNEED
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return false;
+  }
+  fdatasync(fd);
+  int rc = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+  if (rc != 0) {
+    fprintf(stderr, "Could not evict %s: %s\n", path, strerror(rc));
+    return false;
+  }
+  return true;
+#else
+  fprintf(stderr, "Cold runs need posix_fadvise, not available here\n");
+  (void)path;
+  return false;
+#endif
+}
+
+// How a uring mode read the file, NULL for the other modes
+static const char *bench_reader_backend(const InputReader *reader) {
+  if (reader->mode != READER_URING && reader->mode != READER_URING_DIRECT)
+    return NULL;
+  const StreamDecoder *decoder = reader->decoder;
+  if (decoder == NULL)
+    return "stdio";
+  if (decoder->compression != COMPRESSION_NONE)
+    return "decoder";
+  if (decoder->ahead.uring)
+    return decoder->direct ? "io_uring, direct" : "io_uring";
+  return decoder->direct ? "pread, direct" : "pread";
+}
+
+// The loader before the readers existed: fgets into a 1024 byte line,
+// strsep into fixed size copies of every field, sscanf for the coordinates
+// and every processed row copied whole into the batch
+#define BASELINE_LINE_LENGTH 1024
+
+typedef struct {
+  char change;
+  char country_code[3];
+  char location_code[4];
+  char name[100];
+  char name_wo_diacritics[100];
+  char subdivision[100];
+  char status[10];
+  char function_code[9];
+  char date[5];
+  char iata[4];
+  char coordinates[50];
+  char remarks[200];
+} BaselineLocation;
+
+typedef struct {
+  char unlocode[6];
+  char name[100];
+  char country_code[3];
+  double latitude;
+  double longitude;
+  bool is_airport;
+  bool is_port;
+  bool is_train_station;
+} BaselineProcessed;
+
+// Next field into a fixed size copy, cut at size - 1 bytes
+static void baseline_field(char **rest, char *dst, size_t size) {
+  char *token = strsep(rest, ",");
+  if (token && strlen(token) > 0) {
+    strncpy(dst, token, size - 1);
+    dst[size - 1] = '\0';
+  }
+}
+
+static void baseline_parse_line(char *line, BaselineLocation *data) {
+  memset(data, 0, sizeof(BaselineLocation));
+  if (strlen(line) <= 1)
+    return;
+  char *rest = line;
+  char *token = strsep(&rest, ",");
+  if (token && strlen(token) > 0)
+    data->change = token[0];
+  baseline_field(&rest, data->country_code, sizeof(data->country_code));
+  baseline_field(&rest, data->location_code, sizeof(data->location_code));
+  baseline_field(&rest, data->name, sizeof(data->name));
+  baseline_field(&rest, data->name_wo_diacritics,
+                 sizeof(data->name_wo_diacritics));
+  baseline_field(&rest, data->subdivision, sizeof(data->subdivision));
+  baseline_field(&rest, data->status, sizeof(data->status));
+  baseline_field(&rest, data->function_code, sizeof(data->function_code));
+  baseline_field(&rest, data->date, sizeof(data->date));
+  baseline_field(&rest, data->iata, sizeof(data->iata));
+  baseline_field(&rest, data->coordinates, sizeof(data->coordinates));
+  baseline_field(&rest, data->remarks, sizeof(data->remarks));
+}
+
+static void baseline_process(const BaselineLocation *raw,
+                             BaselineProcessed *processed) {
+  snprintf(processed->unlocode, 6, "%s%s", raw->country_code,
+           raw->location_code);
+  strncpy(processed->name, raw->name, 99);
+  processed->name[99] = '\0';
+  strncpy(processed->country_code, raw->country_code, 2);
+  processed->country_code[2] = '\0';
+
+  int lat_deg, lat_min, lon_deg, lon_min;
+  char lat_dir, lon_dir;
+  processed->latitude = processed->longitude = 0;
+  if (sscanf(raw->coordinates, "%2d%2d%c %3d%2d%c", &lat_deg, &lat_min,
+             &lat_dir, &lon_deg, &lon_min, &lon_dir) == 6) {
+    processed->latitude =
+        (lat_deg + lat_min / 60.0) * (lat_dir == 'S' ? -1 : 1);
+    processed->longitude =
+        (lon_deg + lon_min / 60.0) * (lon_dir == 'W' ? -1 : 1);
+  }
+
+  processed->is_port = processed->is_airport = false;
+  processed->is_train_station = false;
+  if (strlen(raw->function_code) >= 8) {
+    for (int i = 0; i < 8; i++) {
+      processed->is_port |= raw->function_code[i] == '1';
+      processed->is_train_station |= raw->function_code[i] == '2';
+      processed->is_airport |= raw->function_code[i] == '4';
+    }
+  }
+}
+
+// parse false only counts the lines fgets returns
+static bool bench_reader_baseline(const char *path, bool parse,
+                                  ReaderRun *run) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    fprintf(stderr, "Could not open %s\n", path);
+    return false;
+  }
+  BaselineProcessed *batch =
+      malloc(BENCH_BATCH_SIZE * sizeof(BaselineProcessed));
+  int count = 0;
+  char line[BASELINE_LINE_LENGTH];
+
+  double start = get_time();
+  run->rows = 0;
+  run->backend = NULL;
+  if (parse && fgets(line, sizeof(line), file) == NULL)
+    parse = false; // no header, nothing to parse
+  while (fgets(line, sizeof(line), file)) {
+    run->rows++;
+    if (!parse)
+      continue;
+    BaselineLocation raw;
+    line[strcspn(line, "\n")] = 0;
+    baseline_parse_line(line, &raw);
+    baseline_process(&raw, &batch[count]);
+    if (++count == BENCH_BATCH_SIZE)
+      count = 0;
+  }
+  run->seconds = get_time() - start;
+  run->bytes = (size_t)ftell(file);
+
+  free(batch);
+  fclose(file);
+  return true;
+}
+
+// Line splitting only, shows the cost of the reader itself
+static bool bench_reader_scan(const char *path, ReaderMode mode,
+                              ReaderRun *run) {
+  InputReader reader;
+  if (!reader_open(&reader, path, mode)) {
+    fprintf(stderr, "Could not open %s\n", path);
+    return false;
+  }
+
+  const char *line;
+  size_t line_len;
+  double start = get_time();
+  run->rows = 0;
+  run->backend = bench_reader_backend(&reader);
+  while (reader_next_line(&reader, &line, &line_len))
+    run->rows++;
+  run->seconds = get_time() - start;
+  run->bytes = reader.offset;
+
+  reader_close(&reader);
+  return true;
+}
+
+// Read, parse and fill batches the way the producer in main does
+static bool bench_reader_run(const char *path, ReaderMode mode,
+                             ReaderRun *run) {
+  InputReader reader;
+  if (!reader_open(&reader, path, mode)) {
+    fprintf(stderr, "Could not open %s\n", path);
+    return false;
+  }
+
+  Batch *batch = batch_create(BENCH_BATCH_SIZE);
+
+  const char *line;
+  size_t line_len;
+  double start = get_time();
+
+  reader_next_line(&reader, &line, &line_len); // header
+  run->rows = 0;
+  run->backend = bench_reader_backend(&reader);
+  while (reader_next_line(&reader, &line, &line_len)) {
+    LocationData raw_data;
+    ProcessedLocation processed;
+    parse_line(line, line_len, &raw_data);
+    process_location_data(&raw_data, &processed);
+    batch_append(batch, &processed);
+    run->rows++;
+    if (batch->count == batch->capacity)
+      batch_reset(batch);
+  }
+
+  run->seconds = get_time() - start;
+  run->bytes = reader.offset;
+
+  batch_free(batch);
+  reader_close(&reader);
+  return true;
+}
+
+static int bench_reader(int argc, char *argv[]) {
+  if (argc < 1) {
+    fprintf(stderr,
+            "Usage: bench reader <file.csv> [iterations] [warm|cold]\n");
+    return 1;
+  }
+  const char *path = argv[0];
+  int iterations = argc > 1 ? atoi(argv[1]) : 3;
+  bool cold = argc > 2 && strcmp(argv[2], "cold") == 0;
+  if (argc > 2 && !cold && strcmp(argv[2], "warm") != 0) {
+    fprintf(stderr, "Unknown cache state '%s', expected warm or cold\n",
+            argv[2]);
+    return 1;
+  }
+
+  const ReaderMode modes[] = {READER_STDIO, READER_MMAP, READER_URING,
+                              READER_URING_DIRECT};
+  const char *names[] = {"stdio", "mmap", "uring", "uring-direct"};
+
+  printf("%s page cache\n", cold ? "Cold" : "Warm");
+  printf("%-13s %-6s %12s %12s %12s %12s  %s\n", "reader", "pass", "rows",
+         "best (s)", "MB/s", "rows/s", "reads");
+  // Mode -1 is the original fgets path, the baseline of the others
+  for (int m = -1; m < 4; m++) {
+    for (int pass = 0; pass < 2; pass++) {
+      ReaderRun best = {.seconds = 0};
+      for (int i = 0; i < iterations; i++) {
+        ReaderRun run;
+        if (cold && !bench_reader_evict(path))
+          return 1;
+        bool ok = m < 0       ? bench_reader_baseline(path, pass == 1, &run)
+                  : pass == 0 ? bench_reader_scan(path, modes[m], &run)
+                              : bench_reader_run(path, modes[m], &run);
+        if (!ok)
+          return 1;
+        if (i == 0 || run.seconds < best.seconds)
+          best = run;
+      }
+      printf("%-13s %-6s %12zu %12.4f %12.1f %12.0f  %s\n",
+             m < 0 ? "fgets" : names[m],
+             pass == 0 ? "scan" : "parse", best.rows, best.seconds,
+             best.bytes / best.seconds / 1e6, best.rows / best.seconds,
+             best.backend ? best.backend : "");
+    }
+  }
+  return 0;
+}
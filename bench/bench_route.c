@@ -0,0 +1,100 @@
+// Writer routing benchmark: batches of the file go through the router to
+// one drain thread per writer. Reports the routing cost per row and how
+// evenly the country codes spread the rows over the writers
+
+typedef struct {
+  BatchQueue *queue;
+  BatchPool *pool;
+  int partition;
+  int partitions;
+  size_t rows;
+  size_t misrouted;
+} RouteDrain;
+
+static void *bench_route_drain(void *arg) {
+  RouteDrain *drain = arg;
+  Batch *batch;
+  while ((batch = queue_pop(drain->queue)) != NULL) {
+    for (int i = 0; i < batch->count; i++)
+      drain->misrouted +=
+          router_partition(batch, i, drain->partitions) != drain->partition;
+    drain->rows += batch->count;
+    batch_release(drain->pool, batch);
+  }
+  return NULL;
+}
+
+static int bench_route(int argc, char *argv[]) {
+  if (argc < 1) {
+    fprintf(stderr, "Usage: bench route <file.csv> [max_writers]\n");
+    return 1;
+  }
+  int max_writers = argc > 1 ? atoi(argv[1]) : 8;
+  if (max_writers < 1)
+    max_writers = 1;
+
+  InputReader reader;
+  if (!reader_open(&reader, argv[0], READER_MMAP)) {
+    fprintf(stderr, "Could not open %s\n", argv[0]);
+    return 1;
+  }
+
+  printf("%-8s %12s %10s %10s %12s %10s\n", "writers", "rows", "time (s)",
+         "ns/row", "max share", "misrouted");
+  for (int writers = 1; writers <= max_writers; writers *= 2) {
+    reader_seek(&reader, 0);
+    size_t num_batches;
+    Batch **batches = bench_load_batches(&reader, &num_batches);
+
+    BatchQueue input;
+    queue_init(&input, QUEUE_SIZE);
+    BatchPool pool;
+    batch_pool_init(&pool, BENCH_BATCH_SIZE, 0);
+    Benchmark bench;
+    benchmark_init(&bench);
+    BatchRouter router = {.input = &input,
+                          .partitions = writers,
+                          .pool = &pool,
+                          .metrics = benchmark_thread(&bench, "router", 0)};
+
+    double start = get_time();
+    router_start(&router);
+    RouteDrain drains[writers];
+    pthread_t threads[writers];
+    for (int w = 0; w < writers; w++) {
+      drains[w] = (RouteDrain){.queue = &router.outputs[w],
+                               .pool = &pool,
+                               .partition = w,
+                               .partitions = writers};
+      pthread_create(&threads[w], NULL, bench_route_drain, &drains[w]);
+    }
+    for (size_t b = 0; b < num_batches; b++)
+      queue_push(&input, batches[b]);
+    queue_finish(&input);
+    router_join(&router);
+
+    size_t rows = 0, largest = 0, misrouted = 0;
+    for (int w = 0; w < writers; w++) {
+      pthread_join(threads[w], NULL);
+      rows += drains[w].rows;
+      misrouted += drains[w].misrouted;
+      if (drains[w].rows > largest)
+        largest = drains[w].rows;
+    }
+    double seconds = get_time() - start;
+
+    // 1.00 is a perfectly even split, the slowest writer sets the pace
+    printf("%-8d %12zu %10.4f %10.1f %12.2f %10zu\n", writers, rows, seconds,
+           rows ? seconds / rows * 1e9 : 0,
+           rows ? (double)largest * writers / rows : 0, misrouted);
+
+    router_destroy(&router);
+    benchmark_destroy(&bench);
+    batch_pool_destroy(&pool);
+    queue_destroy(&input);
+    free(batches);
+  }
+
+  reader_close(&reader);
+  return 0;
+}
@@ -0,0 +1,180 @@
+// Schema kernel benchmark: the hand written UN/LOCODE parse and encode
+// against the kernels a schema plan binds, for the same layout. The plan
+// must produce byte identical COPY streams
+
+typedef struct {
+  FieldView *lines;
+  size_t count;
+} LineSample;
+
+// Every record after the header, views into the mapping
+static void bench_load_lines(InputReader *reader, LineSample *sample) {
+  size_t capacity = 1 << 16;
+  const char *line;
+  size_t line_len;
+
+  sample->lines = malloc(capacity * sizeof(FieldView));
+  sample->count = 0;
+  while (reader_next_line(reader, &line, &line_len)) {
+    if (sample->count == capacity) {
+      capacity *= 2;
+      sample->lines = realloc(sample->lines, capacity * sizeof(FieldView));
+    }
+    sample->lines[sample->count++] = (FieldView){line, line_len};
+  }
+}
+
+// Parse every line into the batches, plan NULL for the hand written path
+static void bench_schema_parse(const LineSample *sample,
+                               const SchemaPlan *plan, Batch **batches) {
+  FieldView fields[SCHEMA_MAX_FIELDS];
+  int b = 0;
+  batch_reset(batches[0]);
+  for (size_t i = 0; i < sample->count; i++) {
+    Batch *batch = batches[b];
+    if (batch->count == batch->capacity) {
+      batch = batches[++b];
+      batch_reset(batch);
+    }
+    FieldView line = sample->lines[i];
+    if (plan) {
+      size_t count = line.len > 1 ? csv_split_record(line.ptr, line.len,
+                                                     fields, plan->num_fields)
+                                  : 0;
+      schema_append_row(plan, fields, count, batch);
+    } else {
+      LocationData raw_data;
+      ProcessedLocation processed;
+      parse_line(line.ptr, line.len, &raw_data);
+      process_location_data(&raw_data, &processed);
+      batch_append(batch, &processed);
+    }
+  }
+}
+
+// The whole input as one COPY stream, without flushes
+static void bench_schema_encode(CopyBuffer *buffer, CopyFormat format,
+                                Batch **batches, int num_batches) {
+  buffer->len = 0;
+  if (format == COPY_FORMAT_BINARY)
+    copy_encode_binary_header(buffer);
+  for (int b = 0; b < num_batches; b++) {
+    const Batch *batch = batches[b];
+    for (int r = 0; r < batch->count; r++) {
+      if (!batch_row_is_valid(batch, r))
+        continue;
+      if (format == COPY_FORMAT_BINARY)
+        copy_encode_binary_row(buffer, batch, r);
+      else
+        copy_encode_csv_row(buffer, batch, r);
+    }
+  }
+  if (format == COPY_FORMAT_BINARY)
+    copy_encode_binary_trailer(buffer);
+}
+
+static int bench_schema(int argc, char *argv[]) {
+  if (argc < 1) {
+    fprintf(stderr, "Usage: bench schema <file.csv> [iterations]\n");
+    return 1;
+  }
+  int iterations = argc > 1 ? atoi(argv[1]) : 5;
+  if (iterations < 1)
+    iterations = 1;
+
+  InputReader reader;
+  if (!reader_open(&reader, argv[0], READER_MMAP)) {
+    fprintf(stderr, "Could not open %s\n", argv[0]);
+    return 1;
+  }
+  const char *header;
+  size_t header_len;
+  if (!reader_next_line(&reader, &header, &header_len)) {
+    fprintf(stderr, "%s has no header line\n", argv[0]);
+    reader_close(&reader);
+    return 1;
+  }
+
+  // The built in layout parsed as any other schema file, so every column
+  // runs through a kernel
+  Schema schema;
+  SchemaPlan plan;
+  if (!schema_parse(&schema, schema_unlocode_text, "built in schema")) {
+    reader_close(&reader);
+    return 1;
+  }
+  if (!schema_bind(&plan, &schema, header, header_len, argv[0])) {
+    schema_free(&schema);
+    reader_close(&reader);
+    return 1;
+  }
+
+  LineSample sample;
+  bench_load_lines(&reader, &sample);
+  int num_batches = (int)(sample.count / BENCH_ENCODE_BATCH) + 1;
+  Batch **batches[2];
+  CopyBuffer streams[2][2]; // by path, then by format
+  for (int path = 0; path < 2; path++) {
+    batches[path] = malloc(num_batches * sizeof(Batch *));
+    for (int b = 0; b < num_batches; b++)
+      batches[path][b] = batch_create(BENCH_ENCODE_BATCH);
+    copy_buffer_init(&streams[path][COPY_FORMAT_CSV]);
+    copy_buffer_init(&streams[path][COPY_FORMAT_BINARY]);
+  }
+
+  const char *names[2] = {"hand", "schema"};
+  double best[2][3]; // parse, binary, csv
+  printf("%-8s %12s %14s %14s %14s\n", "path", "rows", "parse rows/s",
+         "binary rows/s", "csv rows/s");
+  // Paths alternate, so both see the same state of the machine
+  for (int i = 0; i < iterations; i++) {
+    for (int path = 0; path < 2; path++) {
+      const SchemaPlan *kernels = path == 0 ? NULL : &plan;
+      double start = get_time();
+      bench_schema_parse(&sample, kernels, batches[path]);
+      double parsed = get_time();
+      bench_schema_encode(&streams[path][COPY_FORMAT_BINARY],
+                          COPY_FORMAT_BINARY, batches[path], num_batches);
+      double binary = get_time();
+      bench_schema_encode(&streams[path][COPY_FORMAT_CSV], COPY_FORMAT_CSV,
+                          batches[path], num_batches);
+      double seconds[3] = {parsed - start, binary - parsed,
+                           get_time() - binary};
+      for (int s = 0; s < 3; s++)
+        if (i == 0 || seconds[s] < best[path][s])
+          best[path][s] = seconds[s];
+    }
+  }
+  for (int path = 0; path < 2; path++)
+    printf("%-8s %12zu %14.0f %14.0f %14.0f\n", names[path], sample.count,
+           sample.count / best[path][0], sample.count / best[path][1],
+           sample.count / best[path][2]);
+  printf("%-8s %12s %13.1f%% %13.1f%% %13.1f%%\n", "ratio", "",
+         100 * best[0][0] / best[1][0], 100 * best[0][1] / best[1][1],
+         100 * best[0][2] / best[1][2]);
+
+  int status = 0;
+  const char *formats[2] = {"csv", "binary"};
+  for (int f = 0; f < 2; f++) {
+    const CopyBuffer *hand = &streams[0][f];
+    const CopyBuffer *kernel = &streams[1][f];
+    bool same = hand->len == kernel->len &&
+                memcmp(hand->data, kernel->data, hand->len) == 0;
+    printf("%s COPY streams: %zu bytes, %s\n", formats[f], hand->len,
+           same ? "identical" : "DIFFERENT");
+    if (!same)
+      status = 1;
+  }
+
+  for (int path = 0; path < 2; path++) {
+    for (int b = 0; b < num_batches; b++)
+      batch_free(batches[path][b]);
+    free(batches[path]);
+    copy_buffer_free(&streams[path][COPY_FORMAT_CSV]);
+    copy_buffer_free(&streams[path][COPY_FORMAT_BINARY]);
+  }
+  free(sample.lines);
+  schema_free(&schema);
+  reader_close(&reader);
+  return status;
+}
@@ -0,0 +1,238 @@
+// Spatial sort benchmark: the batches of the file go through the sorter,
+// which is timed, and the order it sends the rows in is compared with the
+// file order. Without a server the GiST and heap effects are estimated from
+// where each row lands: index leaves are runs of neighbouring points along
+// the curve, heap pages fill in the order rows arrive
+
+// Points per GiST leaf page, about 8 kB of 48 byte entries
+#define BENCH_LEAF_ENTRIES 150
+// Rows per heap page of the locations table, about 100 bytes a row
+#define BENCH_ROWS_PER_PAGE 80
+// Radius queries, boxes of this many degrees around a located row
+#define BENCH_QUERIES 200
+#define BENCH_QUERY_DEGREES 0.5
+
+typedef struct {
+  double latitude;
+  double longitude;
+  uint64_t key;
+  bool located;
+} SpatialPoint;
+
+typedef struct {
+  BatchQueue *queue;
+  BatchPool *pool;
+  SpatialPoint *points; // in the order the sorter sends them
+  size_t rows;
+  size_t capacity;
+} SpatialDrain;
+
+static SpatialPoint spatial_point(const Batch *batch, int i) {
+  return (SpatialPoint){batch->latitude[i], batch->longitude[i],
+                        batch_hilbert_key(batch, i),
+                        (batch->flags[i] & LOCATION_HAS_COORDINATES) != 0};
+}
+
+static void *bench_spatial_drain(void *arg) {
+  SpatialDrain *drain = arg;
+  Batch *batch;
+  while ((batch = queue_pop(drain->queue)) != NULL) {
+    for (int i = 0; i < batch->count && drain->rows < drain->capacity; i++)
+      drain->points[drain->rows++] = spatial_point(batch, i);
+    batch_release(drain->pool, batch);
+  }
+  return NULL;
+}
+
+typedef struct {
+  double pages_per_query;
+  double rows_per_page; // of the pages a query reads
+  double leaves_per_batch;
+  double leaf_switches; // per 1000 located rows
+} SpatialLocality;
+
+// Leaf of a key: its rank among all keys, in leaves
+static size_t spatial_leaf(const uint64_t *keys, size_t count, uint64_t key) {
+  size_t low = 0, high = count;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (keys[mid] < key)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low / BENCH_LEAF_ENTRIES;
+}
+
+static void spatial_locality(const SpatialPoint *points, size_t count,
+                             const SpatialPoint *centers, int num_centers,
+                             const uint64_t *keys, size_t num_keys, int fill,
+                             SpatialLocality *report) {
+  // Heap pages a bounding box query reads
+  size_t num_pages = count / BENCH_ROWS_PER_PAGE + 1;
+  uint8_t *seen = calloc(num_pages, 1);
+  size_t *touched = malloc(num_pages * sizeof(size_t));
+  size_t pages = 0, matches = 0;
+  for (int q = 0; q < num_centers; q++) {
+    const SpatialPoint *c = &centers[q];
+    size_t num_touched = 0;
+    for (size_t i = 0; i < count; i++) {
+      const SpatialPoint *p = &points[i];
+      if (!p->located || p->latitude < c->latitude - BENCH_QUERY_DEGREES ||
+          p->latitude > c->latitude + BENCH_QUERY_DEGREES ||
+          p->longitude < c->longitude - BENCH_QUERY_DEGREES ||
+          p->longitude > c->longitude + BENCH_QUERY_DEGREES)
+        continue;
+      matches++;
+      size_t page = i / BENCH_ROWS_PER_PAGE;
+      if (!seen[page]) {
+        seen[page] = 1;
+        touched[num_touched++] = page;
+      }
+    }
+    for (size_t t = 0; t < num_touched; t++)
+      seen[touched[t]] = 0;
+    pages += num_touched;
+  }
+  report->pages_per_query = num_centers ? (double)pages / num_centers : 0;
+  report->rows_per_page = pages ? (double)matches / pages : 0;
+  free(seen);
+  free(touched);
+
+  // Index leaves every batch inserts into, and how often consecutive
+  // inserts move to another leaf
+  size_t num_leaves = num_keys / BENCH_LEAF_ENTRIES + 1;
+  size_t *stamp = calloc(num_leaves, sizeof(size_t));
+  size_t leaves = 0, switches = 0, located = 0, batches = 0;
+  size_t previous = SIZE_MAX;
+  for (size_t i = 0; i < count; i++) {
+    size_t batch = i / fill + 1;
+    if (!points[i].located)
+      continue;
+    size_t leaf = spatial_leaf(keys, num_keys, points[i].key);
+    if (stamp[leaf] != batch) {
+      stamp[leaf] = batch;
+      leaves++;
+    }
+    switches += previous != SIZE_MAX && leaf != previous;
+    previous = leaf;
+    located++;
+  }
+  batches = count / fill + (count % fill != 0);
+  report->leaves_per_batch = batches ? (double)leaves / batches : 0;
+  report->leaf_switches = located ? 1000.0 * switches / located : 0;
+  free(stamp);
+}
+
+static int compare_keys(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static int bench_spatial(int argc, char *argv[]) {
+  if (argc < 1) {
+    fprintf(stderr, "Usage: bench spatial <file.csv> [memory_mb]\n");
+    return 1;
+  }
+  int memory_mb = argc > 1 ? atoi(argv[1]) : DEFAULT_SORT_MEMORY_MB;
+  if (memory_mb < 1)
+    memory_mb = 1;
+
+  InputReader reader;
+  if (!reader_open(&reader, argv[0], READER_MMAP)) {
+    fprintf(stderr, "Could not open %s\n", argv[0]);
+    return 1;
+  }
+  size_t num_batches;
+  Batch **batches = bench_load_batches(&reader, &num_batches);
+  size_t count = 0;
+  for (size_t b = 0; b < num_batches; b++)
+    count += batches[b]->count;
+  SpatialPoint *file_order = malloc((count + 1) * sizeof(SpatialPoint));
+  size_t n = 0;
+  for (size_t b = 0; b < num_batches; b++)
+    for (int i = 0; i < batches[b]->count; i++)
+      file_order[n++] = spatial_point(batches[b], i);
+
+  BatchQueue input;
+  queue_init(&input, QUEUE_SIZE);
+  BatchPool pool;
+  batch_pool_init(&pool, BENCH_ENCODE_BATCH, 0);
+  Benchmark bench;
+  benchmark_init(&bench);
+  SpatialSorter sorter = {.input = &input,
+                          .pool = &pool,
+                          .memory = (size_t)memory_mb << 20,
+                          .metrics = benchmark_thread(&bench, "sorter", 0)};
+  // One more slot, a row the sorter made up would show as a count mismatch
+  SpatialDrain drain = {.pool = &pool,
+                        .points = malloc((count + 1) * sizeof(SpatialPoint)),
+                        .capacity = count + 1};
+
+  double start = get_time();
+  sorter_start(&sorter);
+  drain.queue = &sorter.output;
+  pthread_t thread;
+  pthread_create(&thread, NULL, bench_spatial_drain, &drain);
+  for (size_t b = 0; b < num_batches; b++)
+    queue_push(&input, batches[b]);
+  queue_finish(&input);
+  sorter_join(&sorter);
+  pthread_join(thread, NULL);
+  double seconds = get_time() - start;
+
+  bool ordered = drain.rows == count;
+  for (size_t i = 1; ordered && i < drain.rows; i++)
+    ordered = drain.points[i - 1].key <= drain.points[i].key;
+  printf("sorted %zu rows in %.3f seconds (%.0f rows/s) with %d MB: sort "
+         "%.3f s, %d runs, %.1f MB spilled, spill and merge %.3f s, %s\n",
+         drain.rows, seconds, drain.rows / seconds, memory_mb,
+         sorter.sort_seconds, sorter.num_runs, sorter.spilled_bytes / 1e6,
+         sorter.merge_seconds, ordered ? "order ok" : "ORDER WRONG");
+
+  // Keys of the located rows in curve order give every leaf its range
+  uint64_t *keys = malloc((count + 1) * sizeof(uint64_t));
+  size_t num_keys = 0;
+  for (size_t i = 0; i < count; i++)
+    if (file_order[i].located)
+      keys[num_keys++] = file_order[i].key;
+  qsort(keys, num_keys, sizeof(uint64_t), compare_keys);
+  SpatialPoint centers[BENCH_QUERIES];
+  int num_centers = 0;
+  size_t stride = num_keys / BENCH_QUERIES + 1;
+  for (size_t i = 0, located = 0; i < count && num_centers < BENCH_QUERIES;
+       i++)
+    if (file_order[i].located && located++ % stride == 0)
+      centers[num_centers++] = file_order[i];
+
+  SpatialLocality file, sorted;
+  spatial_locality(file_order, count, centers, num_centers, keys, num_keys,
+                   BENCH_ENCODE_BATCH, &file);
+  spatial_locality(drain.points, drain.rows, centers, num_centers, keys,
+                   num_keys, BENCH_ENCODE_BATCH, &sorted);
+  printf("%-8s %14s %14s %16s %16s\n", "order", "heap pages/q",
+         "rows/page", "leaves/batch", "leaf switches");
+  printf("%-8s %14.1f %14.2f %16.1f %16.1f\n", "file", file.pages_per_query,
+         file.rows_per_page, file.leaves_per_batch, file.leaf_switches);
+  printf("%-8s %14.1f %14.2f %16.1f %16.1f\n", "hilbert",
+         sorted.pages_per_query, sorted.rows_per_page,
+         sorted.leaves_per_batch, sorted.leaf_switches);
+  // How many times fewer pages and leaves the sorted load touches
+  printf("%-8s %13.1fx %13.1fx %15.1fx %15.1fx\n", "gain",
+         file.pages_per_query / sorted.pages_per_query,
+         sorted.rows_per_page / file.rows_per_page,
+         file.leaves_per_batch / sorted.leaves_per_batch,
+         file.leaf_switches / sorted.leaf_switches);
+
+  sorter_destroy(&sorter);
+  benchmark_destroy(&bench);
+  batch_pool_destroy(&pool);
+  queue_destroy(&input);
+  free(batches);
+  free(file_order);
+  free(drain.points);
+  free(keys);
+  reader_close(&reader);
+  return ordered ? 0 : 1;
+}
@@ -0,0 +1,118 @@
+// Field splitting benchmark: the old strsep loop against the tokenizer
+// kernels. Reports raw splitting throughput, no field processing
+
+typedef struct {
+  double seconds;
+  size_t fields;
+  size_t checksum; // sum of field lengths, must match across kernels
+} SplitRun;
+
+// Baseline: what parse_line did before the tokenizer, a line copy followed
+// by twelve strsep calls and a strlen per token
+static void bench_split_strsep(const char *data, size_t size, SplitRun *run) {
+  char line[4096];
+  const char *p = data;
+  const char *end = data + size;
+  double start = get_time();
+
+  run->fields = 0;
+  run->checksum = 0;
+  while (p < end) {
+    const char *newline = memchr(p, '\n', end - p);
+    size_t len = newline ? (size_t)(newline - p) : (size_t)(end - p);
+    if (len >= sizeof(line))
+      len = sizeof(line) - 1;
+    memcpy(line, p, len);
+    line[len] = '\0';
+
+    char *rest = line;
+    for (int i = 0; i < LOCATION_FIELDS; i++) {
+      char *token = strsep(&rest, ",");
+      if (!token)
+        break;
+      run->fields++;
+      run->checksum += strlen(token);
+    }
+    p = newline ? newline + 1 : end;
+  }
+  run->seconds = get_time() - start;
+}
+
+static void bench_split_kernel(const char *data, size_t size, SplitRun *run) {
+  CsvIndex index;
+  csv_index_init(&index);
+  const char *p = data;
+  const char *end = data + size;
+  double start = get_time();
+
+  run->fields = 0;
+  run->checksum = 0;
+  while (p < end) {
+    size_t available = end - p;
+    bool at_end = available <= PARSER_WINDOW;
+    size_t consumed = csv_index_block(&index, p,
+                                      at_end ? available : PARSER_WINDOW, at_end);
+    FieldView fields[LOCATION_FIELDS];
+    size_t cursor = 0;
+    size_t count;
+    while ((count = csv_next_record(&index, p, &cursor, fields,
+                                    LOCATION_FIELDS)) > 0) {
+      run->fields += count;
+      for (size_t i = 0; i < count; i++)
+        run->checksum += fields[i].len;
+    }
+    p += consumed;
+  }
+  run->seconds = get_time() - start;
+  csv_index_free(&index);
+}
+
+static int bench_split(int argc, char *argv[]) {
+  if (argc < 1) {
+    fprintf(stderr, "Usage: bench split <file.csv> [iterations]\n");
+    return 1;
+  }
+  int iterations = argc > 1 ? atoi(argv[1]) : 5;
+
+  InputReader reader;
+  if (!reader_open(&reader, argv[0], READER_MMAP)) {
+    fprintf(stderr, "Could not open %s\n", argv[0]);
+    return 1;
+  }
+  if (reader.decoder) {
+    fprintf(stderr, "%s is compressed, these runs need the mapped file\n",
+            argv[0]);
+    reader_close(&reader);
+    return 1;
+  }
+  CsvKernel detected = csv_active_kernel();
+  printf("detected kernel: %s\n", csv_kernel_name(detected));
+  printf("%-8s %12s %14s %10s %8s\n", "splitter", "fields", "checksum",
+         "best (s)", "GB/s");
+
+  const char *names[] = {"strsep", "scalar", "sse2", "avx2"};
+  const CsvKernel kernels[] = {CSV_KERNEL_SCALAR, CSV_KERNEL_SCALAR,
+                               CSV_KERNEL_SSE2, CSV_KERNEL_AVX2};
+  for (int k = 0; k < 4; k++) {
+    if (k > 0 && !csv_set_kernel(kernels[k])) {
+      printf("%-8s unsupported on this CPU\n", names[k]);
+      continue;
+    }
+    SplitRun best = {.seconds = 0};
+    for (int i = 0; i < iterations; i++) {
+      SplitRun run;
+      if (k == 0)
+        bench_split_strsep(reader.data, reader.size, &run);
+      else
+        bench_split_kernel(reader.data, reader.size, &run);
+      if (i == 0 || run.seconds < best.seconds)
+        best = run;
+    }
+    printf("%-8s %12zu %14zu %10.4f %8.2f\n", names[k], best.fields,
+           best.checksum, best.seconds, reader.size / best.seconds / 1e9);
+  }
+  csv_set_kernel(detected);
+
+  reader_close(&reader);
+  return 0;
+}
@@ -0,0 +1,160 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "parsers.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Codes of a UN/LOCODE, as snapshots store them. Batches hold keys and
+// country codes of any length
+#define UNLOCODE_WIDTH 5
+#define COUNTRY_CODE_WIDTH 2
+
+// Bits of Batch.flags
+#define LOCATION_AIRPORT 0x1
+#define LOCATION_PORT 0x2
+#define LOCATION_TRAIN_STATION 0x4
+#define LOCATION_HAS_COORDINATES 0x8 // otherwise the location is sent as NULL
+// Row operations of a delta batch, rows with neither bit are upserted
+#define LOCATION_DELETE 0x10
+#define LOCATION_RENAME 0x20 // upsert and delete the other names of the code
+
+// Where a row was read: input file index plus one in the top bits, 0 when
+// unknown, and the byte offset of its record below
+#define ORIGIN_OFFSET_BITS 48
+
+// Half open byte range [begin, end) of the input, always starting at a
+// record boundary
+typedef struct {
+  size_t begin;
+  size_t end;
+} ByteRange;
+
+struct Schema;
+
+// Columnar batch of processed locations. The booleans share one flag byte
+// and names are packed back to back in a string heap: name i is
+// names[name_offset[i], name_offset[i + 1]). Codes are packed the same way,
+// the key of row i from code_offset[i] to country_offset[i] and its country
+// code from there to code_offset[i + 1]. The other columns of a schema are
+// packed like names, already in their binary COPY form: a 32 bit length or
+// -1 for NULL, then the value
+struct Batch {
+  int count;
+  int capacity;
+
+  uint32_t *code_offset;    // capacity + 1 entries
+  uint32_t *country_offset; // capacity entries
+  char *codes;
+  size_t codes_capacity;
+  double *latitude;
+  double *longitude;
+  uint8_t *flags;
+
+  uint64_t *origin; // see row_origin
+
+  uint32_t *name_offset; // capacity + 1 entries
+  char *names;
+  size_t names_capacity;
+
+  uint32_t *carry_offset; // capacity + 1 entries, all 0 without a schema
+  char *carried;          // allocated on first use
+  size_t carried_capacity;
+  const struct Schema *schema; // NULL for the hand written UN/LOCODE layout
+
+  ByteRange source; // input bytes the rows were parsed from
+  bool delta;       // rows carry an operation, sent as an extra column
+  int file;         // input file of the rows, -1 when they are mixed
+};
+
+typedef struct Batch Batch;
+
+// One row outside of any batch, the name already unescaped and the carried
+// values in their COPY form
+typedef struct {
+  FieldView key;
+  FieldView country;
+  uint8_t flags;
+  double latitude;
+  double longitude;
+  uint64_t origin;
+  FieldView name;
+  FieldView carried;
+} BatchRow;
+
+Batch *batch_create(int capacity);
+void batch_free(Batch *batch);
+
+// Drop the rows, keep the buffers
+void batch_reset(Batch *batch);
+
+// Append one row, the name is copied into the string heap. Its origin is
+// unknown until the producer sets it
+void batch_append(Batch *batch, const ProcessedLocation *location);
+
+// Append row i of another batch, its name is already unescaped
+void batch_copy_row(Batch *batch, const Batch *source, int i);
+void batch_append_row(Batch *batch, const BatchRow *row);
+
+// Remove the rows from first on whose keep flag is clear, keep is indexed
+// from first. The rest move down in order with their names
+void batch_compact(Batch *batch, int first, const bool *keep);
+
+// Room for len more bytes of carried values of the last row
+char *batch_carry_reserve(Batch *batch, size_t len);
+// Give back the unused end of the last reservation
+static inline void batch_carry_unreserve(Batch *batch, size_t len) {
+  batch->carry_offset[batch->count] -= (uint32_t)len;
+}
+
+static inline FieldView batch_key(const Batch *batch, int i) {
+  return (FieldView){batch->codes + batch->code_offset[i],
+                     batch->country_offset[i] - batch->code_offset[i]};
+}
+
+static inline FieldView batch_country(const Batch *batch, int i) {
+  return (FieldView){batch->codes + batch->country_offset[i],
+                     batch->code_offset[i + 1] - batch->country_offset[i]};
+}
+
+static inline FieldView batch_name(const Batch *batch, int i) {
+  return (FieldView){batch->names + batch->name_offset[i],
+                     batch->name_offset[i + 1] - batch->name_offset[i]};
+}
+
+static inline FieldView batch_carried(const Batch *batch, int i) {
+  return (FieldView){batch->carried + batch->carry_offset[i],
+                     batch->carry_offset[i + 1] - batch->carry_offset[i]};
+}
+
+static inline uint64_t row_origin(int file, size_t offset) {
+  return (uint64_t)(file + 1) << ORIGIN_OFFSET_BITS | offset;
+}
+
+// Input file of a row, -1 when it was not read from one
+static inline int origin_file(uint64_t origin) {
+  return (int)(origin >> ORIGIN_OFFSET_BITS) - 1;
+}
+
+static inline size_t origin_offset(uint64_t origin) {
+  return origin & (((uint64_t)1 << ORIGIN_OFFSET_BITS) - 1);
+}
+
+// Operation column of a delta row: D(elete), R(ename) or U(psert)
+static inline char batch_row_op(const Batch *batch, int i) {
+  uint8_t flags = batch->flags[i];
+  return flags & LOCATION_DELETE ? 'D' : flags & LOCATION_RENAME ? 'R' : 'U';
+}
+
+// Length of a fixed width, NUL padded code
+static inline size_t code_length(const char *code, size_t width) {
+  size_t len = 0;
+  while (len < width && code[len] != '\0')
+    len++;
+  return len;
+}
+
+// Bytes held by a freshly created batch, the name heap grows on demand
+size_t batch_footprint(int capacity);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef BATCH_POOL_H
+#define BATCH_POOL_H
+
+#include "batch_queue.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Fixed set of batch buffers shared by producers and writers. Writers hand
+// finished batches back and producers reuse them, so at most limit batches
+// ever exist and peak memory is known up front. Producers block in
+// batch_acquire when every buffer is in flight
+typedef struct {
+  BatchQueue free_list;
+  int batch_size;
+  size_t limit;   // 0 disables recycling: plain malloc and free
+  atomic_int fill_rows; // rows per batch the producers aim for
+  atomic_size_t created;
+  atomic_size_t reused;
+} BatchPool;
+
+void batch_pool_init(BatchPool *pool, int batch_size, size_t limit);
+void batch_pool_destroy(BatchPool *pool);
+
+// Rows a producer puts in a batch before pushing it, at most batch_size.
+// Starts at batch_size, adaptive batching moves it during the load
+static inline int batch_pool_fill(BatchPool *pool) {
+  return atomic_load_explicit(&pool->fill_rows, memory_order_relaxed);
+}
+
+// An empty batch, recycled when possible
+Batch *batch_acquire(BatchPool *pool);
+void batch_release(BatchPool *pool, Batch *batch);
+
+// Size the pool so the pipeline never starves: one batch being filled per
+// producer, a full queue, and what every writer holds
+size_t batch_pool_limit(int producers, int queue_depth, int writers,
+                        int writer_depth);
+
+#endif
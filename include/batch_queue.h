@@ -0,0 +1,65 @@
+#ifndef BATCH_QUEUE_H
+#define BATCH_QUEUE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define QUEUE_SIZE 10
+#define CACHE_LINE_SIZE 64
+
+typedef struct Batch Batch;
+
+typedef struct {
+  atomic_size_t sequence;
+  Batch *batch;
+} QueueCell;
+
+// Futex style wait point: sleepers wait for seq to move, wakers only pay for
+// a syscall when somebody is registered in waiters
+typedef struct {
+  atomic_uint seq;
+  atomic_uint waiters;
+#ifndef __linux__
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+#endif
+} WaitPoint;
+
+// Bounded lock-free multi-producer/multi-consumer queue. Every cell carries
+// a sequence number telling producers and consumers whose turn it is, so a
+// push or pop is one CAS on its own index. Threads only sleep when the queue
+// is full or empty
+typedef struct {
+  // Producers and consumers each spin on their own cache line
+  _Alignas(CACHE_LINE_SIZE) atomic_size_t enqueue_pos;
+  _Alignas(CACHE_LINE_SIZE) atomic_size_t dequeue_pos;
+
+  _Alignas(CACHE_LINE_SIZE) QueueCell *cells;
+  size_t capacity;
+  atomic_bool done;
+  WaitPoint not_empty;
+  WaitPoint not_full;
+} BatchQueue;
+
+void queue_init(BatchQueue *queue, size_t capacity);
+void queue_destroy(BatchQueue *queue);
+
+// Blocks while the queue is full
+void queue_push(BatchQueue *queue, Batch *batch);
+
+// Blocks while the queue is empty, NULL once it is finished and drained
+Batch *queue_pop(BatchQueue *queue);
+
+// Pop without waiting, *done is set once the queue is drained for good
+Batch *queue_try_pop(BatchQueue *queue, bool *done);
+
+// Signal consumers that no more batches will be pushed
+void queue_finish(BatchQueue *queue);
+
+// Batches currently queued, a snapshot
+size_t queue_count(BatchQueue *queue);
+
+#endif
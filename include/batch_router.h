@@ -0,0 +1,56 @@
+#ifndef BATCH_ROUTER_H
+#define BATCH_ROUTER_H
+
+#include "batch.h"
+#include "batch_pool.h"
+#include "batch_queue.h"
+#include "benchmark.h"
+#include <pthread.h>
+
+// Batches each writer queue holds, the writer merges one while the router
+// fills the next
+#define ROUTER_QUEUE_DEPTH 2
+
+// Thread between the producers and the writers that splits every batch by
+// key range into one batch per writer. Ranges are the country code and first
+// letter of the location, contiguous in the unique index, so each writer
+// merges into its own parts of the btree, concurrent merges stop waiting on
+// each other's leaf pages and the same key is never merged twice at once.
+// A country alone is too coarse to spread a few large countries evenly
+typedef struct {
+  BatchQueue *input; // filled by the producers
+  BatchQueue *outputs; // one per writer
+  int partitions;
+  BatchPool *pool;
+  ThreadMetrics *metrics; // owned by the router
+  pthread_t thread;
+} BatchRouter;
+
+// Bytes of the key that name the key range of a row
+#define ROUTER_PREFIX 3
+
+// Writer owning row i of a batch, shorter keys are hashed whole
+static inline int router_partition(const Batch *batch, int i, int partitions) {
+  FieldView key = batch_key(batch, i);
+  const unsigned char *code = (const unsigned char *)key.ptr;
+  size_t len = key.len < ROUTER_PREFIX ? key.len : ROUTER_PREFIX;
+  unsigned hash = 0;
+  for (size_t k = 0; k < len; k++)
+    hash = hash * 31u + code[k];
+  hash *= 2654435761u; // spreads neighbouring ranges over the writers
+  return (int)((hash >> 16) % (unsigned)partitions);
+}
+
+// Batches the router holds on top of the pool limit of an unrouted load
+static inline size_t router_pool_batches(int partitions) {
+  return 1 + (size_t)partitions * (1 + ROUTER_QUEUE_DEPTH);
+}
+
+// Create the writer queues and start routing
+void router_start(BatchRouter *router);
+// Route what is left once the input is finished, then finish the writer
+// queues and wait for the router
+void router_join(BatchRouter *router);
+void router_destroy(BatchRouter *router);
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef BATCH_TUNER_H
+#define BATCH_TUNER_H
+
+#include "batch_pool.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Adaptive batching bounds: batches never shrink below TUNER_MIN_ROWS and
+// never grow past TUNER_MAX_FACTOR times the starting size
+#define TUNER_MIN_ROWS 1000
+#define TUNER_MAX_FACTOR 4
+#define TUNER_WINDOW 2.0    // seconds of committed batches per measurement
+#define TUNER_NOISE 0.05    // throughput changes below this are ignored
+#define TUNER_SPIKE 3.0     // merge latency per row over the baseline
+#define TUNER_MIN_STEP 1.1  // the search stops below this factor
+
+typedef enum {
+  TUNE_ROWS,    // rows per batch
+  TUNE_WRITERS, // active writer connections
+  TUNE_DONE,
+} TuneDimension;
+
+// Hill climbing controller fed by the writers after every committed batch.
+// Each window of TUNER_WINDOW seconds is compared with the previous one: a
+// better throughput keeps moving the parameter in the same direction, a
+// worse one reverses it with a smaller step. Rows per batch are tuned first
+// and settle on the best size measured, then writers are parked one at a
+// time while the throughput holds. A merge latency spike halves the batch size
+// whatever the search is doing
+typedef struct {
+  BatchPool *pool; // its fill_rows is the knob the producers read
+  int min_rows;
+  int max_rows;
+  int max_writers;
+  bool tune_writers;
+
+  atomic_int active_writers; // writers with a higher id park
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  bool finished;
+
+  // Current window
+  double window_start;
+  uint64_t window_rows;
+  uint64_t window_batches;
+  double window_merge; // merge and commit seconds
+  bool settling;       // the window after a change is not measured
+
+  // Search state
+  TuneDimension dimension;
+  int direction; // +1 grow, -1 shrink
+  double step;   // multiplicative for rows
+  double last_throughput;
+  double merge_baseline; // lowest merge seconds per row seen
+  int adjustments;
+
+  double best_throughput;
+  int best_rows;    // batch size of the best window
+  double reference; // throughput fewer writers must keep
+} BatchTuner;
+
+// Starts at rows per batch, the pool batches must hold the largest size
+void tuner_init(BatchTuner *tuner, BatchPool *pool, int rows, int writers,
+                bool tune_writers);
+void tuner_destroy(BatchTuner *tuner);
+
+// A batch of rows committed, with its merge and commit latency
+void tuner_record(BatchTuner *tuner, uint64_t rows, double merge_seconds);
+
+// Blocks a writer the tuner parked until it is active again or the load is
+// finished
+void tuner_wait_active(BatchTuner *tuner, int writer_id);
+// Releases parked writers so they see the finished queue
+void tuner_finish(BatchTuner *tuner);
+
+// The best setting found, as the options that pin it
+void tuner_report(BatchTuner *tuner, FILE *out);
+
+#endif
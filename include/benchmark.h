@@ -1,13 +1,120 @@
 #ifndef BENCHMARK_H
 #define BENCHMARK_H
 
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Pipeline stages, every sample is the time one batch spent in the stage
+typedef enum {
+  STAGE_READ,         // reader or tokenizer index pass
+  STAGE_PARSE,        // field decoding and batch append
+  STAGE_ENQUEUE_WAIT, // producer blocked on a full queue or an empty pool
+  STAGE_DEQUEUE_WAIT, // writer blocked on an empty queue
+  STAGE_ENCODE,       // COPY serialization
+  STAGE_SETUP,        // BEGIN and staging table preparation
+  STAGE_COPY,         // COPY stream until the server acknowledged it
+  STAGE_MERGE,        // pipelined writers include the COMMIT here
+  STAGE_COMMIT,
+  STAGE_COUNT,
+} Stage;
+
+// Row outcomes
+typedef enum {
+  ROWS_PARSED,
+  ROWS_SKIPPED,    // empty name or coordinates out of range, never sent
+  ROWS_CONFLICTED, // sent but already in the table
+  ROWS_INSERTED,
+  ROWS_FAILED, // part of a failed batch, not retried or lost while retrying
+  ROWS_BAD_COORDINATES,
+  ROWS_BAD_FUNCTION_CODE,
+  ROWS_BAD_VALUE, // numbers and booleans of schema columns, loaded as NULL
+  ROWS_DUPLICATE, // dropped by the producer, an earlier row had the same key
+  ROWS_UPDATED,   // delta rows that changed an existing row
+  ROWS_DELETED,   // removed by delete or rename rows, or bulk duplicates
+  ROWS_UNCHANGED, // delta rows equal to the snapshot, never sent
+  ROWS_REJECTED,  // refused by the server alone when a failed batch was retried
+  COUNTER_COUNT,
+} Counter;
+
+// Bucket i counts samples below 2^i nanoseconds, the last one is open
+#define HISTOGRAM_BUCKETS 48
+
+typedef struct {
+  uint64_t count;
+  uint64_t sum_ns;
+  uint64_t max_ns;
+  uint64_t buckets[HISTOGRAM_BUCKETS];
+} Histogram;
+
+// Owned and written by exactly one thread without locks. Counters and
+// histogram totals are updated with relaxed atomic stores so the progress
+// reporter can sample them during the load, the buckets are only read once
+// the thread is joined
+typedef struct {
+  const char *role; // main, parser or writer
+  int id;
+  uint64_t batches;
+  uint64_t counters[COUNTER_COUNT];
+  uint64_t bytes_read;     // input consumed by a producer
+  uint64_t duplicate_bytes; // binary COPY size of the duplicates dropped
+  uint64_t in_flight_rows; // rows a writer holds but has not committed
+  Histogram stages[STAGE_COUNT];
+} ThreadMetrics;
+
 typedef struct {
   double start_time;
-  double parse_time;
-  double db_time;
-  int records_processed;
+  double parse_time; // wall time of the parse phase
+  pthread_mutex_t lock; // guards the threads array, not the metrics
+  ThreadMetrics **threads;
+  int num_threads;
 } Benchmark;
 
+// Single writer update and concurrent read of a metrics field
+static inline void metrics_add(uint64_t *field, uint64_t n) {
+  __atomic_store_n(field, *field + n, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_set(uint64_t *field, uint64_t value) {
+  __atomic_store_n(field, value, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t metrics_load(const uint64_t *field) {
+  return __atomic_load_n(field, __ATOMIC_RELAXED);
+}
+
+typedef struct {
+  long minor_faults;
+  long major_faults;
+  long max_rss_kb;
+} MemoryCounters;
+
+// Cheap timestamps for per row and per batch timing: the TSC on x86,
+// CLOCK_MONOTONIC nanoseconds elsewhere
+typedef uint64_t Ticks;
+
 double get_time();
+Ticks ticks_now(void);
+double ticks_to_seconds(Ticks ticks);
+void read_memory_counters(MemoryCounters *counters);
+
+// Calibrates the tick rate, call before any thread records
+void benchmark_init(Benchmark *bench);
+void benchmark_destroy(Benchmark *bench);
+// Metrics slot for one thread, register every thread before it starts
+ThreadMetrics *benchmark_thread(Benchmark *bench, const char *role, int id);
+
+void stage_record(ThreadMetrics *metrics, Stage stage, double seconds);
+void stage_record_ticks(ThreadMetrics *metrics, Stage stage, Ticks ticks);
+
+// Sum of every registered thread
+void benchmark_totals(const Benchmark *bench, ThreadMetrics *totals);
+double stage_seconds(const ThreadMetrics *metrics, Stage stage);
+const char *stage_name(Stage stage);
+const char *counter_name(Counter counter);
+
+// Machine readable report: totals, per stage histograms, per thread detail
+void benchmark_write_json(const Benchmark *bench, FILE *out, double total_time,
+                          const MemoryCounters *memory);
 
 #endif
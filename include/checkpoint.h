@@ -0,0 +1,54 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "batch.h"
+#include <libpq-fe.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// One row per committed batch: the byte range its rows came from. Written
+// by the merge statement itself, so a range is recorded exactly when its
+// rows are committed
+#define PROGRESS_TABLE_DDL                                                     \
+  "CREATE TABLE IF NOT EXISTS load_progress ("                                 \
+  "load_key TEXT NOT NULL, input_size BIGINT NOT NULL, "                       \
+  "range_begin BIGINT NOT NULL, range_end BIGINT NOT NULL, "                   \
+  "committed_at TIMESTAMPTZ NOT NULL DEFAULT now())"
+
+// Prefix that turns the merge into one that also records the batch range,
+// parameters are the load key, input size, range begin and range end
+#define PROGRESS_INSERT                                                        \
+  "WITH progress AS (INSERT INTO load_progress"                                \
+  "(load_key, input_size, range_begin, range_end) "                            \
+  "VALUES ($1, $2, $3, $4)) "
+#define PROGRESS_PARAMS 4
+
+typedef struct {
+  char *key; // absolute path of the input
+  size_t input_size;
+  ByteRange *committed; // sorted and coalesced
+  int num_committed;
+} Checkpoint;
+
+// Create the progress table. With resume the ranges committed by earlier
+// runs over the same file are loaded, otherwise they are discarded
+bool checkpoint_open(Checkpoint *checkpoint, PGconn *conn, const char *path,
+                     size_t input_size, bool resume);
+void checkpoint_close(Checkpoint *checkpoint);
+
+// The parts of [begin, end) not committed yet. Returns the number of ranges
+// stored in *pending, which the caller frees
+int checkpoint_pending(const Checkpoint *checkpoint, size_t begin, size_t end,
+                       ByteRange **pending);
+
+// Text parameters of the progress insert for one batch, the buffers back
+// the values
+typedef struct {
+  char numbers[3][24];
+  const char *values[PROGRESS_PARAMS];
+} ProgressParams;
+
+void checkpoint_params(const Checkpoint *checkpoint, const Batch *batch,
+                       ProgressParams *params);
+
+#endif
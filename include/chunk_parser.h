@@ -0,0 +1,82 @@
+#ifndef CHUNK_PARSER_H
+#define CHUNK_PARSER_H
+
+#include "dedup.h"
+#include "delta.h"
+#include "schema.h"
+#include "stream_decoder.h"
+#include "worker_threads.h"
+#include <stddef.h>
+
+#define MAX_PARSERS 64
+// Bytes indexed per tokenizer pass
+#define PARSER_WINDOW (1 << 20)
+
+// Parser thread context. Parsers take ranges from a shared work list until
+// it is exhausted, a batch never spans two ranges. For compressed input they
+// take decoded chunks instead, batches then span chunks
+typedef struct {
+  int id;
+  const char *data; // the mapped input
+  const ByteRange *ranges;
+  int num_ranges;
+  atomic_int *next_range; // shared by all parsers of the list
+  StreamDecoder *decoder; // replaces the ranges when set
+  int file;               // index of the input in the file list
+  BatchPool *pool;
+  BatchQueue *queue;
+  DedupSet *dedup;        // NULL when duplicates are left to the server
+  DeltaLoad *delta;       // NULL unless only changes are loaded
+  const SchemaPlan *plan; // NULL for the built in schema
+  ThreadMetrics *metrics; // owned by this parser
+} ParserContext;
+
+// Split [start, size) into at most parts ranges that end on newlines outside
+// quoted fields. Returns the number of ranges written
+int plan_chunks(const char *data, size_t size, size_t start, int parts,
+                ByteRange *ranges);
+
+// Split every pending range into record aligned parts, about parts in total
+// and in proportion to the range sizes. Returns the number of ranges stored
+// in *ranges, which the caller frees
+int plan_pending(const char *data, const ByteRange *pending, int num_pending,
+                 int parts, ByteRange **ranges);
+
+// Parse every record of the range into batches and push them to the queue
+void *parser_thread(void *arg);
+
+// Record the read and parse time of a filled batch and push it, timing how
+// long the producer waits on the queue and then on the pool for the next
+// batch. Returns the next batch, or NULL when last is set
+Batch *producer_push(BatchPool *pool, BatchQueue *queue,
+                     ThreadMetrics *metrics, Batch *batch, Ticks read_ticks,
+                     Ticks parse_ticks, bool last);
+
+// Count a decoded row and the fields that failed to decode
+static inline void producer_count_row(ThreadMetrics *metrics,
+                                      unsigned errors) {
+  metrics_add(&metrics->counters[ROWS_PARSED], 1);
+  if (errors) {
+    metrics_add(&metrics->counters[ROWS_BAD_COORDINATES],
+                (errors & PARSE_BAD_COORDINATES) != 0);
+    metrics_add(&metrics->counters[ROWS_BAD_FUNCTION_CODE],
+                (errors & PARSE_BAD_FUNCTION_CODE) != 0);
+    metrics_add(&metrics->counters[ROWS_BAD_VALUE],
+                (errors & PARSE_BAD_VALUE) != 0);
+  }
+}
+
+// Drop the duplicates among the rows appended since *checked, which then
+// covers the whole batch. A batch that shrank keeps being filled
+static inline void producer_dedup(DedupSet *dedup, ThreadMetrics *metrics,
+                                  Batch *batch, int *checked) {
+  uint64_t bytes = 0;
+  int removed = dedup_batch(dedup, batch, *checked, &bytes);
+  *checked = batch->count;
+  if (removed > 0) {
+    metrics_add(&metrics->counters[ROWS_DUPLICATE], removed);
+    metrics_add(&metrics->duplicate_bytes, bytes);
+  }
+}
+
+#endif
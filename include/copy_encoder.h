@@ -0,0 +1,51 @@
+#ifndef COPY_ENCODER_H
+#define COPY_ENCODER_H
+
+#include "batch.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// Send buffer size, rows are encoded into it and flushed in chunks this big
+#define COPY_BUFFER_SIZE (1 << 20)
+#define COPY_FLUSH_THRESHOLD (COPY_BUFFER_SIZE - 8192)
+// Longest CSV line, names are truncated to fit
+#define COPY_CSV_LINE_MAX 4096
+// Operation and input position of a delta row, ",U,<20 digits>\n"
+#define COPY_CSV_DELTA_MAX 32
+
+typedef enum {
+  COPY_FORMAT_CSV,    // text rows with an EWKT point, parsed by the server
+  COPY_FORMAT_BINARY, // binary tuples with an EWKB point
+} CopyFormat;
+
+// Reusable send buffer, owned by one writer for the lifetime of its
+// connection
+typedef struct {
+  char *data;
+  size_t len;
+  size_t capacity;
+} CopyBuffer;
+
+void copy_buffer_init(CopyBuffer *buffer);
+void copy_buffer_free(CopyBuffer *buffer);
+
+// Rows with an empty name or out of range coordinates are not sent
+bool batch_row_is_valid(const Batch *batch, int i);
+
+// Binary COPY stream: header, one tuple per row, trailer
+void copy_encode_binary_header(CopyBuffer *buffer);
+void copy_encode_binary_row(CopyBuffer *buffer, const Batch *batch, int i);
+size_t copy_binary_row_size(const Batch *batch, int i);
+void copy_encode_binary_trailer(CopyBuffer *buffer);
+
+// A whole batch as one COPY stream, invalid rows are left out. Returns the
+// number of rows encoded
+int copy_encode_batch(CopyBuffer *buffer, CopyFormat format,
+                      const Batch *batch);
+
+// CSV COPY row, the point is sent as EWKT
+void copy_encode_csv_row(CopyBuffer *buffer, const Batch *batch, int i);
+
+bool copy_parse_format(const char *name, CopyFormat *format);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef CSV_TOKENIZER_H
+#define CSV_TOKENIZER_H
+
+#include "parsers.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Set on a separator that terminates a record rather than a field
+#define CSV_RECORD_END 0x80000000u
+
+// Field terminators of a block of complete records. Every entry is the byte
+// offset of a comma or newline outside quoted fields, relative to the block
+typedef struct {
+  uint32_t *seps;
+  size_t count;
+  size_t capacity;
+} CsvIndex;
+
+typedef enum {
+  CSV_KERNEL_SCALAR,
+  CSV_KERNEL_SSE2,
+  CSV_KERNEL_AVX2,
+} CsvKernel;
+
+// Kernel picked from CPUID on first use, can be overridden for benchmarks
+CsvKernel csv_active_kernel(void);
+bool csv_set_kernel(CsvKernel kernel);
+const char *csv_kernel_name(CsvKernel kernel);
+
+void csv_index_init(CsvIndex *index);
+void csv_index_free(CsvIndex *index);
+
+// Index the complete records of data[0, len) in one pass, 64 bytes at a time.
+// The last record only counts when it ends with a newline, unless at_end is
+// set. Returns the bytes consumed, which is where the next block starts.
+// Offsets are 31 bits, callers feed blocks well below 2 GiB
+size_t csv_index_block(CsvIndex *index, const char *data, size_t len,
+                       bool at_end);
+
+// Walk the records of an indexed block. *cursor is an index into seps,
+// returns the number of fields stored (at most max_fields) or 0 when done
+size_t csv_next_record(const CsvIndex *index, const char *data, size_t *cursor,
+                       FieldView *fields, size_t max_fields);
+
+// Scalar splitter for a single record, used for line based input
+size_t csv_split_record(const char *line, size_t len, FieldView *fields,
+                        size_t max_fields);
+
+#endif
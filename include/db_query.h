@@ -2,11 +2,88 @@
 #define DB_QUERY_H
 
 #include <libpq-fe.h>
-#include "parsers.h"
+#include "benchmark.h"
+#include "batch.h"
+#include "checkpoint.h"
+#include "copy_encoder.h"
+#include "schema.h"
 
-void create_table(PGconn *conn);
+// Prepared ON CONFLICT merge from the persistent staging table
+#define MERGE_STATEMENT "merge_locations"
 
-bool batch_insert_locations(PGconn *conn, ProcessedLocation *locations,
-                            int count);
+typedef enum {
+  STAGING_TEMP,       // CREATE TEMP TABLE ... ON COMMIT DROP for every batch
+  STAGING_PERSISTENT, // one unindexed staging table per connection, TRUNCATEd
+  STAGING_NONE,       // plain COPY into the table, bulk loads only
+} StagingMode;
+
+// Work memory of the bulk index build, shared by its parallel workers
+#define BULK_MAINTENANCE_MEMORY "512MB"
+
+// Time of each step that turns a bulk loaded table into the regular one
+typedef struct {
+  double dedup;
+  double index;
+  double logged;
+  long duplicates; // rows removed, ON CONFLICT DO NOTHING would have skipped
+} BulkTimings;
+
+// Per connection writer state
+typedef struct {
+  PGconn *conn;
+  const Schema *schema; // table and statements the batches go to
+  CopyBuffer buffer;
+  CopyFormat copy_format;
+  StagingMode staging;
+  const Checkpoint *checkpoint; // merges also record the batch range
+  bool delta; // rows carry an operation, the merge updates and deletes too
+  char error[256]; // server message of the last failed batch
+  bool quiet;      // record failures without printing them, while retrying
+} WriterSession;
+
+// What the merge did with the rows sent, the rest conflicted or were unchanged
+typedef struct {
+  long inserted;
+  long updated;
+  long deleted;
+} MergeCounts;
+
+// Where the time of one batch went, in seconds, and what happened to its rows
+typedef struct {
+  double setup;  // BEGIN and staging table preparation
+  double encode; // serialization, interleaved with the COPY send
+  double copy;   // COPY without the encode time
+  double merge;
+  double commit;
+  int rows_sent; // valid rows in the COPY stream
+  MergeCounts merged;
+} InsertTimings;
+
+void create_table(PGconn *conn, const Schema *schema);
+
+// Make the empty table a bulk load target: unlogged and without the unique
+// index. Fails when the table already holds rows
+bool bulk_prepare(PGconn *conn, const Schema *schema);
+// Remove duplicate keys, keeping the first row loaded, build the unique index
+// with up to workers parallel maintenance workers and log the table again
+bool bulk_finish(PGconn *conn, const Schema *schema, int workers,
+                 BulkTimings *timings);
+
+bool writer_session_open(WriterSession *session, const char *conninfo,
+                         const Schema *schema, CopyFormat copy_format,
+                         StagingMode staging, const Checkpoint *checkpoint,
+                         bool delta);
+
+// Parameters of the merge for one batch, none without a checkpoint
+int merge_params(const WriterSession *session, const Batch *batch,
+                 ProgressParams *params);
+// Status check of a merge result, fills the row counts on success
+bool merge_result(const WriterSession *session, PGresult *res,
+                  MergeCounts *counts);
+void writer_session_close(WriterSession *session);
+bool staging_parse_mode(const char *name, StagingMode *mode);
+
+bool batch_insert_locations(WriterSession *session, const Batch *batch,
+                            InsertTimings *timings);
 
 #endif
@@ -0,0 +1,51 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include "batch.h"
+#include "copy_encoder.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DEFAULT_DEDUP_MEMORY_MB 64
+// Share of the slots filled before the set stops taking new keys, probes
+// stay short and there is always an empty slot to end them
+#define DEDUP_MAX_LOAD 0.75
+
+// Keys the producers have already put in a batch: (unlocode, name), the
+// columns of the ON CONFLICT target. Each key is stored as its 64 bit hash in
+// an open addressing table with linear probing, filled lock free by every
+// producer. Memory is fixed up front; once the table is full new keys are
+// let through unchecked and the server resolves them as before. Two keys
+// sharing a hash would drop a unique row, with a 64 bit hash that takes
+// billions of keys to become likely
+typedef struct {
+  _Atomic uint64_t *slots; // 0 is an empty slot
+  size_t mask;
+  size_t limit; // keys accepted before the set is full
+  atomic_size_t count;
+} DedupSet;
+
+bool dedup_init(DedupSet *set, size_t memory_bytes);
+void dedup_free(DedupSet *set);
+
+uint64_t dedup_hash(const char *data, size_t len, uint64_t seed);
+// Hash of the conflict key of batch row i, its name is already unescaped
+uint64_t dedup_row_hash(const Batch *batch, int i);
+
+// False when the key was seen before, true for a new key and for any key
+// once the set is full
+bool dedup_insert(DedupSet *set, uint64_t hash);
+
+// Check rows [first, count) of a batch against the set and remove the
+// duplicates. Hashes are computed for all rows first so the table slots can
+// be prefetched a few rows ahead, every probe is a likely cache miss.
+// Returns the rows removed and adds their binary COPY size to *bytes
+int dedup_batch(DedupSet *set, Batch *batch, int first, uint64_t *bytes);
+
+static inline bool dedup_full(DedupSet *set) {
+  return atomic_load_explicit(&set->count, memory_order_relaxed) >= set->limit;
+}
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include "batch.h"
+#include "batch_pool.h"
+#include "batch_queue.h"
+#include "benchmark.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// First bytes of a snapshot file
+#define SNAPSHOT_MAGIC "LOCSNAP1"
+
+// One loaded row: its conflict key, a hash of the other columns and the key
+// itself, so rows gone from the input can be deleted by name
+typedef struct {
+  uint64_t key;     // dedup_row_hash of (unlocode, name)
+  uint64_t content; // country code, types and position
+  char unlocode[UNLOCODE_WIDTH];
+  uint16_t name_len;
+  bool deleted;       // an X row, the key is dropped when it is kept
+  bool sent;          // false for rows dropped as unchanged
+  uint64_t origin;    // input position, see delta_write_snapshot
+  size_t name_offset; // into the names of the list
+} SnapshotEntry;
+
+typedef struct {
+  SnapshotEntry *entries;
+  size_t count;
+  size_t capacity;
+  char *names;
+  size_t names_len;
+  size_t names_capacity;
+} SnapshotList;
+
+// Delta load state shared by the producers. Without a snapshot only the
+// change indicator of each record decides what is sent. With one, every
+// record is compared with the snapshot of the previous load: unchanged rows
+// are dropped, rows of the snapshot that no record matched are deleted, and
+// the rows seen are collected into the next snapshot
+typedef struct {
+  const char *snapshot_path; // NULL when only the indicators are used
+  SnapshotList previous;
+  uint32_t *index; // open addressing over previous, entry + 1, 0 is empty
+  size_t mask;
+  atomic_bool *seen; // per previous entry, set by any producer
+  pthread_mutex_t lock; // guards next
+  SnapshotList next;
+} DeltaLoad;
+
+// Read the snapshot when there is one, a missing file is an empty snapshot
+bool delta_open(DeltaLoad *delta, const char *snapshot_path);
+void delta_close(DeltaLoad *delta);
+
+void snapshot_list_init(SnapshotList *list);
+void snapshot_list_free(SnapshotList *list);
+
+// Decide what to do with the row just appended to the batch from its change
+// indicator and the snapshot. Returns false when the row was dropped again.
+// Rows to keep in the next snapshot go to local, a list of the producer
+bool delta_row(DeltaLoad *delta, SnapshotList *local, ThreadMetrics *metrics,
+               Batch *batch, char change);
+
+// Move the rows a producer collected into the next snapshot
+void delta_collect(DeltaLoad *delta, SnapshotList *local);
+
+// After the producers are done, push delete rows for every snapshot entry
+// that no record matched. Returns the number of rows pushed
+size_t delta_push_deletes(DeltaLoad *delta, BatchPool *pool,
+                          BatchQueue *queue);
+
+// Write the next snapshot sorted by code and name, replacing the old one
+// only once the new one is complete
+bool delta_write_snapshot(DeltaLoad *delta);
+
+#endif
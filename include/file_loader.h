@@ -0,0 +1,35 @@
+#ifndef FILE_LOADER_H
+#define FILE_LOADER_H
+
+#include "batch_pool.h"
+#include "batch_queue.h"
+#include "benchmark.h"
+#include "checkpoint.h"
+#include "dedup.h"
+#include "delta.h"
+#include "input_files.h"
+#include "options.h"
+#include "schema.h"
+#include <pthread.h>
+
+// Takes whole files from the shared list and parses each with its own
+// parsers. Every loader feeds the one queue, so the writers never wait for a
+// file to start or for the tail of the previous one
+typedef struct {
+  InputFileList *files;
+  const LoaderOptions *options;
+  const Schema *schema; // bound to the header of every file
+  int num_parsers;
+  BatchPool *pool;
+  BatchQueue *queue;
+  DedupSet *dedup;
+  DeltaLoad *delta;
+  const Checkpoint *checkpoint; // single file loads only
+  ThreadMetrics **metrics;      // one per parser, reused for every file
+  pthread_t thread;
+} FileLoader;
+
+// Load files from the list until none is left
+void *loader_thread(void *arg);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef INPUT_FILES_H
+#define INPUT_FILES_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// One input of a load and what became of it
+typedef struct {
+  char *path;
+  size_t size;     // bytes on disk, 0 for pipes
+  bool compressed; // no byte progress against size
+  // Filled in by the loader that took the file
+  uint64_t rows;   // records parsed
+  double seconds;  // from open to the last batch pushed
+  const char *error; // why the file was not loaded completely, NULL if it was
+  // Added to by the writers, rows of failed batches parsed from this file
+  atomic_uint_least64_t failed_rows;
+  atomic_uint_least64_t rejected_rows; // failed alone when a batch was retried
+} InputFile;
+
+// Every file of a load, taken one at a time by the loaders
+typedef struct {
+  InputFile *files;
+  int count;
+  atomic_int next;
+} InputFileList;
+
+// Expand the command line inputs in order: a directory stands for the
+// regular files in it, sorted by name and without hidden ones, a path with
+// *, ? or [ is a glob the shell did not expand. A file named twice is loaded
+// once. False when an input matches nothing
+bool input_files_expand(InputFileList *list, char *const *paths,
+                        int num_paths);
+void input_files_free(InputFileList *list);
+
+// Next file nobody has taken yet, NULL when all are taken
+InputFile *input_files_take(InputFileList *list);
+
+// Sum of the file sizes, 0 when any file has no usable size
+size_t input_files_size(const InputFileList *list);
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef INPUT_READER_H
+#define INPUT_READER_H
+
+#include "stream_decoder.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+typedef enum {
+  READER_STDIO, // getline into a reusable buffer, lines are copied out
+  READER_MMAP,  // whole file mapped, lines are views into the mapping
+  READER_URING, // large reads kept in flight, lines are views into buffers
+  READER_URING_DIRECT, // READER_URING with O_DIRECT, bypassing the page cache
+} ReaderMode;
+
+typedef struct {
+  ReaderMode mode;
+
+  // stdio mode
+  FILE *file;
+  char *line_buf;
+  size_t line_cap;
+
+  // mmap mode
+  int fd;
+  const char *data;
+
+  // compressed input in any mode and uring mode, lines are views into the
+  // chunks of the decoder ring
+  StreamDecoder *decoder;
+  DecodedChunk chunk; // data is NULL when no chunk is held
+  size_t chunk_pos;
+
+  size_t size;   // file size, 0 for pipes in stdio mode and compressed input
+  size_t offset; // byte offset of the next unread line, decoded for streams
+} InputReader;
+
+// gzip and zstd files are detected from their first bytes and decoded on a
+// separate thread. The uring modes read other regular files through the same
+// ring, anything else like stdio
+bool reader_open(InputReader *reader, const char *path, ReaderMode mode);
+
+// Returns the next line without its line terminator. In stdio mode the line
+// is only valid until the next call, in mmap mode until reader_close. The mmap
+// reader does not split quoted fields that contain newlines
+bool reader_next_line(InputReader *reader, const char **line, size_t *len);
+
+// Continue reading at offset, which must be a record boundary. Streams
+// cannot seek
+bool reader_seek(InputReader *reader, size_t offset);
+
+// Give the rest of the current chunk back to the decoder, so parser threads
+// taking chunks from it continue after the lines already read
+void reader_hand_off(InputReader *reader);
+
+void reader_close(InputReader *reader);
+
+bool reader_parse_mode(const char *name, ReaderMode *mode);
+
+// End of the record starting at start: the first newline that is not inside
+// a quoted field, or end when the record is not terminated
+const char *find_record_end(const char *start, const char *end);
+
+#endif
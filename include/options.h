@@ -0,0 +1,45 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include "copy_encoder.h"
+#include "db_query.h"
+#include "input_reader.h"
+#include "sink.h"
+#include <stdbool.h>
+
+// Command line configuration of a load
+typedef struct {
+  ReaderMode reader_mode;
+  int num_parsers; // threads splitting the mapped input, mmap reader only
+  int num_writers; // database connections
+  int batch_size;  // rows per batch, the starting point when adaptive
+  bool adaptive;   // tune rows per batch from the measured throughput
+  bool adaptive_writers; // also tune the active writer count
+  CopyFormat copy_format;
+  StagingMode staging;
+  int pipeline_depth;
+  int queue_depth; // batches buffered between parsers and writers
+  bool batch_pool; // recycle batch buffers instead of malloc per batch
+  const char *metrics_path; // JSON report destination, - for stdout
+  int progress_interval;    // seconds between progress lines, 0 for none
+  const char *metrics_listen; // Prometheus endpoint: port or socket path
+  bool checkpoint; // record committed byte ranges in load_progress
+  bool resume;     // skip the ranges an earlier run committed
+  size_t dedup_memory; // bytes for the duplicate key set, 0 disables it
+  bool delta;          // load only what the change indicators mark changed
+  const char *snapshot_path; // rows of the previous delta load, implies delta
+  bool bulk; // first load: COPY into an unlogged, unindexed table
+  bool partition; // route rows to writers by country code
+  SinkConfig sink; // where the writers send their batches
+  const char *reject_path; // CSV of the rejected rows, NULL for none
+  int max_rejects; // rows rejected before failed batches are not retried
+  const char *schema_path; // column mapping, NULL for the built in one
+  size_t sort_memory; // bytes of a spatial sort run, 0 keeps file order
+  char **input_paths; // files, directories or globs
+  int num_inputs;
+} LoaderOptions;
+
+bool parse_options(int argc, char *argv[], LoaderOptions *options);
+void print_usage(const char *program);
+
+#endif
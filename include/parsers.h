@@ -4,27 +4,79 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+// A (pointer, length) view into the input buffer, fields are not NUL
+// terminated and stay valid as long as the buffer they point into
+typedef struct {
+  const char *ptr;
+  size_t len;
+} FieldView;
+
+// Column order of the UN/LOCODE code list
+enum {
+  FIELD_CHANGE,
+  FIELD_COUNTRY,
+  FIELD_LOCATION,
+  FIELD_NAME,
+  FIELD_NAME_WO_DIACRITICS,
+  FIELD_SUBDIVISION,
+  FIELD_STATUS,
+  FIELD_FUNCTION,
+  FIELD_DATE,
+  FIELD_IATA,
+  FIELD_COORDINATES,
+  FIELD_REMARKS,
+  LOCATION_FIELDS
+};
 
+// Fields have their enclosing quotes stripped, a field whose bit is set in
+// escaped still holds RFC 4180 "" escapes
 typedef struct {
-  char change;
-  char country_code[3];
-  char location_code[4];
-  char name[100];
-  char name_wo_diacritics[100];
-  char subdivision[100];
-  char status[10];
-  char function_code[9];
-  char date[5];
-  char iata[4];
-  char coordinates[50];
-  char remarks[200];
+  FieldView change;
+  FieldView country_code;
+  FieldView location_code;
+  FieldView name;
+  FieldView name_wo_diacritics;
+  FieldView subdivision;
+  FieldView status;
+  FieldView function_code;
+  FieldView date;
+  FieldView iata;
+  FieldView coordinates;
+  FieldView remarks;
+  unsigned escaped;
 } LocationData;
 
-// Structure to hold processed location data
+// Outcome of decoding the DDMM[NS] DDDMM[EW] coordinates field
+typedef enum {
+  COORD_OK,
+  COORD_MISSING,   // empty field, the row has no position
+  COORD_MALFORMED, // present but not in the fixed UN/LOCODE shape
+} CoordStatus;
+
+// Bits returned by process_location_data for fields that failed to decode
+#define PARSE_BAD_COORDINATES 0x1
+#define PARSE_BAD_FUNCTION_CODE 0x2
+#define PARSE_BAD_VALUE 0x4 // a number or boolean of a schema column
+
+// Fields a code is joined from, the country and location of a UN/LOCODE
+#define CODE_MAX_PARTS 2
+
+// A code as views into the record, its parts are concatenated when the row
+// is appended to a batch
+typedef struct {
+  FieldView parts[CODE_MAX_PARTS];
+  int num_parts;
+} CodeView;
+
+// Structure to hold processed location data, one row on its way into a
+// columnar Batch
 typedef struct {
-  char unlocode[6]; // country_code + location_code
-  char name[100];
-  char country_code[3];
+  CodeView key; // the unlocode: country_code + location_code
+  CodeView country;
+  char change; // UN/LOCODE change indicator: + # | X = or a space
+  FieldView name;    // view into the record, copied by batch_append
+  bool name_escaped; // name still holds "" escapes
+  bool has_coordinates; // latitude and longitude are meaningful
   double latitude;
   double longitude;
   bool is_airport;
@@ -33,11 +85,15 @@ typedef struct {
 } ProcessedLocation;
 
 
-void parse_line(char *line, LocationData *data);
-void process_location_data(LocationData *raw, ProcessedLocation *processed);
-bool parse_coordinates(const char *coord_str, double *lat, double *lon);
-void parse_function_code(const char *function_code, bool *is_port,
+void parse_fields(const FieldView *fields, size_t count, LocationData *data);
+void parse_line(const char *line, size_t len, LocationData *data);
+// Returns the PARSE_BAD_* bits of the fields that could not be decoded
+unsigned process_location_data(LocationData *raw,
+                               ProcessedLocation *processed);
+CoordStatus parse_coordinates(FieldView coord, double *lat, double *lon);
+// False when the code is present but not 8 characters of digits, B or -
+bool parse_function_code(FieldView function_code, bool *is_port,
                          bool *is_airport, bool *is_train);
-char *escape_csv_field(const char *field, char *buffer, size_t buffer_size);
+char *escape_csv_field(FieldView field, char *buffer, size_t buffer_size);
 
 #endif
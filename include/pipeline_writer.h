@@ -0,0 +1,19 @@
+#ifndef PIPELINE_WRITER_H
+#define PIPELINE_WRITER_H
+
+#include "db_query.h"
+#include "worker_threads.h"
+
+// Bytes handed to PQputCopyData per call while streaming a batch
+#define PIPELINE_SEND_CHUNK (256 * 1024)
+#define MAX_PIPELINE_DEPTH 16
+
+// Writer loop that overlaps client work with the server. The merge, COMMIT,
+// BEGIN and TRUNCATE that follow a COPY are sent as one libpq pipeline and
+// their results are only collected once up to ctx->pipeline_depth further
+// batches are encoded. COPY itself is not allowed in pipeline mode, so at
+// most one merge per connection is outstanding when the next COPY starts.
+// Requires the persistent staging table
+void pipelined_writer_loop(WorkerContext *ctx, WriterSession *session);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include "batch_queue.h"
+#include "benchmark.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define DEFAULT_PROGRESS_INTERVAL 10 // seconds
+
+// Snapshot of the load, the deltas between two give the rates
+typedef struct {
+  double time;
+  uint64_t rows;
+  uint64_t bytes;
+  double enqueue_wait; // summed over producers
+  double dequeue_wait; // summed over writers
+  int producers;
+  int writers;
+} ProgressSample;
+
+// Background thread printing a progress line to stderr every interval and,
+// when listen is set, serving the same numbers in Prometheus text format
+typedef struct {
+  Benchmark *bench;
+  BatchQueue *queue;
+  size_t input_size;  // 0 when unknown, no ETA then
+  size_t input_start; // bytes before the first record
+  int interval;       // seconds, 0 disables the stderr line
+  const char *listen; // TCP port on localhost or a Unix socket path
+
+  pthread_t thread;
+  int listen_fd;
+  bool unix_socket; // the socket file is removed on stop
+  int stop_pipe[2];
+  ProgressSample last;
+} ProgressReporter;
+
+// Starts the reporter thread when there is anything to report
+bool progress_start(ProgressReporter *reporter);
+void progress_stop(ProgressReporter *reporter);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef READ_AHEAD_H
+#define READ_AHEAD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Buffer address, file offset and length of O_DIRECT reads are multiples
+#define READ_AHEAD_ALIGNMENT 4096
+// Reads kept in flight at most
+#define READ_AHEAD_MAX_DEPTH 32
+
+typedef struct {
+  uint64_t tag;   // given at submit
+  ssize_t result; // bytes read, or -errno
+} ReadCompletion;
+
+// Reads of one file that run while the caller does other work. io_uring on
+// Linux, set up with raw system calls. Where it is not available (other
+// systems, kernels before 5.1, seccomp filters) every read is a pread done at
+// submit time and only its completion is deferred
+typedef struct {
+  int fd;
+  bool uring;
+  unsigned in_flight;
+
+  // io_uring rings, shared with the kernel
+  int ring_fd;
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  void *sqes;
+  size_t sqes_size;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  void *cqes;
+  struct iovec *iovecs; // one per submission queue entry
+
+  // pread fallback, completions in submit order
+  ReadCompletion done[READ_AHEAD_MAX_DEPTH];
+  unsigned done_head;
+} ReadAhead;
+
+// depth is the most reads ever in flight, up to READ_AHEAD_MAX_DEPTH
+void read_ahead_init(ReadAhead *ahead, int fd, unsigned depth);
+void read_ahead_close(ReadAhead *ahead);
+
+// Read len bytes at offset into buffer. io_uring may finish a read short of
+// the end of the file, the caller reads the rest. False when the read could
+// not be queued
+bool read_ahead_submit(ReadAhead *ahead, uint64_t tag, void *buffer,
+                       size_t len, uint64_t offset);
+// Next finished read in any order, blocks until one is. False when nothing
+// is in flight
+bool read_ahead_wait(ReadAhead *ahead, ReadCompletion *completion);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef REJECT_LOG_H
+#define REJECT_LOG_H
+
+#include "batch.h"
+#include "input_files.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define DEFAULT_MAX_REJECTS 1000
+// Rows listed on stderr when there is no reject file
+#define REJECTS_SHOWN 10
+
+// A row the server refused on its own, with the first line of its error
+typedef struct {
+  uint64_t origin;
+  char *error;
+} RejectedRow;
+
+// Rows rejected by every writer of a load. Only their origins are kept, the
+// line numbers and records are read back from the inputs at the end
+typedef struct {
+  pthread_mutex_t lock;
+  RejectedRow *rows;
+  int count;
+  int capacity;
+  int limit;            // rows rejected before failed batches are not retried
+  atomic_int reserved;  // rows taken against the limit, count catches up
+} RejectLog;
+
+void reject_log_init(RejectLog *log, int limit);
+void reject_log_free(RejectLog *log);
+
+// False once the limit is reached, the failed rows are no longer retried
+bool reject_log_open(RejectLog *log);
+// Record row i of a batch, false when the limit is already reached
+bool reject_log_add(RejectLog *log, const Batch *batch, int i,
+                    const char *error);
+
+// Write the rejected rows as CSV ordered by file and line: file, line, byte
+// offset, error and the record as it appears in the input. Inputs that
+// cannot be read again, pipes, leave line and record empty
+bool reject_log_write(RejectLog *log, const InputFileList *files,
+                      const char *path);
+// List the first rejected rows on stderr as file:line: error
+void reject_log_print(RejectLog *log, const InputFileList *files);
+
+#endif
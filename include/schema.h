@@ -0,0 +1,171 @@
+#ifndef SCHEMA_H
+#define SCHEMA_H
+
+#include "batch.h"
+#include "parsers.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// Target columns of a schema
+#define SCHEMA_MAX_COLUMNS 64
+// Source columns a record is split into, later ones are ignored
+#define SCHEMA_MAX_FIELDS 256
+// Table and column names, SQL identifiers
+#define SCHEMA_NAME_MAX 64
+
+// What a target column is to the loader. The key and name identify a row
+// for the merge, dedup, delta and routing, the other built in roles fill the
+// batch columns of the same meaning. COLUMN is any other column, its values
+// are carried through in their COPY form
+typedef enum {
+  ROLE_KEY,
+  ROLE_NAME,
+  ROLE_COUNTRY,
+  ROLE_LOCATION,
+  ROLE_AIRPORT,
+  ROLE_PORT,
+  ROLE_TRAIN,
+  ROLE_COLUMN,
+  ROLE_COUNT,
+} ColumnRole;
+
+// How the source fields become the value
+typedef enum {
+  TRANSFORM_TEXT,           // the field, "" escapes collapsed
+  TRANSFORM_CODE,           // fields concatenated, no escapes
+  TRANSFORM_INTEGER,        // int4, NULL when empty
+  TRANSFORM_BIGINT,         // int8
+  TRANSFORM_DOUBLE,         // float8
+  TRANSFORM_BOOLEAN,        // t, f, true, false, y, n, yes, no, 1 or 0
+  TRANSFORM_UNLOCODE_POINT, // DDMMN DDDMME, see parse_coordinates
+  TRANSFORM_POINT,          // latitude and longitude in decimal degrees
+  TRANSFORM_FUNCTION_FLAG,  // the function code holds the digit
+  TRANSFORM_COUNT,
+} Transform;
+
+// Value of a column in the COPY stream, indexes the encoder tables
+typedef enum {
+  ENCODE_KEY,
+  ENCODE_NAME,
+  ENCODE_COUNTRY,
+  ENCODE_POINT,
+  ENCODE_AIRPORT,
+  ENCODE_PORT,
+  ENCODE_TRAIN,
+  ENCODE_TEXT, // the rest are carried columns
+  ENCODE_INT4,
+  ENCODE_INT8,
+  ENCODE_FLOAT8,
+  ENCODE_BOOL,
+  ENCODE_FLAGS, // airport, port and train next to each other, in that order
+  ENCODE_COUNT,
+} ColumnEncoding;
+
+// Source fields of a column, as many as a code is joined from
+#define SCHEMA_MAX_SOURCES CODE_MAX_PARTS
+
+typedef struct {
+  char name[SCHEMA_NAME_MAX];
+  char *type; // SQL type and constraints, as written
+  ColumnRole role;
+  Transform transform;
+  ColumnEncoding encoding;
+  char *sources[SCHEMA_MAX_SOURCES]; // header names, or #N for column N
+  int num_sources;
+  int digit; // function_flag only
+} SchemaColumn;
+
+// Statements of a load into the schema's table
+typedef struct {
+  char *columns;      // target column list, in COPY order
+  char *create_table; // with id and created_at around the columns
+  char *unique_index; // over the key and MD5 of the name
+  char *staging;      // persistent staging table, the columns only
+  char *temp_staging; // staging table dropped at commit
+  char *copy_staging[2];  // persistent, by CopyFormat
+  char *copy_temp[2];     // per batch staging table
+  char *copy_table[2];    // bulk loads
+  char *merge;            // from the persistent staging table
+  char *merge_temp;
+  char *merge_progress;   // with a checkpoint, PROGRESS_PARAMS parameters
+  char *merge_temp_progress;
+  char *bulk_check;       // whether the table holds rows
+  char *bulk_unlogged;
+  char *bulk_dedup;
+  char *bulk_logged;
+} SchemaSql;
+
+// A target table and where every column of it comes from
+typedef struct Schema {
+  char table[SCHEMA_NAME_MAX];
+  SchemaColumn columns[SCHEMA_MAX_COLUMNS];
+  int num_columns;
+  int num_carried;        // ROLE_COLUMN columns
+  int role_column[ROLE_COUNT]; // index of a built in role, -1 when absent
+  // Encoder of every column in COPY order, adjacent flags share one
+  ColumnEncoding encoders[SCHEMA_MAX_COLUMNS];
+  int num_encoders;
+  // The UN/LOCODE code list into locations, parsed and encoded by the hand
+  // written kernels instead of the tables below
+  bool builtin;
+  SchemaSql sql;
+} Schema;
+
+// Parse and encode steps of one column, bound to the source positions of a
+// file's header
+struct SchemaStep;
+typedef unsigned (*RowKernel)(const struct SchemaStep *step,
+                              const FieldView *fields,
+                              ProcessedLocation *row);
+typedef unsigned (*CarryKernel)(const struct SchemaStep *step,
+                                const FieldView *fields, Batch *batch);
+
+// The location type flags a step can set, in ProcessedLocation order
+enum { STEP_AIRPORT, STEP_PORT, STEP_TRAIN, STEP_FLAGS };
+
+typedef struct SchemaStep {
+  union {
+    RowKernel row;
+    CarryKernel carry;
+  } run;
+  int sources[SCHEMA_MAX_SOURCES];
+  int num_sources;
+  int flag; // boolean flags: STEP_AIRPORT, STEP_PORT or STEP_TRAIN
+  // Function codes: per flag, the digits that set it
+  unsigned digits[STEP_FLAGS];
+} SchemaStep;
+
+// Specialized parser of one file: the kernels of the built in roles fill
+// the row, the carried ones append to the batch in column order. Built once
+// per file from its header, the hot path is a loop over function pointers
+typedef struct {
+  const Schema *schema;
+  SchemaStep row_steps[SCHEMA_MAX_COLUMNS];
+  int num_row_steps;
+  SchemaStep carry_steps[SCHEMA_MAX_COLUMNS];
+  int num_carry_steps;
+  int num_fields; // source columns the steps read
+} SchemaPlan;
+
+// The UN/LOCODE layout the loader was written for
+extern const char *const schema_unlocode_text;
+
+bool schema_builtin(Schema *schema);
+// Read a schema file, errors name the file and line
+bool schema_load(Schema *schema, const char *path);
+// Parse schema text, origin names it in errors
+bool schema_parse(Schema *schema, const char *text, const char *origin);
+void schema_free(Schema *schema);
+
+// Resolve the source columns against a header line. False, with the missing
+// column on stderr, when the header lacks one
+bool schema_bind(SchemaPlan *plan, const Schema *schema, const char *header,
+                 size_t len, const char *path);
+
+// Append one split record to the batch. Returns the PARSE_BAD_* bits of the
+// fields that could not be decoded. fields holds at least plan->num_fields
+// entries, count of them split from the record
+unsigned schema_append_row(const SchemaPlan *plan, FieldView *fields,
+                           size_t count, Batch *batch);
+
+#endif
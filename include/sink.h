@@ -0,0 +1,55 @@
+#ifndef SINK_H
+#define SINK_H
+
+#include "batch.h"
+#include "copy_encoder.h"
+#include "db_query.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Where the writers send their batches
+typedef enum {
+  SINK_POSTGRES, // libpq, staged and merged
+  SINK_NULL,     // encoded and dropped, measures everything but the server
+  SINK_FILE,     // the COPY stream of each writer in PATH.<writer>
+  SINK_SOCKET,   // COPY protocol over a Unix socket, no merge
+} SinkKind;
+
+typedef struct {
+  SinkKind kind;
+  const char *path; // file prefix or socket path
+} SinkConfig;
+
+// Writer end of a sink other than Postgres, owned by one writer
+typedef struct {
+  SinkKind kind;
+  CopyFormat format;
+  const Schema *schema; // the socket sink copies into its table
+  CopyBuffer buffer;
+  int fd; // output file or socket, -1 for the null sink
+  // Socket receive buffer, one backend message at a time
+  char *message;
+  size_t message_capacity;
+  uint64_t bytes; // COPY data written
+  char error[256]; // why the last batch failed
+  bool quiet;      // record failures without printing them, while retrying
+  bool broken;     // the output failed, nothing more can be sent
+} SinkWriter;
+
+// postgres, null, file:PATH or socket:PATH
+bool sink_parse(const char *spec, SinkConfig *config);
+const char *sink_name(SinkKind kind);
+
+// Open the output of one writer. A socket sink connects and completes the
+// startup handshake, trust authentication only
+bool sink_open(SinkWriter *writer, const SinkConfig *config, int writer_id,
+               CopyFormat format, const Schema *schema);
+// Send one batch as a COPY. rows_sent and merged.inserted count the valid
+// rows, for a socket as acknowledged by the server
+bool sink_write_batch(SinkWriter *writer, const Batch *batch,
+                      InsertTimings *timings);
+// Ends the binary stream of a file sink and closes the output
+void sink_close(SinkWriter *writer);
+
+#endif
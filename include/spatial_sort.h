@@ -0,0 +1,98 @@
+#ifndef SPATIAL_SORT_H
+#define SPATIAL_SORT_H
+
+#include "batch.h"
+#include "batch_pool.h"
+#include "batch_queue.h"
+#include "benchmark.h"
+#include <pthread.h>
+#include <stdio.h>
+
+#define DEFAULT_SORT_MEMORY_MB 256
+// Batches between the sorter and the writers or the router
+#define SORTER_QUEUE_DEPTH 4
+// Cells of the curve along each axis, 2^HILBERT_ORDER
+#define HILBERT_ORDER 32
+// Key of rows without coordinates, they are sent last
+#define HILBERT_NONE UINT64_MAX
+
+// Position of a point along a Hilbert curve over the whole globe. Points
+// close on the curve are close on the ground, so rows sent in key order
+// insert into neighbouring GiST leaves and heap pages instead of all over
+// the index
+static inline uint64_t hilbert_key(double latitude, double longitude) {
+  const double cells = 4294967296.0; // 2^HILBERT_ORDER
+  double fx = (longitude + 180.0) / 360.0 * cells;
+  double fy = (latitude + 90.0) / 180.0 * cells;
+  uint32_t x = fx >= cells ? UINT32_MAX : fx > 0 ? (uint32_t)fx : 0;
+  uint32_t y = fy >= cells ? UINT32_MAX : fy > 0 ? (uint32_t)fy : 0;
+
+  uint64_t key = 0;
+  for (uint32_t s = 1u << (HILBERT_ORDER - 1); s > 0; s >>= 1) {
+    uint32_t rx = (x & s) ? 1 : 0;
+    uint32_t ry = (y & s) ? 1 : 0;
+    key += (uint64_t)s * s * ((3 * rx) ^ ry);
+    // Rotate the quadrant so the curve stays continuous
+    if (ry == 0) {
+      if (rx == 1) {
+        x = UINT32_MAX - x;
+        y = UINT32_MAX - y;
+      }
+      uint32_t t = x;
+      x = y;
+      y = t;
+    }
+  }
+  return key;
+}
+
+static inline uint64_t batch_hilbert_key(const Batch *batch, int i) {
+  if (!(batch->flags[i] & LOCATION_HAS_COORDINATES))
+    return HILBERT_NONE;
+  return hilbert_key(batch->latitude[i], batch->longitude[i]);
+}
+
+// Sorted rows written out while the input did not fit in memory
+typedef struct {
+  FILE *file;
+  size_t rows;
+  size_t bytes;
+} SortRun;
+
+// Thread between the producers and the writers that sends every row of the
+// load in Hilbert key order. Rows are copied out of the producer batches,
+// which go straight back to the pool, into a run of at most memory bytes.
+// A full run is sorted and spilled to a temporary file; at the end the runs
+// are merged into batches of the pool's fill size. A load that fits in
+// memory is never written out. The writers start only once the input is
+// parsed
+typedef struct {
+  BatchQueue *input; // filled by the producers
+  BatchQueue output; // sorted batches, for the writers or the router
+  BatchPool *pool;
+  size_t memory;           // bytes of a run, rows and index
+  ThreadMetrics *metrics;  // owned by the sorter
+  pthread_t thread;
+
+  // Filled in by the sorter, read after sorter_join
+  size_t rows;
+  SortRun *runs;
+  int num_runs;
+  size_t spilled_bytes;
+  double sort_seconds;  // sorting the runs
+  double merge_seconds; // spilling and merging, 0 when nothing spilled
+} SpatialSorter;
+
+// Batches the sorter holds on top of the pool limit of an unsorted load: the
+// one being read and the one being filled, and its output queue
+static inline size_t sorter_pool_batches(void) {
+  return 2 + SORTER_QUEUE_DEPTH;
+}
+
+void sorter_start(SpatialSorter *sorter);
+// Sort and send what was queued once the input is finished, then finish the
+// output queue and wait for the sorter
+void sorter_join(SpatialSorter *sorter);
+void sorter_destroy(SpatialSorter *sorter);
+
+#endif
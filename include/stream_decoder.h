@@ -0,0 +1,96 @@
+#ifndef STREAM_DECODER_H
+#define STREAM_DECODER_H
+
+#include "read_ahead.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Buffers in the ring, the decoder fills one while parsers hold the rest
+#define DECODER_BUFFERS 8
+// Decoded bytes per buffer, grown for a record that does not fit
+#define DECODER_BUFFER_SIZE (4 << 20)
+// Compressed bytes read per call
+#define DECODER_READ_SIZE (1 << 20)
+// Room before the aligned read of a plain file buffer for the record cut at
+// the end of the previous one, grown for longer records
+#define DECODER_CARRY_ROOM (64 << 10)
+
+typedef enum {
+  COMPRESSION_NONE,
+  COMPRESSION_GZIP,
+  COMPRESSION_ZSTD,
+} Compression;
+
+typedef enum {
+  SLOT_FREE,   // the decoder may fill it
+  SLOT_FILLED, // whole records waiting for a consumer
+  SLOT_TAKEN,  // a consumer is parsing it
+} SlotState;
+
+typedef struct {
+  char *data;
+  size_t capacity;
+  size_t head;   // the records start at data + head
+  size_t room;   // plain files: the read goes to data + room
+  size_t len;    // bytes of whole records
+  size_t filled; // len plus the start of the record cut at the end
+  size_t offset; // position of data + head in the decoded stream
+  SlotState state;
+} DecoderSlot;
+
+// Whole records of the decoded stream, a view into a ring buffer that stays
+// valid until the chunk is released
+typedef struct {
+  const char *data;
+  size_t len;
+  size_t offset; // position of data[0] in the decoded stream
+  int slot;
+} DecodedChunk;
+
+// Decompresses a gzip or zstd file on its own thread into a ring of large
+// buffers. Every buffer ends on a record boundary, the partial record at its
+// end is moved to the front of the next one, so consumers parse buffers in
+// place and in parallel, like ranges of a mapped file. A plain file is read
+// into the same ring with all but one buffer's reads in flight at once
+typedef struct {
+  int fd;
+  Compression compression;
+  size_t size;  // plain files only
+  bool direct;  // reads of fd bypass the page cache
+  ReadAhead ahead;
+  DecoderSlot slots[DECODER_BUFFERS];
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  pthread_t thread;
+  uint64_t next_take; // chunk the consumers get next, in stream order
+  bool done;    // the decoder filled its last slot
+  bool stop;    // consumers gave up, the decoder exits
+  bool failed;  // corrupt or truncated input
+  DecodedChunk returned; // put back by decoder_unget, taken first
+  bool has_returned;
+} StreamDecoder;
+
+// Compression of an open file from its first bytes, the file offset is kept.
+// Pipes cannot be peeked at and count as uncompressed
+Compression detect_compression(int fd);
+
+// Starts decoding fd, which the decoder closes
+bool decoder_start(StreamDecoder *decoder, int fd, Compression compression);
+// Starts reading a plain file of size bytes ahead, through io_uring where
+// the system has it. direct when reads of fd bypass the page cache
+bool decoder_start_reads(StreamDecoder *decoder, int fd, size_t size,
+                         bool direct);
+void decoder_stop(StreamDecoder *decoder);
+
+// Next chunk in stream order, blocks while the decoder is behind. False at
+// the end of the stream or when decoding failed. Safe from any thread
+bool decoder_take(StreamDecoder *decoder, DecodedChunk *chunk);
+void decoder_release(StreamDecoder *decoder, const DecodedChunk *chunk);
+
+// Hand back the unconsumed end of a taken chunk, the next take returns it
+void decoder_unget(StreamDecoder *decoder, const DecodedChunk *chunk,
+                   size_t consumed);
+
+#endif
@@ -1,41 +1,48 @@
 #ifndef WORKER_THREADS_H
 #define WORKER_THREADS_H
 
+#include "batch.h"
+#include "batch_pool.h"
+#include "batch_queue.h"
+#include "batch_tuner.h"
 #include "benchmark.h"
+#include "copy_encoder.h"
+#include "db_query.h"
+#include "input_files.h"
 #include "parsers.h"
-#include <sys/_pthread/_pthread_cond_t.h>
-#include <sys/_pthread/_pthread_mutex_t.h>
-
-#define QUEUE_SIZE 10
-
-typedef struct {
-  ProcessedLocation *locations;
-  int count;
-} Batch;
-
-// Thread-safe queue
-typedef struct {
-  Batch *batches[QUEUE_SIZE];
-  int front;
-  int rear;
-  int count;
-  pthread_mutex_t mutex;
-  pthread_cond_t not_full;
-  pthread_cond_t not_empty;
-  bool done;
-} BatchQueue;
+#include "reject_log.h"
+#include "sink.h"
+#include <pthread.h>
 
 // Worker thread context
 typedef struct {
   int id;
   BatchQueue *queue;
+  BatchPool *pool;
   const char *conninfo;
-  Benchmark *stats;
-  pthread_mutex_t *stats_mutex;
+  const Schema *schema;
+  CopyFormat copy_format;
+  StagingMode staging;
+  int pipeline_depth; // batches encoded ahead, 0 for the synchronous writer
+  const Checkpoint *checkpoint; // NULL when committed ranges are not tracked
+  BatchTuner *tuner;            // NULL with a fixed batch size
+  bool delta;                   // batches carry row operations
+  InputFileList *files;         // failed rows are counted per file
+  const SinkConfig *sink;       // NULL or postgres for the database
+  RejectLog *rejects;           // NULL when failed batches are not retried
+  ThreadMetrics *metrics; // owned by this worker
 } WorkerContext;
 
 // Function prototypes
-void queue_init(BatchQueue *queue);
 void *worker_thread(void *arg);
+// Row outcome counters of one committed batch
+void writer_count_rows(ThreadMetrics *metrics, const Batch *batch,
+                       int rows_sent, const MergeCounts *merged);
+// A batch whose transaction failed. With a reject log its rows are sent
+// again in halves, halves that commit are counted as usual and a row that
+// fails on its own is rejected. The rest count as failed, in total and for
+// their file. session is NULL when the writer sends to another sink
+void writer_batch_failed(WorkerContext *ctx, WriterSession *session,
+                         SinkWriter *sink, const Batch *batch);
 
 #endif
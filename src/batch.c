@@ -0,0 +1,244 @@
+#include "batch.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Initial name heap per row, most UN/LOCODE names are shorter
+#define NAME_BYTES_PER_ROW 24
+// Initial code heap per row, a UN/LOCODE and its country code
+#define CODE_BYTES_PER_ROW (UNLOCODE_WIDTH + COUNTRY_CODE_WIDTH)
+
+Batch *batch_create(int capacity) {
+  Batch *batch = malloc(sizeof(Batch));
+  batch->count = 0;
+  batch->capacity = capacity;
+  batch->code_offset = malloc((capacity + 1) * sizeof(uint32_t));
+  batch->code_offset[0] = 0;
+  batch->country_offset = malloc(capacity * sizeof(uint32_t));
+  batch->codes_capacity = (size_t)capacity * CODE_BYTES_PER_ROW;
+  batch->codes = malloc(batch->codes_capacity);
+  batch->latitude = malloc(capacity * sizeof(double));
+  batch->longitude = malloc(capacity * sizeof(double));
+  batch->flags = malloc(capacity * sizeof(uint8_t));
+  batch->origin = malloc(capacity * sizeof(uint64_t));
+  batch->name_offset = malloc((capacity + 1) * sizeof(uint32_t));
+  batch->name_offset[0] = 0;
+  batch->source.begin = 0;
+  batch->source.end = 0;
+  batch->delta = false;
+  batch->file = -1;
+  batch->names_capacity = (size_t)capacity * NAME_BYTES_PER_ROW;
+  batch->names = malloc(batch->names_capacity);
+  batch->carry_offset = malloc((capacity + 1) * sizeof(uint32_t));
+  batch->carry_offset[0] = 0;
+  batch->carried = NULL;
+  batch->carried_capacity = 0;
+  batch->schema = NULL;
+  return batch;
+}
+
+void batch_free(Batch *batch) {
+  free(batch->code_offset);
+  free(batch->country_offset);
+  free(batch->codes);
+  free(batch->latitude);
+  free(batch->longitude);
+  free(batch->flags);
+  free(batch->origin);
+  free(batch->name_offset);
+  free(batch->names);
+  free(batch->carry_offset);
+  free(batch->carried);
+  free(batch);
+}
+
+void batch_reset(Batch *batch) {
+  batch->count = 0;
+  batch->code_offset[0] = 0;
+  batch->name_offset[0] = 0;
+  batch->carry_offset[0] = 0;
+  batch->schema = NULL;
+  batch->source.begin = 0;
+  batch->source.end = 0;
+  batch->delta = false;
+  batch->file = -1;
+}
+
+// Copy a name into the heap, collapsing "" escapes of quoted fields
+static void append_name(Batch *batch, FieldView name, bool escaped) {
+  size_t used = batch->name_offset[batch->count];
+  if (used + name.len > batch->names_capacity) {
+    size_t capacity = batch->names_capacity * 2;
+    while (used + name.len > capacity)
+      capacity *= 2;
+    batch->names = realloc(batch->names, capacity);
+    batch->names_capacity = capacity;
+  }
+
+  char *dst = batch->names + used;
+  size_t len = name.len;
+  if (escaped) {
+    len = 0;
+    for (size_t i = 0; i < name.len; i++) {
+      dst[len++] = name.ptr[i];
+      if (name.ptr[i] == '"' && i + 1 < name.len && name.ptr[i + 1] == '"')
+        i++;
+    }
+  } else {
+    memcpy(dst, name.ptr, len);
+  }
+  batch->name_offset[batch->count + 1] = (uint32_t)(used + len);
+}
+
+// Room for the len code bytes of row i, which start where the last row ends
+static char *codes_reserve(Batch *batch, int i, size_t len) {
+  size_t used = batch->code_offset[i];
+  if (used + len > batch->codes_capacity) {
+    size_t capacity = batch->codes_capacity * 2;
+    while (used + len > capacity)
+      capacity *= 2;
+    batch->codes = realloc(batch->codes, capacity);
+    batch->codes_capacity = capacity;
+  }
+  batch->code_offset[i + 1] = (uint32_t)(used + len);
+  return batch->codes + used;
+}
+
+static inline size_t code_view_length(const CodeView *code) {
+  size_t len = 0;
+  for (int k = 0; k < code->num_parts; k++)
+    len += code->parts[k].len;
+  return len;
+}
+
+static inline char *copy_code_view(char *dst, const CodeView *code) {
+  for (int k = 0; k < code->num_parts; k++) {
+    memcpy(dst, code->parts[k].ptr, code->parts[k].len);
+    dst += code->parts[k].len;
+  }
+  return dst;
+}
+
+// Key and country code of row i
+static void append_codes(Batch *batch, int i, FieldView key,
+                         FieldView country) {
+  char *dst = codes_reserve(batch, i, key.len + country.len);
+  memcpy(dst, key.ptr, key.len);
+  memcpy(dst + key.len, country.ptr, country.len);
+  batch->country_offset[i] = batch->code_offset[i] + (uint32_t)key.len;
+}
+
+void batch_append(Batch *batch, const ProcessedLocation *location) {
+  int i = batch->count;
+
+  size_t key_len = code_view_length(&location->key);
+  char *dst = codes_reserve(batch, i,
+                            key_len + code_view_length(&location->country));
+  copy_code_view(copy_code_view(dst, &location->key), &location->country);
+  batch->country_offset[i] = batch->code_offset[i] + (uint32_t)key_len;
+  batch->latitude[i] = location->latitude;
+  batch->longitude[i] = location->longitude;
+  batch->flags[i] = (location->is_airport ? LOCATION_AIRPORT : 0) |
+                    (location->is_port ? LOCATION_PORT : 0) |
+                    (location->is_train_station ? LOCATION_TRAIN_STATION : 0) |
+                    (location->has_coordinates ? LOCATION_HAS_COORDINATES : 0);
+  batch->origin[i] = 0;
+  append_name(batch, location->name, location->name_escaped);
+  batch->carry_offset[i + 1] = batch->carry_offset[i];
+  batch->count++;
+}
+
+char *batch_carry_reserve(Batch *batch, size_t len) {
+  // The row being appended is the last one, count was already advanced
+  size_t used = batch->carry_offset[batch->count];
+  if (used + len > batch->carried_capacity) {
+    size_t capacity = batch->carried_capacity
+                          ? batch->carried_capacity * 2
+                          : (size_t)batch->capacity * NAME_BYTES_PER_ROW;
+    while (used + len > capacity)
+      capacity *= 2;
+    batch->carried = realloc(batch->carried, capacity);
+    batch->carried_capacity = capacity;
+  }
+  batch->carry_offset[batch->count] = (uint32_t)(used + len);
+  return batch->carried + used;
+}
+
+void batch_copy_row(Batch *batch, const Batch *source, int i) {
+  int out = batch->count;
+  append_codes(batch, out, batch_key(source, i), batch_country(source, i));
+  batch->latitude[out] = source->latitude[i];
+  batch->longitude[out] = source->longitude[i];
+  batch->flags[out] = source->flags[i];
+  batch->origin[out] = source->origin[i];
+  append_name(batch, batch_name(source, i), false);
+  batch->carry_offset[out + 1] = batch->carry_offset[out];
+  batch->count++;
+  batch->schema = source->schema;
+  FieldView carried = batch_carried(source, i);
+  if (carried.len > 0)
+    memcpy(batch_carry_reserve(batch, carried.len), carried.ptr, carried.len);
+}
+
+void batch_append_row(Batch *batch, const BatchRow *row) {
+  int out = batch->count;
+  append_codes(batch, out, row->key, row->country);
+  batch->latitude[out] = row->latitude;
+  batch->longitude[out] = row->longitude;
+  batch->flags[out] = row->flags;
+  batch->origin[out] = row->origin;
+  append_name(batch, row->name, false);
+  batch->carry_offset[out + 1] = batch->carry_offset[out];
+  batch->count++;
+  if (row->carried.len > 0)
+    memcpy(batch_carry_reserve(batch, row->carried.len), row->carried.ptr,
+           row->carried.len);
+}
+
+void batch_compact(Batch *batch, int first, const bool *keep) {
+  int out = first;
+  // Name offsets below i are rewritten as rows move down, remember where
+  // the name of row i started before that
+  uint32_t code_begin = batch->code_offset[first];
+  uint32_t name_begin = batch->name_offset[first];
+  uint32_t carry_begin = batch->carry_offset[first];
+  for (int i = first; i < batch->count; i++) {
+    uint32_t code_end = batch->code_offset[i + 1];
+    uint32_t key_len = batch->country_offset[i] - code_begin;
+    uint32_t name_end = batch->name_offset[i + 1];
+    uint32_t carry_end = batch->carry_offset[i + 1];
+    if (keep[i - first]) {
+      if (out != i) {
+        memmove(batch->codes + batch->code_offset[out],
+                batch->codes + code_begin, code_end - code_begin);
+        batch->latitude[out] = batch->latitude[i];
+        batch->longitude[out] = batch->longitude[i];
+        batch->flags[out] = batch->flags[i];
+        batch->origin[out] = batch->origin[i];
+        memmove(batch->names + batch->name_offset[out],
+                batch->names + name_begin, name_end - name_begin);
+        if (carry_end > carry_begin)
+          memmove(batch->carried + batch->carry_offset[out],
+                  batch->carried + carry_begin, carry_end - carry_begin);
+      }
+      batch->country_offset[out] = batch->code_offset[out] + key_len;
+      batch->code_offset[out + 1] =
+          batch->code_offset[out] + (code_end - code_begin);
+      batch->name_offset[out + 1] =
+          batch->name_offset[out] + (name_end - name_begin);
+      batch->carry_offset[out + 1] =
+          batch->carry_offset[out] + (carry_end - carry_begin);
+      out++;
+    }
+    code_begin = code_end;
+    name_begin = name_end;
+    carry_begin = carry_end;
+  }
+  batch->count = out;
+}
+
+size_t batch_footprint(int capacity) {
+  size_t per_row = CODE_BYTES_PER_ROW + 2 * sizeof(double) + sizeof(uint8_t) +
+                   sizeof(uint64_t) + 4 * sizeof(uint32_t) +
+                   NAME_BYTES_PER_ROW;
+  return sizeof(Batch) + (size_t)capacity * per_row + 3 * sizeof(uint32_t);
+}
@@ -0,0 +1,66 @@
+#include "batch_pool.h"
+#include "batch.h"
+#include <stdlib.h>
+
+void batch_pool_init(BatchPool *pool, int batch_size, size_t limit) {
+  pool->batch_size = batch_size;
+  pool->limit = limit;
+  atomic_init(&pool->fill_rows, batch_size);
+  atomic_init(&pool->created, 0);
+  atomic_init(&pool->reused, 0);
+  if (limit > 0)
+    queue_init(&pool->free_list, limit);
+}
+
+void batch_pool_destroy(BatchPool *pool) {
+  if (pool->limit == 0)
+    return;
+
+  bool done = false;
+  Batch *batch;
+  while ((batch = queue_try_pop(&pool->free_list, &done)) != NULL)
+    batch_free(batch);
+  queue_destroy(&pool->free_list);
+}
+
+Batch *batch_acquire(BatchPool *pool) {
+  if (pool->limit == 0) {
+    atomic_fetch_add(&pool->created, 1);
+    return batch_create(pool->batch_size);
+  }
+
+  bool done = false;
+  Batch *batch = queue_try_pop(&pool->free_list, &done);
+  if (batch) {
+    atomic_fetch_add(&pool->reused, 1);
+    return batch;
+  }
+
+  // Buffers are created lazily up to the limit, then producers wait for a
+  // writer to give one back
+  size_t created = atomic_load(&pool->created);
+  while (created < pool->limit) {
+    if (atomic_compare_exchange_weak(&pool->created, &created, created + 1))
+      return batch_create(pool->batch_size);
+  }
+
+  batch = queue_pop(&pool->free_list);
+  atomic_fetch_add(&pool->reused, 1);
+  return batch;
+}
+
+void batch_release(BatchPool *pool, Batch *batch) {
+  if (pool->limit == 0) {
+    batch_free(batch);
+    return;
+  }
+
+  // Keep the buffers, drop the rows
+  batch_reset(batch);
+  queue_push(&pool->free_list, batch);
+}
+
+size_t batch_pool_limit(int producers, int queue_depth, int writers,
+                        int writer_depth) {
+  return (size_t)producers + queue_depth + (size_t)writers * (1 + writer_depth);
+}
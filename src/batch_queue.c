@@ -0,0 +1,208 @@
+#include "batch_queue.h"
+#include <stdlib.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static void wait_point_init(WaitPoint *point) {
+  atomic_init(&point->seq, 0);
+  atomic_init(&point->waiters, 0);
+#ifndef __linux__
+  pthread_mutex_init(&point->mutex, NULL);
+  pthread_cond_init(&point->cond, NULL);
+#endif
+}
+
+static void wait_point_destroy(WaitPoint *point) {
+#ifndef __linux__
+  pthread_mutex_destroy(&point->mutex);
+  pthread_cond_destroy(&point->cond);
+#else
+  (void)point;
+#endif
+}
+
+// Sleep until seq moves away from the value read before the caller rechecked
+// its condition
+static void wait_point_sleep(WaitPoint *point, unsigned seen) {
+#ifdef __linux__
+  syscall(SYS_futex, &point->seq, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+#else
+  pthread_mutex_lock(&point->mutex);
+  while (atomic_load(&point->seq) == seen)
+    pthread_cond_wait(&point->cond, &point->mutex);
+  pthread_mutex_unlock(&point->mutex);
+#endif
+}
+
+static void wait_point_wake(WaitPoint *point, bool all) {
+  // The release store that published the change must not pass the load of
+  // waiters, pairs with the fence after a waiter registers
+  atomic_thread_fence(memory_order_seq_cst);
+  // Fast path: nobody is sleeping, no syscall
+  if (atomic_load(&point->waiters) == 0)
+    return;
+
+  atomic_fetch_add(&point->seq, 1);
+#ifdef __linux__
+  syscall(SYS_futex, &point->seq, FUTEX_WAKE_PRIVATE, all ? INT32_MAX : 1,
+          NULL, NULL, 0);
+#else
+  pthread_mutex_lock(&point->mutex);
+  if (all)
+    pthread_cond_broadcast(&point->cond);
+  else
+    pthread_cond_signal(&point->cond);
+  pthread_mutex_unlock(&point->mutex);
+#endif
+}
+
+void queue_init(BatchQueue *queue, size_t capacity) {
+  if (capacity == 0)
+    capacity = QUEUE_SIZE;
+
+  atomic_init(&queue->enqueue_pos, 0);
+  atomic_init(&queue->dequeue_pos, 0);
+  atomic_init(&queue->done, false);
+  queue->capacity = capacity;
+  queue->cells = malloc(capacity * sizeof(QueueCell));
+  for (size_t i = 0; i < capacity; i++) {
+    atomic_init(&queue->cells[i].sequence, i);
+    queue->cells[i].batch = NULL;
+  }
+  wait_point_init(&queue->not_empty);
+  wait_point_init(&queue->not_full);
+}
+
+void queue_destroy(BatchQueue *queue) {
+  wait_point_destroy(&queue->not_empty);
+  wait_point_destroy(&queue->not_full);
+  free(queue->cells);
+  queue->cells = NULL;
+}
+
+static bool queue_try_push(BatchQueue *queue, Batch *batch) {
+  size_t pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+
+  while (true) {
+    QueueCell *cell = &queue->cells[pos % queue->capacity];
+    size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+    if (diff == 0) {
+      // The cell is free for this lap, claim it
+      if (atomic_compare_exchange_weak_explicit(&queue->enqueue_pos, &pos,
+                                                pos + 1, memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        cell->batch = batch;
+        atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+        return true;
+      }
+    } else if (diff < 0) {
+      return false; // a whole lap behind: full
+    } else {
+      pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+    }
+  }
+}
+
+static Batch *queue_try_take(BatchQueue *queue) {
+  size_t pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+
+  while (true) {
+    QueueCell *cell = &queue->cells[pos % queue->capacity];
+    size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&queue->dequeue_pos, &pos,
+                                                pos + 1, memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        Batch *batch = cell->batch;
+        // Hand the cell back to producers for the next lap
+        atomic_store_explicit(&cell->sequence, pos + queue->capacity,
+                              memory_order_release);
+        return batch;
+      }
+    } else if (diff < 0) {
+      return NULL; // empty
+    } else {
+      pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+    }
+  }
+}
+
+void queue_push(BatchQueue *queue, Batch *batch) {
+  while (!queue_try_push(queue, batch)) {
+    /*
+     * The queue is full: register as a waiter, then check again before
+     * sleeping. A consumer that frees a cell after our check sees the waiter
+     * and bumps seq, so the futex wait returns right away instead of missing
+     * the wakeup
+     */
+    unsigned seen = atomic_load(&queue->not_full.seq);
+    atomic_fetch_add(&queue->not_full.waiters, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (queue_try_push(queue, batch)) {
+      atomic_fetch_sub(&queue->not_full.waiters, 1);
+      break;
+    }
+    wait_point_sleep(&queue->not_full, seen);
+    atomic_fetch_sub(&queue->not_full.waiters, 1);
+  }
+  wait_point_wake(&queue->not_empty, false);
+}
+
+Batch *queue_pop(BatchQueue *queue) {
+  while (true) {
+    Batch *batch = queue_try_take(queue);
+    if (batch) {
+      wait_point_wake(&queue->not_full, false);
+      return batch;
+    }
+
+    unsigned seen = atomic_load(&queue->not_empty.seq);
+    atomic_fetch_add(&queue->not_empty.waiters, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    batch = queue_try_take(queue);
+    if (batch == NULL && atomic_load(&queue->done)) {
+      // done is set after the last push, one more look decides
+      atomic_fetch_sub(&queue->not_empty.waiters, 1);
+      batch = queue_try_take(queue);
+      if (batch)
+        wait_point_wake(&queue->not_full, false);
+      return batch;
+    }
+    if (batch) {
+      atomic_fetch_sub(&queue->not_empty.waiters, 1);
+      wait_point_wake(&queue->not_full, false);
+      return batch;
+    }
+    wait_point_sleep(&queue->not_empty, seen);
+    atomic_fetch_sub(&queue->not_empty.waiters, 1);
+  }
+}
+
+Batch *queue_try_pop(BatchQueue *queue, bool *done) {
+  Batch *batch = queue_try_take(queue);
+  if (batch) {
+    wait_point_wake(&queue->not_full, false);
+    return batch;
+  }
+  *done = atomic_load(&queue->done) && queue_count(queue) == 0;
+  return NULL;
+}
+
+void queue_finish(BatchQueue *queue) {
+  atomic_store(&queue->done, true);
+  wait_point_wake(&queue->not_empty, true);
+}
+
+size_t queue_count(BatchQueue *queue) {
+  size_t tail = atomic_load(&queue->enqueue_pos);
+  size_t head = atomic_load(&queue->dequeue_pos);
+  return tail > head ? tail - head : 0;
+}
@@ -0,0 +1,65 @@
+#include "batch_router.h"
+#include <stdlib.h>
+
+static void push_partition(BatchRouter *router, int p, Batch *batch) {
+  Ticks wait_start = ticks_now();
+  queue_push(&router->outputs[p], batch);
+  stage_record_ticks(router->metrics, STAGE_ENQUEUE_WAIT,
+                     ticks_now() - wait_start);
+}
+
+static void *router_thread(void *arg) {
+  BatchRouter *router = arg;
+  int partitions = router->partitions;
+  Batch **open = calloc(partitions, sizeof(Batch *));
+
+  Batch *batch;
+  while ((batch = queue_pop(router->input)) != NULL) {
+    Ticks start = ticks_now();
+    int fill = batch_pool_fill(router->pool);
+    for (int i = 0; i < batch->count; i++) {
+      int p = router_partition(batch, i, partitions);
+      if (open[p] == NULL) {
+        open[p] = batch_acquire(router->pool);
+        open[p]->delta = batch->delta;
+        open[p]->file = batch->file;
+      } else if (open[p]->file != batch->file) {
+        open[p]->file = -1;
+      }
+      batch_copy_row(open[p], batch, i);
+      if (open[p]->count >= fill) {
+        push_partition(router, p, open[p]);
+        open[p] = NULL;
+      }
+    }
+    metrics_add(&router->metrics->batches, 1);
+    stage_record_ticks(router->metrics, STAGE_PARSE, ticks_now() - start);
+    batch_release(router->pool, batch);
+  }
+
+  for (int p = 0; p < partitions; p++) {
+    if (open[p])
+      push_partition(router, p, open[p]);
+    queue_finish(&router->outputs[p]);
+  }
+  free(open);
+  return NULL;
+}
+
+void router_start(BatchRouter *router) {
+  router->outputs = malloc(router->partitions * sizeof(BatchQueue));
+  for (int p = 0; p < router->partitions; p++)
+    queue_init(&router->outputs[p], ROUTER_QUEUE_DEPTH);
+  pthread_create(&router->thread, NULL, router_thread, router);
+}
+
+void router_join(BatchRouter *router) {
+  pthread_join(router->thread, NULL);
+}
+
+void router_destroy(BatchRouter *router) {
+  for (int p = 0; p < router->partitions; p++)
+    queue_destroy(&router->outputs[p]);
+  free(router->outputs);
+  router->outputs = NULL;
+}
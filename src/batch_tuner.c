@@ -0,0 +1,226 @@
+#include "batch_tuner.h"
+#include "benchmark.h"
+#include <string.h>
+
+void tuner_init(BatchTuner *tuner, BatchPool *pool, int rows, int writers,
+                bool tune_writers) {
+  memset(tuner, 0, sizeof(BatchTuner));
+  tuner->pool = pool;
+  tuner->max_rows = pool->batch_size;
+  tuner->min_rows =
+      TUNER_MIN_ROWS < tuner->max_rows ? TUNER_MIN_ROWS : tuner->max_rows;
+  tuner->max_writers = writers;
+  tuner->tune_writers = tune_writers;
+  atomic_init(&tuner->active_writers, writers);
+  pthread_mutex_init(&tuner->lock, NULL);
+  pthread_cond_init(&tuner->wake, NULL);
+
+  tuner->window_start = get_time();
+  tuner->dimension = TUNE_ROWS;
+  tuner->direction = 1;
+  tuner->step = 2.0;
+  atomic_store(&pool->fill_rows, rows);
+  tuner->best_rows = rows;
+}
+
+void tuner_destroy(BatchTuner *tuner) {
+  pthread_mutex_destroy(&tuner->lock);
+  pthread_cond_destroy(&tuner->wake);
+}
+
+// Halve how far a step moves the batch size: 2x, 1.5x, 1.25x, ...
+static double narrow(double step) { return 1 + (step - 1) / 2; }
+
+static void set_writers(BatchTuner *tuner, int writers) {
+  atomic_store(&tuner->active_writers, writers);
+  pthread_cond_broadcast(&tuner->wake);
+}
+
+// Move the current dimension one step, false when it is at its bound
+static bool move(BatchTuner *tuner) {
+  if (tuner->dimension == TUNE_ROWS) {
+    int rows = batch_pool_fill(tuner->pool);
+    double target = tuner->direction > 0 ? rows * tuner->step
+                                         : rows / tuner->step;
+    int next = target < tuner->min_rows   ? tuner->min_rows
+               : target > tuner->max_rows ? tuner->max_rows
+                                          : (int)target;
+    if (next == rows)
+      return false;
+    atomic_store_explicit(&tuner->pool->fill_rows, next,
+                          memory_order_relaxed);
+    return true;
+  }
+
+  int writers = atomic_load(&tuner->active_writers) + tuner->direction;
+  if (writers < 1 || writers > tuner->max_writers)
+    return false;
+  set_writers(tuner, writers);
+  return true;
+}
+
+// The search has narrowed down, settle on the best batch size measured and
+// probe with one connection less: as long as the throughput holds, fewer
+// connections are better for the server
+static void next_dimension(BatchTuner *tuner) {
+  if (tuner->dimension == TUNE_ROWS) {
+    atomic_store_explicit(&tuner->pool->fill_rows, tuner->best_rows,
+                          memory_order_relaxed);
+    tuner->reference = tuner->best_throughput;
+  }
+  if (tuner->dimension == TUNE_ROWS && tuner->tune_writers &&
+      tuner->max_writers > 1) {
+    tuner->dimension = TUNE_WRITERS;
+    tuner->direction = -1;
+    move(tuner);
+  } else {
+    tuner->dimension = TUNE_DONE;
+  }
+}
+
+static void adjust(BatchTuner *tuner, double throughput) {
+  // Nothing to compare the first window with yet
+  if (tuner->last_throughput == 0) {
+    move(tuner);
+    return;
+  }
+
+  if (tuner->dimension == TUNE_WRITERS) {
+    // Losing throughput means the last connection was needed, take it back
+    if (throughput < tuner->reference * (1 - TUNER_NOISE)) {
+      tuner->direction = -tuner->direction;
+      move(tuner);
+      next_dimension(tuner);
+    } else if (!move(tuner)) {
+      next_dimension(tuner);
+    }
+    return;
+  }
+
+  // A worse window reverses the search, a flat one narrows it in place
+  double change = throughput / tuner->last_throughput - 1;
+  if (change < -TUNER_NOISE)
+    tuner->direction = -tuner->direction;
+  if (change <= TUNER_NOISE)
+    tuner->step = narrow(tuner->step);
+  if (tuner->step < TUNER_MIN_STEP) {
+    next_dimension(tuner);
+    return;
+  }
+  // At a bound, turn around
+  if (!move(tuner)) {
+    tuner->direction = -tuner->direction;
+    tuner->step = narrow(tuner->step);
+  }
+}
+
+static void close_window(BatchTuner *tuner, double now) {
+  double throughput = tuner->window_rows / (now - tuner->window_start);
+  double merge_per_row = tuner->window_merge / tuner->window_rows;
+  int rows = batch_pool_fill(tuner->pool);
+  int writers = atomic_load(&tuner->active_writers);
+
+  if (throughput > tuner->best_throughput) {
+    tuner->best_throughput = throughput;
+    tuner->best_rows = rows;
+  }
+  if (tuner->merge_baseline == 0 || merge_per_row < tuner->merge_baseline)
+    tuner->merge_baseline = merge_per_row;
+
+  if (merge_per_row > TUNER_SPIKE * tuner->merge_baseline &&
+      rows > tuner->min_rows) {
+    // The server is struggling: smaller transactions hold locks for less
+    // time, and one connection less takes load off it
+    fprintf(stderr, "Tuner: merge latency %.1f us/row, %.1fx the baseline, "
+                    "backing off\n",
+            merge_per_row * 1e6, merge_per_row / tuner->merge_baseline);
+    int smaller = rows / 2 > tuner->min_rows ? rows / 2 : tuner->min_rows;
+    atomic_store_explicit(&tuner->pool->fill_rows, smaller,
+                          memory_order_relaxed);
+    if (tuner->tune_writers && writers > 1)
+      set_writers(tuner, writers - 1);
+
+    // Nothing measured before holds anymore, search again from here
+    tuner->dimension = TUNE_ROWS;
+    tuner->direction = -1;
+    tuner->step = 2.0;
+    tuner->merge_baseline = 0;
+    tuner->best_throughput = 0;
+    tuner->best_rows = smaller;
+  } else if (tuner->dimension != TUNE_DONE) {
+    adjust(tuner, throughput);
+  }
+
+  int next_rows = batch_pool_fill(tuner->pool);
+  int next_writers = atomic_load(&tuner->active_writers);
+  if (next_rows != rows || next_writers != writers) {
+    tuner->adjustments++;
+    fprintf(stderr,
+            "Tuner: %.0f rows/s at %d rows x %d writers, next %d rows x %d "
+            "writers\n",
+            throughput, rows, writers, next_rows, next_writers);
+  }
+  tuner->last_throughput = tuner->best_throughput > 0 ? throughput : 0;
+}
+
+void tuner_record(BatchTuner *tuner, uint64_t rows, double merge_seconds) {
+  pthread_mutex_lock(&tuner->lock);
+  tuner->window_rows += rows;
+  tuner->window_batches++;
+  tuner->window_merge += merge_seconds;
+
+  // Every active writer should have contributed to the window
+  double now = get_time();
+  if (now - tuner->window_start >= TUNER_WINDOW &&
+      tuner->window_batches >= (uint64_t)atomic_load(&tuner->active_writers) &&
+      tuner->window_rows > 0) {
+    int rows_before = batch_pool_fill(tuner->pool);
+    int writers_before = atomic_load(&tuner->active_writers);
+    if (tuner->settling) {
+      tuner->settling = false;
+    } else {
+      close_window(tuner, now);
+      // The next window still holds batches cut at the old size or
+      // writers busy with the old split, it is not measured
+      tuner->settling = batch_pool_fill(tuner->pool) != rows_before ||
+                        atomic_load(&tuner->active_writers) != writers_before;
+    }
+    tuner->window_start = now;
+    tuner->window_rows = 0;
+    tuner->window_batches = 0;
+    tuner->window_merge = 0;
+  }
+  pthread_mutex_unlock(&tuner->lock);
+}
+
+void tuner_wait_active(BatchTuner *tuner, int writer_id) {
+  if (writer_id < atomic_load(&tuner->active_writers))
+    return;
+  pthread_mutex_lock(&tuner->lock);
+  while (writer_id >= atomic_load(&tuner->active_writers) && !tuner->finished)
+    pthread_cond_wait(&tuner->wake, &tuner->lock);
+  pthread_mutex_unlock(&tuner->lock);
+}
+
+void tuner_finish(BatchTuner *tuner) {
+  pthread_mutex_lock(&tuner->lock);
+  tuner->finished = true;
+  pthread_cond_broadcast(&tuner->wake);
+  pthread_mutex_unlock(&tuner->lock);
+}
+
+void tuner_report(BatchTuner *tuner, FILE *out) {
+  pthread_mutex_lock(&tuner->lock);
+  if (tuner->best_throughput == 0) {
+    fprintf(out, "Adaptive batching: load too short to measure\n");
+  } else {
+    fprintf(out,
+            "Adaptive batching: %s after %d adjustments (best %.0f rows/s), "
+            "pin with --batch-size %d --writers %d\n",
+            tuner->dimension == TUNE_DONE ? "settled" : "still searching",
+            tuner->adjustments, tuner->best_throughput,
+            batch_pool_fill(tuner->pool),
+            atomic_load(&tuner->active_writers));
+  }
+  pthread_mutex_unlock(&tuner->lock);
+}
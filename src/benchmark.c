@@ -1,7 +1,22 @@
 #include "benchmark.h"
-#include <_time.h>
+#include <time.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
 
+static const char *const stage_names[STAGE_COUNT] = {
+    "read",  "parse", "enqueue_wait", "dequeue_wait", "encode",
+    "setup", "copy",  "merge",        "commit"};
 
+static const char *const counter_names[COUNTER_COUNT] = {
+    "parsed",     "skipped",         "conflicted",         "inserted",
+    "failed",     "bad_coordinates", "bad_function_codes", "bad_values",
+    "duplicate",  "updated",         "deleted",            "unchanged",
+    "rejected"};
+
+// Nanoseconds per tick, 1 unless the TSC is used
+static double ns_per_tick = 1.0;
 
 // Function to get current time in seconds
 double get_time() {
@@ -9,3 +24,214 @@ double get_time() {
   clock_gettime(CLOCK_MONOTONIC, &ts);
   return ts.tv_sec + ts.tv_nsec / 1e9;
 }
+
+Ticks ticks_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (Ticks)ts.tv_sec * 1000000000u + ts.tv_nsec;
+#endif
+}
+
+double ticks_to_seconds(Ticks ticks) { return ticks * ns_per_tick / 1e9; }
+
+// Process wide page fault and resident set counters
+void read_memory_counters(MemoryCounters *counters) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  counters->minor_faults = usage.ru_minflt;
+  counters->major_faults = usage.ru_majflt;
+#ifdef __APPLE__
+  counters->max_rss_kb = usage.ru_maxrss / 1024; // bytes on macOS
+#else
+  counters->max_rss_kb = usage.ru_maxrss;
+#endif
+}
+
+void benchmark_init(Benchmark *bench) {
+  memset(bench, 0, sizeof(Benchmark));
+  bench->start_time = get_time();
+  pthread_mutex_init(&bench->lock, NULL);
+
+#if defined(__x86_64__) || defined(__i386__)
+  // Measure the TSC against the monotonic clock over a few milliseconds
+  double start = get_time();
+  Ticks ticks_start = ticks_now();
+  struct timespec pause = {0, 5000000};
+  nanosleep(&pause, NULL);
+  double elapsed = get_time() - start;
+  Ticks ticks = ticks_now() - ticks_start;
+  if (ticks > 0)
+    ns_per_tick = elapsed * 1e9 / ticks;
+#endif
+}
+
+void benchmark_destroy(Benchmark *bench) {
+  for (int i = 0; i < bench->num_threads; i++)
+    free(bench->threads[i]);
+  free(bench->threads);
+  bench->threads = NULL;
+  bench->num_threads = 0;
+  pthread_mutex_destroy(&bench->lock);
+}
+
+ThreadMetrics *benchmark_thread(Benchmark *bench, const char *role, int id) {
+  // Cache line aligned so threads never share a line
+  ThreadMetrics *metrics;
+  if (posix_memalign((void **)&metrics, 64, sizeof(ThreadMetrics)) != 0)
+    return NULL;
+  memset(metrics, 0, sizeof(ThreadMetrics));
+  metrics->role = role;
+  metrics->id = id;
+
+  pthread_mutex_lock(&bench->lock);
+  bench->threads = realloc(bench->threads, (bench->num_threads + 1) *
+                                               sizeof(ThreadMetrics *));
+  bench->threads[bench->num_threads++] = metrics;
+  pthread_mutex_unlock(&bench->lock);
+  return metrics;
+}
+
+static void histogram_record(Histogram *histogram, uint64_t ns) {
+  int bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+  if (bucket >= HISTOGRAM_BUCKETS)
+    bucket = HISTOGRAM_BUCKETS - 1;
+  histogram->buckets[bucket]++;
+  metrics_add(&histogram->count, 1);
+  metrics_add(&histogram->sum_ns, ns);
+  if (ns > histogram->max_ns)
+    histogram->max_ns = ns;
+}
+
+void stage_record(ThreadMetrics *metrics, Stage stage, double seconds) {
+  histogram_record(&metrics->stages[stage],
+                   seconds > 0 ? (uint64_t)(seconds * 1e9) : 0);
+}
+
+void stage_record_ticks(ThreadMetrics *metrics, Stage stage, Ticks ticks) {
+  histogram_record(&metrics->stages[stage], (uint64_t)(ticks * ns_per_tick));
+}
+
+static void histogram_add(Histogram *total, const Histogram *histogram) {
+  total->count += histogram->count;
+  total->sum_ns += histogram->sum_ns;
+  if (histogram->max_ns > total->max_ns)
+    total->max_ns = histogram->max_ns;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    total->buckets[i] += histogram->buckets[i];
+}
+
+void benchmark_totals(const Benchmark *bench, ThreadMetrics *totals) {
+  memset(totals, 0, sizeof(ThreadMetrics));
+  totals->role = "total";
+  for (int t = 0; t < bench->num_threads; t++) {
+    const ThreadMetrics *metrics = bench->threads[t];
+    totals->batches += metrics->batches;
+    totals->bytes_read += metrics->bytes_read;
+    totals->duplicate_bytes += metrics->duplicate_bytes;
+    for (int i = 0; i < COUNTER_COUNT; i++)
+      totals->counters[i] += metrics->counters[i];
+    for (int i = 0; i < STAGE_COUNT; i++)
+      histogram_add(&totals->stages[i], &metrics->stages[i]);
+  }
+}
+
+const char *stage_name(Stage stage) { return stage_names[stage]; }
+
+const char *counter_name(Counter counter) { return counter_names[counter]; }
+
+double stage_seconds(const ThreadMetrics *metrics, Stage stage) {
+  return metrics->stages[stage].sum_ns / 1e9;
+}
+
+// Upper bound of the bucket holding the given quantile, capped at the max
+static double histogram_quantile_us(const Histogram *histogram, double q) {
+  if (histogram->count == 0)
+    return 0;
+  uint64_t rank = (uint64_t)(q * (histogram->count - 1)) + 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += histogram->buckets[i];
+    if (seen >= rank) {
+      uint64_t bound = i == 0 ? 0 : 1ull << i;
+      if (bound > histogram->max_ns || i == HISTOGRAM_BUCKETS - 1)
+        bound = histogram->max_ns;
+      return bound / 1e3;
+    }
+  }
+  return histogram->max_ns / 1e3;
+}
+
+static void write_histogram(FILE *out, const Histogram *histogram) {
+  fprintf(out,
+          "{\"count\": %llu, \"total_s\": %.6f, \"mean_us\": %.3f, "
+          "\"p50_us\": %.3f, \"p90_us\": %.3f, \"p99_us\": %.3f, "
+          "\"max_us\": %.3f, \"buckets\": [",
+          (unsigned long long)histogram->count, histogram->sum_ns / 1e9,
+          histogram->count ? histogram->sum_ns / 1e3 / histogram->count : 0,
+          histogram_quantile_us(histogram, 0.5),
+          histogram_quantile_us(histogram, 0.9),
+          histogram_quantile_us(histogram, 0.99), histogram->max_ns / 1e3);
+
+  // Only populated buckets, as [upper bound in ns, samples]
+  bool first = true;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    if (histogram->buckets[i] == 0)
+      continue;
+    fprintf(out, "%s[%llu, %llu]", first ? "" : ", ",
+            i == 0 ? 0ull : 1ull << i,
+            (unsigned long long)histogram->buckets[i]);
+    first = false;
+  }
+  fprintf(out, "]}");
+}
+
+static void write_metrics(FILE *out, const ThreadMetrics *metrics,
+                          const char *indent) {
+  fprintf(out, "%s\"batches\": %llu,\n", indent,
+          (unsigned long long)metrics->batches);
+  fprintf(out,
+          "%s\"bytes_read\": %llu, \"duplicate_bytes\": %llu,\n%s\"rows\": {",
+          indent, (unsigned long long)metrics->bytes_read,
+          (unsigned long long)metrics->duplicate_bytes, indent);
+  for (int i = 0; i < COUNTER_COUNT; i++)
+    fprintf(out, "%s\"%s\": %llu", i ? ", " : "", counter_names[i],
+            (unsigned long long)metrics->counters[i]);
+  fprintf(out, "},\n%s\"stages\": {", indent);
+
+  // Stages this thread never ran are left out
+  bool first = true;
+  for (int i = 0; i < STAGE_COUNT; i++) {
+    if (metrics->stages[i].count == 0)
+      continue;
+    fprintf(out, "%s\n%s  \"%s\": ", first ? "" : ",", indent, stage_names[i]);
+    write_histogram(out, &metrics->stages[i]);
+    first = false;
+  }
+  fprintf(out, "%s}", first ? "" : "\n");
+}
+
+void benchmark_write_json(const Benchmark *bench, FILE *out, double total_time,
+                          const MemoryCounters *memory) {
+  ThreadMetrics totals;
+  benchmark_totals(bench, &totals);
+
+  fprintf(out, "{\n  \"total_s\": %.6f,\n  \"parse_wall_s\": %.6f,\n",
+          total_time, bench->parse_time);
+  fprintf(out,
+          "  \"memory\": {\"minor_faults\": %ld, \"major_faults\": %ld, "
+          "\"max_rss_kb\": %ld},\n",
+          memory->minor_faults, memory->major_faults, memory->max_rss_kb);
+  write_metrics(out, &totals, "  ");
+  fprintf(out, ",\n  \"threads\": [");
+  for (int t = 0; t < bench->num_threads; t++) {
+    const ThreadMetrics *metrics = bench->threads[t];
+    fprintf(out, "%s\n    {\"role\": \"%s\", \"id\": %d,\n", t ? "," : "",
+            metrics->role, metrics->id);
+    write_metrics(out, metrics, "     ");
+    fprintf(out, "}");
+  }
+  fprintf(out, "\n  ]\n}\n");
+}
@@ -0,0 +1,146 @@
+#include "checkpoint.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int compare_ranges(const void *a, const void *b) {
+  const ByteRange *x = a;
+  const ByteRange *y = b;
+  return x->begin < y->begin ? -1 : x->begin > y->begin;
+}
+
+// Sort and merge overlapping or touching ranges in place
+static int coalesce_ranges(ByteRange *ranges, int count) {
+  if (count == 0)
+    return 0;
+  qsort(ranges, count, sizeof(ByteRange), compare_ranges);
+
+  int merged = 0;
+  for (int i = 1; i < count; i++) {
+    if (ranges[i].begin <= ranges[merged].end) {
+      if (ranges[i].end > ranges[merged].end)
+        ranges[merged].end = ranges[i].end;
+    } else {
+      ranges[++merged] = ranges[i];
+    }
+  }
+  return merged + 1;
+}
+
+static bool exec_key(PGconn *conn, const char *query, const char *key,
+                     const char *size, PGresult **result) {
+  const char *values[2] = {key, size};
+  PGresult *res = PQexecParams(conn, query, size ? 2 : 1, NULL, values, NULL,
+                               NULL, 0);
+  ExecStatusType status = PQresultStatus(res);
+  if (status != PGRES_COMMAND_OK && status != PGRES_TUPLES_OK) {
+    fprintf(stderr, "Checkpoint query failed: %s", PQerrorMessage(conn));
+    PQclear(res);
+    return false;
+  }
+  if (result)
+    *result = res;
+  else
+    PQclear(res);
+  return true;
+}
+
+bool checkpoint_open(Checkpoint *checkpoint, PGconn *conn, const char *path,
+                     size_t input_size, bool resume) {
+  memset(checkpoint, 0, sizeof(Checkpoint));
+  checkpoint->input_size = input_size;
+
+  // The same file reached through another relative path is the same load
+  char resolved[PATH_MAX];
+  checkpoint->key = strdup(realpath(path, resolved) ? resolved : path);
+
+  PGresult *res = PQexec(conn, PROGRESS_TABLE_DDL);
+  if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+    fprintf(stderr, "Create progress table failed: %s", PQerrorMessage(conn));
+    PQclear(res);
+    return false;
+  }
+  PQclear(res);
+
+  if (!resume)
+    return exec_key(conn, "DELETE FROM load_progress WHERE load_key = $1",
+                    checkpoint->key, NULL, NULL);
+
+  // Ranges recorded against a different file size belong to another
+  // version of the file and cannot be trusted
+  char size[24];
+  snprintf(size, sizeof(size), "%zu", input_size);
+  if (!exec_key(conn,
+                "SELECT count(*) FROM load_progress "
+                "WHERE load_key = $1 AND input_size <> $2",
+                checkpoint->key, size, &res))
+    return false;
+  long stale = atol(PQgetvalue(res, 0, 0));
+  PQclear(res);
+  if (stale > 0) {
+    fprintf(stderr,
+            "%s changed size since the checkpointed load, run without "
+            "--resume to start over\n",
+            checkpoint->key);
+    return false;
+  }
+
+  if (!exec_key(conn,
+                "SELECT range_begin, range_end FROM load_progress "
+                "WHERE load_key = $1 AND input_size = $2",
+                checkpoint->key, size, &res))
+    return false;
+
+  int rows = PQntuples(res);
+  checkpoint->committed = malloc((rows > 0 ? rows : 1) * sizeof(ByteRange));
+  for (int i = 0; i < rows; i++) {
+    checkpoint->committed[i].begin = strtoull(PQgetvalue(res, i, 0), NULL, 10);
+    checkpoint->committed[i].end = strtoull(PQgetvalue(res, i, 1), NULL, 10);
+  }
+  PQclear(res);
+  checkpoint->num_committed = coalesce_ranges(checkpoint->committed, rows);
+  return true;
+}
+
+void checkpoint_close(Checkpoint *checkpoint) {
+  free(checkpoint->key);
+  free(checkpoint->committed);
+  memset(checkpoint, 0, sizeof(Checkpoint));
+}
+
+int checkpoint_pending(const Checkpoint *checkpoint, size_t begin, size_t end,
+                       ByteRange **pending) {
+  int capacity = (checkpoint ? checkpoint->num_committed : 0) + 1;
+  *pending = malloc(capacity * sizeof(ByteRange));
+
+  int count = 0;
+  size_t cursor = begin;
+  for (int i = 0; checkpoint && i < checkpoint->num_committed; i++) {
+    const ByteRange *done = &checkpoint->committed[i];
+    if (done->end <= cursor)
+      continue;
+    if (done->begin >= end)
+      break;
+    if (done->begin > cursor)
+      (*pending)[count++] = (ByteRange){cursor, done->begin};
+    cursor = done->end;
+  }
+  if (cursor < end)
+    (*pending)[count++] = (ByteRange){cursor, end};
+  return count;
+}
+
+void checkpoint_params(const Checkpoint *checkpoint, const Batch *batch,
+                       ProgressParams *params) {
+  snprintf(params->numbers[0], sizeof(params->numbers[0]), "%zu",
+           checkpoint->input_size);
+  snprintf(params->numbers[1], sizeof(params->numbers[1]), "%zu",
+           batch->source.begin);
+  snprintf(params->numbers[2], sizeof(params->numbers[2]), "%zu",
+           batch->source.end);
+  params->values[0] = checkpoint->key;
+  params->values[1] = params->numbers[0];
+  params->values[2] = params->numbers[1];
+  params->values[3] = params->numbers[2];
+}
@@ -0,0 +1,234 @@
+#include "chunk_parser.h"
+#include "csv_tokenizer.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Find the first record boundary at or after target. The quote state at
+// target is recovered by counting quotes from begin, which is a boundary
+static size_t find_boundary(const char *data, size_t begin, size_t target,
+                            size_t size) {
+  bool in_quotes = false;
+  const char *q = data + begin;
+  const char *limit = data + target;
+  while ((q = memchr(q, '"', limit - q)) != NULL) {
+    in_quotes = !in_quotes;
+    q++;
+  }
+
+  const char *p = data + target;
+  const char *end = data + size;
+  while (p < end) {
+    const char *newline = memchr(p, '\n', end - p);
+    if (!newline)
+      return size;
+
+    for (q = p; (q = memchr(q, '"', newline - q)) != NULL; q++)
+      in_quotes = !in_quotes;
+
+    if (!in_quotes)
+      return newline - data + 1;
+    p = newline + 1;
+  }
+  return size;
+}
+
+int plan_chunks(const char *data, size_t size, size_t start, int parts,
+                ByteRange *ranges) {
+  int count = 0;
+  size_t begin = start;
+
+  for (int i = 0; i < parts && begin < size; i++) {
+    size_t remaining_parts = parts - i;
+    size_t target = begin + (size - begin) / remaining_parts;
+    size_t end = i == parts - 1 ? size : find_boundary(data, begin, target, size);
+
+    ranges[count].begin = begin;
+    ranges[count].end = end;
+    count++;
+    begin = end;
+  }
+  return count;
+}
+
+int plan_pending(const char *data, const ByteRange *pending, int num_pending,
+                 int parts, ByteRange **ranges) {
+  size_t total = 0;
+  for (int i = 0; i < num_pending; i++)
+    total += pending[i].end - pending[i].begin;
+
+  // Every range gets at least one part, so at most parts + num_pending
+  *ranges = malloc((parts + num_pending) * sizeof(ByteRange));
+  int count = 0;
+  for (int i = 0; i < num_pending; i++) {
+    size_t size = pending[i].end - pending[i].begin;
+    int share = total > 0 ? (int)((double)parts * size / total) : 0;
+    if (share < 1)
+      share = 1;
+    count += plan_chunks(data, pending[i].end, pending[i].begin, share,
+                         *ranges + count);
+  }
+  return count;
+}
+
+Batch *producer_push(BatchPool *pool, BatchQueue *queue,
+                     ThreadMetrics *metrics, Batch *batch, Ticks read_ticks,
+                     Ticks parse_ticks, bool last) {
+  stage_record_ticks(metrics, STAGE_READ, read_ticks);
+  stage_record_ticks(metrics, STAGE_PARSE, parse_ticks);
+
+  Ticks wait_start = ticks_now();
+  queue_push(queue, batch);
+  Batch *next = last ? NULL : batch_acquire(pool);
+  stage_record_ticks(metrics, STAGE_ENQUEUE_WAIT, ticks_now() - wait_start);
+  return next;
+}
+
+// Next piece of input: a planned range of the mapped file or a chunk of the
+// decoded stream. *data points at the range begin
+static bool parser_next_input(ParserContext *ctx, const char **data,
+                              ByteRange *range, DecodedChunk *chunk) {
+  if (ctx->decoder) {
+    if (!decoder_take(ctx->decoder, chunk))
+      return false;
+    *data = chunk->data;
+    *range = (ByteRange){chunk->offset, chunk->offset + chunk->len};
+    return true;
+  }
+
+  int r = atomic_fetch_add(ctx->next_range, 1);
+  if (r >= ctx->num_ranges)
+    return false;
+  *range = ctx->ranges[r];
+  *data = ctx->data + range->begin;
+  return true;
+}
+
+void *parser_thread(void *arg) {
+  ParserContext *ctx = (ParserContext *)arg;
+  ThreadMetrics *metrics = ctx->metrics;
+
+  Batch *batch = batch_acquire(ctx->pool);
+  CsvIndex index;
+  csv_index_init(&index);
+  size_t window = PARSER_WINDOW;
+  // Time spent on the current batch, a window can span batches
+  Ticks read_ticks = 0;
+  Ticks parse_ticks = 0;
+  int checked = 0; // rows of the batch already checked for duplicates
+  SnapshotList seen; // rows for the next delta snapshot
+  snapshot_list_init(&seen);
+
+  const char *data;
+  ByteRange range;
+  DecodedChunk chunk;
+  while (parser_next_input(ctx, &data, &range, &chunk)) {
+    const char *p = data;
+    const char *end = data + (range.end - range.begin);
+    if (batch->count == 0)
+      batch->source.begin = range.begin;
+
+    while (p < end) {
+      size_t available = end - p;
+      bool at_end = available <= window;
+      Ticks mark = ticks_now();
+      size_t consumed =
+          csv_index_block(&index, p, at_end ? available : window, at_end);
+      Ticks now = ticks_now();
+      read_ticks += now - mark;
+      mark = now;
+
+      // A single record longer than the window, retry with a larger one
+      if (consumed == 0) {
+        window *= 2;
+        continue;
+      }
+      metrics_add(&metrics->bytes_read, consumed);
+
+      FieldView fields[SCHEMA_MAX_FIELDS];
+      size_t max_fields = ctx->plan ? (size_t)ctx->plan->num_fields
+                                    : LOCATION_FIELDS;
+      size_t cursor = 0;
+      size_t count;
+      while ((count = csv_next_record(&index, p, &cursor, fields,
+                                      max_fields)) > 0) {
+        ProcessedLocation processed;
+        if (ctx->plan) {
+          processed.change = ' ';
+          producer_count_row(
+              metrics, schema_append_row(ctx->plan, fields, count, batch));
+        } else {
+          LocationData raw_data;
+          parse_fields(fields, count, &raw_data);
+          producer_count_row(metrics,
+                             process_location_data(&raw_data, &processed));
+          batch_append(batch, &processed);
+        }
+        batch->origin[batch->count - 1] =
+            row_origin(ctx->file, range.begin + (fields[0].ptr - data));
+        if (ctx->delta &&
+            !delta_row(ctx->delta, &seen, metrics, batch, processed.change))
+          continue;
+
+        int fill = batch_pool_fill(ctx->pool);
+        if (batch->count >= fill && ctx->dedup)
+          producer_dedup(ctx->dedup, metrics, batch, &checked);
+        if (batch->count >= fill) {
+          // The batch ends where the next record starts
+          size_t next = (index.seps[cursor - 1] & ~CSV_RECORD_END) + 1;
+          batch->source.end =
+              range.begin + (p - data) + (next < consumed ? next : consumed);
+          parse_ticks += ticks_now() - mark;
+          size_t batch_end = batch->source.end;
+          batch->file = ctx->file;
+          batch = producer_push(ctx->pool, ctx->queue, metrics, batch,
+                                read_ticks, parse_ticks, false);
+          batch->source.begin = batch_end;
+          checked = 0;
+          read_ticks = 0;
+          parse_ticks = 0;
+          mark = ticks_now();
+        }
+      }
+      parse_ticks += ticks_now() - mark;
+      p += consumed;
+    }
+
+    // Chunks follow each other and nothing tracks their ranges, the batch
+    // goes on with the next one
+    if (ctx->decoder) {
+      decoder_release(ctx->decoder, &chunk);
+      continue;
+    }
+
+    // Ranges are not adjacent, flush what is left before the next one
+    if (ctx->dedup)
+      producer_dedup(ctx->dedup, metrics, batch, &checked);
+    if (batch->count > 0) {
+      batch->source.end = range.end;
+      batch->file = ctx->file;
+      batch = producer_push(ctx->pool, ctx->queue, metrics, batch, read_ticks,
+                            parse_ticks, false);
+      read_ticks = 0;
+      parse_ticks = 0;
+    }
+    batch_reset(batch);
+    checked = 0;
+  }
+
+  if (ctx->decoder) {
+    if (ctx->dedup)
+      producer_dedup(ctx->dedup, metrics, batch, &checked);
+    if (batch->count > 0) {
+      batch->file = ctx->file;
+      producer_push(ctx->pool, ctx->queue, metrics, batch, read_ticks,
+                    parse_ticks, true);
+      batch = NULL;
+    }
+  }
+  if (ctx->delta)
+    delta_collect(ctx->delta, &seen);
+  if (batch)
+    batch_release(ctx->pool, batch);
+  csv_index_free(&index);
+  return NULL;
+}
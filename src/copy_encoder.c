@@ -0,0 +1,565 @@
+#include "copy_encoder.h"
+#include "schema.h"
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Number of columns in the COPY column list
+#define COPY_COLUMNS 7
+
+// EWKB geometry type of a point carrying an SRID
+#define EWKB_POINT 1u
+#define EWKB_SRID_FLAG 0x20000000u
+#define EWKB_POINT_SIZE (1 + 4 + 4 + 2 * sizeof(double))
+
+void copy_buffer_init(CopyBuffer *buffer) {
+  buffer->data = malloc(COPY_BUFFER_SIZE);
+  buffer->len = 0;
+  buffer->capacity = COPY_BUFFER_SIZE;
+}
+
+void copy_buffer_free(CopyBuffer *buffer) {
+  free(buffer->data);
+  buffer->data = NULL;
+  buffer->len = 0;
+  buffer->capacity = 0;
+}
+
+static char *copy_buffer_reserve(CopyBuffer *buffer, size_t len) {
+  if (buffer->len + len > buffer->capacity) {
+    size_t capacity = buffer->capacity ? buffer->capacity : COPY_BUFFER_SIZE;
+    while (buffer->len + len > capacity)
+      capacity *= 2;
+    buffer->data = realloc(buffer->data, capacity);
+    buffer->capacity = capacity;
+  }
+  char *dst = buffer->data + buffer->len;
+  buffer->len += len;
+  return dst;
+}
+
+bool batch_row_is_valid(const Batch *batch, int i) {
+  // Skip records with empty names
+  if (batch->name_offset[i + 1] == batch->name_offset[i])
+    return false;
+
+  // Rows without a position are loaded with a NULL location
+  if (!(batch->flags[i] & LOCATION_HAS_COORDINATES))
+    return true;
+
+  // Validate coordinates
+  return batch->longitude[i] >= -180 && batch->longitude[i] <= 180 &&
+         batch->latitude[i] >= -90 && batch->latitude[i] <= 90;
+}
+
+static inline char *put_int16(char *p, int16_t value) {
+  uint16_t n = htons((uint16_t)value);
+  memcpy(p, &n, sizeof(n));
+  return p + sizeof(n);
+}
+
+static inline char *put_int32(char *p, int32_t value) {
+  uint32_t n = htonl((uint32_t)value);
+  memcpy(p, &n, sizeof(n));
+  return p + sizeof(n);
+}
+
+static inline char *put_int64(char *p, uint64_t value) {
+  for (int i = 0; i < 8; i++)
+    p[i] = (char)(value >> (56 - 8 * i));
+  return p + 8;
+}
+
+// Length prefixed field value
+static inline char *put_field(char *p, const char *value, size_t len) {
+  p = put_int32(p, (int32_t)len);
+  memcpy(p, value, len);
+  return p + len;
+}
+
+static inline char *put_bool(char *p, bool value) {
+  p = put_int32(p, 1);
+  *p = value ? 1 : 0;
+  return p + 1;
+}
+
+// EWKB point in host byte order, the leading byte tells the server which
+static char *put_ewkb_point(char *p, double lon, double lat) {
+  const uint32_t type = EWKB_POINT | EWKB_SRID_FLAG;
+  const uint32_t srid = 4326;
+
+  p = put_int32(p, EWKB_POINT_SIZE);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  *p++ = 1;
+#else
+  *p++ = 0;
+#endif
+  memcpy(p, &type, sizeof(type));
+  p += sizeof(type);
+  memcpy(p, &srid, sizeof(srid));
+  p += sizeof(srid);
+  // PostGIS expects longitude first
+  memcpy(p, &lon, sizeof(lon));
+  p += sizeof(lon);
+  memcpy(p, &lat, sizeof(lat));
+  return p + sizeof(lat);
+}
+
+void copy_encode_binary_header(CopyBuffer *buffer) {
+  static const char signature[11] = "PGCOPY\n\377\r\n\0";
+  char *p = copy_buffer_reserve(buffer, sizeof(signature) + 8);
+  memcpy(p, signature, sizeof(signature));
+  p = put_int32(p + sizeof(signature), 0); // flags
+  put_int32(p, 0);                          // header extension length
+}
+
+// Schema rows: one encoder per column, picked by its ColumnEncoding when the
+// schema is loaded. Carried values are read in column order through cursor
+
+typedef char *(*BinaryEncoder)(char *p, const Batch *batch, int i,
+                               const char **cursor);
+
+static char *binary_key(char *p, const Batch *batch, int i,
+                        const char **cursor) {
+  (void)cursor;
+  FieldView key = batch_key(batch, i);
+  return put_field(p, key.ptr, key.len);
+}
+
+static char *binary_name(char *p, const Batch *batch, int i,
+                         const char **cursor) {
+  (void)cursor;
+  FieldView name = batch_name(batch, i);
+  return put_field(p, name.ptr, name.len);
+}
+
+static char *binary_country(char *p, const Batch *batch, int i,
+                            const char **cursor) {
+  (void)cursor;
+  FieldView country = batch_country(batch, i);
+  return put_field(p, country.ptr, country.len);
+}
+
+static char *binary_point(char *p, const Batch *batch, int i,
+                          const char **cursor) {
+  (void)cursor;
+  if (batch->flags[i] & LOCATION_HAS_COORDINATES)
+    return put_ewkb_point(p, batch->longitude[i], batch->latitude[i]);
+  return put_int32(p, -1);
+}
+
+static char *binary_airport(char *p, const Batch *batch, int i,
+                            const char **cursor) {
+  (void)cursor;
+  return put_bool(p, batch->flags[i] & LOCATION_AIRPORT);
+}
+
+static char *binary_port(char *p, const Batch *batch, int i,
+                         const char **cursor) {
+  (void)cursor;
+  return put_bool(p, batch->flags[i] & LOCATION_PORT);
+}
+
+static char *binary_train(char *p, const Batch *batch, int i,
+                          const char **cursor) {
+  (void)cursor;
+  return put_bool(p, batch->flags[i] & LOCATION_TRAIN_STATION);
+}
+
+static char *binary_flags(char *p, const Batch *batch, int i,
+                          const char **cursor) {
+  (void)cursor;
+  uint8_t flags = batch->flags[i];
+  p = put_bool(p, flags & LOCATION_AIRPORT);
+  p = put_bool(p, flags & LOCATION_PORT);
+  return put_bool(p, flags & LOCATION_TRAIN_STATION);
+}
+
+// Big endian int32, the length of a carried value or an int4
+static inline int32_t get_int32(const char *p) {
+  uint32_t n;
+  memcpy(&n, p, sizeof(n));
+  return (int32_t)ntohl(n);
+}
+
+// Carried values are already in their binary form
+static char *binary_carried(char *p, const Batch *batch, int i,
+                            const char **cursor) {
+  (void)batch;
+  (void)i;
+  int32_t len = get_int32(*cursor);
+  size_t size = 4 + (len > 0 ? (size_t)len : 0);
+  memcpy(p, *cursor, size);
+  *cursor += size;
+  return p + size;
+}
+
+static const BinaryEncoder binary_encoders[ENCODE_COUNT] = {
+    [ENCODE_KEY] = binary_key,         [ENCODE_NAME] = binary_name,
+    [ENCODE_COUNTRY] = binary_country, [ENCODE_POINT] = binary_point,
+    [ENCODE_AIRPORT] = binary_airport, [ENCODE_PORT] = binary_port,
+    [ENCODE_TRAIN] = binary_train,     [ENCODE_TEXT] = binary_carried,
+    [ENCODE_INT4] = binary_carried,    [ENCODE_INT8] = binary_carried,
+    [ENCODE_FLOAT8] = binary_carried,  [ENCODE_BOOL] = binary_carried,
+    [ENCODE_FLAGS] = binary_flags,
+};
+
+static size_t schema_binary_row_size(const Schema *schema, const Batch *batch,
+                                     int i) {
+  const int *role = schema->role_column;
+  size_t size = 2 + 4 * (size_t)(schema->num_columns - schema->num_carried) +
+                batch_carried(batch, i).len + batch_name(batch, i).len +
+                batch_key(batch, i).len;
+  if (role[ROLE_COUNTRY] >= 0)
+    size += batch_country(batch, i).len;
+  if (role[ROLE_LOCATION] >= 0 &&
+      (batch->flags[i] & LOCATION_HAS_COORDINATES))
+    size += EWKB_POINT_SIZE;
+  size += (role[ROLE_AIRPORT] >= 0) + (role[ROLE_PORT] >= 0) +
+          (role[ROLE_TRAIN] >= 0);
+  return size;
+}
+
+// Reserves for the point and every code, the unused end is given back
+static void schema_encode_binary_row(CopyBuffer *buffer, const Batch *batch,
+                                     int i) {
+  const Schema *schema = batch->schema;
+  size_t bound = 2 + 4 * (size_t)schema->num_columns + EWKB_POINT_SIZE + 3 +
+                 batch_key(batch, i).len + batch_country(batch, i).len +
+                 batch_name(batch, i).len + batch_carried(batch, i).len;
+  char *row = copy_buffer_reserve(buffer, bound);
+  const char *cursor = batch_carried(batch, i).ptr;
+  char *p = put_int16(row, (int16_t)schema->num_columns);
+  for (int c = 0; c < schema->num_encoders; c++)
+    p = binary_encoders[schema->encoders[c]](p, batch, i, &cursor);
+  buffer->len -= bound - (size_t)(p - row);
+}
+
+size_t copy_binary_row_size(const Batch *batch, int i) {
+  if (batch->schema)
+    return schema_binary_row_size(batch->schema, batch, i);
+  size_t point_size =
+      batch->flags[i] & LOCATION_HAS_COORDINATES ? EWKB_POINT_SIZE : 0;
+  size_t op_size = batch->delta ? 4 + 1 + 4 + 8 : 0;
+  return 2 + COPY_COLUMNS * 4 + op_size + batch_key(batch, i).len +
+         batch_name(batch, i).len + batch_country(batch, i).len + point_size +
+         3;
+}
+
+void copy_encode_binary_row(CopyBuffer *buffer, const Batch *batch, int i) {
+  if (batch->schema) {
+    schema_encode_binary_row(buffer, batch, i);
+    return;
+  }
+  FieldView key = batch_key(batch, i);
+  FieldView country = batch_country(batch, i);
+  FieldView name = batch_name(batch, i);
+  uint8_t flags = batch->flags[i];
+
+  char *p = copy_buffer_reserve(buffer, copy_binary_row_size(batch, i));
+  p = put_int16(p, COPY_COLUMNS + 2 * batch->delta);
+  p = put_field(p, key.ptr, key.len);
+  p = put_field(p, name.ptr, name.len);
+  p = put_field(p, country.ptr, country.len);
+  if (flags & LOCATION_HAS_COORDINATES)
+    p = put_ewkb_point(p, batch->longitude[i], batch->latitude[i]);
+  else
+    p = put_int32(p, -1); // NULL
+  p = put_bool(p, flags & LOCATION_AIRPORT);
+  p = put_bool(p, flags & LOCATION_PORT);
+  p = put_bool(p, flags & LOCATION_TRAIN_STATION);
+  // The merge keeps the last operation on a row by its input position
+  if (batch->delta) {
+    char op = batch_row_op(batch, i);
+    p = put_field(p, &op, 1);
+    p = put_int32(p, 8);
+    put_int64(p, batch->origin[i]);
+  }
+}
+
+void copy_encode_binary_trailer(CopyBuffer *buffer) {
+  put_int16(copy_buffer_reserve(buffer, 2), -1);
+}
+
+typedef char *(*CsvEncoder)(char *p, const Batch *batch, int i,
+                            const char **cursor);
+
+// Fields are written unquoted unless they hold a separator, quote or newline
+static char *csv_text(char *p, const char *value, size_t len) {
+  bool quote = false;
+  for (size_t k = 0; k < len && !quote; k++)
+    quote = value[k] == '"' || value[k] == ',' || value[k] == '\n' ||
+            value[k] == '\r';
+  if (!quote) {
+    memcpy(p, value, len);
+    return p + len;
+  }
+  *p++ = '"';
+  for (size_t k = 0; k < len; k++) {
+    if (value[k] == '"')
+      *p++ = '"';
+    *p++ = value[k];
+  }
+  *p++ = '"';
+  return p;
+}
+
+// Escaped like the hand written rows, names cut at the same length
+static char *csv_escaped(char *p, FieldView field) {
+  char buffer[1024];
+  escape_csv_field(field, buffer, sizeof(buffer));
+  size_t len = strlen(buffer);
+  memcpy(p, buffer, len);
+  return p + len;
+}
+
+static char *csv_key(char *p, const Batch *batch, int i,
+                     const char **cursor) {
+  (void)cursor;
+  // Never cut, an empty key is an empty string like in the hand written rows
+  FieldView key = batch_key(batch, i);
+  if (key.len == 0)
+    return csv_escaped(p, key);
+  return csv_text(p, key.ptr, key.len);
+}
+
+static char *csv_name(char *p, const Batch *batch, int i,
+                      const char **cursor) {
+  (void)cursor;
+  return csv_escaped(p, batch_name(batch, i));
+}
+
+static char *csv_country(char *p, const Batch *batch, int i,
+                         const char **cursor) {
+  (void)cursor;
+  FieldView country = batch_country(batch, i);
+  return csv_text(p, country.ptr, country.len);
+}
+
+static char *csv_point(char *p, const Batch *batch, int i,
+                       const char **cursor) {
+  (void)cursor;
+  if (!(batch->flags[i] & LOCATION_HAS_COORDINATES))
+    return p;
+  return p + sprintf(p, "\"SRID=4326;POINT(%f %f)\"", batch->longitude[i],
+                     batch->latitude[i]);
+}
+
+static char *csv_bool(char *p, bool value) {
+  *p = value ? 't' : 'f';
+  return p + 1;
+}
+
+static char *csv_airport(char *p, const Batch *batch, int i,
+                         const char **cursor) {
+  (void)cursor;
+  return csv_bool(p, batch->flags[i] & LOCATION_AIRPORT);
+}
+
+static char *csv_port(char *p, const Batch *batch, int i,
+                      const char **cursor) {
+  (void)cursor;
+  return csv_bool(p, batch->flags[i] & LOCATION_PORT);
+}
+
+static char *csv_train(char *p, const Batch *batch, int i,
+                       const char **cursor) {
+  (void)cursor;
+  return csv_bool(p, batch->flags[i] & LOCATION_TRAIN_STATION);
+}
+
+static char *csv_flags(char *p, const Batch *batch, int i,
+                       const char **cursor) {
+  (void)cursor;
+  uint8_t flags = batch->flags[i];
+  p = csv_bool(p, flags & LOCATION_AIRPORT);
+  *p++ = ',';
+  p = csv_bool(p, flags & LOCATION_PORT);
+  *p++ = ',';
+  return csv_bool(p, flags & LOCATION_TRAIN_STATION);
+}
+
+// Value of the next carried field, NULL for a NULL one. An empty unquoted
+// CSV field is NULL too
+static const char *next_carried(const char **cursor, int32_t *len) {
+  *len = get_int32(*cursor);
+  const char *value = *cursor + 4;
+  *cursor = value + (*len > 0 ? *len : 0);
+  return *len < 0 ? NULL : value;
+}
+
+static inline uint64_t get_uint64(const char *p) {
+  uint64_t value = 0;
+  for (int k = 0; k < 8; k++)
+    value = value << 8 | (unsigned char)p[k];
+  return value;
+}
+
+static char *csv_carried_text(char *p, const Batch *batch, int i,
+                              const char **cursor) {
+  (void)batch;
+  (void)i;
+  int32_t len;
+  const char *value = next_carried(cursor, &len);
+  if (value == NULL)
+    return p;
+  // An empty string is not NULL
+  if (len == 0) {
+    memcpy(p, "\"\"", 2);
+    return p + 2;
+  }
+  return csv_text(p, value, (size_t)len);
+}
+
+static char *csv_carried_int4(char *p, const Batch *batch, int i,
+                              const char **cursor) {
+  (void)batch;
+  (void)i;
+  int32_t len;
+  const char *value = next_carried(cursor, &len);
+  if (value == NULL)
+    return p;
+  return p + sprintf(p, "%d", (int)get_int32(value));
+}
+
+static char *csv_carried_int8(char *p, const Batch *batch, int i,
+                              const char **cursor) {
+  (void)batch;
+  (void)i;
+  int32_t len;
+  const char *value = next_carried(cursor, &len);
+  if (value == NULL)
+    return p;
+  return p + sprintf(p, "%lld", (long long)(int64_t)get_uint64(value));
+}
+
+static char *csv_carried_float8(char *p, const Batch *batch, int i,
+                                const char **cursor) {
+  (void)batch;
+  (void)i;
+  int32_t len;
+  const char *value = next_carried(cursor, &len);
+  if (value == NULL)
+    return p;
+  uint64_t bits = get_uint64(value);
+  double number;
+  memcpy(&number, &bits, sizeof(number));
+  return p + sprintf(p, "%.17g", number);
+}
+
+static char *csv_carried_bool(char *p, const Batch *batch, int i,
+                              const char **cursor) {
+  (void)batch;
+  (void)i;
+  int32_t len;
+  const char *value = next_carried(cursor, &len);
+  if (value == NULL)
+    return p;
+  return csv_bool(p, *value != 0);
+}
+
+static const CsvEncoder csv_encoders[ENCODE_COUNT] = {
+    [ENCODE_KEY] = csv_key,           [ENCODE_NAME] = csv_name,
+    [ENCODE_COUNTRY] = csv_country,   [ENCODE_POINT] = csv_point,
+    [ENCODE_AIRPORT] = csv_airport,   [ENCODE_PORT] = csv_port,
+    [ENCODE_TRAIN] = csv_train,       [ENCODE_TEXT] = csv_carried_text,
+    [ENCODE_INT4] = csv_carried_int4, [ENCODE_INT8] = csv_carried_int8,
+    [ENCODE_FLOAT8] = csv_carried_float8, [ENCODE_BOOL] = csv_carried_bool,
+    [ENCODE_FLAGS] = csv_flags,
+};
+
+static void schema_encode_csv_row(CopyBuffer *buffer, const Batch *batch,
+                                  int i) {
+  const Schema *schema = batch->schema;
+  // Quoting at most doubles a text value, numbers and the point stay under
+  // 48 bytes and the name under its 1024 byte buffer
+  size_t bound = 2 * (batch_carried(batch, i).len + batch_key(batch, i).len +
+                      batch_country(batch, i).len) +
+                 1024 + 48 * (size_t)schema->num_columns + 64;
+  char *line = copy_buffer_reserve(buffer, bound);
+  char *p = line;
+  const char *cursor = batch_carried(batch, i).ptr;
+  for (int c = 0; c < schema->num_encoders; c++) {
+    if (c > 0)
+      *p++ = ',';
+    p = csv_encoders[schema->encoders[c]](p, batch, i, &cursor);
+  }
+  *p++ = '\n';
+  buffer->len -= bound - (size_t)(p - line);
+}
+
+void copy_encode_csv_row(CopyBuffer *buffer, const Batch *batch, int i) {
+  if (batch->schema) {
+    schema_encode_csv_row(buffer, batch, i);
+    return;
+  }
+  char name_buffer[1024];
+  char unlocode_buffer[32];
+  char point_buffer[64] = ""; // an empty unquoted field is NULL
+  uint8_t flags = batch->flags[i];
+  char *line = copy_buffer_reserve(buffer, COPY_CSV_LINE_MAX);
+
+  // Format the point in PostGIS format, longitude first
+  if (flags & LOCATION_HAS_COORDINATES)
+    snprintf(point_buffer, sizeof(point_buffer),
+             "\"SRID=4326;POINT(%f %f)\"", batch->longitude[i],
+             batch->latitude[i]);
+
+  int n = snprintf(
+      line, COPY_CSV_LINE_MAX, "%s,%s,%.*s,%s,%s,%s,%s\n",
+      escape_csv_field(batch_key(batch, i), unlocode_buffer,
+                       sizeof(unlocode_buffer)),
+      escape_csv_field(batch_name(batch, i), name_buffer, sizeof(name_buffer)),
+      (int)batch_country(batch, i).len, batch_country(batch, i).ptr,
+      point_buffer,
+      (flags & LOCATION_AIRPORT) ? "t" : "f",
+      (flags & LOCATION_PORT) ? "t" : "f",
+      (flags & LOCATION_TRAIN_STATION) ? "t" : "f");
+  if (n < 0)
+    n = 0;
+  else if (n >= COPY_CSV_LINE_MAX - COPY_CSV_DELTA_MAX)
+    n = COPY_CSV_LINE_MAX - COPY_CSV_DELTA_MAX - 1;
+  // The operation and the input position go last, in place of the newline
+  if (batch->delta && n > 0)
+    n += snprintf(line + n - 1, COPY_CSV_DELTA_MAX, ",%c,%llu\n",
+                  batch_row_op(batch, i),
+                  (unsigned long long)batch->origin[i]) -
+         1;
+  buffer->len -= COPY_CSV_LINE_MAX - n;
+}
+
+int copy_encode_batch(CopyBuffer *buffer, CopyFormat format,
+                      const Batch *batch) {
+  int rows = 0;
+  buffer->len = 0;
+  if (format == COPY_FORMAT_BINARY)
+    copy_encode_binary_header(buffer);
+
+  for (int i = 0; i < batch->count; i++) {
+    if (!batch_row_is_valid(batch, i))
+      continue;
+    if (format == COPY_FORMAT_BINARY)
+      copy_encode_binary_row(buffer, batch, i);
+    else
+      copy_encode_csv_row(buffer, batch, i);
+    rows++;
+  }
+
+  if (format == COPY_FORMAT_BINARY)
+    copy_encode_binary_trailer(buffer);
+  return rows;
+}
+
+bool copy_parse_format(const char *name, CopyFormat *format) {
+  if (strcmp(name, "csv") == 0) {
+    *format = COPY_FORMAT_CSV;
+    return true;
+  }
+  if (strcmp(name, "binary") == 0) {
+    *format = COPY_FORMAT_BINARY;
+    return true;
+  }
+  return false;
+}
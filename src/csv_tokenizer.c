@@ -0,0 +1,300 @@
+#include "csv_tokenizer.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CSV_HAVE_X86 1
+#endif
+
+// Words classified per pass, 64 bytes each
+#define CSV_WORDS_PER_PASS 256
+
+// Stage one: one bit per input byte for commas, quotes and newlines
+typedef void (*ClassifyFn)(const char *p, size_t words, uint64_t *comma,
+                           uint64_t *quote, uint64_t *newline);
+
+static void classify_scalar(const char *p, size_t words, uint64_t *comma,
+                            uint64_t *quote, uint64_t *newline) {
+  for (size_t w = 0; w < words; w++, p += 64) {
+    uint64_t c = 0, q = 0, n = 0;
+    for (int i = 0; i < 64; i++) {
+      uint64_t bit = 1ULL << i;
+      c |= p[i] == ',' ? bit : 0;
+      q |= p[i] == '"' ? bit : 0;
+      n |= p[i] == '\n' ? bit : 0;
+    }
+    comma[w] = c;
+    quote[w] = q;
+    newline[w] = n;
+  }
+}
+
+#ifdef CSV_HAVE_X86
+static void classify_sse2(const char *p, size_t words, uint64_t *comma,
+                          uint64_t *quote, uint64_t *newline) {
+  const __m128i commas = _mm_set1_epi8(',');
+  const __m128i quotes = _mm_set1_epi8('"');
+  const __m128i newlines = _mm_set1_epi8('\n');
+
+  for (size_t w = 0; w < words; w++, p += 64) {
+    uint64_t c = 0, q = 0, n = 0;
+    for (int i = 0; i < 4; i++) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(p + i * 16));
+      c |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, commas))
+           << (i * 16);
+      q |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, quotes))
+           << (i * 16);
+      n |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, newlines))
+           << (i * 16);
+    }
+    comma[w] = c;
+    quote[w] = q;
+    newline[w] = n;
+  }
+}
+
+__attribute__((target("avx2"))) static void
+classify_avx2(const char *p, size_t words, uint64_t *comma, uint64_t *quote,
+              uint64_t *newline) {
+  const __m256i commas = _mm256_set1_epi8(',');
+  const __m256i quotes = _mm256_set1_epi8('"');
+  const __m256i newlines = _mm256_set1_epi8('\n');
+
+  for (size_t w = 0; w < words; w++, p += 64) {
+    __m256i lo = _mm256_loadu_si256((const __m256i *)p);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(p + 32));
+    comma[w] =
+        (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, commas)) |
+        (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, commas))
+            << 32;
+    quote[w] =
+        (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, quotes)) |
+        (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, quotes))
+            << 32;
+    newline[w] = (uint32_t)_mm256_movemask_epi8(
+                     _mm256_cmpeq_epi8(lo, newlines)) |
+                 (uint64_t)(uint32_t)_mm256_movemask_epi8(
+                     _mm256_cmpeq_epi8(hi, newlines))
+                     << 32;
+  }
+}
+#endif
+
+static CsvKernel active_kernel = CSV_KERNEL_SCALAR;
+static ClassifyFn classify = classify_scalar;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+static bool apply_kernel(CsvKernel kernel) {
+  switch (kernel) {
+  case CSV_KERNEL_SCALAR:
+    classify = classify_scalar;
+    break;
+#ifdef CSV_HAVE_X86
+  case CSV_KERNEL_SSE2:
+    classify = classify_sse2;
+    break;
+  case CSV_KERNEL_AVX2:
+    __builtin_cpu_init();
+    if (!__builtin_cpu_supports("avx2"))
+      return false;
+    classify = classify_avx2;
+    break;
+#endif
+  default:
+    return false;
+  }
+  active_kernel = kernel;
+  return true;
+}
+
+static void detect_kernel(void) {
+#ifdef CSV_HAVE_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && apply_kernel(CSV_KERNEL_AVX2))
+    return;
+  if (__builtin_cpu_supports("sse2") && apply_kernel(CSV_KERNEL_SSE2))
+    return;
+#endif
+  apply_kernel(CSV_KERNEL_SCALAR);
+}
+
+CsvKernel csv_active_kernel(void) {
+  pthread_once(&kernel_once, detect_kernel);
+  return active_kernel;
+}
+
+bool csv_set_kernel(CsvKernel kernel) {
+  pthread_once(&kernel_once, detect_kernel);
+  return apply_kernel(kernel);
+}
+
+const char *csv_kernel_name(CsvKernel kernel) {
+  switch (kernel) {
+  case CSV_KERNEL_SSE2:
+    return "sse2";
+  case CSV_KERNEL_AVX2:
+    return "avx2";
+  default:
+    return "scalar";
+  }
+}
+
+void csv_index_init(CsvIndex *index) {
+  index->seps = NULL;
+  index->count = 0;
+  index->capacity = 0;
+}
+
+void csv_index_free(CsvIndex *index) {
+  free(index->seps);
+  csv_index_init(index);
+}
+
+static void csv_index_reserve(CsvIndex *index, size_t extra) {
+  if (index->count + extra <= index->capacity)
+    return;
+  size_t capacity = index->capacity ? index->capacity * 2 : 4096;
+  while (capacity < index->count + extra)
+    capacity *= 2;
+  index->seps = realloc(index->seps, capacity * sizeof(uint32_t));
+  index->capacity = capacity;
+}
+
+// Bit i is set when an odd number of quotes precede or sit at position i,
+// i.e. the byte is inside a quoted field
+static inline uint64_t prefix_xor(uint64_t x) {
+  x ^= x << 1;
+  x ^= x << 2;
+  x ^= x << 4;
+  x ^= x << 8;
+  x ^= x << 16;
+  x ^= x << 32;
+  return x;
+}
+
+size_t csv_index_block(CsvIndex *index, const char *data, size_t len,
+                       bool at_end) {
+  uint64_t comma[CSV_WORDS_PER_PASS];
+  uint64_t quote[CSV_WORDS_PER_PASS];
+  uint64_t newline[CSV_WORDS_PER_PASS];
+
+  pthread_once(&kernel_once, detect_kernel);
+  index->count = 0;
+
+  uint64_t in_quotes = 0; // all ones while a quoted field spans words
+  size_t record_end = 0;  // bytes consumed by complete records
+  size_t record_seps = 0; // separators of complete records
+
+  size_t full_words = len / 64;
+  size_t total_words = (len + 63) / 64;
+
+  for (size_t first = 0; first < total_words; first += CSV_WORDS_PER_PASS) {
+    size_t words = total_words - first;
+    if (words > CSV_WORDS_PER_PASS)
+      words = CSV_WORDS_PER_PASS;
+
+    // Stage one: vectorized classification, the tail goes through a padded
+    // copy so the kernels never read past the block
+    size_t simd_words = full_words > first ? full_words - first : 0;
+    if (simd_words > words)
+      simd_words = words;
+    classify(data + first * 64, simd_words, comma, quote, newline);
+    if (simd_words < words) {
+      char tail[64] = {0};
+      size_t offset = (first + simd_words) * 64;
+      memcpy(tail, data + offset, len - offset);
+      classify_scalar(tail, 1, &comma[simd_words], &quote[simd_words],
+                      &newline[simd_words]);
+    }
+
+    // Stage two: mask out separators inside quotes and record their offsets
+    for (size_t w = 0; w < words; w++) {
+      uint64_t inside = prefix_xor(quote[w]) ^ in_quotes;
+      in_quotes = (uint64_t)((int64_t)inside >> 63);
+      uint64_t structural = (comma[w] | newline[w]) & ~inside;
+
+      csv_index_reserve(index, __builtin_popcountll(structural) + 1);
+      uint32_t base = (uint32_t)((first + w) * 64);
+      while (structural) {
+        int bit = __builtin_ctzll(structural);
+        uint32_t entry = base + bit;
+        if ((newline[w] >> bit) & 1) {
+          entry |= CSV_RECORD_END;
+          record_end = base + bit + 1;
+          record_seps = index->count + 1;
+        }
+        index->seps[index->count++] = entry;
+        structural &= structural - 1;
+      }
+    }
+  }
+
+  // An unterminated last record ends at the end of the input
+  if (at_end && record_end < len) {
+    csv_index_reserve(index, 1);
+    index->seps[index->count++] = (uint32_t)len | CSV_RECORD_END;
+    record_end = len;
+    record_seps = index->count;
+  }
+
+  index->count = record_seps;
+  return record_end;
+}
+
+size_t csv_next_record(const CsvIndex *index, const char *data, size_t *cursor,
+                       FieldView *fields, size_t max_fields) {
+  size_t i = *cursor;
+  if (i >= index->count)
+    return 0;
+
+  size_t start = i == 0 ? 0 : (index->seps[i - 1] & ~CSV_RECORD_END) + 1;
+  size_t count = 0;
+
+  while (i < index->count) {
+    uint32_t entry = index->seps[i++];
+    size_t end = entry & ~CSV_RECORD_END;
+
+    if (entry & CSV_RECORD_END) {
+      if (end > start && data[end - 1] == '\r')
+        end--;
+    }
+    if (count < max_fields) {
+      fields[count].ptr = data + start;
+      fields[count].len = end - start;
+      count++;
+    }
+    start = (entry & ~CSV_RECORD_END) + 1;
+
+    if (entry & CSV_RECORD_END)
+      break;
+  }
+
+  *cursor = i;
+  return count;
+}
+
+size_t csv_split_record(const char *line, size_t len, FieldView *fields,
+                        size_t max_fields) {
+  size_t count = 0;
+  size_t start = 0;
+  bool in_quotes = false;
+
+  for (size_t i = 0; i <= len; i++) {
+    if (i < len) {
+      char c = line[i];
+      if (c == '"')
+        in_quotes = !in_quotes;
+      if (in_quotes || c != ',')
+        continue;
+    }
+    if (count < max_fields) {
+      fields[count].ptr = line + start;
+      fields[count].len = i - start;
+      count++;
+    }
+    start = i + 1;
+  }
+  return count;
+}
@@ -1,25 +1,15 @@
 #include "db_query.h"
 #include <libpq-fe.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 
 
 // Create the PostGIS table
-void create_table(PGconn *conn) {
+void create_table(PGconn *conn, const Schema *schema) {
   PGresult *res;
-  const char *query = "CREATE TABLE IF NOT EXISTS locations (\
-    id SERIAL PRIMARY KEY,\
-    unlocode VARCHAR(10) NOT NULL,\
-    name TEXT NOT NULL, \
-    country_code CHAR(2) NOT NULL, \
-    location GEOGRAPHY(POINT, 4326),\
-    is_airport BOOLEAN DEFAULT FALSE,\
-    is_port BOOLEAN DEFAULT FALSE,\
-    is_train_station BOOLEAN DEFAULT FALSE,\
-    created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP\
-    );";
-
-  res = PQexec(conn, query);
+
+  res = PQexec(conn, schema->sql.create_table);
   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
     fprintf(stderr, "Table creation failed: %s", PQerrorMessage(conn));
     PQclear(res);
@@ -27,8 +17,7 @@ void create_table(PGconn *conn) {
   }
   PQclear(res);
 
-  res = PQexec(conn, "CREATE UNIQUE INDEX locations_unlocode_name_idx ON "
-                     "locations (unlocode, MD5(name)) WHERE name IS NOT NULL;");
+  res = PQexec(conn, schema->sql.unique_index);
   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
     fprintf(stderr, "Table creation failed: %s", PQerrorMessage(conn));
     PQclear(res);
@@ -37,121 +26,378 @@ void create_table(PGconn *conn) {
   PQclear(res);
 }
 
+// Delta loads stage the operation of every row and its position in the
+// input as extra columns
+#define DELTA_STAGING_TABLE_DDL                                                \
+  "CREATE TEMP TABLE IF NOT EXISTS staging_locations ("                       \
+  "unlocode VARCHAR(10), name TEXT, country_code CHAR(2), "                    \
+  "location GEOGRAPHY(POINT, 4326), is_airport BOOLEAN, is_port BOOLEAN, "     \
+  "is_train_station BOOLEAN, op CHAR(1), seq BIGINT)"
 
-bool batch_insert_locations(PGconn *conn, ProcessedLocation *locations,
-                            int count) {
-  PGresult *res;
-  res = PQexec(conn, "BEGIN");
+// One statement applies a delta batch, a statement cannot touch a row twice
+// so only the last operation on every name counts. D deletes the name, R
+// every other name of the code but those upserted after it, and an upsert
+// followed by a rename of its code is dropped. Upserts only rewrite rows
+// whose values differ and return xmax = 0 for the inserted ones
+#define DELTA_MERGE_QUERY                                                      \
+  "WITH last AS (SELECT DISTINCT ON (unlocode, MD5(name)) * "                  \
+  "FROM staging_locations ORDER BY unlocode, MD5(name), seq DESC), "           \
+  "renamed AS (SELECT DISTINCT ON (unlocode) unlocode, seq FROM last "         \
+  "WHERE op = 'R' ORDER BY unlocode, seq DESC), "                              \
+  "live AS (SELECT * FROM last u WHERE u.op <> 'D' AND NOT EXISTS ("           \
+  "SELECT 1 FROM renamed r WHERE r.unlocode = u.unlocode AND "                 \
+  "r.seq > u.seq)), "                                                          \
+  "deleted AS (DELETE FROM locations l USING last s "                          \
+  "WHERE l.unlocode = s.unlocode AND "                                         \
+  "((s.op = 'D' AND MD5(l.name) = MD5(s.name)) OR "                            \
+  "(s.op = 'R' AND MD5(l.name) <> MD5(s.name))) AND NOT EXISTS ("              \
+  "SELECT 1 FROM live u WHERE "                                                \
+  "u.unlocode = l.unlocode AND MD5(u.name) = MD5(l.name)) "                    \
+  "RETURNING 1), "                                                             \
+  "upserted AS (INSERT INTO locations(unlocode, name, country_code, "          \
+  "location, is_airport, is_port, is_train_station) "                          \
+  "SELECT unlocode, name, country_code, "                                      \
+  "location, is_airport, is_port, is_train_station FROM live "                 \
+  "ON CONFLICT (unlocode, MD5(name)) WHERE name IS NOT NULL DO UPDATE SET "    \
+  "country_code = EXCLUDED.country_code, location = EXCLUDED.location, "       \
+  "is_airport = EXCLUDED.is_airport, is_port = EXCLUDED.is_port, "             \
+  "is_train_station = EXCLUDED.is_train_station "                              \
+  "WHERE (locations.country_code, ST_AsBinary(locations.location), "           \
+  "locations.is_airport, locations.is_port, locations.is_train_station) "      \
+  "IS DISTINCT FROM (EXCLUDED.country_code, ST_AsBinary(EXCLUDED.location), "  \
+  "EXCLUDED.is_airport, EXCLUDED.is_port, EXCLUDED.is_train_station) "         \
+  "RETURNING xmax = 0 AS inserted) "                                           \
+  "SELECT (SELECT count(*) FROM upserted WHERE inserted), "                    \
+  "(SELECT count(*) FROM upserted WHERE NOT inserted), "                       \
+  "(SELECT count(*) FROM deleted)"
+
+static bool exec_command(PGconn *conn, const char *query, const char *what) {
+  PGresult *res = PQexec(conn, query);
+  ExecStatusType status = PQresultStatus(res);
+  if (status != PGRES_COMMAND_OK && status != PGRES_TUPLES_OK) {
+    fprintf(stderr, "%s failed: %s", what, PQerrorMessage(conn));
+    PQclear(res);
+    return false;
+  }
+  PQclear(res);
+  return true;
+}
+
+bool bulk_prepare(PGconn *conn, const Schema *schema) {
+  PGresult *res = PQexec(conn, schema->sql.bulk_check);
+  if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+    fprintf(stderr, "Bulk check failed: %s", PQerrorMessage(conn));
+    PQclear(res);
+    return false;
+  }
+  bool loaded = strcmp(PQgetvalue(res, 0, 0), "t") == 0;
+  PQclear(res);
+  if (loaded) {
+    fprintf(stderr, "--bulk needs an empty %s table\n", schema->table);
+    return false;
+  }
+
+  return exec_command(conn, schema->sql.bulk_unlogged, "Bulk setup");
+}
+
+bool bulk_finish(PGconn *conn, const Schema *schema, int workers,
+                 BulkTimings *timings) {
+  memset(timings, 0, sizeof(BulkTimings));
+
+  double start = get_time();
+  PGresult *res = PQexec(conn, schema->sql.bulk_dedup);
+  if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+    fprintf(stderr, "Bulk dedup failed: %s", PQerrorMessage(conn));
+    PQclear(res);
+    return false;
+  }
+  timings->duplicates = atol(PQcmdTuples(res));
+  PQclear(res);
+  double dedup_end = get_time();
+  timings->dedup = dedup_end - start;
+
+  char settings[160];
+  snprintf(settings, sizeof(settings),
+           "SET max_parallel_maintenance_workers = %d; "
+           "SET maintenance_work_mem = '" BULK_MAINTENANCE_MEMORY "'",
+           workers);
+  if (!exec_command(conn, settings, "Bulk index settings") ||
+      !exec_command(conn, schema->sql.unique_index, "Bulk index build"))
+    return false;
+  double index_end = get_time();
+  timings->index = index_end - dedup_end;
+
+  // Writes the whole table to the WAL once instead of row by row
+  if (!exec_command(conn, schema->sql.bulk_logged, "Bulk SET LOGGED"))
+    return false;
+  timings->logged = get_time() - index_end;
+  return true;
+}
+
+bool writer_session_open(WriterSession *session, const char *conninfo,
+                         const Schema *schema, CopyFormat copy_format,
+                         StagingMode staging, const Checkpoint *checkpoint,
+                         bool delta) {
+  session->conn = PQconnectdb(conninfo);
+  session->schema = schema;
+  session->copy_format = copy_format;
+  session->staging = staging;
+  session->checkpoint = checkpoint;
+  session->delta = delta;
+  copy_buffer_init(&session->buffer);
+
+  if (PQstatus(session->conn) != CONNECTION_OK) {
+    fprintf(stderr, "Connection failed: %s", PQerrorMessage(session->conn));
+    return false;
+  }
+
+  if (staging != STAGING_PERSISTENT)
+    return true;
+
+  // Created once per connection, the merge is planned once as well
+  PGresult *res = PQexec(session->conn, delta ? DELTA_STAGING_TABLE_DDL
+                                               : schema->sql.staging);
   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-    fprintf(stderr, "BEGIN failed: %s", PQerrorMessage(conn));
+    fprintf(stderr, "Create staging table failed: %s",
+            PQerrorMessage(session->conn));
     PQclear(res);
     return false;
   }
   PQclear(res);
 
-  res = PQexec(conn, "CREATE TEMP TABLE temp_locations (LIKE locations "
-                     "INCLUDING ALL) ON COMMIT DROP;");
+  if (delta)
+    res = PQprepare(session->conn, MERGE_STATEMENT, DELTA_MERGE_QUERY, 0, NULL);
+  else
+    res = checkpoint ? PQprepare(session->conn, MERGE_STATEMENT,
+                                 schema->sql.merge_progress, PROGRESS_PARAMS,
+                                 NULL)
+                     : PQprepare(session->conn, MERGE_STATEMENT,
+                                 schema->sql.merge, 0, NULL);
   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-    fprintf(stderr, "Create temp table failed: %s", PQerrorMessage(conn));
+    fprintf(stderr, "Prepare merge failed: %s", PQerrorMessage(session->conn));
     PQclear(res);
-    PQexec(conn, "ROLLBACK");
     return false;
   }
   PQclear(res);
+  return true;
+}
+
+void writer_session_close(WriterSession *session) {
+  copy_buffer_free(&session->buffer);
+  PQfinish(session->conn);
+  session->conn = NULL;
+}
+
+int merge_params(const WriterSession *session, const Batch *batch,
+                 ProgressParams *params) {
+  if (session->checkpoint == NULL)
+    return 0;
+  checkpoint_params(session->checkpoint, batch, params);
+  return PROGRESS_PARAMS;
+}
+
+bool merge_result(const WriterSession *session, PGresult *res,
+                  MergeCounts *counts) {
+  memset(counts, 0, sizeof(MergeCounts));
+  if (!session->delta) {
+    if (PQresultStatus(res) != PGRES_COMMAND_OK)
+      return false;
+    counts->inserted = atol(PQcmdTuples(res));
+    return true;
+  }
+  if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) != 1)
+    return false;
+  counts->inserted = atol(PQgetvalue(res, 0, 0));
+  counts->updated = atol(PQgetvalue(res, 0, 1));
+  counts->deleted = atol(PQgetvalue(res, 0, 2));
+  return true;
+}
+
+bool staging_parse_mode(const char *name, StagingMode *mode) {
+  if (strcmp(name, "temp") == 0) {
+    *mode = STAGING_TEMP;
+    return true;
+  }
+  if (strcmp(name, "persistent") == 0) {
+    *mode = STAGING_PERSISTENT;
+    return true;
+  }
+  return false;
+}
+
+// Keep the server message of a failed batch step for the writer
+static void batch_failed(WriterSession *session, const char *what) {
+  snprintf(session->error, sizeof(session->error), "%s",
+           PQerrorMessage(session->conn));
+  if (!session->quiet)
+    fprintf(stderr, "%s failed: %s", what, session->error);
+}
+
+// Send the buffered COPY data, on failure the COPY and transaction are aborted
+static bool flush_copy_buffer(WriterSession *session, CopyBuffer *buffer) {
+  PGconn *conn = session->conn;
+  if (buffer->len == 0)
+    return true;
+
+  if (PQputCopyData(conn, buffer->data, (int)buffer->len) != 1) {
+    batch_failed(session, "Put copy data");
+    PQputCopyEnd(conn, "Error while copying data");
+    PQclear(PQgetResult(conn));
+    PQclear(PQexec(conn, "ROLLBACK"));
+    return false;
+  }
+  buffer->len = 0;
+  return true;
+}
+
+bool batch_insert_locations(WriterSession *session, const Batch *batch,
+                            InsertTimings *timings) {
+  PGconn *conn = session->conn;
+  CopyBuffer *buffer = &session->buffer;
+  CopyFormat format = session->copy_format;
+  bool persistent = session->staging == STAGING_PERSISTENT;
+  bool direct = session->staging == STAGING_NONE;
+  const SchemaSql *sql = &session->schema->sql;
+  double start = get_time();
+  PGresult *res;
+
+  if (persistent) {
+    // One round trip, the staging table is emptied inside the transaction
+    res = PQexec(conn, "BEGIN; TRUNCATE staging_locations");
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      batch_failed(session, "BEGIN");
+      PQclear(res);
+      PQclear(PQexec(conn, "ROLLBACK"));
+      return false;
+    }
+    PQclear(res);
+  } else {
+    res = PQexec(conn, "BEGIN");
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      batch_failed(session, "BEGIN");
+      PQclear(res);
+      return false;
+    }
+    PQclear(res);
+  }
+  if (session->staging == STAGING_TEMP) {
+    res = PQexec(conn, sql->temp_staging);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      batch_failed(session, "Create temp table");
+      PQclear(res);
+      PQclear(PQexec(conn, "ROLLBACK"));
+      return false;
+    }
+    PQclear(res);
+  }
+  double setup_end = get_time();
 
   // Start COPY operation
-  const char *copy_cmd =
-      "COPY temp_locations(unlocode, name, country_code, location, is_airport, "
-      "is_port, is_train_station) FROM STDIN WITH (FORMAT csv)";
+  const char *copy_cmd = persistent ? sql->copy_staging[format]
+                         : direct   ? sql->copy_table[format]
+                                    : sql->copy_temp[format];
   res = PQexec(conn, copy_cmd);
   if (PQresultStatus(res) != PGRES_COPY_IN) {
-    fprintf(stderr, "COPY command failed: %s", PQerrorMessage(conn));
+    batch_failed(session, "COPY command");
     PQclear(res);
-    PQexec(conn, "ROLLBACK");
+    PQclear(PQexec(conn, "ROLLBACK"));
     return false;
   }
   PQclear(res);
 
-  // Buffer for forming CSV lines
-  char line[4096];
-  char name_buffer[1024];
-  char unlocode_buffer[32];
+  // Rows are encoded into the send buffer and sent in large chunks, the
+  // encode time is what the loop spends outside the flushes
+  double encode_start = get_time();
+  double send_time = 0;
+  int rows_sent = 0;
+  buffer->len = 0;
+  if (format == COPY_FORMAT_BINARY)
+    copy_encode_binary_header(buffer);
 
-  // Write each location as a CSV line
-  for (int i = 0; i < count; i++) {
-    // Skip records with empty names
-    if (strlen(locations[i].name) == 0) {
+  for (int i = 0; i < batch->count; i++) {
+    if (!batch_row_is_valid(batch, i)) {
       continue;
     }
 
-    // Validate coordinates
-    if (locations[i].longitude < -180 || locations[i].longitude > 180 ||
-        locations[i].latitude < -90 || locations[i].latitude > 90) {
-      // Skip invalid coordinates or set to default
-      continue;
+    if (format == COPY_FORMAT_BINARY) {
+      copy_encode_binary_row(buffer, batch, i);
+    } else {
+      copy_encode_csv_row(buffer, batch, i);
     }
-    // Format the point in PostGIS format
-    snprintf(
-        line, sizeof(line), "%s,%s,%s,\"SRID=4326;POINT(%f %f)\",%s,%s,%s\n",
-        escape_csv_field(locations[i].unlocode, unlocode_buffer,
-                         sizeof(unlocode_buffer)),
-        escape_csv_field(locations[i].name, name_buffer, sizeof(name_buffer)),
-        locations[i].country_code,
-        locations[i].longitude, // PostGIS expects longitude first
-        locations[i].latitude, locations[i].is_airport ? "t" : "f",
-        locations[i].is_port ? "t" : "f",
-        locations[i].is_train_station ? "t" : "f");
-
-    // Send the line to PostgreSQL
-    if (PQputCopyData(conn, line, strlen(line)) != 1) {
-      fprintf(stderr, "Put copy data failed: %s", PQerrorMessage(conn));
-      PQputCopyEnd(conn, "Error while copying data");
-      PQexec(conn, "ROLLBACK");
-      return false;
+    rows_sent++;
+
+    if (buffer->len >= COPY_FLUSH_THRESHOLD) {
+      double send_start = get_time();
+      if (!flush_copy_buffer(session, buffer))
+        return false;
+      send_time += get_time() - send_start;
     }
   }
 
+  if (format == COPY_FORMAT_BINARY)
+    copy_encode_binary_trailer(buffer);
+  double encode_time = get_time() - encode_start - send_time;
+  if (!flush_copy_buffer(session, buffer)) {
+    return false;
+  }
+
   if (PQputCopyEnd(conn, NULL) != 1) {
-    fprintf(stderr, "Put copy end failed: %s", PQerrorMessage(conn));
-    PQexec(conn, "ROLLBACK");
+    batch_failed(session, "Put copy end");
+    PQclear(PQexec(conn, "ROLLBACK"));
     return false;
   }
 
   res = PQgetResult(conn);
   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-    fprintf(stderr, "COPY failed: %s", PQerrorMessage(conn));
+    batch_failed(session, "COPY");
     PQclear(res);
-    PQexec(conn, "ROLLBACK");
+    PQclear(PQexec(conn, "ROLLBACK"));
     return false;
   }
   PQclear(res);
+  double copy_end = get_time();
 
-  // Insert from temp table to main table
-  res = PQexec(
-      conn,
-      "INSERT INTO locations(unlocode, name, country_code, "
-      "location, is_airport, is_port, is_train_station) "
-      "SELECT unlocode, name, country_code, location, "
-      "is_airport, is_port, is_train_station "
-      "FROM temp_locations "
-      "ON CONFLICT (unlocode, MD5(name)) WHERE name IS NOT NULL DO NOTHING");
+  // Insert from the staging table to main table, a bulk load already did
+  MergeCounts merged = {.inserted = rows_sent};
+  if (!direct) {
+    ProgressParams params;
+    int num_params = merge_params(session, batch, &params);
+    if (persistent)
+      res = PQexecPrepared(conn, MERGE_STATEMENT, num_params, params.values,
+                           NULL, NULL, 0);
+    else if (num_params > 0)
+      res = PQexecParams(conn, sql->merge_temp_progress, num_params, NULL,
+                         params.values, NULL, NULL, 0);
+    else
+      res = PQexec(conn, sql->merge_temp);
 
-  if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-    fprintf(stderr, "Insert failed: %s", PQerrorMessage(conn));
+    if (!merge_result(session, res, &merged)) {
+      batch_failed(session, "Insert");
+      PQclear(res);
+      PQclear(PQexec(conn, "ROLLBACK"));
+      return false;
+    }
     PQclear(res);
-    PQexec(conn, "ROLLBACK");
-    return false;
   }
-  PQclear(res);
+  double merge_end = get_time();
 
   // Commit transaction
   res = PQexec(conn, "COMMIT");
   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-    fprintf(stderr, "COMMIT failed: %s", PQerrorMessage(conn));
+    batch_failed(session, "COMMIT");
     PQclear(res);
     return false;
   }
   PQclear(res);
 
+  if (timings) {
+    timings->setup = setup_end - start;
+    timings->encode = encode_time;
+    timings->copy = copy_end - setup_end - encode_time;
+    timings->merge = merge_end - copy_end;
+    timings->commit = get_time() - merge_end;
+    timings->rows_sent = rows_sent;
+    timings->merged = merged;
+  }
   return true;
 }
@@ -0,0 +1,133 @@
+#include "dedup.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HASH_MULTIPLIER 0x9e3779b97f4a7c15ull
+
+static inline uint64_t load_word(const char *p, size_t len) {
+  uint64_t word = 0;
+  memcpy(&word, p, len);
+  return word;
+}
+
+// Final avalanche so every input bit reaches the low bits used as the slot
+static inline uint64_t finalize(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+// Multiply and rotate over 8 byte words, names are short so the loop runs a
+// handful of times
+uint64_t dedup_hash(const char *data, size_t len, uint64_t seed) {
+  uint64_t h = seed ^ (len * HASH_MULTIPLIER);
+  while (len >= 8) {
+    h = (h ^ load_word(data, 8)) * HASH_MULTIPLIER;
+    h = (h << 31) | (h >> 33);
+    data += 8;
+    len -= 8;
+  }
+  if (len > 0)
+    h = (h ^ load_word(data, len)) * HASH_MULTIPLIER;
+  return finalize(h);
+}
+
+uint64_t dedup_row_hash(const Batch *batch, int i) {
+  FieldView key = batch_key(batch, i);
+  uint64_t code = dedup_hash(key.ptr, key.len, 0);
+  FieldView name = batch_name(batch, i);
+  return dedup_hash(name.ptr, name.len, code);
+}
+
+bool dedup_init(DedupSet *set, size_t memory_bytes) {
+  // Largest power of two number of slots that fits
+  size_t slots = 1;
+  while (slots * 2 * sizeof(uint64_t) <= memory_bytes)
+    slots *= 2;
+  if (slots < 2) {
+    fprintf(stderr, "Dedup memory of %zu bytes is too small\n", memory_bytes);
+    return false;
+  }
+
+  // calloc of a large block maps zero pages, untouched slots cost nothing
+  set->slots = calloc(slots, sizeof(uint64_t));
+  if (set->slots == NULL) {
+    fprintf(stderr, "Could not allocate %zu bytes for dedup\n",
+            slots * sizeof(uint64_t));
+    return false;
+  }
+  set->mask = slots - 1;
+  set->limit = (size_t)(slots * DEDUP_MAX_LOAD);
+  atomic_init(&set->count, 0);
+  return true;
+}
+
+void dedup_free(DedupSet *set) {
+  free((void *)set->slots);
+  set->slots = NULL;
+}
+
+// Rows whose slot is requested ahead of the probe
+#define DEDUP_PREFETCH 16
+
+int dedup_batch(DedupSet *set, Batch *batch, int first, uint64_t *bytes) {
+  int count = batch->count - first;
+  if (count <= 0)
+    return 0;
+  uint64_t *hashes = malloc(count * sizeof(uint64_t));
+  bool *keep = malloc(count * sizeof(bool));
+
+  for (int i = 0; i < count; i++)
+    hashes[i] = dedup_row_hash(batch, first + i);
+
+  int removed = 0;
+  for (int i = 0; i < count; i++) {
+    if (i + DEDUP_PREFETCH < count)
+      __builtin_prefetch(
+          (const void *)&set->slots[hashes[i + DEDUP_PREFETCH] & set->mask]);
+    // Only rows that will be sent are remembered, a duplicate of a skipped
+    // row still gets its chance
+    keep[i] = !batch_row_is_valid(batch, first + i) ||
+              dedup_insert(set, hashes[i]);
+    if (!keep[i]) {
+      *bytes += copy_binary_row_size(batch, first + i);
+      removed++;
+    }
+  }
+
+  if (removed > 0)
+    batch_compact(batch, first, keep);
+  free(hashes);
+  free(keep);
+  return removed;
+}
+
+bool dedup_insert(DedupSet *set, uint64_t hash) {
+  if (hash == 0)
+    hash = 1; // 0 marks an empty slot
+
+  size_t i = hash & set->mask;
+  while (true) {
+    uint64_t slot = atomic_load_explicit(&set->slots[i], memory_order_relaxed);
+    if (slot == hash)
+      return false;
+    if (slot != 0) {
+      i = (i + 1) & set->mask;
+      continue;
+    }
+
+    if (dedup_full(set))
+      return true;
+    // Another producer may claim the slot first, then look at it again
+    if (atomic_compare_exchange_weak_explicit(&set->slots[i], &slot, hash,
+                                              memory_order_relaxed,
+                                              memory_order_relaxed)) {
+      atomic_fetch_add_explicit(&set->count, 1, memory_order_relaxed);
+      return true;
+    }
+  }
+}
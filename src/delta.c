@@ -0,0 +1,358 @@
+#include "delta.h"
+#include "copy_encoder.h"
+#include "dedup.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Bits of the flags that are row values, not operations
+#define LOCATION_VALUE_FLAGS                                                   \
+  (LOCATION_AIRPORT | LOCATION_PORT | LOCATION_TRAIN_STATION |                 \
+   LOCATION_HAS_COORDINATES)
+
+void snapshot_list_init(SnapshotList *list) { memset(list, 0, sizeof(*list)); }
+
+void snapshot_list_free(SnapshotList *list) {
+  free(list->entries);
+  free(list->names);
+  snapshot_list_init(list);
+}
+
+// Delta loads take the UN/LOCODE layout only, the code fits the entry
+static SnapshotEntry *snapshot_append(SnapshotList *list, uint64_t key,
+                                      uint64_t content, FieldView unlocode,
+                                      const char *name, size_t name_len) {
+  if (list->count == list->capacity) {
+    list->capacity = list->capacity ? list->capacity * 2 : 1024;
+    list->entries =
+        realloc(list->entries, list->capacity * sizeof(SnapshotEntry));
+  }
+  if (list->names_len + name_len > list->names_capacity) {
+    size_t capacity = list->names_capacity ? list->names_capacity : 16384;
+    while (list->names_len + name_len > capacity)
+      capacity *= 2;
+    list->names = realloc(list->names, capacity);
+    list->names_capacity = capacity;
+  }
+
+  SnapshotEntry *entry = &list->entries[list->count++];
+  entry->key = key;
+  entry->content = content;
+  memset(entry->unlocode, 0, UNLOCODE_WIDTH);
+  memcpy(entry->unlocode, unlocode.ptr,
+         unlocode.len < UNLOCODE_WIDTH ? unlocode.len : UNLOCODE_WIDTH);
+  entry->name_len = (uint16_t)name_len;
+  entry->deleted = false;
+  entry->sent = false;
+  entry->origin = 0;
+  entry->name_offset = list->names_len;
+  memcpy(list->names + list->names_len, name, name_len);
+  list->names_len += name_len;
+  return entry;
+}
+
+// Everything the merge would overwrite: country code, types and position
+static uint64_t content_hash(const Batch *batch, int i) {
+  uint8_t flags = batch->flags[i] & LOCATION_VALUE_FLAGS;
+  // Padded to the width the snapshots were hashed with
+  char country[COUNTRY_CODE_WIDTH] = {0};
+  FieldView code = batch_country(batch, i);
+  memcpy(country, code.ptr,
+         code.len < COUNTRY_CODE_WIDTH ? code.len : COUNTRY_CODE_WIDTH);
+  uint64_t h = dedup_hash(country, COUNTRY_CODE_WIDTH, flags);
+  if (flags & LOCATION_HAS_COORDINATES) {
+    double position[2] = {batch->latitude[i], batch->longitude[i]};
+    h = dedup_hash((const char *)position, sizeof(position), h);
+  }
+  return h;
+}
+
+static bool read_snapshot(SnapshotList *list, const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    printf("No snapshot at %s yet, every row is new\n", path);
+    return true;
+  }
+
+  char magic[sizeof(SNAPSHOT_MAGIC) - 1];
+  uint64_t count;
+  if (fread(magic, sizeof(magic), 1, file) != 1 ||
+      memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) != 0 ||
+      fread(&count, sizeof(count), 1, file) != 1) {
+    fprintf(stderr, "%s is not a snapshot\n", path);
+    fclose(file);
+    return false;
+  }
+
+  for (uint64_t n = 0; n < count; n++) {
+    char unlocode[UNLOCODE_WIDTH];
+    uint64_t content;
+    uint16_t name_len;
+    char name[UINT16_MAX];
+    if (fread(unlocode, sizeof(unlocode), 1, file) != 1 ||
+        fread(&content, sizeof(content), 1, file) != 1 ||
+        fread(&name_len, sizeof(name_len), 1, file) != 1 ||
+        (name_len > 0 && fread(name, name_len, 1, file) != 1)) {
+      fprintf(stderr, "Snapshot %s is truncated\n", path);
+      fclose(file);
+      return false;
+    }
+
+    // Same key hash as the producers compute from a batch row
+    FieldView code = {unlocode, code_length(unlocode, UNLOCODE_WIDTH)};
+    uint64_t key =
+        dedup_hash(name, name_len, dedup_hash(code.ptr, code.len, 0));
+    snapshot_append(list, key, content, code, name, name_len);
+  }
+  fclose(file);
+  return true;
+}
+
+static const SnapshotEntry *delta_lookup(const DeltaLoad *delta, uint64_t key,
+                                         size_t *position) {
+  if (delta->index == NULL)
+    return NULL;
+  for (size_t slot = key & delta->mask;; slot = (slot + 1) & delta->mask) {
+    uint32_t entry = delta->index[slot];
+    if (entry == 0)
+      return NULL;
+    if (delta->previous.entries[entry - 1].key == key) {
+      *position = entry - 1;
+      return &delta->previous.entries[entry - 1];
+    }
+  }
+}
+
+bool delta_open(DeltaLoad *delta, const char *snapshot_path) {
+  memset(delta, 0, sizeof(DeltaLoad));
+  delta->snapshot_path = snapshot_path;
+  pthread_mutex_init(&delta->lock, NULL);
+  if (snapshot_path == NULL)
+    return true;
+
+  SnapshotList *previous = &delta->previous;
+  if (!read_snapshot(previous, snapshot_path)) {
+    delta_close(delta);
+    return false;
+  }
+  if (previous->count == 0)
+    return true;
+
+  // At most half full, misses end on an empty slot after a short probe
+  size_t slots = 16;
+  while (slots < previous->count * 2)
+    slots *= 2;
+  delta->index = calloc(slots, sizeof(uint32_t));
+  delta->mask = slots - 1;
+  delta->seen = calloc(previous->count, sizeof(atomic_bool));
+  for (size_t i = 0; i < previous->count; i++) {
+    size_t slot = previous->entries[i].key & delta->mask;
+    while (delta->index[slot] != 0)
+      slot = (slot + 1) & delta->mask;
+    delta->index[slot] = (uint32_t)(i + 1);
+  }
+  printf("Snapshot %s: %zu rows from the previous load\n", snapshot_path,
+         previous->count);
+  return true;
+}
+
+void delta_close(DeltaLoad *delta) {
+  snapshot_list_free(&delta->previous);
+  snapshot_list_free(&delta->next);
+  free(delta->index);
+  free(delta->seen);
+  pthread_mutex_destroy(&delta->lock);
+  delta->index = NULL;
+  delta->seen = NULL;
+}
+
+bool delta_row(DeltaLoad *delta, SnapshotList *local, ThreadMetrics *metrics,
+               Batch *batch, char change) {
+  int i = batch->count - 1;
+  batch->delta = true;
+
+  size_t position;
+  uint64_t key = 0;
+  const SnapshotEntry *old = NULL;
+  if (delta->snapshot_path) {
+    key = dedup_row_hash(batch, i);
+    old = delta_lookup(delta, key, &position);
+    // Matched rows are not deleted after the load, rows the writers skip
+    // included, their old values stay
+    if (old)
+      atomic_store_explicit(&delta->seen[position], true,
+                            memory_order_relaxed);
+  }
+
+  if (change == 'X') {
+    batch->flags[i] |= LOCATION_DELETE;
+    // Sent rows only, the writers skip the others
+    if (delta->snapshot_path && batch_row_is_valid(batch, i) &&
+        batch_name(batch, i).len <= UINT16_MAX) {
+      FieldView name = batch_name(batch, i);
+      SnapshotEntry *entry = snapshot_append(
+          local, key, 0, batch_key(batch, i), name.ptr, name.len);
+      entry->deleted = true;
+      entry->sent = true;
+      entry->origin = batch->origin[i];
+    }
+    return true;
+  }
+
+  bool changed;
+  if (delta->snapshot_path == NULL) {
+    changed = change == '+' || change == '|' || change == '#';
+  } else if (!batch_row_is_valid(batch, i) ||
+             batch_name(batch, i).len > UINT16_MAX) {
+    changed = true; // counted as skipped by the writer, or sent every time
+  } else {
+    uint64_t content = content_hash(batch, i);
+    FieldView name = batch_name(batch, i);
+    SnapshotEntry *entry = snapshot_append(local, key, content,
+                                           batch_key(batch, i), name.ptr,
+                                           name.len);
+    entry->origin = batch->origin[i];
+    changed = old == NULL || old->content != content;
+    entry->sent = changed;
+  }
+
+  if (!changed) {
+    // The name of the last row ends the heap, dropping it is enough
+    batch->count--;
+    metrics_add(&metrics->counters[ROWS_UNCHANGED], 1);
+    return false;
+  }
+  if (change == '#')
+    batch->flags[i] |= LOCATION_RENAME;
+  return true;
+}
+
+void delta_collect(DeltaLoad *delta, SnapshotList *local) {
+  if (delta->snapshot_path == NULL) {
+    snapshot_list_free(local);
+    return;
+  }
+  pthread_mutex_lock(&delta->lock);
+  for (size_t i = 0; i < local->count; i++) {
+    const SnapshotEntry *entry = &local->entries[i];
+    FieldView code = {entry->unlocode,
+                      code_length(entry->unlocode, UNLOCODE_WIDTH)};
+    SnapshotEntry *copy = snapshot_append(
+        &delta->next, entry->key, entry->content, code,
+        local->names + entry->name_offset, entry->name_len);
+    copy->deleted = entry->deleted;
+    copy->sent = entry->sent;
+    copy->origin = entry->origin;
+  }
+  pthread_mutex_unlock(&delta->lock);
+  snapshot_list_free(local);
+}
+
+size_t delta_push_deletes(DeltaLoad *delta, BatchPool *pool,
+                          BatchQueue *queue) {
+  const SnapshotList *previous = &delta->previous;
+  Batch *batch = NULL;
+  size_t pushed = 0;
+
+  for (size_t i = 0; i < previous->count; i++) {
+    if (atomic_load_explicit(&delta->seen[i], memory_order_relaxed))
+      continue;
+    if (batch == NULL)
+      batch = batch_acquire(pool);
+
+    const SnapshotEntry *entry = &previous->entries[i];
+    ProcessedLocation location = {0};
+    FieldView code = {entry->unlocode,
+                      code_length(entry->unlocode, UNLOCODE_WIDTH)};
+    FieldView country = {code.ptr, code.len < COUNTRY_CODE_WIDTH
+                                       ? code.len
+                                       : COUNTRY_CODE_WIDTH};
+    location.key = (CodeView){{code}, 1};
+    location.country = (CodeView){{country}, 1};
+    location.name =
+        (FieldView){previous->names + entry->name_offset, entry->name_len};
+    batch_append(batch, &location);
+    batch->flags[batch->count - 1] |= LOCATION_DELETE;
+    batch->delta = true;
+    pushed++;
+
+    if (batch->count >= batch_pool_fill(pool)) {
+      queue_push(queue, batch);
+      batch = NULL;
+    }
+  }
+  if (batch)
+    queue_push(queue, batch);
+  return pushed;
+}
+
+// Snapshot names, qsort takes no context and only the main thread sorts
+static const char *sort_names;
+
+static int compare_entries(const void *a, const void *b) {
+  const SnapshotEntry *x = a;
+  const SnapshotEntry *y = b;
+  int order = memcmp(x->unlocode, y->unlocode, UNLOCODE_WIDTH);
+  if (order != 0)
+    return order;
+  size_t len = x->name_len < y->name_len ? x->name_len : y->name_len;
+  order = memcmp(sort_names + x->name_offset, sort_names + y->name_offset, len);
+  if (order != 0)
+    return order;
+  if (x->name_len != y->name_len)
+    return (x->name_len > y->name_len) - (x->name_len < y->name_len);
+  // Copies of one row in input order, qsort is not stable
+  return (x->origin > y->origin) - (x->origin < y->origin);
+}
+
+bool delta_write_snapshot(DeltaLoad *delta) {
+  SnapshotList *next = &delta->next;
+  sort_names = next->names;
+  qsort(next->entries, next->count, sizeof(SnapshotEntry), compare_entries);
+
+  // Copies of a row repeated in the input are adjacent now, in input order.
+  // The merge leaves the table with the last one sent, or with the old
+  // values when every copy was unchanged; a delete kept drops the row
+  size_t unique = 0;
+  for (size_t i = 0; i < next->count;) {
+    const SnapshotEntry *entries = next->entries;
+    size_t keep = i, end = i;
+    for (; end < next->count && entries[end].key == entries[i].key; end++)
+      if (entries[end].sent || !entries[keep].sent)
+        keep = end;
+    if (!entries[keep].deleted)
+      next->entries[unique++] = entries[keep];
+    i = end;
+  }
+
+  char tmp_path[4096];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", delta->snapshot_path);
+  FILE *file = fopen(tmp_path, "wb");
+  if (file == NULL) {
+    perror(tmp_path);
+    return false;
+  }
+
+  uint64_t count = unique;
+  bool ok = fwrite(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC) - 1, 1, file) == 1 &&
+            fwrite(&count, sizeof(count), 1, file) == 1;
+  for (size_t i = 0; ok && i < unique; i++) {
+    const SnapshotEntry *entry = &next->entries[i];
+    ok = fwrite(entry->unlocode, UNLOCODE_WIDTH, 1, file) == 1 &&
+         fwrite(&entry->content, sizeof(entry->content), 1, file) == 1 &&
+         fwrite(&entry->name_len, sizeof(entry->name_len), 1, file) == 1 &&
+         fwrite(next->names + entry->name_offset, 1, entry->name_len, file) ==
+             entry->name_len;
+  }
+  if (fclose(file) != 0 || !ok) {
+    fprintf(stderr, "Could not write snapshot %s\n", tmp_path);
+    remove(tmp_path);
+    return false;
+  }
+  if (rename(tmp_path, delta->snapshot_path) != 0) {
+    perror(delta->snapshot_path);
+    return false;
+  }
+  printf("Snapshot %s: %zu rows written\n", delta->snapshot_path, unique);
+  return true;
+}
@@ -0,0 +1,255 @@
+#include "file_loader.h"
+#include "chunk_parser.h"
+#include "csv_tokenizer.h"
+#include "input_reader.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// Single producer: read the pending ranges record by record on the main
+// thread
+static void parse_sequential(InputReader *reader, const ByteRange *pending,
+                             int num_pending, int file,
+                             const SchemaPlan *plan, BatchPool *pool,
+                             BatchQueue *queue, DedupSet *dedup,
+                             DeltaLoad *delta, ThreadMetrics *metrics) {
+  const char *line;
+  size_t line_len;
+
+  // create memory to hold Batch values
+  Batch *current_batch = batch_acquire(pool);
+  Ticks read_ticks = 0;
+  Ticks parse_ticks = 0;
+  size_t bytes_read = metrics->bytes_read; // earlier files included
+  int checked = 0; // rows of the batch already checked for duplicates
+  SnapshotList seen; // rows for the next delta snapshot
+  snapshot_list_init(&seen);
+  FieldView *fields =
+      plan ? malloc(SCHEMA_MAX_FIELDS * sizeof(FieldView)) : NULL;
+
+  printf("Debug: Process file line by line\n");
+  for (int r = 0; r < num_pending; r++) {
+    // Pipes cannot seek, but their single range starts where the reader is
+    if (reader->offset != pending[r].begin &&
+        !reader_seek(reader, pending[r].begin)) {
+      fprintf(stderr, "Could not seek to offset %zu\n", pending[r].begin);
+      break;
+    }
+
+    size_t range_start = reader->offset;
+    current_batch->source.begin = range_start;
+    Ticks mark = ticks_now();
+    while (reader->offset < pending[r].end) {
+      size_t record_start = reader->offset;
+      if (!reader_next_line(reader, &line, &line_len))
+        break;
+      Ticks read_end = ticks_now();
+      read_ticks += read_end - mark;
+      metrics_set(&metrics->bytes_read,
+                  bytes_read + reader->offset - range_start);
+
+      LocationData raw_data;
+      ProcessedLocation processed_data;
+
+      if (plan) {
+        processed_data.change = ' ';
+        // Empty lines are rows without fields, as for parse_line
+        size_t count = line_len > 1 ? csv_split_record(line, line_len, fields,
+                                                       plan->num_fields)
+                                    : 0;
+        producer_count_row(
+            metrics, schema_append_row(plan, fields, count, current_batch));
+      } else {
+        // Parse and process data
+        parse_line(line, line_len, &raw_data);
+        producer_count_row(metrics,
+                           process_location_data(&raw_data, &processed_data));
+
+        // Add to batch, the name is copied out of the line buffer
+        batch_append(current_batch, &processed_data);
+      }
+      current_batch->origin[current_batch->count - 1] =
+          row_origin(file, record_start);
+      current_batch->source.end = reader->offset;
+      if (delta && !delta_row(delta, &seen, metrics, current_batch,
+                              processed_data.change)) {
+        mark = ticks_now();
+        parse_ticks += mark - read_end;
+        continue;
+      }
+      int fill = batch_pool_fill(pool);
+      if (current_batch->count >= fill && dedup)
+        producer_dedup(dedup, metrics, current_batch, &checked);
+      mark = ticks_now();
+      parse_ticks += mark - read_end;
+
+      // If batch is full, insert and reset
+      if (current_batch->count >= fill) {
+        current_batch->file = file;
+        current_batch = producer_push(pool, queue, metrics, current_batch,
+                                      read_ticks, parse_ticks, false);
+        current_batch->source.begin = reader->offset;
+        checked = 0;
+        read_ticks = 0;
+        parse_ticks = 0;
+        mark = ticks_now();
+      }
+    }
+    bytes_read += reader->offset - range_start;
+
+    // A batch never spans two ranges
+    if (dedup)
+      producer_dedup(dedup, metrics, current_batch, &checked);
+    if (current_batch->count > 0) {
+      current_batch->file = file;
+      current_batch = producer_push(pool, queue, metrics, current_batch,
+                                    read_ticks, parse_ticks, false);
+      read_ticks = 0;
+      parse_ticks = 0;
+    }
+    batch_reset(current_batch);
+    checked = 0;
+  }
+  if (delta)
+    delta_collect(delta, &seen);
+  batch_release(pool, current_batch);
+  free(fields);
+}
+
+// Split the pending ranges of the mapped input into newline aligned parts
+// that the parsers take from a shared list
+static void parse_parallel(InputReader *reader, const ByteRange *pending,
+                           int num_pending, int file, int num_parsers,
+                           const SchemaPlan *plan, BatchPool *pool,
+                           BatchQueue *queue, DedupSet *dedup,
+                           DeltaLoad *delta, ThreadMetrics **metrics) {
+  pthread_t parsers[MAX_PARSERS];
+  ParserContext contexts[MAX_PARSERS];
+
+  // A stream is parsed chunk by chunk as the decoder produces it, starting
+  // with what is left of the chunk the header came from
+  ByteRange *ranges = NULL;
+  int count = 0;
+  int threads = num_parsers;
+  if (reader->decoder) {
+    reader_hand_off(reader);
+    printf("Debug: Parsing decoded chunks on %d parsers\n", threads);
+  } else {
+    count = plan_pending(reader->data, pending, num_pending, num_parsers,
+                         &ranges);
+    threads = count < num_parsers ? count : num_parsers;
+    printf("Debug: Parsing %d ranges on %d parsers\n", count, threads);
+  }
+  atomic_int next_range = 0;
+
+  for (int i = 0; i < threads; i++) {
+    contexts[i].id = i;
+    contexts[i].data = reader->data;
+    contexts[i].ranges = ranges;
+    contexts[i].num_ranges = count;
+    contexts[i].next_range = &next_range;
+    contexts[i].decoder = reader->decoder;
+    contexts[i].file = file;
+    contexts[i].pool = pool;
+    contexts[i].queue = queue;
+    contexts[i].dedup = dedup;
+    contexts[i].delta = delta;
+    contexts[i].plan = plan;
+    contexts[i].metrics = metrics[i];
+    pthread_create(&parsers[i], NULL, parser_thread, &contexts[i]);
+  }
+
+  for (int i = 0; i < threads; i++) {
+    pthread_join(parsers[i], NULL);
+  }
+  free(ranges);
+  if (!reader->decoder)
+    reader->offset = reader->size;
+}
+
+
+static uint64_t loader_rows(const FileLoader *loader) {
+  uint64_t rows = 0;
+  for (int i = 0; i < loader->num_parsers; i++)
+    rows += loader->metrics[i]->counters[ROWS_PARSED];
+  return rows;
+}
+
+static void load_file(FileLoader *loader, InputFile *file) {
+  const LoaderOptions *options = loader->options;
+  double start = get_time();
+  uint64_t rows_before = loader_rows(loader);
+
+  InputReader reader;
+  if (!reader_open(&reader, file->path, options->reader_mode)) {
+    file->error = "could not be opened";
+    fprintf(stderr, "Could not open input file %s\n", file->path);
+    return;
+  }
+  const char *line;
+  size_t line_len;
+  if (!reader_next_line(&reader, &line, &line_len)) {
+    file->error = "has no header line";
+    fprintf(stderr, "Failed to read header line of %s\n", file->path);
+    reader_close(&reader);
+    return;
+  }
+
+  // Other schemas run the kernels bound to this file's header
+  SchemaPlan *plan = NULL;
+  if (!loader->schema->builtin) {
+    plan = malloc(sizeof(SchemaPlan));
+    if (!schema_bind(plan, loader->schema, line, line_len, file->path)) {
+      file->error = "lacks a column of the schema";
+      free(plan);
+      reader_close(&reader);
+      return;
+    }
+  }
+
+  // What is left to load, everything after the header unless resuming
+  ByteRange *pending;
+  int num_pending =
+      checkpoint_pending(loader->checkpoint, reader.offset,
+                         reader.size > 0 ? reader.size : SIZE_MAX, &pending);
+  if (options->resume) {
+    size_t remaining = 0;
+    for (int i = 0; i < num_pending; i++)
+      remaining += pending[i].end - pending[i].begin;
+    printf("Resuming: %zu of %zu bytes already committed, %d ranges left\n",
+           reader.size - reader.offset - remaining,
+           reader.size - reader.offset, num_pending);
+  }
+
+  int index = (int)(file - loader->files->files);
+  // Only a stdio stream, also read in uring mode from pipes, is not split
+  if (reader.file == NULL && options->num_parsers > 1) {
+    parse_parallel(&reader, pending, num_pending, index, loader->num_parsers,
+                   plan, loader->pool, loader->queue, loader->dedup,
+                   loader->delta, loader->metrics);
+  } else {
+    parse_sequential(&reader, pending, num_pending, index, plan, loader->pool,
+                     loader->queue, loader->dedup, loader->delta,
+                     loader->metrics[0]);
+  }
+  if (reader.decoder && reader.decoder->failed) {
+    file->error = "is corrupt or truncated";
+    fprintf(stderr, "%s is corrupt or truncated, the records after the last "
+                    "whole chunk were not loaded\n",
+            file->path);
+  }
+  file->rows = loader_rows(loader) - rows_before;
+  file->seconds = get_time() - start;
+
+  // Batches hold copies of the rows, nothing points into the input anymore
+  reader_close(&reader);
+  free(pending);
+  free(plan);
+}
+
+void *loader_thread(void *arg) {
+  FileLoader *loader = arg;
+  InputFile *file;
+  while ((file = input_files_take(loader->files)) != NULL)
+    load_file(loader, file);
+  return NULL;
+}
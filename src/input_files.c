@@ -0,0 +1,169 @@
+#include "input_files.h"
+#include "stream_decoder.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Device and inode of every file added, the same file under two names is
+// loaded once
+typedef struct {
+  dev_t device;
+  ino_t inode;
+} FileId;
+
+typedef struct {
+  InputFileList *list;
+  FileId *ids;
+  int capacity;
+} Expansion;
+
+static void add_file(Expansion *expansion, const char *path,
+                     const struct stat *st) {
+  InputFileList *list = expansion->list;
+  for (int i = 0; i < list->count; i++) {
+    if (expansion->ids[i].device == st->st_dev &&
+        expansion->ids[i].inode == st->st_ino)
+      return;
+  }
+  if (list->count == expansion->capacity) {
+    expansion->capacity = expansion->capacity ? expansion->capacity * 2 : 16;
+    list->files =
+        realloc(list->files, expansion->capacity * sizeof(InputFile));
+    expansion->ids =
+        realloc(expansion->ids, expansion->capacity * sizeof(FileId));
+  }
+
+  InputFile *file = &list->files[list->count];
+  memset(file, 0, sizeof(InputFile));
+  file->path = strdup(path);
+  file->size = S_ISREG(st->st_mode) ? st->st_size : 0;
+  int fd = open(path, O_RDONLY);
+  if (fd >= 0) {
+    file->compressed = detect_compression(fd) != COMPRESSION_NONE;
+    close(fd);
+  }
+  atomic_init(&file->failed_rows, 0);
+  atomic_init(&file->rejected_rows, 0);
+  expansion->ids[list->count] = (FileId){st->st_dev, st->st_ino};
+  list->count++;
+}
+
+static int compare_names(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static bool add_directory(Expansion *expansion, const char *path) {
+  DIR *dir = opendir(path);
+  if (dir == NULL) {
+    perror(path);
+    return false;
+  }
+  char **names = NULL;
+  int count = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.')
+      continue;
+    names = realloc(names, (count + 1) * sizeof(char *));
+    names[count++] = strdup(entry->d_name);
+  }
+  closedir(dir);
+  qsort(names, count, sizeof(char *), compare_names);
+
+  int before = expansion->list->count;
+  for (int i = 0; i < count; i++) {
+    char file_path[4096];
+    snprintf(file_path, sizeof(file_path), "%s/%s", path, names[i]);
+    struct stat st;
+    // Subdirectories and special files are not inputs
+    if (stat(file_path, &st) == 0 && S_ISREG(st.st_mode))
+      add_file(expansion, file_path, &st);
+    free(names[i]);
+  }
+  free(names);
+  if (expansion->list->count == before) {
+    fprintf(stderr, "No input files in directory %s\n", path);
+    return false;
+  }
+  return true;
+}
+
+static bool add_input(Expansion *expansion, const char *path) {
+  struct stat st;
+  if (stat(path, &st) == 0) {
+    if (S_ISDIR(st.st_mode))
+      return add_directory(expansion, path);
+    add_file(expansion, path, &st);
+    return true;
+  }
+
+  if (strpbrk(path, "*?[") == NULL) {
+    perror(path);
+    return false;
+  }
+  glob_t matches;
+  if (glob(path, 0, NULL, &matches) != 0) {
+    fprintf(stderr, "No input files match %s\n", path);
+    return false;
+  }
+  // glob sorts its matches
+  bool ok = true;
+  for (size_t i = 0; ok && i < matches.gl_pathc; i++) {
+    if (stat(matches.gl_pathv[i], &st) != 0)
+      continue;
+    if (S_ISDIR(st.st_mode))
+      ok = add_directory(expansion, matches.gl_pathv[i]);
+    else
+      add_file(expansion, matches.gl_pathv[i], &st);
+  }
+  globfree(&matches);
+  return ok;
+}
+
+bool input_files_expand(InputFileList *list, char *const *paths,
+                        int num_paths) {
+  memset(list, 0, sizeof(InputFileList));
+  atomic_init(&list->next, 0);
+  Expansion expansion = {.list = list};
+  for (int i = 0; i < num_paths; i++) {
+    if (!add_input(&expansion, paths[i])) {
+      free(expansion.ids);
+      input_files_free(list);
+      return false;
+    }
+  }
+  free(expansion.ids);
+  if (list->count == 0) {
+    fprintf(stderr, "No input files\n");
+    return false;
+  }
+  return true;
+}
+
+void input_files_free(InputFileList *list) {
+  for (int i = 0; i < list->count; i++)
+    free(list->files[i].path);
+  free(list->files);
+  list->files = NULL;
+  list->count = 0;
+}
+
+InputFile *input_files_take(InputFileList *list) {
+  int i = atomic_fetch_add(&list->next, 1);
+  return i < list->count ? &list->files[i] : NULL;
+}
+
+size_t input_files_size(const InputFileList *list) {
+  size_t total = 0;
+  for (int i = 0; i < list->count; i++) {
+    if (list->files[i].size == 0 || list->files[i].compressed)
+      return 0;
+    total += list->files[i].size;
+  }
+  return total;
+}
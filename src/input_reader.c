@@ -0,0 +1,258 @@
+#include "input_reader.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static bool reader_open_mmap(InputReader *reader, int fd) {
+  reader->fd = fd;
+
+  struct stat st;
+  if (fstat(reader->fd, &st) != 0) {
+    close(reader->fd);
+    return false;
+  }
+  reader->size = st.st_size;
+
+  // mmap refuses zero length mappings, an empty file just has no lines
+  if (reader->size == 0) {
+    reader->data = NULL;
+    return true;
+  }
+
+  void *map = mmap(NULL, reader->size, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+  if (map == MAP_FAILED) {
+    close(reader->fd);
+    return false;
+  }
+  madvise(map, reader->size, MADV_SEQUENTIAL);
+  reader->data = map;
+  return true;
+}
+
+static bool reader_open_stream(InputReader *reader, int fd,
+                               Compression compression) {
+  reader->decoder = malloc(sizeof(StreamDecoder));
+  if (!decoder_start(reader->decoder, fd, compression)) {
+    free(reader->decoder);
+    reader->decoder = NULL;
+    return false;
+  }
+  return true;
+}
+
+// A descriptor whose reads bypass the page cache, -1 where that is refused
+// (tmpfs) or not supported
+static int open_direct(const char *path) {
+#if defined(O_DIRECT)
+  return open(path, O_RDONLY | O_DIRECT);
+#elif defined(F_NOCACHE)
+  int fd = open(path, O_RDONLY);
+  if (fd >= 0 && fcntl(fd, F_NOCACHE, 1) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+#else
+  (void)path;
+  return -1;
+#endif
+}
+
+// Reads ahead of the parsers into the decoder ring, through the page cache
+// when it cannot be bypassed
+static bool reader_open_reads(InputReader *reader, const char *path, int fd,
+                              size_t size) {
+  bool direct = false;
+  if (reader->mode == READER_URING_DIRECT) {
+    int direct_fd = open_direct(path);
+    if (direct_fd >= 0) {
+      close(fd);
+      fd = direct_fd;
+      direct = true;
+    } else {
+      fprintf(stderr, "Direct reads not supported for %s, reading through "
+                      "the page cache\n",
+              path);
+    }
+  }
+  reader->size = size;
+  reader->decoder = malloc(sizeof(StreamDecoder));
+  return decoder_start_reads(reader->decoder, fd, size, direct);
+}
+
+bool reader_open(InputReader *reader, const char *path, ReaderMode mode) {
+  memset(reader, 0, sizeof(InputReader));
+  reader->mode = mode;
+  reader->fd = -1;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+  Compression compression = detect_compression(fd);
+  if (compression != COMPRESSION_NONE)
+    return reader_open_stream(reader, fd, compression);
+
+  if (mode == READER_MMAP)
+    return reader_open_mmap(reader, fd);
+
+  struct stat st;
+  bool regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+  if (regular && (mode == READER_URING || mode == READER_URING_DIRECT))
+    return reader_open_reads(reader, path, fd, st.st_size);
+
+  reader->file = fdopen(fd, "r");
+  if (reader->file == NULL) {
+    close(fd);
+    return false;
+  }
+
+  // Only used for progress reporting
+  if (regular)
+    reader->size = st.st_size;
+  return true;
+}
+
+const char *find_record_end(const char *start, const char *end) {
+  const char *p = start;
+  bool in_quotes = false;
+
+  while (p < end) {
+    const char *newline = memchr(p, '\n', end - p);
+    const char *limit = newline ? newline : end;
+
+    // Every quote flips the state, an escaped "" flips it twice
+    for (const char *q = p; (q = memchr(q, '"', limit - q)) != NULL; q++)
+      in_quotes = !in_quotes;
+
+    if (!in_quotes || !newline)
+      return limit;
+    p = newline + 1;
+  }
+  return end;
+}
+
+static void trim_line_end(const char *line, size_t *len) {
+  while (*len > 0 && (line[*len - 1] == '\n' || line[*len - 1] == '\r'))
+    (*len)--;
+}
+
+// Next record of the decoded chunks, which never cut one in two
+static bool stream_next_line(InputReader *reader, const char **line,
+                             size_t *len) {
+  DecodedChunk *chunk = &reader->chunk;
+  while (chunk->data == NULL || reader->chunk_pos >= chunk->len) {
+    if (chunk->data)
+      decoder_release(reader->decoder, chunk);
+    chunk->data = NULL;
+    if (!decoder_take(reader->decoder, chunk))
+      return false;
+    reader->chunk_pos = 0;
+  }
+
+  const char *start = chunk->data + reader->chunk_pos;
+  const char *end = chunk->data + chunk->len;
+  const char *record_end = find_record_end(start, end);
+  size_t consumed = record_end - start + (record_end < end ? 1 : 0);
+
+  *line = start;
+  *len = consumed;
+  reader->chunk_pos += consumed;
+  reader->offset = chunk->offset + reader->chunk_pos;
+  trim_line_end(*line, len);
+  return true;
+}
+
+bool reader_next_line(InputReader *reader, const char **line, size_t *len) {
+  if (reader->decoder)
+    return stream_next_line(reader, line, len);
+
+  if (reader->mode == READER_MMAP) {
+    if (reader->offset >= reader->size)
+      return false;
+
+    const char *start = reader->data + reader->offset;
+    const char *end = reader->data + reader->size;
+    const char *record_end = find_record_end(start, end);
+    size_t consumed = record_end - start + (record_end < end ? 1 : 0);
+
+    *line = start;
+    *len = consumed;
+    reader->offset += consumed;
+    trim_line_end(*line, len);
+    return true;
+  }
+
+  // getline grows the buffer, so long lines are never split in two records
+  ssize_t n = getline(&reader->line_buf, &reader->line_cap, reader->file);
+  if (n < 0)
+    return false;
+
+  *line = reader->line_buf;
+  *len = n;
+  reader->offset += n;
+  trim_line_end(*line, len);
+  return true;
+}
+
+bool reader_seek(InputReader *reader, size_t offset) {
+  if (reader->decoder)
+    return offset == reader->offset;
+  if (reader->mode == READER_STDIO &&
+      fseeko(reader->file, (off_t)offset, SEEK_SET) != 0)
+    return false;
+  reader->offset = offset;
+  return true;
+}
+
+void reader_hand_off(InputReader *reader) {
+  if (reader->decoder == NULL || reader->chunk.data == NULL)
+    return;
+  if (reader->chunk_pos < reader->chunk.len)
+    decoder_unget(reader->decoder, &reader->chunk, reader->chunk_pos);
+  else
+    decoder_release(reader->decoder, &reader->chunk);
+  reader->chunk.data = NULL;
+}
+
+void reader_close(InputReader *reader) {
+  if (reader->decoder) {
+    // The decoder owns the descriptor
+    decoder_stop(reader->decoder);
+    free(reader->decoder);
+  } else if (reader->mode == READER_MMAP) {
+    if (reader->data)
+      munmap((void *)reader->data, reader->size);
+    if (reader->fd >= 0)
+      close(reader->fd);
+  } else {
+    if (reader->file)
+      fclose(reader->file);
+    free(reader->line_buf);
+  }
+  memset(reader, 0, sizeof(InputReader));
+  reader->fd = -1;
+}
+
+bool reader_parse_mode(const char *name, ReaderMode *mode) {
+  if (strcmp(name, "stdio") == 0) {
+    *mode = READER_STDIO;
+    return true;
+  }
+  if (strcmp(name, "mmap") == 0) {
+    *mode = READER_MMAP;
+    return true;
+  }
+  if (strcmp(name, "uring") == 0) {
+    *mode = READER_URING;
+    return true;
+  }
+  if (strcmp(name, "uring-direct") == 0) {
+    *mode = READER_URING_DIRECT;
+    return true;
+  }
+  return false;
+}
@@ -2,165 +2,479 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "csv_tokenizer.c"
 #include "parsers.c"
+#include "batch.c"
+#include "schema.c"
+#include "dedup.c"
+#include "read_ahead.c"
+#include "stream_decoder.c"
+#include "input_reader.c"
+#include "input_files.c"
+#include "reject_log.c"
+#include "copy_encoder.c"
+#include "checkpoint.c"
+#include "delta.c"
 #include "db_query.c"
+#include "batch_queue.c"
+#include "batch_pool.c"
+#include "batch_tuner.c"
+#include "batch_router.c"
+#include "spatial_sort.c"
 #include "worker_threads.c"
+#include "pipeline_writer.c"
+#include "sink.c"
+#include "chunk_parser.c"
+#include "file_loader.c"
+#include "options.c"
+#include "progress.c"
 #include "benchmark.c"
 
-#define MAX_LINE_LENGTH 1024
-#define BATCH_SIZE 24000
-#define NUM_WORKERS 3
-
 
 int main(int argc, char *argv[]) {
 
   printf("Debug: Starting the program \n");
 
-  if (argc != 2) {
-    fprintf(stderr, "Usage: %s <path_to_csv_file>\n", argv[0]);
+  LoaderOptions options;
+  if (!parse_options(argc, argv, &options)) {
     return 1;
   }
 
-  Benchmark stats = {.start_time = get_time(),
-                     .parse_time = 0,
-                     .db_time = 0,
-                     .records_processed = 0};
-
-  pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-  BatchQueue queue;
-  queue_init(&queue);
-
-  pthread_t workers[NUM_WORKERS];
+  // Per thread metrics, every thread writes only its own slot
+  Benchmark stats;
+  benchmark_init(&stats);
+  ThreadMetrics *main_metrics = benchmark_thread(&stats, "main", 0);
 
-  WorkerContext contexts[NUM_WORKERS];
-  const char *conninfo = "host=localhost port=5432 dbname=vessel_tracking "
-                         "user=yourusername password=yourpassword";
+  // Everything that can fail without touching the table comes first, so a
+  // failed setup never leaves a bulk load's table unlogged or threads
+  // running
 
-  PGconn *conn = PQconnectdb(conninfo);
+  // Target table and column mapping, the UN/LOCODE layout by default
+  Schema schema;
+  if (options.schema_path ? !schema_load(&schema, options.schema_path)
+                          : !schema_builtin(&schema))
+    return 1;
+  if (!schema.builtin)
+    printf("Debug: Loading %d columns into %s\n", schema.num_columns,
+           schema.table);
 
-  if (PQstatus(conn) != CONNECTION_OK) {
-    fprintf(stderr, "Worker Masin: Connection failed\n");
-    return 0;
+  // Every input up front, a typo fails the load before anything is sent
+  InputFileList files;
+  if (!input_files_expand(&files, options.input_paths, options.num_inputs))
+    return 1;
+  printf("Debug: %d input files\n", files.count);
+
+  // Ranges are only meaningful against a single file of known size
+  const InputFile *first = &files.files[0];
+  if (options.checkpoint &&
+      (files.count != 1 || first->size == 0 || first->compressed)) {
+    fprintf(stderr, "--checkpoint needs a single uncompressed regular input "
+                    "file\n");
+    input_files_free(&files);
+    return 1;
   }
-  create_table(conn);
-  PQfinish(conn);
 
-  for (int i = 0; i < NUM_WORKERS; i++) {
-    contexts[i].id = i;
-    contexts[i].queue = &queue;
-    contexts[i].conninfo = conninfo;
-    contexts[i].stats = &stats;
-    contexts[i].stats_mutex = &stats_mutex;
-    pthread_create(&workers[i], NULL, worker_thread, &contexts[i]);
+  DedupSet dedup;
+  if (options.dedup_memory > 0 && !dedup_init(&dedup, options.dedup_memory)) {
+    input_files_free(&files);
+    return 1;
   }
+  DedupSet *dedup_set = options.dedup_memory > 0 ? &dedup : NULL;
 
-  printf("Debug: Allocating memory for the batch size %d \n", BATCH_SIZE);
-
-  double total_start_time = get_time();
-
-  // Open input file
-  printf("Debug: Opening file for proccessing \n");
-  FILE *file = fopen(argv[1], "r");
-  if (!file) {
-    fprintf(stderr, "Could not open input file\n");
+  DeltaLoad delta;
+  if (options.delta && !delta_open(&delta, options.snapshot_path)) {
+    input_files_free(&files);
     return 1;
   }
+  DeltaLoad *delta_load = options.delta ? &delta : NULL;
 
-  printf("Debug: Starting main processing loop\n");
-  char line[MAX_LINE_LENGTH];
-
-    /*// Skip header line*/
-  if (fgets(line, MAX_LINE_LENGTH, file) == NULL) {
-    fprintf(stderr, "Failed to read header line\n");
-    fclose(file);
+  BatchQueue queue;
+  queue_init(&queue, options.queue_depth);
+
+  // Reports until the writers are done
+  ProgressReporter progress = {.bench = &stats,
+                               .queue = &queue,
+                               .input_size = input_files_size(&files),
+                               .input_start = 0,
+                               .interval = options.progress_interval,
+                               .listen = options.metrics_listen};
+  if (!progress_start(&progress)) {
+    input_files_free(&files);
     return 1;
   }
 
-  // create memory to hold Batch values
-  Batch *current_batch = malloc(sizeof(Batch));
-  current_batch->locations = malloc(BATCH_SIZE * sizeof(ProcessedLocation));
-  current_batch->count = 0;
+  const char *conninfo = "host=localhost port=5432 dbname=vessel_tracking "
+                         "user=yourusername password=yourpassword";
+
+  // One connection checks the table for all files, other sinks have none
+  PGconn *conn = NULL;
+  Checkpoint checkpoint = {0};
+  if (options.sink.kind == SINK_POSTGRES) {
+    conn = PQconnectdb(conninfo);
+
+    if (PQstatus(conn) != CONNECTION_OK) {
+      fprintf(stderr, "Worker Masin: Connection failed\n");
+      PQfinish(conn);
+      progress_stop(&progress);
+      input_files_free(&files);
+      return 1;
+    }
+    create_table(conn, &schema);
+    if (options.bulk && !bulk_prepare(conn, &schema)) {
+      PQfinish(conn);
+      progress_stop(&progress);
+      input_files_free(&files);
+      return 1;
+    }
 
-  printf("Debug: Process file line by line\n");
-  while (fgets(line, MAX_LINE_LENGTH, file)) {
-    double parse_start = get_time();
+    if (options.checkpoint &&
+        !checkpoint_open(&checkpoint, conn, first->path, first->size,
+                         options.resume)) {
+      PQfinish(conn);
+      progress_stop(&progress);
+      input_files_free(&files);
+      return 1;
+    }
+    PQfinish(conn);
+  } else {
+    printf("Debug: Writing to the %s sink\n", sink_name(options.sink.kind));
+  }
 
-    LocationData raw_data;
-    ProcessedLocation processed_data;
+  // Every batch buffer the load will ever use, recycled between producers
+  // and writers
+  // Adaptive batching needs room to grow the batches
+  int batch_capacity = options.adaptive
+                           ? options.batch_size * TUNER_MAX_FACTOR
+                           : options.batch_size;
+  BatchPool pool;
+  batch_pool_init(&pool, batch_capacity,
+                  options.batch_pool
+                      ? batch_pool_limit(options.num_parsers,
+                                         options.queue_depth,
+                                         options.num_writers,
+                                         options.pipeline_depth) +
+                            (options.partition
+                                 ? router_pool_batches(options.num_writers)
+                                 : 0) +
+                            (options.sort_memory > 0 ? sorter_pool_batches()
+                                                     : 0)
+                      : 0);
+  BatchTuner tuner;
+  if (options.adaptive)
+    tuner_init(&tuner, &pool, options.batch_size, options.num_writers,
+               options.adaptive_writers);
+
+  // Rows leave the sorter in curve order, for the router or the writers
+  SpatialSorter sorter = {
+      .input = &queue, .pool = &pool, .memory = options.sort_memory};
+  BatchQueue *sent = &queue;
+  if (options.sort_memory > 0) {
+    sorter.metrics = benchmark_thread(&stats, "sorter", 0);
+    sorter_start(&sorter);
+    sent = &sorter.output;
+  }
 
-    line[strcspn(line, "\n")] = 0;
+  // Writers take their own key space from the router instead of the queue
+  BatchRouter router = {
+      .input = sent, .partitions = options.num_writers, .pool = &pool};
+  if (options.partition) {
+    router.metrics = benchmark_thread(&stats, "router", 0);
+    router_start(&router);
+  }
 
-    // Parse and process data
-    parse_line(line, &raw_data);
-    process_location_data(&raw_data, &processed_data);
+  pthread_t *workers = malloc(options.num_writers * sizeof(pthread_t));
 
-    stats.parse_time = get_time() - parse_start;
+  WorkerContext *contexts =
+      malloc(options.num_writers * sizeof(WorkerContext));
 
-    // Add to batch
-    memcpy(&current_batch->locations[current_batch->count], &processed_data,
-           sizeof(ProcessedLocation));
-    current_batch->count++;
+  // Failed batches are retried in halves until this many rows were rejected
+  RejectLog rejects;
+  reject_log_init(&rejects, options.max_rejects);
 
-    // If batch is full, insert and reset
-    if (current_batch->count == BATCH_SIZE) {
-      queue_push(&queue, current_batch);
-      current_batch = malloc(sizeof(Batch));
-      current_batch->locations = malloc(BATCH_SIZE * sizeof(ProcessedLocation));
-      current_batch->count = 0;
-    }
+  for (int i = 0; i < options.num_writers; i++) {
+    contexts[i].id = i;
+    contexts[i].queue = options.partition ? &router.outputs[i] : sent;
+    contexts[i].pool = &pool;
+    contexts[i].conninfo = conninfo;
+    contexts[i].schema = &schema;
+    contexts[i].copy_format = options.copy_format;
+    contexts[i].staging = options.staging;
+    contexts[i].pipeline_depth = options.pipeline_depth;
+    contexts[i].checkpoint = options.checkpoint ? &checkpoint : NULL;
+    contexts[i].tuner = options.adaptive ? &tuner : NULL;
+    contexts[i].delta = options.delta;
+    contexts[i].files = &files;
+    contexts[i].sink = &options.sink;
+    contexts[i].rejects = options.max_rejects > 0 ? &rejects : NULL;
+    contexts[i].metrics = benchmark_thread(&stats, "writer", i);
+    pthread_create(&workers[i], NULL, worker_thread, &contexts[i]);
   }
 
-  // Push final batch if not empty
-  if (current_batch->count > 0) {
-    queue_push(&queue, current_batch);
+  printf("Debug: Allocating memory for the batch size %d \n", batch_capacity);
+
+  // Large files keep several parsers each, many small ones get a loader
+  // per parser
+  int num_loaders = files.count < options.num_parsers ? files.count
+                                                      : options.num_parsers;
+  int loader_parsers = options.num_parsers / num_loaders;
+  FileLoader *loaders = malloc(num_loaders * sizeof(FileLoader));
+  for (int l = 0; l < num_loaders; l++) {
+    loaders[l] = (FileLoader){.files = &files,
+                              .options = &options,
+                              .schema = &schema,
+                              .num_parsers = loader_parsers,
+                              .pool = &pool,
+                              .queue = &queue,
+                              .dedup = dedup_set,
+                              .delta = delta_load,
+                              .checkpoint =
+                                  options.checkpoint ? &checkpoint : NULL,
+                              .metrics = malloc(loader_parsers *
+                                                sizeof(ThreadMetrics *))};
+    for (int i = 0; i < loader_parsers; i++)
+      loaders[l].metrics[i] =
+          benchmark_thread(&stats, "parser", l * loader_parsers + i);
+  }
+
+  double parse_start = get_time();
+  if (num_loaders == 1) {
+    loader_thread(&loaders[0]);
   } else {
-    free(current_batch->locations);
-    free(current_batch);
+    printf("Debug: Loading %d files on %d loaders of %d parsers\n",
+           files.count, num_loaders, loader_parsers);
+    for (int l = 0; l < num_loaders; l++)
+      pthread_create(&loaders[l].thread, NULL, loader_thread, &loaders[l]);
+    for (int l = 0; l < num_loaders; l++)
+      pthread_join(loaders[l].thread, NULL);
   }
+  int files_failed = 0;
+  for (int i = 0; i < files.count; i++)
+    files_failed += files.files[i].error != NULL;
+  bool input_failed = files_failed > 0;
+  // Only once every record was compared is a snapshot row known to be gone
+  size_t snapshot_deletes = 0;
+  if (options.snapshot_path && !input_failed)
+    snapshot_deletes = delta_push_deletes(&delta, &pool, &queue);
+  // Wall time of the parse phase, parsers run concurrently with the writers
+  stats.parse_time = get_time() - parse_start;
 
   // Singal workers to finish
-  pthread_mutex_lock(&queue.mutex);
-  queue.done = true;
-  pthread_cond_broadcast(&queue.not_empty);
-  pthread_mutex_unlock(&queue.mutex);
-
-  for (int i = 0; i < NUM_WORKERS; i++) {
+  queue_finish(&queue);
+  if (options.sort_memory > 0)
+    sorter_join(&sorter);
+  if (options.partition)
+    router_join(&router);
+  if (options.adaptive)
+    tuner_finish(&tuner);
+
+  for (int i = 0; i < options.num_writers; i++) {
     pthread_join(workers[i], NULL);
   }
+  progress_stop(&progress);
+
+  // Part of the load time, the table is not usable before
+  BulkTimings bulk = {0};
+  double bulk_start = get_time();
+  if (options.bulk) {
+    conn = PQconnectdb(conninfo);
+    if (PQstatus(conn) != CONNECTION_OK ||
+        !bulk_finish(conn, &schema, options.num_writers, &bulk))
+      fprintf(stderr, "Bulk load not finished, %s is left unlogged and "
+                      "without its unique index\n",
+              schema.table);
+    PQfinish(conn);
+    metrics_add(&main_metrics->counters[ROWS_DELETED], bulk.duplicates);
+  }
+  double bulk_time = get_time() - bulk_start;
 
   double total_time = get_time() - stats.start_time;
 
-  /*
-   * the Benchmark might need further refuctoring,
-   * some of the stats like records_processed might be wrong!!
-   * */
+  // Writers are joined, their metrics can be read
+  ThreadMetrics totals;
+  benchmark_totals(&stats, &totals);
+  const uint64_t *rows = totals.counters;
+  double db_time = 0;
+  for (int s = STAGE_ENCODE; s <= STAGE_COMMIT; s++)
+    db_time += stage_seconds(&totals, s);
+
   printf("\nBenchmark Results:\n");
-  printf("Total records processed: %d\n", stats.records_processed);
+  printf("Total records parsed: %llu\n",
+         (unsigned long long)rows[ROWS_PARSED]);
+  printf("  inserted: %llu, conflicted: %llu, skipped: %llu, failed: %llu\n",
+         (unsigned long long)rows[ROWS_INSERTED],
+         (unsigned long long)rows[ROWS_CONFLICTED],
+         (unsigned long long)rows[ROWS_SKIPPED],
+         (unsigned long long)rows[ROWS_FAILED]);
+  // Line numbers and records are read back from the inputs
+  if (rows[ROWS_REJECTED] > 0) {
+    printf("Rejected by the server: %llu rows%s\n",
+           (unsigned long long)rows[ROWS_REJECTED],
+           rejects.count < options.max_rejects
+               ? ""
+               : ", limit reached, later failed batches were not retried");
+    if (options.reject_path) {
+      if (reject_log_write(&rejects, &files, options.reject_path))
+        printf("Rejected rows written to %s\n", options.reject_path);
+    } else {
+      reject_log_print(&rejects, &files);
+    }
+  }
+  if (rows[ROWS_BAD_COORDINATES] > 0 || rows[ROWS_BAD_FUNCTION_CODE] > 0 ||
+      rows[ROWS_BAD_VALUE] > 0) {
+    printf("Malformed fields: %llu coordinates (loaded as NULL), %llu "
+           "function codes (loaded as no type)",
+           (unsigned long long)rows[ROWS_BAD_COORDINATES],
+           (unsigned long long)rows[ROWS_BAD_FUNCTION_CODE]);
+    if (rows[ROWS_BAD_VALUE] > 0)
+      printf(", %llu values (loaded as NULL)",
+             (unsigned long long)rows[ROWS_BAD_VALUE]);
+    printf("\n");
+  }
+  if (dedup_set) {
+    printf("Duplicates dropped before sending: %llu rows, %.1f MB of COPY "
+           "data (%zu keys%s)\n",
+           (unsigned long long)rows[ROWS_DUPLICATE],
+           totals.duplicate_bytes / 1e6, atomic_load(&dedup.count),
+           dedup_full(&dedup) ? ", set full, later keys were not checked"
+                              : "");
+  }
+  if (options.sort_memory > 0) {
+    printf("Spatial sort: %zu rows in Hilbert order, sort %.2f seconds",
+           sorter.rows, sorter.sort_seconds);
+    if (sorter.num_runs > 0)
+      printf(", %d runs, %.1f MB spilled, spill and merge %.2f seconds",
+             sorter.num_runs, sorter.spilled_bytes / 1e6,
+             sorter.merge_seconds);
+    printf("\n");
+  }
+  if (options.bulk) {
+    double load_time = total_time - bulk_time;
+    printf("Bulk load: %.2f seconds loading (%.1f records per second), "
+           "%.2f seconds to finish: dedup %.2f (%ld duplicates removed), "
+           "index %.2f, SET LOGGED %.2f\n",
+           load_time, rows[ROWS_PARSED] / load_time, bulk_time, bulk.dedup,
+           bulk.duplicates, bulk.index, bulk.logged);
+  }
+  if (options.delta) {
+    printf("Delta: %llu updated, %llu deleted, %llu unchanged rows not sent",
+           (unsigned long long)rows[ROWS_UPDATED],
+           (unsigned long long)rows[ROWS_DELETED],
+           (unsigned long long)rows[ROWS_UNCHANGED]);
+    if (options.snapshot_path)
+      printf(", %zu rows missing from the input", snapshot_deletes);
+    printf("\n");
+  }
+  // A failed batch would be missing from the table but not from the snapshot
+  if (options.snapshot_path) {
+    if (rows[ROWS_FAILED] > 0 || rows[ROWS_REJECTED] > 0 || input_failed)
+      printf("Load incomplete, snapshot %s left unchanged\n",
+             options.snapshot_path);
+    else
+      delta_write_snapshot(&delta);
+  }
+  if (options.checkpoint && rows[ROWS_FAILED] > 0) {
+    printf("Some batches failed, rerun with --resume to load only their "
+           "ranges\n");
+  }
+  // Failures stay with their file, the other files are loaded regardless
+  int incomplete = 0;
+  for (int i = 0; i < files.count; i++)
+    incomplete += files.files[i].error != NULL ||
+                  atomic_load(&files.files[i].failed_rows) > 0;
+  if (files.count > 1 || input_failed) {
+    printf("Files: %d loaded, %d incomplete\n", files.count - incomplete,
+           incomplete);
+    for (int i = 0; i < files.count; i++) {
+      const InputFile *file = &files.files[i];
+      uint64_t failed = atomic_load(&file->failed_rows);
+      printf("  %s: %llu records in %.2f seconds", file->path,
+             (unsigned long long)file->rows, file->seconds);
+      uint64_t rejected = atomic_load(&file->rejected_rows);
+      if (failed > 0)
+        printf(", %llu in failed batches", (unsigned long long)failed);
+      if (rejected > 0)
+        printf(", %llu rejected", (unsigned long long)rejected);
+      if (file->error)
+        printf(", %s", file->error);
+      printf("\n");
+    }
+  }
   printf("Total time: %.2f seconds\n", total_time);
-  printf("File parsing time: %.8f seconds (%.1f%%)\n", stats.parse_time,
+  printf("File parsing time: %.2f seconds (%.1f%%)\n", stats.parse_time,
          (stats.parse_time / total_time) * 100);
-  printf("Database time: %.2f seconds (%.1f%%)\n", stats.db_time,
-         (stats.db_time / total_time) * 100);
-  printf("Other operations: %.2f seconds (%.1f%%)\n",
-         total_time - (stats.parse_time + stats.db_time),
-         ((total_time - (stats.parse_time + stats.db_time)) / total_time) *
-             100);
-  printf("Average time per record: %.6f seconds\n",
-         total_time / stats.records_processed);
-  printf("Records per second: %.1f\n", stats.records_processed / total_time);
+  printf("  read: %.2f seconds, parse: %.2f seconds, waiting on writers: "
+         "%.2f seconds (summed over producers)\n",
+         stage_seconds(&totals, STAGE_READ),
+         stage_seconds(&totals, STAGE_PARSE),
+         stage_seconds(&totals, STAGE_ENQUEUE_WAIT));
+  printf("Database time: %.2f seconds (summed over writers)\n", db_time);
+  // Per batch overhead of preparing the staging table against the rest
+  if (totals.batches > 0) {
+    printf("  Staging setup: %.2f seconds (%.3f ms per batch)\n",
+           stage_seconds(&totals, STAGE_SETUP),
+           stage_seconds(&totals, STAGE_SETUP) / totals.batches * 1000);
+    printf("  encode: %.2f seconds, COPY: %.2f seconds, merge: %.2f "
+           "seconds, commit: %.2f seconds\n",
+           stage_seconds(&totals, STAGE_ENCODE),
+           stage_seconds(&totals, STAGE_COPY),
+           stage_seconds(&totals, STAGE_MERGE),
+           stage_seconds(&totals, STAGE_COMMIT));
+    printf("  writers waiting on parsers: %.2f seconds\n",
+           stage_seconds(&totals, STAGE_DEQUEUE_WAIT));
+  }
+  MemoryCounters memory;
+  read_memory_counters(&memory);
+  printf("Batch buffers: %zu allocated, %zu reused (%.1f MB each)\n",
+         atomic_load(&pool.created), atomic_load(&pool.reused),
+         batch_footprint(batch_capacity) / 1e6);
+  if (options.adaptive)
+    tuner_report(&tuner, stdout);
+  printf("Page faults: %ld minor, %ld major, peak RSS %.1f MB\n",
+         memory.minor_faults, memory.major_faults, memory.max_rss_kb / 1024.0);
+  if (rows[ROWS_PARSED] > 0) {
+    printf("Average time per record: %.6f seconds\n",
+           total_time / rows[ROWS_PARSED]);
+  }
+  printf("Records per second: %.1f\n", rows[ROWS_PARSED] / total_time);
+
+  if (options.metrics_path != NULL) {
+    FILE *out = strcmp(options.metrics_path, "-") == 0
+                    ? stdout
+                    : fopen(options.metrics_path, "w");
+    if (out == NULL) {
+      fprintf(stderr, "Could not write metrics to %s\n", options.metrics_path);
+    } else {
+      benchmark_write_json(&stats, out, total_time, &memory);
+      if (out != stdout)
+        fclose(out);
+    }
+  }
 
   printf("Debug: Cleanup \n");
 
-  pthread_mutex_destroy(&queue.mutex);
-  pthread_cond_destroy(&queue.not_full);
-  pthread_cond_destroy(&queue.not_empty);
-  pthread_mutex_destroy(&stats_mutex);
-  fclose(file);
-
-  return 0;
+  if (options.adaptive)
+    tuner_destroy(&tuner);
+  batch_pool_destroy(&pool);
+  queue_destroy(&queue);
+  if (options.partition)
+    router_destroy(&router);
+  if (options.sort_memory > 0)
+    sorter_destroy(&sorter);
+  benchmark_destroy(&stats);
+  for (int l = 0; l < num_loaders; l++)
+    free(loaders[l].metrics);
+  free(loaders);
+  input_files_free(&files);
+  checkpoint_close(&checkpoint);
+  reject_log_free(&rejects);
+  if (dedup_set)
+    dedup_free(&dedup);
+  if (delta_load)
+    delta_close(&delta);
+  free(workers);
+  free(contexts);
+  schema_free(&schema);
+
+  // Any row that did not make it fails the run, the other files are in
+  return incomplete > 0 || rows[ROWS_FAILED] > 0 ? 1 : 0;
 }
-
-
-
-
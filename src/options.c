@@ -0,0 +1,432 @@
+#include "options.h"
+#include "chunk_parser.h"
+#include "dedup.h"
+#include "pipeline_writer.h"
+#include "progress.h"
+#include "reject_log.h"
+#include "spatial_sort.h"
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DEFAULT_WRITERS 3
+#define DEFAULT_BATCH_SIZE 24000
+
+void print_usage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [options] <csv_file|directory|glob>...\n"
+          "  --reader R            stdio, mmap, uring or uring-direct input "
+          "reader\n"
+          "                        (default mmap)\n"
+          "  --parsers N           parser threads, not with the stdio reader "
+          "(default:\n"
+          "                        online cores)\n"
+          "  --writers N           database writer connections (default %d)\n"
+          "  --batch-size N        rows per batch (default %d)\n"
+          "  --adaptive            tune rows per batch during the load from "
+          "the measured\n"
+          "                        throughput, starting at --batch-size\n"
+          "  --adaptive-writers    --adaptive that also parks writers when "
+          "fewer connections\n"
+          "                        load as fast, up to --writers\n"
+          "  --copy-format F       csv or binary COPY stream (default binary)\n"
+          "  --staging temp|persistent\n"
+          "                        staging table per batch or per connection "
+          "(default persistent)\n"
+          "  --pipeline-depth N    pipelined non blocking writer encoding up "
+          "to N\n"
+          "                        batches ahead, 0 for the synchronous writer "
+          "(default 0)\n"
+          "  --queue-depth N       batches buffered between parsers and "
+          "writers (default %d)\n"
+          "  --no-batch-pool       malloc and free every batch instead of "
+          "recycling\n"
+          "  --metrics-json PATH   write per stage latency histograms and row "
+          "counts\n"
+          "                        as JSON, - for stdout\n"
+          "  --progress N          progress line on stderr every N seconds, 0 "
+          "for none\n"
+          "                        (default %d)\n"
+          "  --metrics-listen A    serve live metrics in Prometheus format on "
+          "localhost\n"
+          "                        port A, or on Unix socket path A\n"
+          "  --checkpoint          record the input ranges every batch "
+          "commits\n"
+          "  --resume              skip the ranges committed by an earlier "
+          "--checkpoint\n"
+          "                        run over the same file, implies "
+          "--checkpoint\n"
+          "  --dedup               drop rows whose (unlocode, name) was "
+          "already sent\n"
+          "  --dedup-memory MB     memory of the duplicate key set, implies "
+          "--dedup\n"
+          "                        (default %d)\n"
+          "  --delta               apply the change indicators: + and | "
+          "upsert, # renames,\n"
+          "                        X deletes, unmarked rows are not sent; "
+          "reads with one\n"
+          "                        parser and routes codes to writers\n"
+          "  --snapshot PATH       --delta against the rows of the previous "
+          "load kept in\n"
+          "                        PATH: unchanged rows are not sent, missing "
+          "ones deleted\n"
+          "  --bulk                first load into an empty table: plain COPY "
+          "into an\n"
+          "                        unlogged table, duplicates removed and the "
+          "index built\n"
+          "                        once at the end\n"
+          "  --partition-writers   give every writer its own key ranges (the "
+          "first three\n"
+          "                        characters of the unlocode), merges stop "
+          "contending on\n"
+          "                        the same index pages\n"
+          "  --sink S              postgres, null (encode and drop), "
+          "file:PATH (COPY\n"
+          "                        stream per writer in PATH.N) or "
+          "socket:PATH (COPY\n"
+          "                        protocol on a Unix socket) (default "
+          "postgres)\n"
+          "  --reject-file PATH    write the rows the server refused as CSV "
+          "with their\n"
+          "                        file, line and error\n"
+          "  --max-rejects N       rows rejected before failed batches are no "
+          "longer\n"
+          "                        retried in halves, 0 never retries "
+          "(default %d)\n"
+          "  --schema FILE         target table and column mapping, see "
+          "README (default:\n"
+          "                        the UN/LOCODE locations table)\n"
+          "  --spatial-sort        send the rows in Hilbert curve order of "
+          "their\n"
+          "                        coordinates, the writers start once the "
+          "input is parsed\n"
+          "  --sort-memory MB      memory of a sorted run, larger inputs are "
+          "merged from\n"
+          "                        temporary files, implies --spatial-sort "
+          "(default %d)\n",
+          program, DEFAULT_WRITERS, DEFAULT_BATCH_SIZE, QUEUE_SIZE,
+          DEFAULT_PROGRESS_INTERVAL, DEFAULT_DEDUP_MEMORY_MB,
+          DEFAULT_MAX_REJECTS, DEFAULT_SORT_MEMORY_MB);
+}
+
+static bool parse_count(const char *arg, const char *name, int max,
+                        int *value) {
+  char *end;
+  long n = strtol(arg, &end, 10);
+  if (*end != '\0' || n < 1 || n > max) {
+    fprintf(stderr, "Invalid %s '%s', expected 1..%d\n", name, arg, max);
+    return false;
+  }
+  *value = (int)n;
+  return true;
+}
+
+bool parse_options(int argc, char *argv[], LoaderOptions *options) {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+  options->reader_mode = READER_MMAP;
+  options->num_parsers = cores < 1 ? 1 : cores > MAX_PARSERS ? MAX_PARSERS : cores;
+  options->num_writers = DEFAULT_WRITERS;
+  options->batch_size = DEFAULT_BATCH_SIZE;
+  options->adaptive = false;
+  options->adaptive_writers = false;
+  options->copy_format = COPY_FORMAT_BINARY;
+  options->staging = STAGING_PERSISTENT;
+  options->pipeline_depth = 0;
+  options->queue_depth = QUEUE_SIZE;
+  options->batch_pool = true;
+  options->metrics_path = NULL;
+  options->progress_interval = DEFAULT_PROGRESS_INTERVAL;
+  options->metrics_listen = NULL;
+  options->checkpoint = false;
+  options->resume = false;
+  options->dedup_memory = 0;
+  options->delta = false;
+  options->snapshot_path = NULL;
+  options->bulk = false;
+  options->partition = false;
+  options->sink = (SinkConfig){.kind = SINK_POSTGRES};
+  options->reject_path = NULL;
+  options->max_rejects = DEFAULT_MAX_REJECTS;
+  options->schema_path = NULL;
+  options->sort_memory = 0;
+  options->input_paths = NULL;
+  options->num_inputs = 0;
+
+  static struct option long_options[] = {
+      {"reader", required_argument, 0, 'r'},
+      {"parsers", required_argument, 0, 'p'},
+      {"writers", required_argument, 0, 'w'},
+      {"batch-size", required_argument, 0, 'b'},
+      {"adaptive", no_argument, 0, 'A'},
+      {"adaptive-writers", no_argument, 0, 'W'},
+      {"copy-format", required_argument, 0, 'f'},
+      {"staging", required_argument, 0, 's'},
+      {"pipeline-depth", required_argument, 0, 'd'},
+      {"queue-depth", required_argument, 0, 'q'},
+      {"no-batch-pool", no_argument, 0, 'P'},
+      {"metrics-json", required_argument, 0, 'M'},
+      {"progress", required_argument, 0, 'i'},
+      {"metrics-listen", required_argument, 0, 'L'},
+      {"checkpoint", no_argument, 0, 'C'},
+      {"resume", no_argument, 0, 'R'},
+      {"dedup", no_argument, 0, 'D'},
+      {"dedup-memory", required_argument, 0, 'm'},
+      {"delta", no_argument, 0, 'T'},
+      {"snapshot", required_argument, 0, 'S'},
+      {"bulk", no_argument, 0, 'B'},
+      {"partition-writers", no_argument, 0, 'K'},
+      {"sink", required_argument, 0, 'O'},
+      {"reject-file", required_argument, 0, 'j'},
+      {"max-rejects", required_argument, 0, 'E'},
+      {"schema", required_argument, 0, 'H'},
+      {"spatial-sort", no_argument, 0, 'G'},
+      {"sort-memory", required_argument, 0, 'Y'},
+      {0, 0, 0, 0}};
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "r:p:w:b:f:s:d:q:", long_options, NULL)) != -1) {
+    switch (opt) {
+    case 'r':
+      if (!reader_parse_mode(optarg, &options->reader_mode)) {
+        fprintf(stderr, "Unknown reader '%s', expected stdio, mmap, uring or "
+                        "uring-direct\n",
+                optarg);
+        return false;
+      }
+      break;
+    case 'p':
+      if (!parse_count(optarg, "parser count", MAX_PARSERS,
+                       &options->num_parsers))
+        return false;
+      break;
+    case 'w':
+      if (!parse_count(optarg, "writer count", 256, &options->num_writers))
+        return false;
+      break;
+    case 'b':
+      if (!parse_count(optarg, "batch size", 1000000, &options->batch_size))
+        return false;
+      break;
+    case 'A':
+      options->adaptive = true;
+      break;
+    case 'W':
+      options->adaptive = true;
+      options->adaptive_writers = true;
+      break;
+    case 'f':
+      if (!copy_parse_format(optarg, &options->copy_format)) {
+        fprintf(stderr, "Unknown COPY format '%s', expected csv or binary\n",
+                optarg);
+        return false;
+      }
+      break;
+    case 's':
+      if (!staging_parse_mode(optarg, &options->staging)) {
+        fprintf(stderr, "Unknown staging '%s', expected temp or persistent\n",
+                optarg);
+        return false;
+      }
+      break;
+    case 'd':
+      if (strcmp(optarg, "0") == 0) {
+        options->pipeline_depth = 0;
+      } else if (!parse_count(optarg, "pipeline depth", MAX_PIPELINE_DEPTH,
+                              &options->pipeline_depth)) {
+        return false;
+      }
+      break;
+    case 'q':
+      if (!parse_count(optarg, "queue depth", 4096, &options->queue_depth))
+        return false;
+      break;
+    case 'P':
+      options->batch_pool = false;
+      break;
+    case 'M':
+      options->metrics_path = optarg;
+      break;
+    case 'i':
+      if (strcmp(optarg, "0") == 0) {
+        options->progress_interval = 0;
+      } else if (!parse_count(optarg, "progress interval", 86400,
+                              &options->progress_interval)) {
+        return false;
+      }
+      break;
+    case 'L':
+      options->metrics_listen = optarg;
+      break;
+    case 'C':
+      options->checkpoint = true;
+      break;
+    case 'R':
+      options->checkpoint = true;
+      options->resume = true;
+      break;
+    case 'D':
+      if (options->dedup_memory == 0)
+        options->dedup_memory = (size_t)DEFAULT_DEDUP_MEMORY_MB << 20;
+      break;
+    case 'm': {
+      int megabytes;
+      if (!parse_count(optarg, "dedup memory", 1 << 20, &megabytes))
+        return false;
+      options->dedup_memory = (size_t)megabytes << 20;
+      break;
+    }
+    case 'T':
+      options->delta = true;
+      break;
+    case 'S':
+      options->delta = true;
+      options->snapshot_path = optarg;
+      break;
+    case 'B':
+      options->bulk = true;
+      break;
+    case 'K':
+      options->partition = true;
+      break;
+    case 'O':
+      if (!sink_parse(optarg, &options->sink)) {
+        fprintf(stderr, "Unknown sink '%s', expected postgres, null, "
+                        "file:PATH or socket:PATH\n",
+                optarg);
+        return false;
+      }
+      break;
+    case 'j':
+      options->reject_path = optarg;
+      break;
+    case 'E':
+      if (strcmp(optarg, "0") == 0) {
+        options->max_rejects = 0;
+      } else if (!parse_count(optarg, "reject limit", 10000000,
+                              &options->max_rejects)) {
+        return false;
+      }
+      break;
+    case 'H':
+      options->schema_path = optarg;
+      break;
+    case 'G':
+      if (options->sort_memory == 0)
+        options->sort_memory = (size_t)DEFAULT_SORT_MEMORY_MB << 20;
+      break;
+    case 'Y': {
+      int megabytes;
+      if (!parse_count(optarg, "sort memory", 1 << 20, &megabytes))
+        return false;
+      options->sort_memory = (size_t)megabytes << 20;
+      break;
+    }
+    default:
+      print_usage(argv[0]);
+      return false;
+    }
+  }
+
+  if (argc - optind < 1) {
+    print_usage(argv[0]);
+    return false;
+  }
+  options->input_paths = &argv[optind];
+  options->num_inputs = argc - optind;
+
+  // Bulk rows go straight into the table, there is no merge to pipeline,
+  // apply changes with or record progress in
+  if (options->bulk) {
+    if (options->pipeline_depth > 0 || options->delta || options->checkpoint) {
+      fprintf(stderr, "--bulk cannot be combined with --pipeline-depth, "
+                      "--delta or --checkpoint\n");
+      return false;
+    }
+    options->staging = STAGING_NONE;
+  }
+
+  // Routed batches mix rows of many input ranges, and a parked writer would
+  // leave its key space unloaded
+  if (options->partition &&
+      (options->checkpoint || options->adaptive_writers)) {
+    fprintf(stderr, "--partition-writers cannot be combined with "
+                    "--checkpoint or --adaptive-writers\n");
+    return false;
+  }
+
+  // Sinks other than Postgres only take COPY streams, there is no table to
+  // merge into, prepare or record progress in. The socket copies straight
+  // into the table columns, which have no operation column
+  if (options->sink.kind != SINK_POSTGRES) {
+    if (options->bulk || options->checkpoint || options->pipeline_depth > 0) {
+      fprintf(stderr, "--sink %s cannot be combined with --bulk, "
+                      "--checkpoint or --pipeline-depth\n",
+              sink_name(options->sink.kind));
+      return false;
+    }
+    if (options->sink.kind == SINK_SOCKET && options->delta) {
+      fprintf(stderr, "--sink socket cannot be combined with --delta\n");
+      return false;
+    }
+  }
+
+  // Pipelined merges run against the per connection staging table
+  if (options->pipeline_depth > 0 && options->staging != STAGING_PERSISTENT) {
+    fprintf(stderr, "--pipeline-depth requires --staging persistent\n");
+    return false;
+  }
+
+  // Delta rows carry their operation in a staging table column. The order
+  // of a delete and a later insert of the same row matters, so the producers
+  // keep every row, and a resumed load would see only part of the snapshot.
+  // One parser sends the batches in input order and the router gives every
+  // code to one writer, so no two writers reorder the operations on a row
+  if (options->delta) {
+    if (options->staging != STAGING_PERSISTENT) {
+      fprintf(stderr, "--delta requires --staging persistent\n");
+      return false;
+    }
+    if (options->dedup_memory > 0 || options->checkpoint) {
+      fprintf(stderr, "--delta cannot be combined with --dedup or "
+                      "--checkpoint\n");
+      return false;
+    }
+    // Snapshots and the delta merge know only the locations columns
+    if (options->schema_path) {
+      fprintf(stderr, "--delta cannot be combined with --schema\n");
+      return false;
+    }
+    if (options->adaptive_writers) {
+      fprintf(stderr, "--delta cannot be combined with --adaptive-writers\n");
+      return false;
+    }
+    options->num_parsers = 1;
+    if (options->num_writers > 1)
+      options->partition = true;
+  }
+
+  // Sorted batches mix rows of the whole input, and a delete must not be
+  // reordered before the insert of the same row
+  if (options->sort_memory > 0 && (options->checkpoint || options->delta)) {
+    fprintf(stderr, "--spatial-sort cannot be combined with --checkpoint or "
+                    "--delta\n");
+    return false;
+  }
+
+  // The read ahead ring hands out chunks in order without seeking, like a
+  // compressed stream
+  if ((options->reader_mode == READER_URING ||
+       options->reader_mode == READER_URING_DIRECT) &&
+      options->checkpoint) {
+    fprintf(stderr, "--reader uring cannot be combined with --checkpoint\n");
+    return false;
+  }
+
+  // The stdio reader is a single sequential stream
+  if (options->reader_mode == READER_STDIO)
+    options->num_parsers = 1;
+  return true;
+}
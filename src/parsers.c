@@ -2,227 +2,234 @@
 #include <stdio.h>
 #include <string.h>
 #include "parsers.h"
+#include "csv_tokenizer.h"
 
-// Parse a single CSV line into LocationData structure
-void parse_line(char *line, LocationData *data) {
+// Strip the enclosing quotes of a field, reports whether "" escapes remain
+static bool unquote_field(FieldView *field) {
+  if (field->len < 2 || field->ptr[0] != '"' ||
+      field->ptr[field->len - 1] != '"')
+    return false;
+  field->ptr++;
+  field->len -= 2;
+  return memchr(field->ptr, '"', field->len) != NULL;
+}
+
+// Map the split fields of a record onto LocationData, no bytes are copied:
+// every field is a view into the record
+void parse_fields(const FieldView *fields, size_t count, LocationData *data) {
   // Initialize the structure to zero first
   memset(data, 0, sizeof(LocationData));
 
-  // Skip empty lines or lines with just quotes
-  if (line == NULL || strlen(line) <= 1) {
-    return;
-  }
-
-  char *rest = line;
-  char *token;
+  FieldView *columns[LOCATION_FIELDS] = {
+      &data->change,        &data->country_code, &data->location_code,
+      &data->name,          &data->name_wo_diacritics,
+      &data->subdivision,   &data->status,       &data->function_code,
+      &data->date,          &data->iata,         &data->coordinates,
+      &data->remarks};
 
-  // Change
-  token = strsep(&rest, ",");
-  if (token && strlen(token) > 0) {
-    data->change = token[0];
-  }
-
-  // Country
-  token = strsep(&rest, ",");
-  if (token && strlen(token) > 0) {
-    strncpy(data->country_code, token, 2);
-    data->country_code[2] = '\0';
-  }
+  if (count > LOCATION_FIELDS)
+    count = LOCATION_FIELDS;
 
-  // Location
-  token = strsep(&rest, ",");
-  if (token && strlen(token) > 0) {
-    strncpy(data->location_code, token, 3);
-    data->location_code[3] = '\0';
+  for (size_t i = 0; i < count; i++) {
+    *columns[i] = fields[i];
+    if (unquote_field(columns[i]))
+      data->escaped |= 1u << i;
   }
 
-  // Name
-  token = strsep(&rest, ",");
-  if (token && strlen(token) > 0) {
-    if (strlen(token) > 255) {
-      printf("Warning: Long name found (%zu chars): %s \n", strlen(token),
-             token);
-    }
-    strncpy(data->name, token, 99);
-    data->name[99] = '\0';
-  }
-
-  // Name without diacritics
-  token = strsep(&rest, ",");
-  if (token && strlen(token) > 0) {
-    strncpy(data->name_wo_diacritics, token, 99);
-    data->name_wo_diacritics[99] = '\0';
-  }
-
-  // Subdivision
-  token = strsep(&rest, ",");
-  if (token && strlen(token) > 0) {
-    strncpy(data->subdivision, token, 99);
-    data->subdivision[99] = '\0';
-  }
-
-  // Status
-  token = strsep(&rest, ",");
-  if (token && strlen(token) > 0) {
-    strncpy(data->status, token, 9);
-    data->status[9] = '\0';
-  }
-
-  // Function
-  token = strsep(&rest, ",");
-  if (token && strlen(token) > 0) {
-    strncpy(data->function_code, token, 8);
-    data->function_code[8] = '\0';
-  }
-
-  // Date
-  token = strsep(&rest, ",");
-  if (token && strlen(token) > 0) {
-    strncpy(data->date, token, 4);
-    data->date[4] = '\0';
+  if (data->name.len > 255) {
+    printf("Warning: Long name found (%zu chars): %.*s \n", data->name.len,
+           (int)data->name.len, data->name.ptr);
   }
+}
 
-  // IATA
-  token = strsep(&rest, ",");
-  if (token && strlen(token) > 0) {
-    strncpy(data->iata, token, 3);
-    data->iata[3] = '\0';
-  }
+// Parse a single CSV line into LocationData structure
+void parse_line(const char *line, size_t len, LocationData *data) {
+  FieldView fields[LOCATION_FIELDS];
+  size_t count = 0;
 
-  // Coordinates
-  token = strsep(&rest, ",");
-  if (token && strlen(token) > 0) {
-    strncpy(data->coordinates, token, 49);
-    data->coordinates[49] = '\0';
-  }
+  // Skip empty lines or lines with just quotes
+  if (line != NULL && len > 1)
+    count = csv_split_record(line, len, fields, LOCATION_FIELDS);
 
-  // Remarks - careful with the trailing quote
-  token = strsep(&rest, ",");
-  if (token) {
-    // Remove quotes if present
-    size_t len = strlen(token);
-    if (len > 0) {
-      if (token[len - 1] == '"')
-        token[len - 1] = '\0';
-      if (token[0] == '"')
-        token++;
-      strncpy(data->remarks, token, 199);
-      data->remarks[199] = '\0';
-    }
-  }
+  parse_fields(fields, count, data);
 }
 
-// Parse coordinate string into latitude and longitude
-bool parse_coordinates(const char *coord_str, double *lat, double *lon) {
-  if (!coord_str || strlen(coord_str) == 0) {
-    *lat = 0;
-    *lon = 0;
-    return false;
-  }
-
-  // Expected format: "DDMM[N/S] DDDMM[E/W]"
-  int lat_deg, lat_min, lon_deg, lon_min;
-  char lat_dir, lon_dir;
-
-  if (sscanf(coord_str, "%2d%2d%c %3d%2d%c", &lat_deg, &lat_min, &lat_dir,
-             &lon_deg, &lon_min, &lon_dir) != 6) {
-    *lat = 0;
-    *lon = 0;
-    return false;
-  }
+// Value of an ASCII digit, anything else maps above 9
+static inline unsigned digit(char c) { return (unsigned char)c - '0'; }
+
+// Parse coordinate string into latitude and longitude. The field always has
+// the fixed shape "DDMMN DDDMME", so every digit sits at a known offset
+CoordStatus parse_coordinates(FieldView coord, double *lat, double *lon) {
+  *lat = 0;
+  *lon = 0;
+
+  while (coord.len > 0 && (coord.ptr[coord.len - 1] == ' ' ||
+                           coord.ptr[coord.len - 1] == '\r'))
+    coord.len--;
+  if (coord.len == 0)
+    return COORD_MISSING;
+  if (coord.len != 12)
+    return COORD_MALFORMED;
+
+  const char *p = coord.ptr;
+  unsigned d0 = digit(p[0]), d1 = digit(p[1]), d2 = digit(p[2]),
+           d3 = digit(p[3]), d6 = digit(p[6]), d7 = digit(p[7]),
+           d8 = digit(p[8]), d9 = digit(p[9]), d10 = digit(p[10]);
+  unsigned lat_deg = d0 * 10 + d1;
+  unsigned lat_min = d2 * 10 + d3;
+  unsigned lon_deg = d6 * 100 + d7 * 10 + d8;
+  unsigned lon_min = d9 * 10 + d10;
+
+  // One combined test instead of a branch per character. The range is
+  // checked in minutes, 90°59' is past the pole even though 90 is not
+  bool bad = (d0 > 9) | (d1 > 9) | (d2 > 9) | (d3 > 9) | (d6 > 9) | (d7 > 9) |
+             (d8 > 9) | (d9 > 9) | (d10 > 9) | (p[5] != ' ') |
+             (p[4] != 'N' && p[4] != 'S') | (p[11] != 'E' && p[11] != 'W') |
+             (lat_min > 59) | (lon_min > 59) |
+             (lat_deg * 60 + lat_min > 90 * 60) |
+             (lon_deg * 60 + lon_min > 180 * 60);
+  if (bad)
+    return COORD_MALFORMED;
 
   *lat = lat_deg + lat_min / 60.0;
   *lon = lon_deg + lon_min / 60.0;
-
-  if (lat_dir == 'S')
+  if (p[4] == 'S')
     *lat = -*lat;
-  if (lon_dir == 'W')
+  if (p[11] == 'W')
     *lon = -*lon;
 
-  return true;
+  return COORD_OK;
 }
 
+// Function code characters: location type bits plus a marker for characters
+// that may appear in the field at all
+#define FUNCTION_PORT 0x1
+#define FUNCTION_TRAIN 0x2
+#define FUNCTION_AIRPORT 0x4
+#define FUNCTION_VALID 0x80
+
+static const unsigned char function_code_table[256] = {
+    ['-'] = FUNCTION_VALID,
+    ['0'] = FUNCTION_VALID,
+    ['1'] = FUNCTION_VALID | FUNCTION_PORT,
+    ['2'] = FUNCTION_VALID | FUNCTION_TRAIN,
+    ['3'] = FUNCTION_VALID,
+    ['4'] = FUNCTION_VALID | FUNCTION_AIRPORT,
+    ['5'] = FUNCTION_VALID,
+    ['6'] = FUNCTION_VALID,
+    ['7'] = FUNCTION_VALID,
+    ['8'] = FUNCTION_VALID,
+    ['9'] = FUNCTION_VALID,
+    ['B'] = FUNCTION_VALID,
+};
+
 // Parse function code to determine location type
-void parse_function_code(const char *function_code, bool *is_port,
+bool parse_function_code(FieldView function_code, bool *is_port,
                          bool *is_airport, bool *is_train) {
   *is_port = false;
   *is_airport = false;
   *is_train = false;
 
-  if (!function_code || strlen(function_code) < 8)
-    return;
+  if (function_code.len == 0)
+    return true;
+  if (function_code.len != 8)
+    return false;
 
+  // OR the type bits of all eight characters, AND the valid markers
+  const unsigned char *p = (const unsigned char *)function_code.ptr;
+  unsigned any = 0;
+  unsigned all = FUNCTION_VALID;
   for (int i = 0; i < 8; i++) {
-    switch (function_code[i]) {
-    case '1':
-      *is_port = true;
-      break;
-    case '2':
-      *is_train = true;
-      break;
-    case '4':
-      *is_airport = true;
-      break;
-    }
+    any |= function_code_table[p[i]];
+    all &= function_code_table[p[i]];
   }
-}
+  if (!all)
+    return false;
 
-// Process raw location data into final format
-void process_location_data(LocationData *raw, ProcessedLocation *processed) {
-  // Create UNLOCODE (country + location)
-  snprintf(processed->unlocode, 6, "%s%s", raw->country_code,
-           raw->location_code);
+  *is_port = any & FUNCTION_PORT;
+  *is_train = any & FUNCTION_TRAIN;
+  *is_airport = any & FUNCTION_AIRPORT;
+  return true;
+}
 
-  // Copy name and country code
-  strncpy(processed->name, raw->name, 99);
-  processed->name[99] = '\0';
-  strncpy(processed->country_code, raw->country_code, 2);
-  processed->country_code[2] = '\0';
+// Copy at most cap - 1 bytes of a view into a fixed, NUL terminated field
+static void copy_fixed(char *dst, size_t cap, FieldView src) {
+  size_t n = src.len < cap - 1 ? src.len : cap - 1;
+  memcpy(dst, src.ptr, n);
+  dst[n] = '\0';
+}
 
-  // Parse coordinates
-  parse_coordinates(raw->coordinates, &processed->latitude,
-                    &processed->longitude);
+// Process raw location data into final format
+unsigned process_location_data(LocationData *raw,
+                               ProcessedLocation *processed) {
+  unsigned errors = 0;
+
+  // Create UNLOCODE (country + location), both stay views until the row is
+  // appended
+  FieldView country = raw->country_code;
+  if (country.len > 2)
+    country.len = 2;
+  FieldView location = raw->location_code;
+  if (location.len > 3)
+    location.len = 3;
+  processed->country = (CodeView){{country}, 1};
+  processed->key = (CodeView){{country, location}, 2};
+
+  processed->change = raw->change.len > 0 ? raw->change.ptr[0] : ' ';
+
+  // The name stays a view until the row is appended to a batch
+  processed->name = raw->name;
+  processed->name_escaped = (raw->escaped & (1u << FIELD_NAME)) != 0;
+
+  // Parse coordinates, rows without a usable position are kept but carry
+  // no location
+  CoordStatus coord = parse_coordinates(
+      raw->coordinates, &processed->latitude, &processed->longitude);
+  processed->has_coordinates = coord == COORD_OK;
+  if (coord == COORD_MALFORMED)
+    errors |= PARSE_BAD_COORDINATES;
 
   // Parse function code
-  parse_function_code(raw->function_code, &processed->is_port,
-                      &processed->is_airport, &processed->is_train_station);
+  if (!parse_function_code(raw->function_code, &processed->is_port,
+                           &processed->is_airport,
+                           &processed->is_train_station))
+    errors |= PARSE_BAD_FUNCTION_CODE;
+
+  return errors;
 }
 
 
-char *escape_csv_field(const char *field, char *buffer, size_t buffer_size) {
-  if (!field || strlen(field) == 0) {
+char *escape_csv_field(FieldView field, char *buffer, size_t buffer_size) {
+  if (field.len == 0) {
     strncpy(buffer, "\"\"", buffer_size);
     return buffer;
   }
 
   // Check if we need to escape
   bool needs_escape = false;
-  for (const char *p = field; *p; p++) {
-    if (*p == '"' || *p == ',' || *p == '\n' || *p == '\r') {
+  for (size_t i = 0; i < field.len; i++) {
+    char c = field.ptr[i];
+    if (c == '"' || c == ',' || c == '\n' || c == '\r') {
       needs_escape = true;
       break;
     }
   }
 
   if (!needs_escape) {
-    strncpy(buffer, field, buffer_size);
+    copy_fixed(buffer, buffer_size, field);
     return buffer;
   }
 
   size_t j = 0;
   buffer[j++] = '"';
-  for (const char *p = field; *p && j < buffer_size - 2; p++) {
-    if (*p == '"') {
+  for (size_t i = 0; i < field.len && j < buffer_size - 3; i++) {
+    if (field.ptr[i] == '"') {
       buffer[j++] = '"';
     }
-    buffer[j++] = *p;
+    buffer[j++] = field.ptr[i];
   }
   buffer[j++] = '"';
   buffer[j] = '\0';
 
   return buffer;
 }
-
-
-
-
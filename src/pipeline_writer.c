@@ -0,0 +1,312 @@
+#include "pipeline_writer.h"
+#include <poll.h>
+#include <stdlib.h>
+
+// A batch already serialized into its COPY stream, waiting to be sent
+typedef struct {
+  Batch *batch;
+  CopyBuffer buffer;
+  int rows; // valid rows in the stream
+} EncodedBatch;
+
+typedef struct {
+  WorkerContext *ctx;
+  WriterSession *session;
+
+  EncodedBatch *slots; // ring of ctx->pipeline_depth encoded batches
+  int head;
+  int ready;
+  bool drained; // the queue is done and empty
+
+  Batch *pending; // batch whose merge and COMMIT results are outstanding
+  int pending_rows;
+  double pending_copy_time;
+  double pending_sent; // when the pipeline was flushed
+  bool in_transaction;
+} PipelineWriter;
+
+// Statements pipelined after every COPY, the last two open the next batch
+static const char *const after_copy[] = {NULL, "COMMIT", "BEGIN",
+                                         "TRUNCATE staging_locations"};
+#define AFTER_COPY_STATEMENTS 4
+
+static void encode_slot(PipelineWriter *w, Batch *batch) {
+  int depth = w->ctx->pipeline_depth;
+  EncodedBatch *slot = &w->slots[(w->head + w->ready) % depth];
+  slot->batch = batch;
+  metrics_add(&w->ctx->metrics->in_flight_rows, batch->count);
+  Ticks start = ticks_now();
+  slot->rows = copy_encode_batch(&slot->buffer, w->session->copy_format, batch);
+  stage_record_ticks(w->ctx->metrics, STAGE_ENCODE, ticks_now() - start);
+  w->ready++;
+}
+
+// Useful work while the socket is busy: encode a queued batch if a slot is
+// free. Returns false when there was nothing to do
+static bool encode_ahead(PipelineWriter *w) {
+  if (w->ready >= w->ctx->pipeline_depth || w->drained)
+    return false;
+  Batch *batch = queue_try_pop(w->ctx->queue, &w->drained);
+  if (batch == NULL)
+    return false;
+  encode_slot(w, batch);
+  return true;
+}
+
+static bool wait_socket(PGconn *conn, short events) {
+  struct pollfd pfd = {.fd = PQsocket(conn), .events = events};
+  return poll(&pfd, 1, -1) >= 0;
+}
+
+// Push libpq's output buffer out, encoding ahead instead of blocking
+static bool flush_nonblocking(PipelineWriter *w) {
+  PGconn *conn = w->session->conn;
+  int rc;
+  while ((rc = PQflush(conn)) == 1) {
+    if (encode_ahead(w))
+      continue;
+    if (!wait_socket(conn, POLLOUT | POLLIN) || !PQconsumeInput(conn))
+      return false;
+  }
+  return rc == 0;
+}
+
+static void abort_transaction(PipelineWriter *w) {
+  PGconn *conn = w->session->conn;
+  if (PQpipelineStatus(conn) != PQ_PIPELINE_OFF)
+    PQexitPipelineMode(conn);
+  PQclear(PQexec(conn, "ROLLBACK"));
+  w->in_transaction = false;
+}
+
+static void account_batch(PipelineWriter *w, Batch *batch, bool success,
+                          int rows_sent, const MergeCounts *merged,
+                          double copy_time, double merge_time) {
+  WorkerContext *ctx = w->ctx;
+  ThreadMetrics *metrics = ctx->metrics;
+  if (success) {
+    stage_record(metrics, STAGE_COPY, copy_time);
+    stage_record(metrics, STAGE_MERGE, merge_time);
+    metrics_add(&metrics->batches, 1);
+    writer_count_rows(metrics, batch, rows_sent, merged);
+    if (ctx->tuner)
+      tuner_record(ctx->tuner, batch->count, merge_time);
+  } else {
+    // The connection is out of the pipeline and its transaction by now
+    writer_batch_failed(ctx, w->session, NULL, batch);
+  }
+  metrics_set(&metrics->in_flight_rows, metrics->in_flight_rows - batch->count);
+  batch_release(ctx->pool, batch);
+}
+
+// Collect the results of the pipelined merge, COMMIT, BEGIN and TRUNCATE
+static void finish_pending(PipelineWriter *w) {
+  PGconn *conn = w->session->conn;
+  bool ok[AFTER_COPY_STATEMENTS] = {false};
+  MergeCounts merged = {0};
+  int index = 0;
+  int nulls = 0;
+
+  while (true) {
+    PGresult *res = PQgetResult(conn);
+    if (res == NULL) {
+      // One NULL separates the results of two statements, two in a row mean
+      // the connection has nothing more to give
+      if (++nulls > 1 || PQstatus(conn) == CONNECTION_BAD)
+        break;
+      continue;
+    }
+    nulls = 0;
+
+    ExecStatusType status = PQresultStatus(res);
+    if (status == PGRES_PIPELINE_SYNC) {
+      PQclear(res);
+      break;
+    }
+    if (index < AFTER_COPY_STATEMENTS) {
+      if (index == 0)
+        ok[0] = merge_result(w->session, res, &merged);
+      else
+        ok[index] = status == PGRES_COMMAND_OK;
+      if (status == PGRES_FATAL_ERROR)
+        fprintf(stderr, "Worker %d: pipelined %s failed: %s", w->ctx->id,
+                index == 0 ? "merge" : after_copy[index],
+                PQresultErrorMessage(res));
+    }
+    index++;
+    PQclear(res);
+  }
+
+  double merge_time = get_time() - w->pending_sent;
+  bool committed = ok[0] && ok[1];
+  if (committed && ok[2] && ok[3]) {
+    PQexitPipelineMode(conn);
+    w->in_transaction = true;
+  } else {
+    // A failed batch is retried on this connection
+    abort_transaction(w);
+  }
+
+  account_batch(w, w->pending, committed, w->pending_rows, &merged,
+                w->pending_copy_time, merge_time);
+  w->pending = NULL;
+}
+
+static bool begin_transaction(PipelineWriter *w) {
+  double start = get_time();
+  PGresult *res = PQexec(w->session->conn, "BEGIN; TRUNCATE staging_locations");
+  bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+  if (!ok)
+    fprintf(stderr, "Worker %d: BEGIN failed: %s", w->ctx->id,
+            PQerrorMessage(w->session->conn));
+  PQclear(res);
+  if (!ok) {
+    abort_transaction(w);
+    return false;
+  }
+  stage_record(w->ctx->metrics, STAGE_SETUP, get_time() - start);
+  w->in_transaction = true;
+  return true;
+}
+
+// Stream the encoded batch, then pipeline the statements that follow it
+static bool send_batch(PipelineWriter *w, EncodedBatch *slot) {
+  PGconn *conn = w->session->conn;
+
+  if (!w->in_transaction && !begin_transaction(w))
+    return false;
+  double start = get_time();
+
+  const char *copy_cmd =
+      w->session->schema->sql.copy_staging[w->session->copy_format];
+  PGresult *res = PQexec(conn, copy_cmd);
+  if (PQresultStatus(res) != PGRES_COPY_IN) {
+    fprintf(stderr, "Worker %d: COPY command failed: %s", w->ctx->id,
+            PQerrorMessage(conn));
+    PQclear(res);
+    abort_transaction(w);
+    return false;
+  }
+  PQclear(res);
+
+  // Non blocking send, the next batches are encoded while the socket drains
+  PQsetnonblocking(conn, 1);
+  bool ok = true;
+  for (size_t sent = 0; ok && sent < slot->buffer.len;) {
+    size_t n = slot->buffer.len - sent;
+    if (n > PIPELINE_SEND_CHUNK)
+      n = PIPELINE_SEND_CHUNK;
+    int rc = PQputCopyData(conn, slot->buffer.data + sent, (int)n);
+    if (rc == 1)
+      sent += n;
+    ok = rc >= 0 && flush_nonblocking(w);
+  }
+  ok = ok && PQputCopyEnd(conn, ok ? NULL : "Error while copying data") == 1 &&
+       flush_nonblocking(w);
+  PQsetnonblocking(conn, 0);
+
+  res = PQgetResult(conn);
+  if (!ok || PQresultStatus(res) != PGRES_COMMAND_OK) {
+    fprintf(stderr, "Worker %d: COPY failed: %s", w->ctx->id,
+            PQerrorMessage(conn));
+    PQclear(res);
+    while ((res = PQgetResult(conn)) != NULL)
+      PQclear(res);
+    abort_transaction(w);
+    return false;
+  }
+  PQclear(res);
+  PQclear(PQgetResult(conn));
+  w->pending_copy_time = get_time() - start;
+
+  // Merge, COMMIT and the next BEGIN/TRUNCATE go out in one round trip
+  if (PQenterPipelineMode(conn) != 1) {
+    fprintf(stderr, "Worker %d: pipeline mode unavailable: %s", w->ctx->id,
+            PQerrorMessage(conn));
+    abort_transaction(w);
+    return false;
+  }
+  PQsetnonblocking(conn, 1);
+  ProgressParams params;
+  int num_params = merge_params(w->session, slot->batch, &params);
+  ok = PQsendQueryPrepared(conn, MERGE_STATEMENT, num_params, params.values,
+                           NULL, NULL, 0) == 1;
+  for (int i = 1; ok && i < AFTER_COPY_STATEMENTS; i++)
+    ok = PQsendQueryParams(conn, after_copy[i], 0, NULL, NULL, NULL, NULL,
+                           0) == 1;
+  ok = ok && PQpipelineSync(conn) == 1 && flush_nonblocking(w);
+  PQsetnonblocking(conn, 0);
+
+  if (!ok) {
+    fprintf(stderr, "Worker %d: pipeline send failed: %s", w->ctx->id,
+            PQerrorMessage(conn));
+    abort_transaction(w);
+    return false;
+  }
+
+  w->pending_sent = get_time();
+  w->in_transaction = false;
+  return true;
+}
+
+void pipelined_writer_loop(WorkerContext *ctx, WriterSession *session) {
+  PipelineWriter w = {.ctx = ctx, .session = session};
+  int depth = ctx->pipeline_depth;
+
+  w.slots = calloc(depth, sizeof(EncodedBatch));
+  for (int i = 0; i < depth; i++)
+    copy_buffer_init(&w.slots[i].buffer);
+
+  while (true) {
+    // Encode ahead while the previous merge runs on the server, only block
+    // on the queue when there is nothing else in flight
+    while (w.ready < depth && !w.drained) {
+      if (w.ready == 0 && w.pending == NULL) {
+        // Only park with nothing in flight
+        if (ctx->tuner)
+          tuner_wait_active(ctx->tuner, ctx->id);
+        Ticks wait_start = ticks_now();
+        Batch *batch = queue_pop(ctx->queue);
+        stage_record_ticks(ctx->metrics, STAGE_DEQUEUE_WAIT,
+                           ticks_now() - wait_start);
+        if (batch == NULL) {
+          w.drained = true;
+          break;
+        }
+        encode_slot(&w, batch);
+      } else if (!encode_ahead(&w)) {
+        break;
+      }
+    }
+
+    if (w.pending)
+      finish_pending(&w);
+
+    if (w.ready == 0) {
+      if (w.drained)
+        break;
+      continue;
+    }
+
+    // The slot stays occupied while it is streamed, encode_ahead must not
+    // reuse its buffer
+    EncodedBatch *slot = &w.slots[w.head];
+    if (send_batch(&w, slot)) {
+      w.pending = slot->batch;
+      w.pending_rows = slot->rows;
+    } else {
+      account_batch(&w, slot->batch, false, 0, NULL, 0, 0);
+    }
+    slot->batch = NULL;
+    w.head = (w.head + 1) % depth;
+    w.ready--;
+  }
+
+  // The last pipeline opened a transaction nobody uses
+  if (w.in_transaction)
+    PQclear(PQexec(session->conn, "ROLLBACK"));
+
+  for (int i = 0; i < depth; i++)
+    copy_buffer_free(&w.slots[i].buffer);
+  free(w.slots);
+}
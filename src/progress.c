@@ -0,0 +1,337 @@
+#include "progress.h"
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static double histogram_seconds(const Histogram *histogram) {
+  return metrics_load(&histogram->sum_ns) / 1e9;
+}
+
+// Seconds a writer spent on the database, encode included
+static double writer_db_seconds(const ThreadMetrics *metrics) {
+  double seconds = 0;
+  for (int s = STAGE_ENCODE; s <= STAGE_COMMIT; s++)
+    seconds += histogram_seconds(&metrics->stages[s]);
+  return seconds;
+}
+
+static bool is_writer(const ThreadMetrics *metrics) {
+  return strcmp(metrics->role, "writer") == 0;
+}
+
+static void take_sample(ProgressReporter *reporter, ProgressSample *sample) {
+  Benchmark *bench = reporter->bench;
+  memset(sample, 0, sizeof(ProgressSample));
+  sample->time = get_time();
+
+  pthread_mutex_lock(&bench->lock);
+  for (int t = 0; t < bench->num_threads; t++) {
+    const ThreadMetrics *metrics = bench->threads[t];
+    if (is_writer(metrics)) {
+      sample->writers++;
+      sample->dequeue_wait +=
+          histogram_seconds(&metrics->stages[STAGE_DEQUEUE_WAIT]);
+      continue;
+    }
+    uint64_t bytes = metrics_load(&metrics->bytes_read);
+    if (bytes > 0)
+      sample->producers++;
+    sample->bytes += bytes;
+    sample->rows += metrics_load(&metrics->counters[ROWS_PARSED]);
+    sample->enqueue_wait +=
+        histogram_seconds(&metrics->stages[STAGE_ENQUEUE_WAIT]);
+  }
+  pthread_mutex_unlock(&bench->lock);
+}
+
+// Which side held the other up during the interval: producers blocked on a
+// full queue mean the writers are behind, writers blocked on an empty queue
+// mean the parsers are
+static const char *bottleneck(const ProgressSample *now,
+                              const ProgressSample *last) {
+  double elapsed = now->time - last->time;
+  if (elapsed <= 0)
+    return "starting";
+  double producers_waiting = now->producers == 0
+                                 ? 0
+                                 : (now->enqueue_wait - last->enqueue_wait) /
+                                       (elapsed * now->producers);
+  double writers_waiting = now->writers == 0
+                               ? 0
+                               : (now->dequeue_wait - last->dequeue_wait) /
+                                     (elapsed * now->writers);
+  if (producers_waiting > 0.5 && producers_waiting > writers_waiting)
+    return "db bound";
+  if (writers_waiting > 0.5)
+    return "parse bound";
+  return "balanced";
+}
+
+static void print_progress(ProgressReporter *reporter) {
+  ProgressSample now;
+  take_sample(reporter, &now);
+  ProgressSample *last = &reporter->last;
+  double elapsed = now.time - last->time;
+  double row_rate = elapsed > 0 ? (now.rows - last->rows) / elapsed : 0;
+  double byte_rate = elapsed > 0 ? (now.bytes - last->bytes) / elapsed : 0;
+
+  fprintf(stderr, "Progress: %llu rows (%.0f/s), %.1f MB (%.1f MB/s)",
+          (unsigned long long)now.rows, row_rate, now.bytes / 1e6,
+          byte_rate / 1e6);
+  if (reporter->input_size > reporter->input_start) {
+    size_t total = reporter->input_size - reporter->input_start;
+    size_t remaining = now.bytes < total ? total - now.bytes : 0;
+    fprintf(stderr, ", %.1f%%", 100.0 * now.bytes / total);
+    if (byte_rate > 0)
+      fprintf(stderr, ", ETA %.0f s", remaining / byte_rate);
+  }
+  fprintf(stderr, ", queue %zu/%zu, %s\n", queue_count(reporter->queue),
+          reporter->queue->capacity, bottleneck(&now, last));
+
+  // One line for all writers: rows held and database time so far
+  Benchmark *bench = reporter->bench;
+  fprintf(stderr, "  writers:");
+  pthread_mutex_lock(&bench->lock);
+  for (int t = 0; t < bench->num_threads; t++) {
+    const ThreadMetrics *metrics = bench->threads[t];
+    if (!is_writer(metrics))
+      continue;
+    uint64_t in_flight = metrics_load(&metrics->in_flight_rows);
+    if (in_flight > 0)
+      fprintf(stderr, " #%d %llu rows %.1fs db", metrics->id,
+              (unsigned long long)in_flight, writer_db_seconds(metrics));
+    else
+      fprintf(stderr, " #%d idle %.1fs db", metrics->id,
+              writer_db_seconds(metrics));
+  }
+  pthread_mutex_unlock(&bench->lock);
+  fprintf(stderr, "\n");
+
+  *last = now;
+}
+
+// Prometheus text exposition format, version 0.0.4
+static void write_prometheus(ProgressReporter *reporter, FILE *out) {
+  Benchmark *bench = reporter->bench;
+  ProgressSample now;
+  take_sample(reporter, &now);
+
+  fprintf(out, "# TYPE csv_loader_input_bytes gauge\n");
+  fprintf(out, "csv_loader_input_bytes %zu\n",
+          reporter->input_size > reporter->input_start
+              ? reporter->input_size - reporter->input_start
+              : 0);
+  fprintf(out, "# TYPE csv_loader_read_bytes_total counter\n");
+  fprintf(out, "csv_loader_read_bytes_total %llu\n",
+          (unsigned long long)now.bytes);
+  fprintf(out, "# TYPE csv_loader_queue_batches gauge\n");
+  fprintf(out, "csv_loader_queue_batches %zu\n", queue_count(reporter->queue));
+  fprintf(out, "# TYPE csv_loader_queue_capacity gauge\n");
+  fprintf(out, "csv_loader_queue_capacity %zu\n", reporter->queue->capacity);
+
+  pthread_mutex_lock(&bench->lock);
+  fprintf(out, "# TYPE csv_loader_rows_total counter\n");
+  for (int c = 0; c < COUNTER_COUNT; c++) {
+    uint64_t total = 0;
+    for (int t = 0; t < bench->num_threads; t++)
+      total += metrics_load(&bench->threads[t]->counters[c]);
+    fprintf(out, "csv_loader_rows_total{outcome=\"%s\"} %llu\n",
+            counter_name(c), (unsigned long long)total);
+  }
+
+  // Seconds and batches of every stage a thread has run, one family each
+  for (int family = 0; family < 2; family++) {
+    const char *name = family == 0 ? "csv_loader_stage_seconds_total"
+                                   : "csv_loader_stage_batches_total";
+    fprintf(out, "# TYPE %s counter\n", name);
+    for (int t = 0; t < bench->num_threads; t++) {
+      const ThreadMetrics *metrics = bench->threads[t];
+      for (int s = 0; s < STAGE_COUNT; s++) {
+        const Histogram *histogram = &metrics->stages[s];
+        uint64_t count = metrics_load(&histogram->count);
+        if (count == 0)
+          continue;
+        fprintf(out, "%s{stage=\"%s\",role=\"%s\",thread=\"%d\"} ", name,
+                stage_name(s), metrics->role, metrics->id);
+        if (family == 0)
+          fprintf(out, "%.6f\n", histogram_seconds(histogram));
+        else
+          fprintf(out, "%llu\n", (unsigned long long)count);
+      }
+    }
+  }
+
+  fprintf(out, "# TYPE csv_loader_writer_in_flight_rows gauge\n");
+  for (int t = 0; t < bench->num_threads; t++) {
+    const ThreadMetrics *metrics = bench->threads[t];
+    if (is_writer(metrics))
+      fprintf(out, "csv_loader_writer_in_flight_rows{thread=\"%d\"} %llu\n",
+              metrics->id,
+              (unsigned long long)metrics_load(&metrics->in_flight_rows));
+  }
+  pthread_mutex_unlock(&bench->lock);
+}
+
+// Answer one scrape. The request itself is not parsed, every path gets the
+// metrics
+static void serve_client(ProgressReporter *reporter, int client) {
+  struct timeval timeout = {1, 0};
+  setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  char request[4096];
+  if (recv(client, request, sizeof(request), 0) < 0) {
+    close(client);
+    return;
+  }
+
+  char *body = NULL;
+  size_t body_len = 0;
+  FILE *out = open_memstream(&body, &body_len);
+  if (out == NULL) {
+    close(client);
+    return;
+  }
+  write_prometheus(reporter, out);
+  fclose(out);
+
+  char header[128];
+  int header_len = snprintf(header, sizeof(header),
+                            "HTTP/1.0 200 OK\r\n"
+                            "Content-Type: text/plain; version=0.0.4\r\n"
+                            "Content-Length: %zu\r\n\r\n",
+                            body_len);
+  if (write(client, header, header_len) == header_len)
+    (void)!write(client, body, body_len);
+  free(body);
+  close(client);
+}
+
+// A number is a TCP port on the loopback interface, anything else a Unix
+// socket path
+static int open_listener(ProgressReporter *reporter) {
+  const char *listen_on = reporter->listen;
+  char *end;
+  long port = strtol(listen_on, &end, 10);
+  int fd;
+
+  if (*end == '\0' && port > 0 && port < 65536) {
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+      return -1;
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in addr = {.sin_family = AF_INET,
+                               .sin_port = htons((uint16_t)port),
+                               .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+      close(fd);
+      return -1;
+    }
+  } else {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(listen_on) >= sizeof(addr.sun_path))
+      return -1;
+    strcpy(addr.sun_path, listen_on);
+    reporter->unix_socket = true;
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+      return -1;
+    unlink(listen_on);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+      close(fd);
+      return -1;
+    }
+  }
+
+  if (listen(fd, 8) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void *progress_thread(void *arg) {
+  ProgressReporter *reporter = (ProgressReporter *)arg;
+  double next_report = reporter->last.time + reporter->interval;
+
+  while (true) {
+    int timeout = -1;
+    if (reporter->interval > 0) {
+      double wait = next_report - get_time();
+      timeout = wait > 0 ? (int)(wait * 1000) + 1 : 0;
+    }
+
+    struct pollfd fds[2] = {{.fd = reporter->stop_pipe[0], .events = POLLIN},
+                            {.fd = reporter->listen_fd, .events = POLLIN}};
+    int ready = poll(fds, reporter->listen_fd >= 0 ? 2 : 1, timeout);
+    if (ready < 0 && errno != EINTR)
+      break;
+    if (fds[0].revents)
+      break;
+
+    if (reporter->listen_fd >= 0 && (fds[1].revents & POLLIN)) {
+      int client = accept(reporter->listen_fd, NULL, NULL);
+      if (client >= 0)
+        serve_client(reporter, client);
+    }
+
+    if (reporter->interval > 0 && get_time() >= next_report) {
+      print_progress(reporter);
+      next_report += reporter->interval;
+    }
+  }
+  return NULL;
+}
+
+bool progress_start(ProgressReporter *reporter) {
+  reporter->listen_fd = -1;
+  reporter->unix_socket = false;
+  reporter->stop_pipe[0] = reporter->stop_pipe[1] = -1;
+  if (reporter->interval <= 0 && reporter->listen == NULL)
+    return true;
+
+  if (reporter->listen != NULL) {
+    reporter->listen_fd = open_listener(reporter);
+    if (reporter->listen_fd < 0) {
+      fprintf(stderr, "Could not listen on %s: %s\n", reporter->listen,
+              strerror(errno));
+      return false;
+    }
+    // A scraper hanging up mid response must not kill the load
+    signal(SIGPIPE, SIG_IGN);
+  }
+
+  if (pipe(reporter->stop_pipe) != 0) {
+    if (reporter->listen_fd >= 0)
+      close(reporter->listen_fd);
+    reporter->listen_fd = -1;
+    return false;
+  }
+
+  take_sample(reporter, &reporter->last);
+  pthread_create(&reporter->thread, NULL, progress_thread, reporter);
+  return true;
+}
+
+void progress_stop(ProgressReporter *reporter) {
+  if (reporter->stop_pipe[1] < 0)
+    return;
+
+  (void)!write(reporter->stop_pipe[1], "x", 1);
+  pthread_join(reporter->thread, NULL);
+  close(reporter->stop_pipe[0]);
+  close(reporter->stop_pipe[1]);
+  reporter->stop_pipe[0] = reporter->stop_pipe[1] = -1;
+
+  if (reporter->listen_fd >= 0) {
+    close(reporter->listen_fd);
+    reporter->listen_fd = -1;
+    if (reporter->unix_socket)
+      unlink(reporter->listen);
+  }
+}
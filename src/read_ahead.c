@@ -0,0 +1,202 @@
+#include "read_ahead.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+// The whole length unless the file ends first, -errno on failure
+static ssize_t pread_full(int fd, char *buffer, size_t len, uint64_t offset) {
+  size_t total = 0;
+  while (total < len) {
+    ssize_t n =
+        pread(fd, buffer + total, len - total, (off_t)(offset + total));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return -errno;
+    if (n == 0)
+      break;
+    total += n;
+  }
+  return (ssize_t)total;
+}
+
+#ifdef __linux__
+static bool uring_setup(ReadAhead *ahead, unsigned depth) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int ring_fd = (int)syscall(__NR_io_uring_setup, depth, &params);
+  if (ring_fd < 0)
+    return false;
+  ahead->ring_fd = ring_fd;
+
+  ahead->sq_ring_size =
+      params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ahead->cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  // Kernels since 5.4 map both rings at once
+  bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single && ahead->cq_ring_size > ahead->sq_ring_size)
+    ahead->sq_ring_size = ahead->cq_ring_size;
+  ahead->sq_ring =
+      mmap(NULL, ahead->sq_ring_size, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  if (ahead->sq_ring == MAP_FAILED)
+    goto fail;
+  if (single) {
+    ahead->cq_ring = ahead->sq_ring;
+    ahead->cq_ring_size = 0;
+  } else {
+    ahead->cq_ring =
+        mmap(NULL, ahead->cq_ring_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    if (ahead->cq_ring == MAP_FAILED)
+      goto fail;
+  }
+  ahead->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ahead->sqes = mmap(NULL, ahead->sqes_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+  if (ahead->sqes == MAP_FAILED)
+    goto fail;
+
+  char *sq = ahead->sq_ring;
+  char *cq = ahead->cq_ring;
+  ahead->sq_head = (unsigned *)(sq + params.sq_off.head);
+  ahead->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ahead->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ahead->sq_array = (unsigned *)(sq + params.sq_off.array);
+  ahead->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ahead->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ahead->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ahead->cqes = cq + params.cq_off.cqes;
+  ahead->iovecs = calloc(params.sq_entries, sizeof(struct iovec));
+  return true;
+
+fail:
+  // read_ahead_close unmaps what was mapped
+  if (ahead->sq_ring == MAP_FAILED)
+    ahead->sq_ring = NULL;
+  if (ahead->cq_ring == MAP_FAILED)
+    ahead->cq_ring = NULL;
+  if (ahead->sqes == MAP_FAILED)
+    ahead->sqes = NULL;
+  return false;
+}
+
+static int uring_enter(ReadAhead *ahead, unsigned submit, unsigned wait) {
+  int rc;
+  do {
+    rc = (int)syscall(__NR_io_uring_enter, ahead->ring_fd, submit, wait,
+                      wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  } while (rc < 0 && errno == EINTR);
+  return rc;
+}
+
+static bool uring_submit(ReadAhead *ahead, uint64_t tag, void *buffer,
+                         size_t len, uint64_t offset) {
+  unsigned tail = *ahead->sq_tail;
+  unsigned index = tail & *ahead->sq_mask;
+  // READV rather than READ, which needs 5.6
+  ahead->iovecs[index] = (struct iovec){buffer, len};
+  struct io_uring_sqe *sqe = (struct io_uring_sqe *)ahead->sqes + index;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READV;
+  sqe->fd = ahead->fd;
+  sqe->addr = (uint64_t)(uintptr_t)&ahead->iovecs[index];
+  sqe->len = 1;
+  sqe->off = offset;
+  sqe->user_data = tag;
+  ahead->sq_array[index] = index;
+  __atomic_store_n(ahead->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  return uring_enter(ahead, 1, 0) == 1;
+}
+
+static bool uring_wait(ReadAhead *ahead, ReadCompletion *completion) {
+  while (true) {
+    unsigned head = *ahead->cq_head;
+    if (head != __atomic_load_n(ahead->cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe =
+          (struct io_uring_cqe *)ahead->cqes + (head & *ahead->cq_mask);
+      completion->tag = cqe->user_data;
+      completion->result = cqe->res;
+      __atomic_store_n(ahead->cq_head, head + 1, __ATOMIC_RELEASE);
+      return true;
+    }
+    if (uring_enter(ahead, 0, 1) < 0)
+      return false;
+  }
+}
+#endif
+
+void read_ahead_init(ReadAhead *ahead, int fd, unsigned depth) {
+  memset(ahead, 0, sizeof(ReadAhead));
+  ahead->fd = fd;
+  ahead->ring_fd = -1;
+  if (depth > READ_AHEAD_MAX_DEPTH)
+    depth = READ_AHEAD_MAX_DEPTH;
+#ifdef __linux__
+  ahead->uring = uring_setup(ahead, depth);
+  if (!ahead->uring)
+    read_ahead_close(ahead);
+  ahead->fd = fd;
+#else
+  (void)depth;
+#endif
+}
+
+void read_ahead_close(ReadAhead *ahead) {
+  if (ahead->sqes)
+    munmap(ahead->sqes, ahead->sqes_size);
+  if (ahead->cq_ring && ahead->cq_ring != ahead->sq_ring)
+    munmap(ahead->cq_ring, ahead->cq_ring_size);
+  if (ahead->sq_ring)
+    munmap(ahead->sq_ring, ahead->sq_ring_size);
+  if (ahead->ring_fd >= 0)
+    close(ahead->ring_fd);
+  free(ahead->iovecs);
+  memset(ahead, 0, sizeof(ReadAhead));
+  ahead->ring_fd = -1;
+}
+
+bool read_ahead_submit(ReadAhead *ahead, uint64_t tag, void *buffer,
+                       size_t len, uint64_t offset) {
+#ifdef __linux__
+  if (ahead->uring) {
+    if (!uring_submit(ahead, tag, buffer, len, offset))
+      return false;
+    ahead->in_flight++;
+    return true;
+  }
+#endif
+  if (ahead->in_flight == READ_AHEAD_MAX_DEPTH)
+    return false;
+  unsigned slot =
+      (ahead->done_head + ahead->in_flight) % READ_AHEAD_MAX_DEPTH;
+  ahead->done[slot] =
+      (ReadCompletion){tag, pread_full(ahead->fd, buffer, len, offset)};
+  ahead->in_flight++;
+  return true;
+}
+
+bool read_ahead_wait(ReadAhead *ahead, ReadCompletion *completion) {
+  if (ahead->in_flight == 0)
+    return false;
+#ifdef __linux__
+  if (ahead->uring) {
+    if (!uring_wait(ahead, completion))
+      return false;
+    ahead->in_flight--;
+    return true;
+  }
+#endif
+  *completion = ahead->done[ahead->done_head];
+  ahead->done_head = (ahead->done_head + 1) % READ_AHEAD_MAX_DEPTH;
+  ahead->in_flight--;
+  return true;
+}
@@ -0,0 +1,176 @@
+#include "reject_log.h"
+#include "input_reader.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void reject_log_init(RejectLog *log, int limit) {
+  pthread_mutex_init(&log->lock, NULL);
+  log->rows = NULL;
+  log->count = 0;
+  log->capacity = 0;
+  log->limit = limit;
+  atomic_init(&log->reserved, 0);
+}
+
+void reject_log_free(RejectLog *log) {
+  for (int i = 0; i < log->count; i++)
+    free(log->rows[i].error);
+  free(log->rows);
+  log->rows = NULL;
+  log->count = 0;
+  pthread_mutex_destroy(&log->lock);
+}
+
+bool reject_log_open(RejectLog *log) {
+  return atomic_load(&log->reserved) < log->limit;
+}
+
+bool reject_log_add(RejectLog *log, const Batch *batch, int i,
+                    const char *error) {
+  if (atomic_fetch_add(&log->reserved, 1) >= log->limit)
+    return false;
+  // libpq messages go on with DETAIL and CONTEXT lines
+  size_t len = strcspn(error, "\n");
+
+  pthread_mutex_lock(&log->lock);
+  if (log->count == log->capacity) {
+    log->capacity = log->capacity ? log->capacity * 2 : 64;
+    log->rows = realloc(log->rows, log->capacity * sizeof(RejectedRow));
+  }
+  RejectedRow *row = &log->rows[log->count++];
+  row->origin = batch->origin[i];
+  row->error = strndup(error, len);
+  pthread_mutex_unlock(&log->lock);
+  return true;
+}
+
+static int compare_origins(const void *a, const void *b) {
+  uint64_t x = ((const RejectedRow *)a)->origin;
+  uint64_t y = ((const RejectedRow *)b)->origin;
+  return x < y ? -1 : x > y;
+}
+
+static void write_csv_field(FILE *out, const char *data, size_t len) {
+  fputc('"', out);
+  for (size_t i = 0; i < len; i++) {
+    if (data[i] == '"')
+      fputc('"', out);
+    fputc(data[i], out);
+  }
+  fputc('"', out);
+}
+
+// Where resolved rows go: the reject file or the first few on stderr
+typedef struct {
+  FILE *out;
+  bool csv;
+  int emitted;
+  int max; // rows to emit, the rest are skipped
+} RejectOutput;
+
+// Line 0 and a NULL record when the input was not read back
+static void emit_row(RejectOutput *output, const InputFileList *files,
+                     const RejectedRow *row, long line, const char *record,
+                     size_t len) {
+  int file = origin_file(row->origin);
+  const char *path =
+      file >= 0 && files && file < files->count ? files->files[file].path : "";
+  output->emitted++;
+  if (!output->csv) {
+    if (line > 0)
+      fprintf(output->out, "  %s:%ld: %s\n", path, line, row->error);
+    else if (file >= 0)
+      fprintf(output->out, "  %s at byte %zu: %s\n", path,
+              origin_offset(row->origin), row->error);
+    else
+      fprintf(output->out, "  generated row: %s\n", row->error);
+    return;
+  }
+
+  write_csv_field(output->out, path, strlen(path));
+  if (line > 0)
+    fprintf(output->out, ",%ld,", line);
+  else
+    fprintf(output->out, ",,");
+  fprintf(output->out, "%zu,", origin_offset(row->origin));
+  write_csv_field(output->out, row->error, strlen(row->error));
+  fputc(',', output->out);
+  if (record)
+    write_csv_field(output->out, record, len);
+  fputc('\n', output->out);
+}
+
+// Rows [first, last) are sorted and from the same file. Reads the file once
+// from the start, counting physical lines, newlines inside quotes included
+static void resolve_file(RejectOutput *output, const InputFileList *files,
+                         const RejectedRow *rows, int first, int last) {
+  int file = origin_file(rows[first].origin);
+  int next = first;
+  InputReader reader;
+  // A pipe was consumed by the load
+  if (file >= 0 && files && file < files->count &&
+      files->files[file].size > 0 &&
+      reader_open(&reader, files->files[file].path, READER_MMAP)) {
+    long line = 1;
+    const char *record;
+    size_t len;
+    while (next < last && output->emitted < output->max) {
+      size_t start = reader.offset;
+      if (!reader_next_line(&reader, &record, &len))
+        break;
+      // An offset inside a record does not come from a parser
+      while (next < last && origin_offset(rows[next].origin) < start &&
+             output->emitted < output->max)
+        emit_row(output, files, &rows[next++], 0, NULL, 0);
+      while (next < last && origin_offset(rows[next].origin) == start &&
+             output->emitted < output->max)
+        emit_row(output, files, &rows[next++], line, record, len);
+      line++;
+      for (const char *p = record;
+           (p = memchr(p, '\n', record + len - p)) != NULL; p++)
+        line++;
+    }
+    reader_close(&reader);
+  }
+  while (next < last && output->emitted < output->max)
+    emit_row(output, files, &rows[next++], 0, NULL, 0);
+}
+
+static void resolve_rows(RejectLog *log, const InputFileList *files,
+                         RejectOutput *output) {
+  qsort(log->rows, log->count, sizeof(RejectedRow), compare_origins);
+  int first = 0;
+  while (first < log->count && output->emitted < output->max) {
+    int file = origin_file(log->rows[first].origin);
+    int last = first + 1;
+    while (last < log->count && origin_file(log->rows[last].origin) == file)
+      last++;
+    resolve_file(output, files, log->rows, first, last);
+    first = last;
+  }
+}
+
+bool reject_log_write(RejectLog *log, const InputFileList *files,
+                      const char *path) {
+  FILE *out = fopen(path, "w");
+  if (out == NULL) {
+    perror(path);
+    return false;
+  }
+  fprintf(out, "file,line,offset,error,record\n");
+  RejectOutput output = {.out = out, .csv = true, .max = log->count};
+  resolve_rows(log, files, &output);
+  if (fclose(out) != 0) {
+    perror(path);
+    return false;
+  }
+  return true;
+}
+
+void reject_log_print(RejectLog *log, const InputFileList *files) {
+  RejectOutput output = {.out = stderr, .max = REJECTS_SHOWN};
+  resolve_rows(log, files, &output);
+  if (log->count > REJECTS_SHOWN)
+    fprintf(stderr, "  ... and %d more\n", log->count - REJECTS_SHOWN);
+}
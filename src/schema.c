@@ -0,0 +1,902 @@
+#include "schema.h"
+#include "checkpoint.h"
+#include "copy_encoder.h"
+#include "csv_tokenizer.h"
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+const char *const schema_unlocode_text =
+    "table locations\n"
+    "key      unlocode         VARCHAR(10) NOT NULL   = "
+    "code(Country, Location)\n"
+    "name     name             TEXT NOT NULL          = text(Name)\n"
+    "country  country_code     CHAR(2) NOT NULL       = code(Country)\n"
+    "location location         GEOGRAPHY(POINT, 4326) = "
+    "unlocode_point(Coordinates)\n"
+    "airport  is_airport       BOOLEAN DEFAULT FALSE  = "
+    "function_flag(Function, 4)\n"
+    "port     is_port          BOOLEAN DEFAULT FALSE  = "
+    "function_flag(Function, 1)\n"
+    "train    is_train_station BOOLEAN DEFAULT FALSE  = "
+    "function_flag(Function, 2)\n";
+
+static const char *const role_names[ROLE_COUNT] = {
+    "key", "name", "country", "location", "airport", "port", "train",
+    "column"};
+
+static const char *const transform_names[TRANSFORM_COUNT] = {
+    "text",    "code",           "integer", "bigint",       "double",
+    "boolean", "unlocode_point", "point",   "function_flag"};
+
+// Transforms each role accepts, bit per Transform
+#define T(x) (1u << TRANSFORM_##x)
+static const unsigned role_transforms[ROLE_COUNT] = {
+    [ROLE_KEY] = T(CODE),
+    [ROLE_NAME] = T(TEXT),
+    [ROLE_COUNTRY] = T(CODE),
+    [ROLE_LOCATION] = T(UNLOCODE_POINT) | T(POINT),
+    [ROLE_AIRPORT] = T(FUNCTION_FLAG) | T(BOOLEAN),
+    [ROLE_PORT] = T(FUNCTION_FLAG) | T(BOOLEAN),
+    [ROLE_TRAIN] = T(FUNCTION_FLAG) | T(BOOLEAN),
+    [ROLE_COLUMN] = T(TEXT) | T(CODE) | T(INTEGER) | T(BIGINT) | T(DOUBLE) |
+                    T(BOOLEAN),
+};
+#undef T
+
+// Source columns of a transform, the most when it takes a range
+static const int transform_sources[TRANSFORM_COUNT][2] = {
+    [TRANSFORM_TEXT] = {1, 1},           [TRANSFORM_CODE] = {1, 2},
+    [TRANSFORM_INTEGER] = {1, 1},        [TRANSFORM_BIGINT] = {1, 1},
+    [TRANSFORM_DOUBLE] = {1, 1},         [TRANSFORM_BOOLEAN] = {1, 1},
+    [TRANSFORM_UNLOCODE_POINT] = {1, 1}, [TRANSFORM_POINT] = {2, 2},
+    [TRANSFORM_FUNCTION_FLAG] = {1, 1},
+};
+
+// Encoding of a carried column by its transform
+static const ColumnEncoding carried_encodings[TRANSFORM_COUNT] = {
+    [TRANSFORM_TEXT] = ENCODE_TEXT,     [TRANSFORM_CODE] = ENCODE_TEXT,
+    [TRANSFORM_INTEGER] = ENCODE_INT4,  [TRANSFORM_BIGINT] = ENCODE_INT8,
+    [TRANSFORM_DOUBLE] = ENCODE_FLOAT8, [TRANSFORM_BOOLEAN] = ENCODE_BOOL,
+};
+
+// ---------------------------------------------------------------------------
+// Schema files
+
+static char *trim(char *s) {
+  while (isspace((unsigned char)*s))
+    s++;
+  char *end = s + strlen(s);
+  while (end > s && isspace((unsigned char)end[-1]))
+    end--;
+  *end = '\0';
+  return s;
+}
+
+// Plain SQL identifiers only, names are pasted into the statements unquoted
+static bool valid_identifier(const char *name) {
+  if (!isalpha((unsigned char)*name) && *name != '_')
+    return false;
+  for (const char *p = name; *p; p++)
+    if (!isalnum((unsigned char)*p) && *p != '_')
+      return false;
+  return strlen(name) < SCHEMA_NAME_MAX;
+}
+
+static int lookup(const char *const *names, int count, const char *name) {
+  for (int i = 0; i < count; i++)
+    if (strcmp(names[i], name) == 0)
+      return i;
+  return -1;
+}
+
+// name(arg, arg) after the =, args are trimmed in place
+static bool parse_call(char *text, char **name, char **args, int max_args,
+                       int *num_args) {
+  char *open = strchr(text, '(');
+  char *close = strrchr(text, ')');
+  if (open == NULL || close == NULL || close < open ||
+      *trim(close + 1) != '\0')
+    return false;
+  *open = '\0';
+  *close = '\0';
+  *name = trim(text);
+  *num_args = 0;
+  char *arg = open + 1;
+  while (true) {
+    char *comma = strchr(arg, ',');
+    if (comma)
+      *comma = '\0';
+    if (*num_args == max_args)
+      return false;
+    args[(*num_args)++] = trim(arg);
+    if (comma == NULL)
+      break;
+    arg = comma + 1;
+  }
+  return true;
+}
+
+// <role> <column> <SQL type> = <transform>(<source>, ...)
+static bool parse_column(Schema *schema, char *line, const char *origin,
+                         int number) {
+  char *equals = strchr(line, '=');
+  if (equals)
+    *equals = '\0';
+  char *rest;
+  char *role = strtok_r(line, " \t", &rest);
+  char *name = role ? strtok_r(NULL, " \t", &rest) : NULL;
+  char *type = name ? strtok_r(NULL, "", &rest) : NULL;
+  if (equals == NULL || type == NULL) {
+    fprintf(stderr, "%s:%d: expected <role> <column> <type> = "
+                    "<transform>(<sources>)\n",
+            origin, number);
+    return false;
+  }
+  type = trim(type);
+
+  SchemaColumn *column = &schema->columns[schema->num_columns];
+  memset(column, 0, sizeof(SchemaColumn));
+  int r = lookup(role_names, ROLE_COUNT, role);
+  if (r < 0) {
+    fprintf(stderr, "%s:%d: unknown role '%s', expected key, name, country, "
+                    "location, airport, port, train or column\n",
+            origin, number, role);
+    return false;
+  }
+  column->role = (ColumnRole)r;
+  if (!valid_identifier(name)) {
+    fprintf(stderr, "%s:%d: '%s' is not a plain column name\n", origin,
+            number, name);
+    return false;
+  }
+  snprintf(column->name, sizeof(column->name), "%s", name);
+  if (*type == '\0' || strchr(type, ';')) {
+    fprintf(stderr, "%s:%d: column %s needs an SQL type\n", origin, number,
+            name);
+    return false;
+  }
+
+  char *transform;
+  char *args[SCHEMA_MAX_SOURCES + 1];
+  int num_args;
+  if (!parse_call(equals + 1, &transform, args, SCHEMA_MAX_SOURCES + 1,
+                  &num_args)) {
+    fprintf(stderr, "%s:%d: expected <transform>(<sources>) after the =\n",
+            origin, number);
+    return false;
+  }
+  int t = lookup(transform_names, TRANSFORM_COUNT, transform);
+  if (t < 0 || !(role_transforms[r] & (1u << t))) {
+    fprintf(stderr, "%s:%d: %s is not a transform of a %s column\n", origin,
+            number, transform, role);
+    return false;
+  }
+  column->transform = (Transform)t;
+
+  // function_flag(source, digit)
+  if (column->transform == TRANSFORM_FUNCTION_FLAG) {
+    if (num_args != 2 || strlen(args[1]) != 1 || !isdigit(args[1][0])) {
+      fprintf(stderr, "%s:%d: expected function_flag(<source>, <digit>)\n",
+              origin, number);
+      return false;
+    }
+    column->digit = args[1][0] - '0';
+    num_args = 1;
+  }
+  if (num_args < transform_sources[t][0] ||
+      num_args > transform_sources[t][1]) {
+    if (transform_sources[t][0] == transform_sources[t][1])
+      fprintf(stderr, "%s:%d: %s takes %d source column%s\n", origin, number,
+              transform, transform_sources[t][0],
+              transform_sources[t][0] > 1 ? "s" : "");
+    else
+      fprintf(stderr, "%s:%d: %s takes %d to %d source columns\n", origin,
+              number, transform, transform_sources[t][0],
+              transform_sources[t][1]);
+    return false;
+  }
+  for (int i = 0; i < num_args; i++) {
+    if (*args[i] == '\0') {
+      fprintf(stderr, "%s:%d: empty source column\n", origin, number);
+      return false;
+    }
+    column->sources[i] = strdup(args[i]);
+  }
+  column->num_sources = num_args;
+  column->type = strdup(type);
+  schema->num_columns++;
+  return true;
+}
+
+// Statement text, malloc'd
+static char *sql_format(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(NULL, 0, format, args);
+  va_end(args);
+  char *sql = malloc(len + 1);
+  va_start(args, format);
+  vsnprintf(sql, len + 1, format, args);
+  va_end(args);
+  return sql;
+}
+
+static void build_sql(Schema *schema) {
+  SchemaSql *sql = &schema->sql;
+  const char *table = schema->table;
+  const char *key = schema->columns[schema->role_column[ROLE_KEY]].name;
+  const char *name = schema->columns[schema->role_column[ROLE_NAME]].name;
+
+  size_t columns_len = 1, definitions_len = 1;
+  for (int i = 0; i < schema->num_columns; i++) {
+    columns_len += strlen(schema->columns[i].name) + 2;
+    definitions_len += strlen(schema->columns[i].name) +
+                       strlen(schema->columns[i].type) + 3;
+  }
+  char *columns = malloc(columns_len);
+  char *definitions = malloc(definitions_len);
+  columns[0] = definitions[0] = '\0';
+  for (int i = 0; i < schema->num_columns; i++) {
+    const SchemaColumn *column = &schema->columns[i];
+    const char *separator = i > 0 ? ", " : "";
+    strcat(strcat(columns, separator), column->name);
+    strcat(strcat(strcat(strcat(definitions, separator), column->name), " "),
+           column->type);
+  }
+  sql->columns = columns;
+
+  sql->create_table = sql_format(
+      "CREATE TABLE IF NOT EXISTS %s (id SERIAL PRIMARY KEY, %s, "
+      "created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP)",
+      table, definitions);
+  free(definitions);
+  sql->unique_index =
+      sql_format("CREATE UNIQUE INDEX %s_%s_%s_idx ON %s (%s, MD5(%s)) "
+                 "WHERE %s IS NOT NULL",
+                 table, key, name, table, key, name, name);
+  // No constraints, defaults or indexes, loading it is a plain heap append
+  sql->staging = sql_format("CREATE TEMP TABLE IF NOT EXISTS "
+                            "staging_locations AS SELECT %s FROM %s WITH NO "
+                            "DATA",
+                            columns, table);
+  sql->temp_staging = sql_format("CREATE TEMP TABLE temp_locations (LIKE %s "
+                                 "INCLUDING ALL) ON COMMIT DROP",
+                                 table);
+
+  static const char *const formats[2] = {
+      [COPY_FORMAT_CSV] = "csv", [COPY_FORMAT_BINARY] = "binary"};
+  for (int f = 0; f < 2; f++) {
+    sql->copy_staging[f] = sql_format(
+        "COPY staging_locations FROM STDIN WITH (FORMAT %s)", formats[f]);
+    sql->copy_temp[f] =
+        sql_format("COPY temp_locations(%s) FROM STDIN WITH (FORMAT %s)",
+                   columns, formats[f]);
+    sql->copy_table[f] = sql_format(
+        "COPY %s(%s) FROM STDIN WITH (FORMAT %s)", table, columns, formats[f]);
+  }
+
+  const char *merge = "INSERT INTO %s(%s) SELECT %s FROM %s ON CONFLICT "
+                      "(%s, MD5(%s)) WHERE %s IS NOT NULL DO NOTHING";
+  sql->merge = sql_format(merge, table, columns, columns, "staging_locations",
+                          key, name, name);
+  sql->merge_temp = sql_format(merge, table, columns, columns,
+                               "temp_locations", key, name, name);
+  sql->merge_progress = sql_format("%s%s", PROGRESS_INSERT, sql->merge);
+  sql->merge_temp_progress =
+      sql_format("%s%s", PROGRESS_INSERT, sql->merge_temp);
+
+  sql->bulk_check = sql_format("SELECT EXISTS (SELECT 1 FROM %s)", table);
+  // Nothing is in the table, neither step rewrites any data
+  sql->bulk_unlogged =
+      sql_format("DROP INDEX IF EXISTS %s_%s_%s_idx; ALTER TABLE %s SET "
+                 "UNLOGGED",
+                 table, key, name, table);
+  // The self join is hashed, there is no index to use yet. Ids grow in
+  // commit order closely enough to keep the row the merge would have kept
+  sql->bulk_dedup = sql_format("DELETE FROM %s a USING %s b WHERE a.%s = "
+                               "b.%s AND MD5(a.%s) = MD5(b.%s) AND a.id > "
+                               "b.id",
+                               table, table, key, key, name, name);
+  sql->bulk_logged = sql_format("ALTER TABLE %s SET LOGGED", table);
+}
+
+// Every role but column at most once, key and name always
+static bool check_roles(Schema *schema, const char *origin) {
+  for (int r = 0; r < ROLE_COUNT; r++)
+    schema->role_column[r] = -1;
+  schema->num_carried = 0;
+  for (int i = 0; i < schema->num_columns; i++) {
+    SchemaColumn *column = &schema->columns[i];
+    for (int j = 0; j < i; j++) {
+      if (strcasecmp(schema->columns[j].name, column->name) == 0) {
+        fprintf(stderr, "%s: column %s is defined twice\n", origin,
+                column->name);
+        return false;
+      }
+    }
+    if (column->role == ROLE_COLUMN) {
+      column->encoding = carried_encodings[column->transform];
+      schema->num_carried++;
+      continue;
+    }
+    if (schema->role_column[column->role] >= 0) {
+      fprintf(stderr, "%s: more than one %s column\n", origin,
+              role_names[column->role]);
+      return false;
+    }
+    schema->role_column[column->role] = i;
+    // The built in roles are in ColumnEncoding order
+    column->encoding = (ColumnEncoding)column->role;
+  }
+  if (schema->role_column[ROLE_KEY] < 0 ||
+      schema->role_column[ROLE_NAME] < 0) {
+    fprintf(stderr, "%s: a schema needs a key and a name column, they "
+                    "identify a row\n",
+            origin);
+    return false;
+  }
+  if (schema->table[0] == '\0') {
+    fprintf(stderr, "%s: no table line\n", origin);
+    return false;
+  }
+
+  schema->num_encoders = 0;
+  for (int i = 0; i < schema->num_columns; i++) {
+    ColumnEncoding encoding = schema->columns[i].encoding;
+    if (encoding == ENCODE_AIRPORT && i + 2 < schema->num_columns &&
+        schema->columns[i + 1].encoding == ENCODE_PORT &&
+        schema->columns[i + 2].encoding == ENCODE_TRAIN) {
+      encoding = ENCODE_FLAGS;
+      i += 2;
+    }
+    schema->encoders[schema->num_encoders++] = encoding;
+  }
+  return true;
+}
+
+bool schema_parse(Schema *schema, const char *text, const char *origin) {
+  memset(schema, 0, sizeof(Schema));
+  char *copy = strdup(text);
+  bool ok = true;
+  int number = 0;
+  for (char *next = copy, *line; ok && next != NULL;) {
+    line = next;
+    next = strchr(line, '\n');
+    if (next)
+      *next++ = '\0';
+    number++;
+    line = trim(line);
+    if (*line == '\0' || *line == '#')
+      continue;
+
+    if (strncmp(line, "table", 5) == 0 && isspace((unsigned char)line[5])) {
+      char *table = trim(line + 5);
+      ok = valid_identifier(table);
+      if (!ok)
+        fprintf(stderr, "%s:%d: '%s' is not a plain table name\n", origin,
+                number, table);
+      else
+        snprintf(schema->table, sizeof(schema->table), "%s", table);
+      continue;
+    }
+    if (schema->num_columns == SCHEMA_MAX_COLUMNS) {
+      fprintf(stderr, "%s:%d: more than %d columns\n", origin, number,
+              SCHEMA_MAX_COLUMNS);
+      ok = false;
+      break;
+    }
+    ok = parse_column(schema, line, origin, number);
+  }
+  free(copy);
+
+  if (ok)
+    ok = check_roles(schema, origin);
+  if (!ok) {
+    schema_free(schema);
+    return false;
+  }
+  build_sql(schema);
+  return true;
+}
+
+bool schema_builtin(Schema *schema) {
+  if (!schema_parse(schema, schema_unlocode_text, "built in schema"))
+    return false;
+  schema->builtin = true;
+  return true;
+}
+
+bool schema_load(Schema *schema, const char *path) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    perror(path);
+    return false;
+  }
+  char *text = NULL;
+  size_t len = 0;
+  char chunk[4096];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    text = realloc(text, len + n + 1);
+    memcpy(text + len, chunk, n);
+    len += n;
+  }
+  fclose(file);
+  if (text == NULL) {
+    fprintf(stderr, "%s: empty schema\n", path);
+    return false;
+  }
+  text[len] = '\0';
+  bool ok = schema_parse(schema, text, path);
+  free(text);
+  return ok;
+}
+
+void schema_free(Schema *schema) {
+  for (int i = 0; i < schema->num_columns; i++) {
+    free(schema->columns[i].type);
+    for (int s = 0; s < schema->columns[i].num_sources; s++)
+      free(schema->columns[i].sources[s]);
+  }
+  SchemaSql *sql = &schema->sql;
+  char **statements[] = {
+      &sql->columns,        &sql->create_table,   &sql->unique_index,
+      &sql->staging,        &sql->temp_staging,   &sql->copy_staging[0],
+      &sql->copy_staging[1], &sql->copy_temp[0],  &sql->copy_temp[1],
+      &sql->copy_table[0],  &sql->copy_table[1],  &sql->merge,
+      &sql->merge_temp,     &sql->merge_progress, &sql->merge_temp_progress,
+      &sql->bulk_check,     &sql->bulk_unlogged,  &sql->bulk_dedup,
+      &sql->bulk_logged};
+  for (size_t i = 0; i < sizeof(statements) / sizeof(statements[0]); i++) {
+    free(*statements[i]);
+    *statements[i] = NULL;
+  }
+  schema->num_columns = 0;
+}
+
+// ---------------------------------------------------------------------------
+// Parse kernels, one per transform and destination. Fields arrive as split,
+// still quoted
+
+static const char empty_field[1] = "";
+
+// The value of a field without its enclosing quotes
+static inline FieldView field_value(FieldView field, bool *escaped) {
+  *escaped = false;
+  if (field.len >= 2 && field.ptr[0] == '"' &&
+      field.ptr[field.len - 1] == '"') {
+    field.ptr++;
+    field.len -= 2;
+    *escaped = memchr(field.ptr, '"', field.len) != NULL;
+  }
+  return field;
+}
+
+static inline FieldView field_trimmed(FieldView field) {
+  bool escaped;
+  field = field_value(field, &escaped);
+  while (field.len > 0 && (field.ptr[0] == ' ' || field.ptr[0] == '\t')) {
+    field.ptr++;
+    field.len--;
+  }
+  while (field.len > 0 &&
+         (field.ptr[field.len - 1] == ' ' || field.ptr[field.len - 1] == '\r'))
+    field.len--;
+  return field;
+}
+
+// The code fields as views, batch_append concatenates them at any length
+static inline void code_parts(const SchemaStep *step, const FieldView *fields,
+                              CodeView *code) {
+  for (int s = 0; s < step->num_sources; s++) {
+    bool escaped;
+    code->parts[s] = field_value(fields[step->sources[s]], &escaped);
+  }
+  code->num_parts = step->num_sources;
+}
+
+static unsigned row_key(const SchemaStep *step, const FieldView *fields,
+                        ProcessedLocation *row) {
+  code_parts(step, fields, &row->key);
+  return 0;
+}
+
+static unsigned row_country(const SchemaStep *step, const FieldView *fields,
+                            ProcessedLocation *row) {
+  code_parts(step, fields, &row->country);
+  return 0;
+}
+
+static unsigned row_name(const SchemaStep *step, const FieldView *fields,
+                         ProcessedLocation *row) {
+  row->name = field_value(fields[step->sources[0]], &row->name_escaped);
+  return 0;
+}
+
+static unsigned row_unlocode_point(const SchemaStep *step,
+                                   const FieldView *fields,
+                                   ProcessedLocation *row) {
+  bool escaped;
+  CoordStatus status =
+      parse_coordinates(field_value(fields[step->sources[0]], &escaped),
+                        &row->latitude, &row->longitude);
+  row->has_coordinates = status == COORD_OK;
+  return status == COORD_MALFORMED ? PARSE_BAD_COORDINATES : 0;
+}
+
+// A decimal number of the whole field, false when it is not one
+static bool parse_double(FieldView field, double *value) {
+  char buffer[64];
+  if (field.len == 0 || field.len >= sizeof(buffer))
+    return false;
+  memcpy(buffer, field.ptr, field.len);
+  buffer[field.len] = '\0';
+  char *end;
+  *value = strtod(buffer, &end);
+  return *end == '\0';
+}
+
+static unsigned row_point(const SchemaStep *step, const FieldView *fields,
+                          ProcessedLocation *row) {
+  FieldView lat = field_trimmed(fields[step->sources[0]]);
+  FieldView lon = field_trimmed(fields[step->sources[1]]);
+  row->has_coordinates = false;
+  if (lat.len == 0 && lon.len == 0)
+    return 0;
+  if (!parse_double(lat, &row->latitude) ||
+      !parse_double(lon, &row->longitude) || row->latitude < -90 ||
+      row->latitude > 90 || row->longitude < -180 || row->longitude > 180) {
+    row->latitude = 0;
+    row->longitude = 0;
+    return PARSE_BAD_COORDINATES;
+  }
+  row->has_coordinates = true;
+  return 0;
+}
+
+// Function code characters: a bit per digit plus a marker for the
+// characters that may appear in the field at all
+#define DIGIT_VALID 0x8000
+
+static const uint16_t function_digit_table[256] = {
+    ['-'] = DIGIT_VALID,         ['B'] = DIGIT_VALID,
+    ['0'] = DIGIT_VALID | 1 << 0, ['1'] = DIGIT_VALID | 1 << 1,
+    ['2'] = DIGIT_VALID | 1 << 2, ['3'] = DIGIT_VALID | 1 << 3,
+    ['4'] = DIGIT_VALID | 1 << 4, ['5'] = DIGIT_VALID | 1 << 5,
+    ['6'] = DIGIT_VALID | 1 << 6, ['7'] = DIGIT_VALID | 1 << 7,
+    ['8'] = DIGIT_VALID | 1 << 8, ['9'] = DIGIT_VALID | 1 << 9,
+};
+
+// Every flag read from one function code in one pass, see
+// parse_function_code
+static unsigned row_function_flags(const SchemaStep *step,
+                                   const FieldView *fields,
+                                   ProcessedLocation *row) {
+  bool escaped;
+  FieldView code = field_value(fields[step->sources[0]], &escaped);
+  if (code.len == 0)
+    return 0;
+  if (code.len != 8)
+    return PARSE_BAD_FUNCTION_CODE;
+  const unsigned char *p = (const unsigned char *)code.ptr;
+  unsigned any = 0;
+  unsigned all = DIGIT_VALID;
+  for (int i = 0; i < 8; i++) {
+    any |= function_digit_table[p[i]];
+    all &= function_digit_table[p[i]];
+  }
+  if (!all)
+    return PARSE_BAD_FUNCTION_CODE;
+  row->is_airport |= (any & step->digits[STEP_AIRPORT]) != 0;
+  row->is_port |= (any & step->digits[STEP_PORT]) != 0;
+  row->is_train_station |= (any & step->digits[STEP_TRAIN]) != 0;
+  return 0;
+}
+
+// 1 true, 0 false, -1 neither, empty is false
+static int parse_boolean(FieldView field) {
+  static const char *const truths[] = {"t", "true", "y", "yes", "1"};
+  static const char *const lies[] = {"f", "false", "n", "no", "0"};
+  if (field.len == 0)
+    return 0;
+  for (int i = 0; i < 5; i++) {
+    if (field.len == strlen(truths[i]) &&
+        strncasecmp(field.ptr, truths[i], field.len) == 0)
+      return 1;
+    if (field.len == strlen(lies[i]) &&
+        strncasecmp(field.ptr, lies[i], field.len) == 0)
+      return 0;
+  }
+  return -1;
+}
+
+static unsigned row_boolean_flag(const SchemaStep *step,
+                                 const FieldView *fields,
+                                 ProcessedLocation *row) {
+  int value = parse_boolean(field_trimmed(fields[step->sources[0]]));
+  bool *flags[STEP_FLAGS] = {&row->is_airport, &row->is_port,
+                             &row->is_train_station};
+  *flags[step->flag] = value == 1;
+  return value < 0 ? PARSE_BAD_VALUE : 0;
+}
+
+// Carried values are stored as binary COPY fields, see Batch
+
+static inline void put_length(char *p, int32_t len) {
+  uint32_t n = htonl((uint32_t)len);
+  memcpy(p, &n, sizeof(n));
+}
+
+static inline void carry_null(Batch *batch) {
+  put_length(batch_carry_reserve(batch, 4), -1);
+}
+
+static inline void carry_uint64(Batch *batch, uint64_t value) {
+  char *p = batch_carry_reserve(batch, 4 + 8);
+  put_length(p, 8);
+  for (int i = 0; i < 8; i++)
+    p[4 + i] = (char)(value >> (56 - 8 * i));
+}
+
+static unsigned carry_text(const SchemaStep *step, const FieldView *fields,
+                           Batch *batch) {
+  bool escaped;
+  FieldView value = field_value(fields[step->sources[0]], &escaped);
+  if (value.len == 0) {
+    carry_null(batch);
+    return 0;
+  }
+  char *p = batch_carry_reserve(batch, 4 + value.len);
+  size_t len = value.len;
+  if (escaped) {
+    len = 0;
+    for (size_t i = 0; i < value.len; i++) {
+      p[4 + len++] = value.ptr[i];
+      if (value.ptr[i] == '"' && i + 1 < value.len && value.ptr[i + 1] == '"')
+        i++;
+    }
+    batch_carry_unreserve(batch, value.len - len);
+  } else {
+    memcpy(p + 4, value.ptr, len);
+  }
+  put_length(p, (int32_t)len);
+  return 0;
+}
+
+static unsigned carry_code(const SchemaStep *step, const FieldView *fields,
+                           Batch *batch) {
+  bool escaped;
+  FieldView parts[SCHEMA_MAX_SOURCES];
+  size_t len = 0;
+  for (int s = 0; s < step->num_sources; s++) {
+    parts[s] = field_value(fields[step->sources[s]], &escaped);
+    len += parts[s].len;
+  }
+  if (len == 0) {
+    carry_null(batch);
+    return 0;
+  }
+  char *p = batch_carry_reserve(batch, 4 + len);
+  put_length(p, (int32_t)len);
+  p += 4;
+  for (int s = 0; s < step->num_sources; s++) {
+    memcpy(p, parts[s].ptr, parts[s].len);
+    p += parts[s].len;
+  }
+  return 0;
+}
+
+// Optional sign and digits only, false on overflow past limit
+static bool parse_integer(FieldView field, int64_t min, int64_t max,
+                          int64_t *value) {
+  size_t i = 0;
+  bool negative = field.len > 0 && field.ptr[0] == '-';
+  if (field.len > 0 && (field.ptr[0] == '-' || field.ptr[0] == '+'))
+    i++;
+  if (i == field.len)
+    return false;
+  uint64_t n = 0;
+  uint64_t limit = negative ? (uint64_t)(-(min + 1)) + 1 : (uint64_t)max;
+  for (; i < field.len; i++) {
+    unsigned d = (unsigned char)field.ptr[i] - '0';
+    if (d > 9 || n > (limit - d) / 10)
+      return false;
+    n = n * 10 + d;
+  }
+  *value = negative ? (int64_t)(0 - n) : (int64_t)n;
+  return true;
+}
+
+static unsigned carry_integer(const SchemaStep *step, const FieldView *fields,
+                              Batch *batch) {
+  FieldView field = field_trimmed(fields[step->sources[0]]);
+  int64_t value;
+  if (field.len == 0 || !parse_integer(field, INT32_MIN, INT32_MAX, &value)) {
+    carry_null(batch);
+    return field.len == 0 ? 0 : PARSE_BAD_VALUE;
+  }
+  char *p = batch_carry_reserve(batch, 4 + 4);
+  put_length(p, 4);
+  put_length(p + 4, (int32_t)value);
+  return 0;
+}
+
+static unsigned carry_bigint(const SchemaStep *step, const FieldView *fields,
+                             Batch *batch) {
+  FieldView field = field_trimmed(fields[step->sources[0]]);
+  int64_t value;
+  if (field.len == 0 || !parse_integer(field, INT64_MIN, INT64_MAX, &value)) {
+    carry_null(batch);
+    return field.len == 0 ? 0 : PARSE_BAD_VALUE;
+  }
+  carry_uint64(batch, (uint64_t)value);
+  return 0;
+}
+
+static unsigned carry_double(const SchemaStep *step, const FieldView *fields,
+                             Batch *batch) {
+  FieldView field = field_trimmed(fields[step->sources[0]]);
+  double value;
+  if (field.len == 0 || !parse_double(field, &value)) {
+    carry_null(batch);
+    return field.len == 0 ? 0 : PARSE_BAD_VALUE;
+  }
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  carry_uint64(batch, bits);
+  return 0;
+}
+
+static unsigned carry_boolean(const SchemaStep *step, const FieldView *fields,
+                              Batch *batch) {
+  FieldView field = field_trimmed(fields[step->sources[0]]);
+  int value = field.len == 0 ? -1 : parse_boolean(field);
+  if (value < 0) {
+    carry_null(batch);
+    return field.len == 0 ? 0 : PARSE_BAD_VALUE;
+  }
+  char *p = batch_carry_reserve(batch, 4 + 1);
+  put_length(p, 1);
+  p[4] = (char)value;
+  return 0;
+}
+
+static const CarryKernel carry_kernels[TRANSFORM_COUNT] = {
+    [TRANSFORM_TEXT] = carry_text,       [TRANSFORM_CODE] = carry_code,
+    [TRANSFORM_INTEGER] = carry_integer, [TRANSFORM_BIGINT] = carry_bigint,
+    [TRANSFORM_DOUBLE] = carry_double,   [TRANSFORM_BOOLEAN] = carry_boolean,
+};
+
+// ---------------------------------------------------------------------------
+// Binding
+
+// Header field that names the source, -1 when none does
+static int find_source(const char *source, const FieldView *header,
+                       size_t count) {
+  if (source[0] == '#') {
+    char *end;
+    long n = strtol(source + 1, &end, 10);
+    return *end == '\0' && n >= 1 && n <= SCHEMA_MAX_FIELDS ? (int)n - 1 : -1;
+  }
+  size_t len = strlen(source);
+  for (size_t i = 0; i < count; i++) {
+    FieldView name = field_trimmed(header[i]);
+    if (name.len == len && strncasecmp(name.ptr, source, len) == 0)
+      return (int)i;
+  }
+  return -1;
+}
+
+static SchemaStep *add_step(SchemaStep *steps, int *count) {
+  SchemaStep *step = &steps[(*count)++];
+  memset(step, 0, sizeof(SchemaStep));
+  return step;
+}
+
+bool schema_bind(SchemaPlan *plan, const Schema *schema, const char *header,
+                 size_t len, const char *path) {
+  memset(plan, 0, sizeof(SchemaPlan));
+  plan->schema = schema;
+  FieldView *names = malloc(SCHEMA_MAX_FIELDS * sizeof(FieldView));
+  size_t count = csv_split_record(header, len, names, SCHEMA_MAX_FIELDS);
+
+  bool ok = true;
+  for (int c = 0; ok && c < schema->num_columns; c++) {
+    const SchemaColumn *column = &schema->columns[c];
+    int sources[SCHEMA_MAX_SOURCES];
+    for (int s = 0; s < column->num_sources; s++) {
+      sources[s] = find_source(column->sources[s], names, count);
+      if (sources[s] < 0) {
+        fprintf(stderr, "%s: no source column %s for %s in the header\n",
+                path, column->sources[s], column->name);
+        ok = false;
+        break;
+      }
+      if (sources[s] + 1 > plan->num_fields)
+        plan->num_fields = sources[s] + 1;
+    }
+    if (!ok)
+      break;
+
+    SchemaStep *step = NULL;
+    if (column->role == ROLE_COLUMN) {
+      step = add_step(plan->carry_steps, &plan->num_carry_steps);
+      step->run.carry = carry_kernels[column->transform];
+    } else if (column->transform == TRANSFORM_FUNCTION_FLAG) {
+      // Flags of the same function code share one pass over it
+      for (int i = 0; i < plan->num_row_steps; i++)
+        if (plan->row_steps[i].run.row == row_function_flags &&
+            plan->row_steps[i].sources[0] == sources[0])
+          step = &plan->row_steps[i];
+      if (step == NULL) {
+        step = add_step(plan->row_steps, &plan->num_row_steps);
+        step->run.row = row_function_flags;
+      }
+      step->digits[column->role - ROLE_AIRPORT] |= 1u << column->digit;
+    } else {
+      step = add_step(plan->row_steps, &plan->num_row_steps);
+      switch (column->role) {
+      case ROLE_KEY:
+        step->run.row = row_key;
+        break;
+      case ROLE_NAME:
+        step->run.row = row_name;
+        break;
+      case ROLE_COUNTRY:
+        step->run.row = row_country;
+        break;
+      case ROLE_LOCATION:
+        step->run.row = column->transform == TRANSFORM_POINT
+                            ? row_point
+                            : row_unlocode_point;
+        break;
+      default: // airport, port or train from a boolean
+        step->run.row = row_boolean_flag;
+        step->flag = column->role - ROLE_AIRPORT;
+        break;
+      }
+    }
+    memcpy(step->sources, sources, sizeof(int) * column->num_sources);
+    step->num_sources = column->num_sources;
+  }
+  free(names);
+  return ok;
+}
+
+unsigned schema_append_row(const SchemaPlan *plan, FieldView *fields,
+                           size_t count, Batch *batch) {
+  // Short records read empty fields, CRLF input leaves a \r on the last
+  if (count > 0 && fields[count - 1].len > 0 &&
+      fields[count - 1].ptr[fields[count - 1].len - 1] == '\r')
+    fields[count - 1].len--;
+  for (size_t i = count; i < (size_t)plan->num_fields; i++)
+    fields[i] = (FieldView){empty_field, 0};
+
+  ProcessedLocation row;
+  row.key.num_parts = 0;
+  row.country.num_parts = 0;
+  row.change = ' ';
+  row.name = (FieldView){empty_field, 0};
+  row.name_escaped = false;
+  row.has_coordinates = false;
+  row.latitude = 0;
+  row.longitude = 0;
+  row.is_airport = false;
+  row.is_port = false;
+  row.is_train_station = false;
+
+  unsigned errors = 0;
+  for (int s = 0; s < plan->num_row_steps; s++)
+    errors |= plan->row_steps[s].run.row(&plan->row_steps[s], fields, &row);
+  batch_append(batch, &row);
+  batch->schema = plan->schema;
+  for (int s = 0; s < plan->num_carry_steps; s++)
+    errors |=
+        plan->carry_steps[s].run.carry(&plan->carry_steps[s], fields, batch);
+  return errors;
+}
@@ -0,0 +1,367 @@
+#include "sink.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Frontend/backend protocol 3.0
+#define PROTOCOL_VERSION 196608
+
+bool sink_parse(const char *spec, SinkConfig *config) {
+  config->path = NULL;
+  if (strcmp(spec, "postgres") == 0) {
+    config->kind = SINK_POSTGRES;
+    return true;
+  }
+  if (strcmp(spec, "null") == 0) {
+    config->kind = SINK_NULL;
+    return true;
+  }
+  if (strncmp(spec, "file:", 5) == 0 && spec[5] != '\0') {
+    config->kind = SINK_FILE;
+    config->path = spec + 5;
+    return true;
+  }
+  if (strncmp(spec, "socket:", 7) == 0 && spec[7] != '\0') {
+    config->kind = SINK_SOCKET;
+    config->path = spec + 7;
+    return true;
+  }
+  return false;
+}
+
+const char *sink_name(SinkKind kind) {
+  static const char *names[] = {"postgres", "null", "file", "socket"};
+  return names[kind];
+}
+
+static bool write_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool read_all(int fd, char *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = read(fd, data, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Type byte and length word, then the body, without copying the body
+static bool send_message(SinkWriter *writer, char type, const char *body,
+                         size_t len) {
+  char header[5];
+  header[0] = type;
+  uint32_t n = htonl((uint32_t)(len + 4));
+  memcpy(header + 1, &n, sizeof(n));
+  struct iovec parts[2] = {{header, sizeof(header)}, {(void *)body, len}};
+  size_t total = sizeof(header) + len;
+  int count = len > 0 ? 2 : 1;
+  while (total > 0) {
+    ssize_t sent = writev(writer->fd, parts, count);
+    if (sent < 0 && errno == EINTR)
+      continue;
+    if (sent <= 0) {
+      writer->broken = true;
+      return false;
+    }
+    total -= sent;
+    // Partial writes of a large CopyData message
+    for (int i = 0; i < count && sent > 0; i++) {
+      size_t used = (size_t)sent < parts[i].iov_len ? (size_t)sent
+                                                    : parts[i].iov_len;
+      parts[i].iov_base = (char *)parts[i].iov_base + used;
+      parts[i].iov_len -= used;
+      sent -= used;
+    }
+  }
+  return true;
+}
+
+// Next backend message, its body stays in writer->message until the next call
+static bool read_message(SinkWriter *writer, char *type, size_t *len) {
+  char header[5];
+  if (!read_all(writer->fd, header, sizeof(header))) {
+    writer->broken = true;
+    return false;
+  }
+  uint32_t n;
+  memcpy(&n, header + 1, sizeof(n));
+  n = ntohl(n);
+  if (n < 4) {
+    writer->broken = true;
+    return false;
+  }
+  *type = header[0];
+  *len = n - 4;
+  if (*len + 1 > writer->message_capacity) {
+    writer->message_capacity = *len + 1;
+    writer->message = realloc(writer->message, writer->message_capacity);
+  }
+  if (!read_all(writer->fd, writer->message, *len)) {
+    writer->broken = true;
+    return false;
+  }
+  writer->message[*len] = '\0';
+  return true;
+}
+
+// The M field of an ErrorResponse
+static const char *error_text(const SinkWriter *writer, size_t len) {
+  const char *p = writer->message;
+  const char *end = p + len;
+  while (p < end && *p != '\0') {
+    if (*p == 'M')
+      return p + 1;
+    p += strlen(p + 1) + 2;
+  }
+  return "unknown error";
+}
+
+// Keep why a batch failed, printed unless the writer is retrying
+static void sink_failed(SinkWriter *writer, const char *what,
+                        const char *message) {
+  snprintf(writer->error, sizeof(writer->error), "%s", message);
+  if (!writer->quiet)
+    fprintf(stderr, "%s: %s\n", what, message);
+}
+
+// Read until ReadyForQuery. Fills the tag of a CommandComplete, false when
+// the server reported an error
+static bool wait_ready(SinkWriter *writer, char *tag, size_t tag_size) {
+  bool ok = true;
+  while (true) {
+    char type;
+    size_t len;
+    if (!read_message(writer, &type, &len)) {
+      sink_failed(writer, "Sink", "socket closed by the server");
+      return false;
+    }
+    if (type == 'Z')
+      return ok;
+    if (type == 'E') {
+      sink_failed(writer, "Sink server error", error_text(writer, len));
+      ok = false;
+    } else if (type == 'C' && tag) {
+      snprintf(tag, tag_size, "%s", writer->message);
+    }
+  }
+}
+
+static bool socket_connect(SinkWriter *writer, const char *path) {
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "Socket path %s is too long\n", path);
+    return false;
+  }
+  strcpy(address.sun_path, path);
+  writer->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (writer->fd < 0 || connect(writer->fd, (struct sockaddr *)&address,
+                                sizeof(address)) != 0) {
+    perror(path);
+    return false;
+  }
+
+  // Startup packet: length, version, then name value pairs
+  const char *user = getenv("PGUSER") ? getenv("PGUSER")
+                     : getenv("USER") ? getenv("USER")
+                                      : "postgres";
+  const char *database =
+      getenv("PGDATABASE") ? getenv("PGDATABASE") : "vessel_tracking";
+  char startup[512];
+  int len = snprintf(startup + 8, sizeof(startup) - 9,
+                     "user%c%s%cdatabase%c%s%c", 0, user, 0, 0, database, 0);
+  if (len < 0 || (size_t)len >= sizeof(startup) - 9)
+    return false;
+  len += 8 + 1;
+  startup[len - 1] = '\0';
+  uint32_t words[2] = {htonl((uint32_t)len), htonl(PROTOCOL_VERSION)};
+  memcpy(startup, words, sizeof(words));
+  if (!write_all(writer->fd, startup, len))
+    return false;
+
+  while (true) {
+    char type;
+    size_t body;
+    if (!read_message(writer, &type, &body)) {
+      fprintf(stderr, "Sink startup failed\n");
+      return false;
+    }
+    if (type == 'E') {
+      fprintf(stderr, "Sink startup failed: %s\n", error_text(writer, body));
+      return false;
+    }
+    if (type == 'R') {
+      uint32_t code;
+      memcpy(&code, writer->message, sizeof(code));
+      if (ntohl(code) != 0) {
+        fprintf(stderr, "Sink server wants a password, only trust "
+                        "authentication is supported\n");
+        return false;
+      }
+    }
+    if (type == 'Z')
+      return true;
+  }
+}
+
+bool sink_open(SinkWriter *writer, const SinkConfig *config, int writer_id,
+               CopyFormat format, const Schema *schema) {
+  memset(writer, 0, sizeof(SinkWriter));
+  writer->kind = config->kind;
+  writer->format = format;
+  writer->schema = schema;
+  writer->fd = -1;
+  copy_buffer_init(&writer->buffer);
+
+  if (config->kind == SINK_FILE) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.%d", config->path, writer_id);
+    writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (writer->fd < 0) {
+      perror(path);
+      return false;
+    }
+    // One stream per file, loadable with COPY ... FROM as a whole
+    if (format == COPY_FORMAT_BINARY)
+      copy_encode_binary_header(&writer->buffer);
+    return true;
+  }
+  if (config->kind == SINK_SOCKET)
+    return socket_connect(writer, config->path);
+  return true;
+}
+
+static bool sink_flush(SinkWriter *writer) {
+  CopyBuffer *buffer = &writer->buffer;
+  bool ok = true;
+  if (writer->kind == SINK_FILE)
+    ok = write_all(writer->fd, buffer->data, buffer->len);
+  else if (writer->kind == SINK_SOCKET && buffer->len > 0)
+    ok = send_message(writer, 'd', buffer->data, buffer->len);
+  if (!ok) {
+    writer->broken = true;
+    sink_failed(writer, "Sink write failed", strerror(errno));
+  }
+  writer->bytes += buffer->len;
+  buffer->len = 0;
+  return ok;
+}
+
+bool sink_write_batch(SinkWriter *writer, const Batch *batch,
+                      InsertTimings *timings) {
+  CopyBuffer *buffer = &writer->buffer;
+  bool binary = writer->format == COPY_FORMAT_BINARY;
+  bool socket = writer->kind == SINK_SOCKET;
+  double start = get_time();
+
+  if (socket) {
+    const char *query = writer->schema->sql.copy_table[writer->format];
+    if (!send_message(writer, 'Q', query, strlen(query) + 1))
+      return false;
+    char type;
+    size_t len;
+    if (!read_message(writer, &type, &len))
+      return false;
+    if (type != 'G') {
+      if (type == 'E')
+        sink_failed(writer, "COPY failed", error_text(writer, len));
+      wait_ready(writer, NULL, 0);
+      return false;
+    }
+    if (binary)
+      copy_encode_binary_header(buffer);
+  }
+  double setup_end = get_time();
+
+  double send_time = 0;
+  int rows_sent = 0;
+  for (int i = 0; i < batch->count; i++) {
+    if (!batch_row_is_valid(batch, i))
+      continue;
+    if (binary)
+      copy_encode_binary_row(buffer, batch, i);
+    else
+      copy_encode_csv_row(buffer, batch, i);
+    rows_sent++;
+
+    if (buffer->len >= COPY_FLUSH_THRESHOLD) {
+      double send_start = get_time();
+      if (!sink_flush(writer))
+        return false;
+      send_time += get_time() - send_start;
+    }
+  }
+  // A file keeps one stream across batches, a socket COPY ends here
+  if (socket && binary)
+    copy_encode_binary_trailer(buffer);
+  double encode_time = get_time() - setup_end - send_time;
+  if (!sink_flush(writer))
+    return false;
+  double copy_end = get_time();
+
+  MergeCounts merged = {.inserted = rows_sent};
+  if (socket) {
+    char tag[64] = "";
+    if (!send_message(writer, 'c', NULL, 0) ||
+        !wait_ready(writer, tag, sizeof(tag)))
+      return false;
+    long copied;
+    if (sscanf(tag, "COPY %ld", &copied) != 1 || copied != rows_sent) {
+      char message[128];
+      snprintf(message, sizeof(message), "acknowledged '%s' for %d rows", tag,
+               rows_sent);
+      sink_failed(writer, "Sink server", message);
+      return false;
+    }
+    merged.inserted = copied;
+  }
+
+  if (timings) {
+    timings->setup = setup_end - start;
+    timings->encode = encode_time;
+    timings->copy = copy_end - setup_end - encode_time;
+    timings->merge = 0;
+    timings->commit = get_time() - copy_end;
+    timings->rows_sent = rows_sent;
+    timings->merged = merged;
+  }
+  return true;
+}
+
+void sink_close(SinkWriter *writer) {
+  if (writer->fd >= 0) {
+    if (writer->kind == SINK_FILE) {
+      if (writer->format == COPY_FORMAT_BINARY)
+        copy_encode_binary_trailer(&writer->buffer);
+      sink_flush(writer);
+    } else if (writer->kind == SINK_SOCKET) {
+      send_message(writer, 'X', NULL, 0);
+    }
+    close(writer->fd);
+  }
+  copy_buffer_free(&writer->buffer);
+  free(writer->message);
+  writer->fd = -1;
+  writer->message = NULL;
+}
@@ -0,0 +1,370 @@
+#include "spatial_sort.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// stdio buffer of every run file, what a merge of many runs holds per run
+#define SORT_RUN_BUFFER (256 * 1024)
+
+// Fixed part of a row in a run, its codes, name and carried values follow,
+// padded so the next row is aligned
+typedef struct {
+  uint64_t key;
+  uint64_t origin;
+  double latitude;
+  double longitude;
+  uint32_t code_len; // key and country code
+  uint32_t key_len;
+  uint32_t name_len;
+  uint32_t carried_len;
+  uint8_t flags;
+} SortedRow;
+
+static size_t sorted_payload(const SortedRow *row) {
+  return ((size_t)row->code_len + row->name_len + row->carried_len + 7) &
+         ~(size_t)7;
+}
+
+// Where a row of the run in memory starts, equal keys keep their arrival
+// order
+typedef struct {
+  uint64_t key;
+  size_t offset;
+} SortEntry;
+
+typedef struct {
+  char *data;
+  size_t len;
+  size_t capacity;
+  SortEntry *entries;
+  size_t count;
+  size_t entries_capacity;
+} MemoryRun;
+
+// Batch being filled for the output queue
+typedef struct {
+  SpatialSorter *sorter;
+  Batch *batch;
+  const struct Schema *schema;
+} SortOutput;
+
+static int compare_sort_entries(const void *a, const void *b) {
+  const SortEntry *x = a;
+  const SortEntry *y = b;
+  if (x->key != y->key)
+    return x->key < y->key ? -1 : 1;
+  return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+static void output_push(SortOutput *output) {
+  SpatialSorter *sorter = output->sorter;
+  Ticks wait_start = ticks_now();
+  queue_push(&sorter->output, output->batch);
+  stage_record_ticks(sorter->metrics, STAGE_ENQUEUE_WAIT,
+                     ticks_now() - wait_start);
+  metrics_add(&sorter->metrics->batches, 1);
+  output->batch = NULL;
+}
+
+static void output_row(SortOutput *output, const SortedRow *row,
+                       const char *payload) {
+  int file = origin_file(row->origin);
+  if (output->batch == NULL) {
+    output->batch = batch_acquire(output->sorter->pool);
+    output->batch->file = file;
+  } else if (output->batch->file != file) {
+    output->batch->file = -1;
+  }
+  const char *name = payload + row->code_len;
+  BatchRow append = {.key = {payload, row->key_len},
+                     .country = {payload + row->key_len,
+                                 row->code_len - row->key_len},
+                     .flags = row->flags,
+                     .latitude = row->latitude,
+                     .longitude = row->longitude,
+                     .origin = row->origin,
+                     .name = {name, row->name_len},
+                     .carried = {name + row->name_len, row->carried_len}};
+  batch_append_row(output->batch, &append);
+  output->batch->schema = output->schema;
+  if (output->batch->count >= batch_pool_fill(output->sorter->pool))
+    output_push(output);
+}
+
+// Copy row i into the run, false when the run is full
+static bool run_add(MemoryRun *run, size_t memory, const Batch *batch, int i) {
+  // The key and country code are adjacent in the batch
+  FieldView codes = batch_key(batch, i);
+  uint32_t key_len = (uint32_t)codes.len;
+  codes.len += batch_country(batch, i).len;
+  FieldView name = batch_name(batch, i);
+  FieldView carried = batch_carried(batch, i);
+  SortedRow row = {.key = batch_hilbert_key(batch, i),
+                   .origin = batch->origin[i],
+                   .latitude = batch->latitude[i],
+                   .longitude = batch->longitude[i],
+                   .code_len = (uint32_t)codes.len,
+                   .key_len = key_len,
+                   .name_len = (uint32_t)name.len,
+                   .carried_len = (uint32_t)carried.len,
+                   .flags = batch->flags[i]};
+
+  size_t size = sizeof(SortedRow) + sorted_payload(&row);
+  size_t used = run->len + size + (run->count + 1) * sizeof(SortEntry);
+  // A single row larger than the budget still makes a run of its own
+  if (used > memory && run->count > 0)
+    return false;
+
+  if (run->len + size > run->capacity) {
+    size_t capacity = run->capacity ? run->capacity * 2 : 1 << 20;
+    while (run->len + size > capacity)
+      capacity *= 2;
+    run->data = realloc(run->data, capacity);
+    run->capacity = capacity;
+  }
+  if (run->count == run->entries_capacity) {
+    run->entries_capacity =
+        run->entries_capacity ? run->entries_capacity * 2 : 1 << 14;
+    run->entries =
+        realloc(run->entries, run->entries_capacity * sizeof(SortEntry));
+  }
+
+  char *dst = run->data + run->len;
+  memcpy(dst, &row, sizeof(SortedRow));
+  dst += sizeof(SortedRow);
+  memcpy(dst, codes.ptr, codes.len);
+  memcpy(dst + codes.len, name.ptr, name.len);
+  memcpy(dst + codes.len + name.len, carried.ptr, carried.len);
+  run->entries[run->count++] = (SortEntry){row.key, run->len};
+  run->len += size;
+  return true;
+}
+
+static void run_sort(SpatialSorter *sorter, MemoryRun *run) {
+  double start = get_time();
+  qsort(run->entries, run->count, sizeof(SortEntry), compare_sort_entries);
+  sorter->sort_seconds += get_time() - start;
+}
+
+static void run_send(SortOutput *output, const MemoryRun *run) {
+  for (size_t e = 0; e < run->count; e++) {
+    const char *row = run->data + run->entries[e].offset;
+    output_row(output, (const SortedRow *)row, row + sizeof(SortedRow));
+  }
+}
+
+// Anonymous file in TMPDIR, gone once closed
+static FILE *run_file_create(void) {
+  const char *dir = getenv("TMPDIR");
+  if (dir == NULL || *dir == '\0')
+    dir = "/tmp";
+  size_t len = strlen(dir) + sizeof("/postig-sort-XXXXXX");
+  char *path = malloc(len);
+  snprintf(path, len, "%s/postig-sort-XXXXXX", dir);
+  FILE *file = NULL;
+  int fd = mkstemp(path);
+  if (fd >= 0) {
+    unlink(path);
+    file = fdopen(fd, "w+b");
+    if (file == NULL)
+      close(fd);
+  }
+  if (file == NULL)
+    fprintf(stderr, "Could not create a sort run in %s: %s\n", dir,
+            strerror(errno));
+  else
+    setvbuf(file, NULL, _IOFBF, SORT_RUN_BUFFER);
+  free(path);
+  return file;
+}
+
+// Write the sorted run out. Rows that cannot be spilled are sent in the
+// order of their own run, the load goes on less clustered
+static void run_spill(SpatialSorter *sorter, SortOutput *output,
+                      MemoryRun *run) {
+  double start = get_time();
+  FILE *file = run_file_create();
+  bool written = file != NULL;
+  for (size_t e = 0; written && e < run->count; e++) {
+    const char *row = run->data + run->entries[e].offset;
+    size_t size = sizeof(SortedRow) + sorted_payload((const SortedRow *)row);
+    written = fwrite(row, 1, size, file) == size;
+  }
+  written = written && fflush(file) == 0 && fseek(file, 0, SEEK_SET) == 0;
+
+  if (written) {
+    sorter->runs =
+        realloc(sorter->runs, (sorter->num_runs + 1) * sizeof(SortRun));
+    sorter->runs[sorter->num_runs++] =
+        (SortRun){.file = file, .rows = run->count, .bytes = run->len};
+    sorter->spilled_bytes += run->len;
+  } else {
+    if (file) {
+      fprintf(stderr, "Could not write a sort run: %s, sending %zu rows "
+                      "sorted by themselves\n",
+              strerror(errno), run->count);
+      fclose(file);
+    }
+    run_send(output, run);
+  }
+  run->len = 0;
+  run->count = 0;
+  sorter->merge_seconds += get_time() - start;
+}
+
+// Next row of a spilled run during the merge
+typedef struct {
+  SortRun *run;
+  size_t left; // rows not read yet
+  SortedRow row;
+  char *payload;
+  size_t payload_capacity;
+} RunCursor;
+
+static bool cursor_next(SpatialSorter *sorter, RunCursor *cursor) {
+  if (cursor->left == 0)
+    return false;
+  FILE *file = cursor->run->file;
+  bool read = fread(&cursor->row, sizeof(SortedRow), 1, file) == 1;
+  size_t payload = read ? sorted_payload(&cursor->row) : 0;
+  if (payload > cursor->payload_capacity) {
+    cursor->payload = realloc(cursor->payload, payload);
+    cursor->payload_capacity = payload;
+  }
+  if (read && payload > 0)
+    read = fread(cursor->payload, payload, 1, file) == 1;
+  if (!read) {
+    fprintf(stderr, "Could not read back a sort run, %zu rows lost\n",
+            cursor->left);
+    metrics_add(&sorter->metrics->counters[ROWS_FAILED], cursor->left);
+    cursor->left = 0;
+    return false;
+  }
+  cursor->left--;
+  return true;
+}
+
+// Cursor a sorts before cursor b, ties go to the earlier run
+static bool cursor_before(const RunCursor *a, const RunCursor *b) {
+  if (a->row.key != b->row.key)
+    return a->row.key < b->row.key;
+  return a->run < b->run;
+}
+
+static void heap_sift_down(RunCursor **heap, int size, int i) {
+  while (true) {
+    int least = i;
+    int left = 2 * i + 1;
+    int right = left + 1;
+    if (left < size && cursor_before(heap[left], heap[least]))
+      least = left;
+    if (right < size && cursor_before(heap[right], heap[least]))
+      least = right;
+    if (least == i)
+      return;
+    RunCursor *swap = heap[i];
+    heap[i] = heap[least];
+    heap[least] = swap;
+    i = least;
+  }
+}
+
+// K-way merge of the spilled runs on a min heap of their next rows
+static void runs_merge(SpatialSorter *sorter, SortOutput *output) {
+  double start = get_time();
+  int num_runs = sorter->num_runs;
+  RunCursor *cursors = calloc(num_runs, sizeof(RunCursor));
+  RunCursor **heap = malloc(num_runs * sizeof(RunCursor *));
+  int size = 0;
+  for (int r = 0; r < num_runs; r++) {
+    cursors[r].run = &sorter->runs[r];
+    cursors[r].left = sorter->runs[r].rows;
+    if (cursor_next(sorter, &cursors[r]))
+      heap[size++] = &cursors[r];
+  }
+  for (int i = size / 2 - 1; i >= 0; i--)
+    heap_sift_down(heap, size, i);
+
+  while (size > 0) {
+    RunCursor *next = heap[0];
+    output_row(output, &next->row, next->payload);
+    if (!cursor_next(sorter, next))
+      heap[0] = heap[--size];
+    heap_sift_down(heap, size, 0);
+  }
+
+  for (int r = 0; r < num_runs; r++)
+    free(cursors[r].payload);
+  free(cursors);
+  free(heap);
+  sorter->merge_seconds += get_time() - start;
+}
+
+static void *sorter_thread(void *arg) {
+  SpatialSorter *sorter = arg;
+  MemoryRun run = {0};
+  SortOutput output = {.sorter = sorter};
+
+  Batch *batch;
+  while ((batch = queue_pop(sorter->input)) != NULL) {
+    Ticks start = ticks_now();
+    if (batch->schema)
+      output.schema = batch->schema;
+    for (int i = 0; i < batch->count; i++) {
+      if (run_add(&run, sorter->memory, batch, i))
+        continue;
+      run_sort(sorter, &run);
+      run_spill(sorter, &output, &run);
+      run_add(&run, sorter->memory, batch, i);
+    }
+    sorter->rows += batch->count;
+    stage_record_ticks(sorter->metrics, STAGE_PARSE, ticks_now() - start);
+    batch_release(sorter->pool, batch);
+  }
+
+  // A load that fit in memory is sent from it, otherwise the last run joins
+  // the merge like the others
+  Ticks start = ticks_now();
+  run_sort(sorter, &run);
+  if (sorter->num_runs == 0) {
+    run_send(&output, &run);
+  } else {
+    if (run.count > 0)
+      run_spill(sorter, &output, &run);
+    free(run.data);
+    free(run.entries);
+    run = (MemoryRun){0};
+    runs_merge(sorter, &output);
+  }
+  if (output.batch)
+    output_push(&output);
+  stage_record_ticks(sorter->metrics, STAGE_PARSE, ticks_now() - start);
+  queue_finish(&sorter->output);
+  free(run.data);
+  free(run.entries);
+  return NULL;
+}
+
+void sorter_start(SpatialSorter *sorter) {
+  sorter->rows = 0;
+  sorter->runs = NULL;
+  sorter->num_runs = 0;
+  sorter->spilled_bytes = 0;
+  sorter->sort_seconds = 0;
+  sorter->merge_seconds = 0;
+  queue_init(&sorter->output, SORTER_QUEUE_DEPTH);
+  pthread_create(&sorter->thread, NULL, sorter_thread, sorter);
+}
+
+void sorter_join(SpatialSorter *sorter) {
+  pthread_join(sorter->thread, NULL);
+}
+
+void sorter_destroy(SpatialSorter *sorter) {
+  for (int r = 0; r < sorter->num_runs; r++)
+    fclose(sorter->runs[r].file);
+  free(sorter->runs);
+  sorter->runs = NULL;
+  queue_destroy(&sorter->output);
+}
@@ -0,0 +1,475 @@
+#include "stream_decoder.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+Compression detect_compression(int fd) {
+  unsigned char magic[4];
+  ssize_t n = pread(fd, magic, sizeof(magic), 0);
+  if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+    return COMPRESSION_GZIP;
+  if (n == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f &&
+      magic[3] == 0xfd)
+    return COMPRESSION_ZSTD;
+  return COMPRESSION_NONE;
+}
+
+// Compressed input and the state of the codec
+typedef struct {
+  z_stream zlib;
+#ifdef HAVE_ZSTD
+  ZSTD_DStream *zstd;
+  ZSTD_inBuffer zstd_in;
+#endif
+  char *input;
+  bool input_eof;
+  bool frame_done; // the last gzip member or zstd frame ended
+} Inflater;
+
+// Refill the input when it is used up, false once the file has no more
+static bool read_input(StreamDecoder *decoder, Inflater *inflater,
+                       const char **next, size_t *available) {
+  if (*available > 0)
+    return true;
+  if (inflater->input_eof)
+    return false;
+  ssize_t n = read(decoder->fd, inflater->input, DECODER_READ_SIZE);
+  if (n <= 0) {
+    inflater->input_eof = true;
+    return false;
+  }
+  *next = inflater->input;
+  *available = n;
+  return true;
+}
+
+// Decode into out until it is full or the stream ends. False on corrupt or
+// truncated input
+static bool inflate_into(StreamDecoder *decoder, Inflater *inflater, char *out,
+                         size_t capacity, size_t *written, bool *end) {
+  *written = 0;
+  if (decoder->compression == COMPRESSION_GZIP) {
+    z_stream *z = &inflater->zlib;
+    while (*written < capacity) {
+      const char *next = (const char *)z->next_in;
+      size_t available = z->avail_in;
+      if (!read_input(decoder, inflater, &next, &available)) {
+        *end = true;
+        return inflater->frame_done;
+      }
+      z->next_in = (Bytef *)next;
+      z->avail_in = (uInt)available;
+      z->next_out = (Bytef *)out + *written;
+      z->avail_out = (uInt)(capacity - *written);
+      int status = inflate(z, Z_NO_FLUSH);
+      *written = capacity - z->avail_out;
+      if (status == Z_STREAM_END) {
+        // Concatenated members, as written by pigz or cat a.gz b.gz
+        inflater->frame_done = true;
+        inflateReset(z);
+      } else if (status == Z_OK || status == Z_BUF_ERROR) {
+        inflater->frame_done = false;
+      } else {
+        fprintf(stderr, "gzip decoding failed: %s\n",
+                z->msg ? z->msg : "corrupt input");
+        return false;
+      }
+    }
+    return true;
+  }
+
+#ifdef HAVE_ZSTD
+  ZSTD_inBuffer *in = &inflater->zstd_in;
+  ZSTD_outBuffer out_buffer = {out, capacity, 0};
+  while (out_buffer.pos < capacity) {
+    if (in->pos == in->size) {
+      const char *next = NULL;
+      size_t available = 0;
+      if (!read_input(decoder, inflater, &next, &available)) {
+        *written = out_buffer.pos;
+        *end = true;
+        return inflater->frame_done;
+      }
+      *in = (ZSTD_inBuffer){next, available, 0};
+    }
+    size_t status = ZSTD_decompressStream(inflater->zstd, &out_buffer, in);
+    if (ZSTD_isError(status)) {
+      fprintf(stderr, "zstd decoding failed: %s\n",
+              ZSTD_getErrorName(status));
+      return false;
+    }
+    inflater->frame_done = status == 0;
+  }
+  *written = out_buffer.pos;
+#else
+  (void)out;
+  (void)capacity;
+  (void)end;
+#endif
+  return true;
+}
+
+// End of the last whole record, 0 when none ends in the buffer. data starts
+// on a record boundary, so the quotes before a newline tell whether it is
+// inside a quoted field
+static size_t last_record_boundary(const char *data, size_t len) {
+  size_t newline = len;
+  while (newline > 0 && data[newline - 1] != '\n')
+    newline--;
+  if (newline == 0)
+    return 0;
+
+  // A plain loop the compiler vectorizes, faster than memchr per quote
+  size_t quotes = 0;
+  for (size_t i = 0; i < newline - 1; i++)
+    quotes += data[i] == '"';
+
+  // Inside a quoted field, back off to earlier newlines
+  while (quotes % 2 != 0) {
+    size_t previous = newline - 1;
+    while (previous > 0 && data[previous - 1] != '\n')
+      previous--;
+    if (previous == 0)
+      return 0;
+    for (size_t i = previous - 1; i < newline - 1; i++)
+      quotes -= data[i] == '"';
+    newline = previous;
+  }
+  return newline;
+}
+
+static void publish(StreamDecoder *decoder, DecoderSlot *slot, bool last) {
+  pthread_mutex_lock(&decoder->lock);
+  if (slot)
+    slot->state = SLOT_FILLED;
+  decoder->done = last;
+  pthread_cond_broadcast(&decoder->changed);
+  pthread_mutex_unlock(&decoder->lock);
+}
+
+static void *decoder_thread(void *arg) {
+  StreamDecoder *decoder = arg;
+  Inflater inflater = {.input = malloc(DECODER_READ_SIZE)};
+  if (decoder->compression == COMPRESSION_GZIP) {
+    inflateInit2(&inflater.zlib, 15 + 16); // gzip header only
+  }
+#ifdef HAVE_ZSTD
+  else {
+    inflater.zstd = ZSTD_createDStream();
+    ZSTD_initDStream(inflater.zstd);
+  }
+#endif
+
+  DecoderSlot *previous = NULL;
+  size_t stream_offset = 0;
+  for (uint64_t n = 0;; n++) {
+    DecoderSlot *slot = &decoder->slots[n % DECODER_BUFFERS];
+    pthread_mutex_lock(&decoder->lock);
+    while (slot->state != SLOT_FREE && !decoder->stop)
+      pthread_cond_wait(&decoder->changed, &decoder->lock);
+    bool stop = decoder->stop;
+    pthread_mutex_unlock(&decoder->lock);
+    if (stop)
+      break;
+
+    // The record cut at the end of the previous buffer starts this one
+    size_t carry = previous ? previous->filled - previous->len : 0;
+    if (slot->capacity < carry * 2) {
+      slot->capacity = carry * 2;
+      slot->data = realloc(slot->data, slot->capacity);
+    }
+    if (carry > 0)
+      memcpy(slot->data, previous->data + previous->len, carry);
+    slot->filled = carry;
+    slot->offset = stream_offset;
+
+    bool end = false;
+    size_t boundary = 0;
+    while (true) {
+      size_t written;
+      if (!inflate_into(decoder, &inflater, slot->data + slot->filled,
+                        slot->capacity - slot->filled, &written, &end)) {
+        decoder->failed = true;
+        end = true;
+      }
+      slot->filled += written;
+      // The last record needs no newline
+      boundary = end ? slot->filled
+                     : last_record_boundary(slot->data, slot->filled);
+      if (boundary > 0 || end)
+        break;
+      // One record longer than the buffer
+      slot->capacity *= 2;
+      slot->data = realloc(slot->data, slot->capacity);
+    }
+
+    slot->len = boundary;
+    stream_offset += boundary;
+    previous = slot;
+    if (end) {
+      // Nothing of a stream that failed to decode is handed out
+      bool whole = boundary > 0 && !decoder->failed;
+      publish(decoder, whole ? slot : NULL, true);
+      break;
+    }
+    publish(decoder, slot, false);
+  }
+
+  if (decoder->compression == COMPRESSION_GZIP)
+    inflateEnd(&inflater.zlib);
+#ifdef HAVE_ZSTD
+  else
+    ZSTD_freeDStream(inflater.zstd);
+#endif
+  free(inflater.input);
+  // Consumers waiting on an empty ring see the end
+  publish(decoder, NULL, true);
+  return NULL;
+}
+
+// Whether a plain file read may go into the slot. Waits for the consumers
+// only when asked to, when no other read is in flight
+static bool slot_ready(StreamDecoder *decoder, DecoderSlot *slot, bool wait) {
+  pthread_mutex_lock(&decoder->lock);
+  while (wait && slot->state != SLOT_FREE && !decoder->stop)
+    pthread_cond_wait(&decoder->changed, &decoder->lock);
+  bool ready = slot->state == SLOT_FREE && !decoder->stop;
+  pthread_mutex_unlock(&decoder->lock);
+  return ready;
+}
+
+// The cut record goes in front of the read, which stays where it landed.
+// A record longer than the room moves the read into a larger buffer
+static void place_carry(DecoderSlot *slot, const char *carry, size_t len,
+                        size_t read) {
+  if (len > slot->room) {
+    size_t room = (len + READ_AHEAD_ALIGNMENT - 1) /
+                  READ_AHEAD_ALIGNMENT * READ_AHEAD_ALIGNMENT;
+    size_t capacity = room + (slot->capacity - slot->room);
+    void *data;
+    if (posix_memalign(&data, READ_AHEAD_ALIGNMENT, capacity) != 0)
+      abort();
+    memcpy((char *)data + room, slot->data + slot->room, read);
+    free(slot->data);
+    slot->data = data;
+    slot->room = room;
+    slot->capacity = capacity;
+  }
+  slot->head = slot->room - len;
+  memcpy(slot->data + slot->head, carry, len);
+}
+
+// Plain files: reads of DECODER_BUFFER_SIZE into every free buffer but the
+// one whose cut record the next buffer still needs. Reads finish in any
+// order and are handed out in file order
+static void *read_thread(void *arg) {
+  StreamDecoder *decoder = arg;
+  ReadAhead *ahead = &decoder->ahead;
+  ssize_t results[DECODER_BUFFERS];
+  bool finished[DECODER_BUFFERS] = {false};
+  uint64_t submitted = 0;
+  uint64_t published = 0;
+  size_t read_offset = 0;
+  size_t stream_offset = 0;
+  DecoderSlot *previous = NULL;
+
+  while (true) {
+    // Keep the reads in flight
+    while (read_offset < decoder->size &&
+           submitted - published < DECODER_BUFFERS - 1) {
+      DecoderSlot *slot = &decoder->slots[submitted % DECODER_BUFFERS];
+      if (!slot_ready(decoder, slot, submitted == published))
+        break;
+      if (!read_ahead_submit(ahead, submitted, slot->data + slot->room,
+                             DECODER_BUFFER_SIZE, read_offset)) {
+        fprintf(stderr, "Read of %zu bytes at %zu could not be queued\n",
+                (size_t)DECODER_BUFFER_SIZE, read_offset);
+        decoder->failed = true;
+        break;
+      }
+      read_offset += DECODER_BUFFER_SIZE;
+      submitted++;
+    }
+    // Stopped, failed or at the end of the file
+    if (submitted == published)
+      break;
+
+    int index = (int)(published % DECODER_BUFFERS);
+    while (!finished[index]) {
+      ReadCompletion done;
+      if (!read_ahead_wait(ahead, &done)) {
+        decoder->failed = true;
+        break;
+      }
+      finished[done.tag % DECODER_BUFFERS] = true;
+      results[done.tag % DECODER_BUFFERS] = done.result;
+    }
+    if (decoder->failed)
+      break;
+    finished[index] = false;
+
+    DecoderSlot *slot = &decoder->slots[index];
+    size_t file_offset = published * (size_t)DECODER_BUFFER_SIZE;
+    ssize_t n = results[index];
+    // io_uring may stop short of the end of the file, read the rest. The
+    // read restarts at the last aligned offset, O_DIRECT refuses any other
+    while (n >= 0 && n < DECODER_BUFFER_SIZE &&
+           file_offset + n < decoder->size) {
+      size_t done = (size_t)n / READ_AHEAD_ALIGNMENT * READ_AHEAD_ALIGNMENT;
+      ssize_t more = pread(decoder->fd, slot->data + slot->room + done,
+                           DECODER_BUFFER_SIZE - done,
+                           (off_t)(file_offset + done));
+      if (more < 0 && errno == EINTR)
+        continue;
+      n = more < 0                   ? -errno
+          : done + more <= (size_t)n ? -EIO
+                                     : (ssize_t)(done + more);
+    }
+    if (n < 0) {
+      fprintf(stderr, "Read at %zu failed: %s\n", file_offset, strerror(-n));
+      decoder->failed = true;
+      break;
+    }
+
+    size_t carry = previous ? previous->filled - previous->len : 0;
+    place_carry(slot, previous ? previous->data + previous->head + previous->len
+                               : NULL,
+                carry, (size_t)n);
+    slot->filled = carry + n;
+    slot->offset = stream_offset;
+    bool end = file_offset + n >= decoder->size;
+    // A buffer without a record end is handed out empty, all of it is carried
+    size_t boundary = end ? slot->filled
+                          : last_record_boundary(slot->data + slot->head,
+                                                 slot->filled);
+    slot->len = boundary;
+    stream_offset += boundary;
+    previous = slot;
+    published++;
+    publish(decoder, slot, end);
+    if (end)
+      break;
+  }
+
+  // Buffers are freed once the thread is joined, no read may still land
+  ReadCompletion done;
+  while (read_ahead_wait(ahead, &done))
+    ;
+  publish(decoder, NULL, true);
+  return NULL;
+}
+
+bool decoder_start_reads(StreamDecoder *decoder, int fd, size_t size,
+                         bool direct) {
+  memset(decoder, 0, sizeof(StreamDecoder));
+  decoder->fd = fd;
+  decoder->compression = COMPRESSION_NONE;
+  decoder->size = size;
+  decoder->direct = direct;
+  for (int i = 0; i < DECODER_BUFFERS; i++) {
+    DecoderSlot *slot = &decoder->slots[i];
+    slot->room = DECODER_CARRY_ROOM;
+    slot->capacity = DECODER_CARRY_ROOM + DECODER_BUFFER_SIZE;
+    void *data;
+    if (posix_memalign(&data, READ_AHEAD_ALIGNMENT, slot->capacity) != 0)
+      abort();
+    slot->data = data;
+  }
+  read_ahead_init(&decoder->ahead, fd, DECODER_BUFFERS);
+  pthread_mutex_init(&decoder->lock, NULL);
+  pthread_cond_init(&decoder->changed, NULL);
+  pthread_create(&decoder->thread, NULL, read_thread, decoder);
+  return true;
+}
+
+bool decoder_start(StreamDecoder *decoder, int fd, Compression compression) {
+  memset(decoder, 0, sizeof(StreamDecoder));
+  decoder->fd = fd;
+  decoder->compression = compression;
+#ifndef HAVE_ZSTD
+  if (compression == COMPRESSION_ZSTD) {
+    fprintf(stderr, "zstd input, but built without zstd support\n");
+    close(fd);
+    return false;
+  }
+#endif
+  for (int i = 0; i < DECODER_BUFFERS; i++) {
+    decoder->slots[i].capacity = DECODER_BUFFER_SIZE;
+    decoder->slots[i].data = malloc(DECODER_BUFFER_SIZE);
+  }
+  pthread_mutex_init(&decoder->lock, NULL);
+  pthread_cond_init(&decoder->changed, NULL);
+  pthread_create(&decoder->thread, NULL, decoder_thread, decoder);
+  return true;
+}
+
+void decoder_stop(StreamDecoder *decoder) {
+  pthread_mutex_lock(&decoder->lock);
+  decoder->stop = true;
+  pthread_cond_broadcast(&decoder->changed);
+  pthread_mutex_unlock(&decoder->lock);
+  pthread_join(decoder->thread, NULL);
+
+  for (int i = 0; i < DECODER_BUFFERS; i++)
+    free(decoder->slots[i].data);
+  if (decoder->compression == COMPRESSION_NONE)
+    read_ahead_close(&decoder->ahead);
+  pthread_mutex_destroy(&decoder->lock);
+  pthread_cond_destroy(&decoder->changed);
+  close(decoder->fd);
+}
+
+bool decoder_take(StreamDecoder *decoder, DecodedChunk *chunk) {
+  pthread_mutex_lock(&decoder->lock);
+  if (decoder->has_returned) {
+    *chunk = decoder->returned;
+    decoder->has_returned = false;
+    pthread_mutex_unlock(&decoder->lock);
+    return true;
+  }
+
+  DecoderSlot *slot;
+  while (true) {
+    slot = &decoder->slots[decoder->next_take % DECODER_BUFFERS];
+    if (slot->state == SLOT_FILLED)
+      break;
+    // Slots are filled in order, once the decoder is done an unfilled next
+    // slot means the stream is over
+    if (decoder->done || decoder->stop) {
+      pthread_mutex_unlock(&decoder->lock);
+      return false;
+    }
+    pthread_cond_wait(&decoder->changed, &decoder->lock);
+  }
+  slot->state = SLOT_TAKEN;
+  chunk->data = slot->data + slot->head;
+  chunk->len = slot->len;
+  chunk->offset = slot->offset;
+  chunk->slot = (int)(decoder->next_take % DECODER_BUFFERS);
+  decoder->next_take++;
+  pthread_mutex_unlock(&decoder->lock);
+  return true;
+}
+
+void decoder_release(StreamDecoder *decoder, const DecodedChunk *chunk) {
+  pthread_mutex_lock(&decoder->lock);
+  decoder->slots[chunk->slot].state = SLOT_FREE;
+  pthread_cond_broadcast(&decoder->changed);
+  pthread_mutex_unlock(&decoder->lock);
+}
+
+void decoder_unget(StreamDecoder *decoder, const DecodedChunk *chunk,
+                   size_t consumed) {
+  pthread_mutex_lock(&decoder->lock);
+  decoder->returned = (DecodedChunk){chunk->data + consumed,
+                                     chunk->len - consumed,
+                                     chunk->offset + consumed, chunk->slot};
+  decoder->has_returned = true;
+  pthread_mutex_unlock(&decoder->lock);
+}
@@ -1,102 +1,249 @@
 #include "worker_threads.h"
+#include "pipeline_writer.h"
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 
-void queue_init(BatchQueue *queue) {
-  queue->front = 0;
-  queue->rear = 0;
-  queue->count = 0;
-  queue->done = false;
-  pthread_mutex_init(&queue->mutex, NULL);
-  pthread_cond_init(&queue->not_full, NULL);
-  pthread_cond_init(&queue->not_empty, NULL);
-  memset(queue->batches, 0, sizeof(queue->batches));
+void writer_count_rows(ThreadMetrics *metrics, const Batch *batch,
+                       int rows_sent, const MergeCounts *merged) {
+  // A rename may delete more rows than it sent
+  long applied = merged->inserted + merged->updated + merged->deleted;
+  metrics_add(&metrics->counters[ROWS_SKIPPED], batch->count - rows_sent);
+  metrics_add(&metrics->counters[ROWS_INSERTED], merged->inserted);
+  metrics_add(&metrics->counters[ROWS_UPDATED], merged->updated);
+  metrics_add(&metrics->counters[ROWS_DELETED], merged->deleted);
+  metrics_add(&metrics->counters[ROWS_CONFLICTED],
+              applied < rows_sent ? rows_sent - applied : 0);
 }
 
-void queue_push(BatchQueue *queue, Batch *batch) {
-
-  /*
-   * prevent race condition or dead lock by locking the queue when it's in use
-   * by a consumer thread, or a pushing producer (main thread), The
-   * pthread_mutex_lock() function locks mutex.  If the mutex is already locked,
-   * the calling thread will block until the mutex becomes available.
-   * */
-  pthread_mutex_lock(&queue->mutex);
-
-  /*
- if the queue is full wait for the consumer
- to pop a task from the queue
- the pthread_cond_wait() function atomically blocks the current thread waiting
- on the condition variable specified by cond (in our example cond is not_full
- attr), and releases the mutex specified by mutex.  The waiting thread
- unblocks only after another thread calls pthread_cond_signal(3), or
- pthread_cond_broadcast(3) with the same condition variable, and the current
- thread reacquires the lock on mutex.
- Along def i know don't judge i just wanted to it make clear :)
- */
-  while (queue->count == QUEUE_SIZE) {
-    pthread_cond_wait(&queue->not_full, &queue->mutex);
+// Stage times and row outcomes of a committed batch
+static void count_committed(WorkerContext *ctx, const Batch *batch,
+                            const InsertTimings *timings) {
+  ThreadMetrics *metrics = ctx->metrics;
+  stage_record(metrics, STAGE_SETUP, timings->setup);
+  stage_record(metrics, STAGE_ENCODE, timings->encode);
+  stage_record(metrics, STAGE_COPY, timings->copy);
+  stage_record(metrics, STAGE_MERGE, timings->merge);
+  stage_record(metrics, STAGE_COMMIT, timings->commit);
+  metrics_add(&metrics->batches, 1);
+  writer_count_rows(metrics, batch, timings->rows_sent, &timings->merged);
+}
+
+// Rows [first, first + count) did not make it, in total and for their file
+static void count_failed(const WorkerContext *ctx, const Batch *batch,
+                         int first, int count) {
+  metrics_add(&ctx->metrics->counters[ROWS_FAILED], count);
+  if (ctx->files == NULL)
+    return;
+  // Routed batches mix files, consecutive rows mostly share one
+  int end = first + count;
+  for (int i = first; i < end;) {
+    int file = origin_file(batch->origin[i]);
+    int run = i;
+    while (i < end && origin_file(batch->origin[i]) == file)
+      i++;
+    if (file >= 0)
+      atomic_fetch_add_explicit(&ctx->files->files[file].failed_rows,
+                                i - run, memory_order_relaxed);
   }
+}
 
-  queue->batches[queue->rear] = batch;
-  queue->rear = (queue->rear + 1) % QUEUE_SIZE;
-  queue->count++;
+// Writer end of a batch retry
+typedef struct {
+  WorkerContext *ctx;
+  WriterSession *session; // NULL for other sinks
+  SinkWriter *sink;
+  Batch *part; // the rows being sent again
+  int rejected;
+  int failed;
+} Retry;
+
+static bool retry_send(Retry *retry, InsertTimings *timings) {
+  return retry->session
+             ? batch_insert_locations(retry->session, retry->part, timings)
+             : sink_write_batch(retry->sink, retry->part, timings);
+}
 
-  pthread_cond_signal(&queue->not_empty);
-  pthread_mutex_unlock(&queue->mutex);
+// A lost connection fails every row, splitting further only adds requests
+static bool retry_possible(const Retry *retry) {
+  bool connected = retry->session
+                       ? PQstatus(retry->session->conn) == CONNECTION_OK
+                       : !retry->sink->broken;
+  return connected && reject_log_open(retry->ctx->rejects);
 }
 
-Batch *queue_pop(BatchQueue *queue) {
-  pthread_mutex_lock(&queue->mutex);
-  while (queue->count == 0 && !queue->done) {
-    pthread_cond_wait(&queue->not_empty, &queue->mutex);
+static void retry_failed(Retry *retry, const Batch *batch, int first,
+                         int count) {
+  count_failed(retry->ctx, batch, first, count);
+  retry->failed += count;
+}
+
+static void retry_reject(Retry *retry, const Batch *batch, int i) {
+  const char *error =
+      retry->session ? retry->session->error : retry->sink->error;
+  if (!retry_possible(retry) ||
+      !reject_log_add(retry->ctx->rejects, batch, i, error)) {
+    retry_failed(retry, batch, i, 1);
+    return;
   }
+  metrics_add(&retry->ctx->metrics->counters[ROWS_REJECTED], 1);
+  int file = origin_file(batch->origin[i]);
+  if (retry->ctx->files && file >= 0)
+    atomic_fetch_add_explicit(&retry->ctx->files->files[file].rejected_rows,
+                              1, memory_order_relaxed);
+  retry->rejected++;
+}
 
-  if (queue->count == 0 && queue->done) {
-    pthread_mutex_unlock(&queue->mutex);
-    return NULL;
+// Rows [first, first + count) of the batch, with the input range they were
+// parsed from so a checkpoint records only what commits
+static void retry_copy(Retry *retry, const Batch *batch, int first,
+                       int count) {
+  Batch *part = retry->part;
+  batch_reset(part);
+  for (int i = first; i < first + count; i++)
+    batch_copy_row(part, batch, i);
+  part->delta = batch->delta;
+  part->file = batch->file;
+  part->source.begin =
+      first == 0 ? batch->source.begin : origin_offset(batch->origin[first]);
+  part->source.end = first + count == batch->count
+                         ? batch->source.end
+                         : origin_offset(batch->origin[first + count]);
+}
+
+// Rows [first, first + count) failed together. Both halves are sent on
+// their own and a half that fails again is split in turn, down to the row
+// that fails alone. One bad row costs two sends per halving, 2 log2(n)
+static void retry_halves(Retry *retry, const Batch *batch, int first,
+                         int count) {
+  int half = count / 2;
+  int parts[2][2] = {{first, half}, {first + half, count - half}};
+  for (int p = 0; p < 2; p++) {
+    int part_first = parts[p][0];
+    int part_count = parts[p][1];
+    if (!retry_possible(retry)) {
+      retry_failed(retry, batch, part_first, part_count);
+      continue;
+    }
+    retry_copy(retry, batch, part_first, part_count);
+    InsertTimings timings;
+    if (retry_send(retry, &timings))
+      count_committed(retry->ctx, retry->part, &timings);
+    else if (part_count > 1)
+      retry_halves(retry, batch, part_first, part_count);
+    else
+      retry_reject(retry, batch, part_first);
   }
+}
 
-  Batch *batch = queue->batches[queue->front];
-  queue->front = (queue->front + 1) % QUEUE_SIZE;
-  queue->count--;
+void writer_batch_failed(WorkerContext *ctx, WriterSession *session,
+                         SinkWriter *sink, const Batch *batch) {
+  Retry retry = {.ctx = ctx, .session = session, .sink = sink};
+  if (ctx->rejects == NULL || batch->count == 0 || !retry_possible(&retry)) {
+    count_failed(ctx, batch, 0, batch->count);
+    return;
+  }
+  // The failed send was the only row, its error is the row's
+  if (batch->count == 1) {
+    retry_reject(&retry, batch, 0);
+    return;
+  }
+
+  if (session)
+    session->quiet = true;
+  else
+    sink->quiet = true;
+  retry.part = batch_create(batch->count);
+  retry_halves(&retry, batch, 0, batch->count);
+  batch_free(retry.part);
+  if (session)
+    session->quiet = false;
+  else
+    sink->quiet = false;
+  fprintf(stderr, "Worker %d: failed batch of %d rows retried in halves, "
+                  "%d rows rejected, %d failed\n",
+          ctx->id, batch->count, retry.rejected, retry.failed);
+}
 
-  pthread_cond_signal(&queue->not_full);
-  pthread_mutex_unlock(&queue->mutex);
-  return batch;
+// A writer whose output never opened still takes its share of the queue,
+// so the producers are not left blocked on it, and counts those rows as
+// failed
+static void writer_drain_failed(WorkerContext *ctx) {
+  Batch *batch;
+  while ((batch = queue_pop(ctx->queue)) != NULL) {
+    count_failed(ctx, batch, 0, batch->count);
+    batch_release(ctx->pool, batch);
+  }
 }
 
 // Worker thread function
 void *worker_thread(void *arg) {
   WorkerContext *ctx = (WorkerContext *)arg;
-  PGconn *conn = PQconnectdb(ctx->conninfo);
 
-  if (PQstatus(conn) != CONNECTION_OK) {
+  // Other sinks take the same batches without a database
+  bool postgres = ctx->sink == NULL || ctx->sink->kind == SINK_POSTGRES;
+  SinkWriter sink;
+  if (!postgres) {
+    if (!sink_open(&sink, ctx->sink, ctx->id, ctx->copy_format,
+                   ctx->schema)) {
+      fprintf(stderr, "Worker %d: %s sink failed to open\n", ctx->id,
+              sink_name(ctx->sink->kind));
+      sink_close(&sink);
+      writer_drain_failed(ctx);
+      return NULL;
+    }
+  }
+
+  // Connection, send buffer, staging table and prepared merge are set up
+  // once and reused by every batch
+  WriterSession session = {0};
+  if (postgres &&
+      !writer_session_open(&session, ctx->conninfo, ctx->schema,
+                           ctx->copy_format, ctx->staging, ctx->checkpoint,
+                           ctx->delta)) {
     fprintf(stderr, "Worker %d: Connection failed\n", ctx->id);
+    writer_session_close(&session);
+    writer_drain_failed(ctx);
+    return NULL;
+  }
+
+  if (ctx->pipeline_depth > 0) {
+    pipelined_writer_loop(ctx, &session);
+    writer_session_close(&session);
     return NULL;
   }
 
+  ThreadMetrics *metrics = ctx->metrics;
   while (true) {
+    if (ctx->tuner)
+      tuner_wait_active(ctx->tuner, ctx->id);
+    Ticks wait_start = ticks_now();
     Batch *batch = queue_pop(ctx->queue);
+    stage_record_ticks(metrics, STAGE_DEQUEUE_WAIT, ticks_now() - wait_start);
     if (batch == NULL)
       break; // Queue is done
-
-    double start_time = get_time();
-    bool success = batch_insert_locations(conn, batch->locations, batch->count);
-    double end_time = get_time();
-
-    if (success) {
-      pthread_mutex_lock(ctx->stats_mutex);
-      ctx->stats->db_time += (end_time - start_time);
-      ctx->stats->records_processed += batch->count;
-      pthread_mutex_unlock(ctx->stats_mutex);
+    metrics_set(&metrics->in_flight_rows, batch->count);
+
+    InsertTimings timings;
+    bool ok = postgres ? batch_insert_locations(&session, batch, &timings)
+                       : sink_write_batch(&sink, batch, &timings);
+    if (ok) {
+      count_committed(ctx, batch, &timings);
+      if (ctx->tuner)
+        tuner_record(ctx->tuner, batch->count,
+                     timings.merge + timings.commit);
+    } else {
+      writer_batch_failed(ctx, postgres ? &session : NULL, &sink, batch);
     }
 
-    free(batch->locations);
-    free(batch);
+    metrics_set(&metrics->in_flight_rows, 0);
+    batch_release(ctx->pool, batch);
   }
 
-  PQfinish(conn);
+  if (postgres)
+    writer_session_close(&session);
+  else
+    sink_close(&sink);
   return NULL;
 }